@@ -0,0 +1,202 @@
+/******************************************************************************
+ * rng_bench.c
+ *
+ * Microbenchmarks for the random number generators in "stripeline/rng.c".
+ *
+ ******************************************************************************
+ *
+ * This program is compiled and run by "benchmarks/run_benchmarks.py", using
+ * the same flags as "setup.py". It can also be built by hand:
+ *
+ *     cc -O3 -fno-math-errno -ffp-contract=off -fopenmp -Istripeline \
+ *         benchmarks/rng_bench.c stripeline/rng.c -lm -o rng_bench
+ *     ./rng_bench 1000000 5
+ *
+ * The first argument is the number of samples generated by each call, the
+ * second how many times each benchmark is repeated (the fastest run is
+ * reported). The output contains one JSON object per line, with the name of
+ * the kernel, the number of samples, the best time in seconds, and the
+ * throughput in samples/s and bytes/s (counting the 8-byte numbers written
+ * to memory).
+ *
+ ******************************************************************************/
+
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rng.h"
+
+#define NUM_OF_LANES 8
+#define NUM_OF_DETECTORS 4
+
+/* Parameters of the 1/f noise, similar to a STRIP polarimeter */
+#define FMIN 1e-5
+#define FKNEE 0.05
+#define FSAMPLE 50.0
+#define SLOPE -1.5
+
+static double *output;
+static int num;
+
+static int32_t state[4];
+static int32_t lane_state[4 * NUM_OF_LANES];
+static int32_t next_lane;
+static int8_t empty;
+static double gset;
+static double *oof2_state;
+static double *oof_state;
+static int32_t num_of_poles;
+
+static int32_t bank_states[4 * NUM_OF_LANES * NUM_OF_DETECTORS];
+static int32_t bank_next_lane[NUM_OF_DETECTORS];
+static int8_t bank_empty[NUM_OF_DETECTORS];
+static double bank_gset[NUM_OF_DETECTORS];
+static double *bank_oof_states;
+static double *matrix;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+static void run_uniform(void) { fill_vector_uniform(state, output, num); }
+
+static void run_uniform_lanes(void)
+{
+  fill_vector_uniform_lanes(lane_state, NUM_OF_LANES, &next_lane, output, num);
+}
+
+static void run_normal(void)
+{
+  fill_vector_normal(state, &empty, &gset, output, num);
+}
+
+static void run_normal_lanes(void)
+{
+  fill_vector_normal_lanes(lane_state, NUM_OF_LANES, &next_lane, &empty,
+                           &gset, output, num);
+}
+
+static void run_normal_counter(void)
+{
+  fill_vector_normal_counter(0, 0, 0, output, num);
+}
+
+static void run_oof2(void)
+{
+  fill_vector_oof2(state, &empty, &gset, oof2_state, output, num);
+}
+
+static void run_oof(void)
+{
+  fill_vector_oof(state, &empty, &gset, oof_state, num_of_poles, output, num);
+}
+
+static void run_oof_lanes(void)
+{
+  fill_vector_oof_lanes(lane_state, NUM_OF_LANES, &next_lane, &empty, &gset,
+                        oof_state, num_of_poles, output, num);
+}
+
+static void run_matrix_oof(void)
+{
+  static const double sigma[NUM_OF_DETECTORS] = {1.0, 1.0, 1.0, 1.0};
+  fill_matrix_oof(bank_states, NUM_OF_DETECTORS, 4 * NUM_OF_LANES,
+                  bank_next_lane, bank_empty, bank_gset, bank_oof_states,
+                  num_of_poles, sigma, 0, matrix, num);
+}
+
+/* Run "kernel" "repeats" times and print the fastest run. "samples" is the
+ * number of numbers produced by each call */
+static void benchmark(const char *name, void (*kernel)(void), int repeats,
+                      int64_t samples)
+{
+  double best = -1.0;
+  int i;
+
+  /* Warm up the caches and the OpenMP thread pool */
+  kernel();
+
+  for (i = 0; i < repeats; ++i)
+  {
+    const double start = now();
+    double elapsed;
+
+    kernel();
+    elapsed = now() - start;
+    if (best < 0 || elapsed < best)
+      best = elapsed;
+  }
+
+  printf("{\"name\": \"rng.%s\", \"samples\": %lld, \"time_s\": %.9g, "
+         "\"samples_per_s\": %.6g, \"bytes_per_s\": %.6g}\n",
+         name, (long long)samples, best, samples / best,
+         samples * sizeof(double) / best);
+}
+
+int main(int argc, char **argv)
+{
+  double slopes[NUM_OF_DETECTORS];
+  double fknees[NUM_OF_DETECTORS];
+  int repeats;
+  int det;
+
+  num = (argc > 1) ? atoi(argv[1]) : 1000000;
+  repeats = (argc > 2) ? atoi(argv[2]) : 5;
+  if (num <= 0 || repeats <= 0)
+  {
+    fprintf(stderr, "usage: %s [NUM_OF_SAMPLES [REPEATS]]\n", argv[0]);
+    return 1;
+  }
+
+  output = malloc(sizeof(double) * num);
+  matrix = malloc(sizeof(double) * num * NUM_OF_DETECTORS);
+  oof2_state = malloc(sizeof(double) * oof2_state_size());
+  oof_state = malloc(sizeof(double) * oof_state_size(FMIN, FKNEE, FSAMPLE));
+  bank_oof_states = malloc(sizeof(double) * NUM_OF_DETECTORS *
+                           oof_state_size(FMIN, FKNEE, FSAMPLE));
+  if (!output || !matrix || !oof2_state || !oof_state || !bank_oof_states)
+  {
+    fprintf(stderr, "unable to allocate memory for %d samples\n", num);
+    return 1;
+  }
+
+  init_rng(1, 2, 3, 4, state);
+  init_rng_lanes(1, 2, 3, 4, NUM_OF_LANES, lane_state);
+  init_oof2(FMIN, FKNEE, FSAMPLE, oof2_state);
+  num_of_poles = init_oof(SLOPE, FMIN, FKNEE, FSAMPLE, oof_state);
+
+  for (det = 0; det < NUM_OF_DETECTORS; ++det)
+  {
+    slopes[det] = SLOPE;
+    fknees[det] = FKNEE;
+    init_rng_lanes(1 + det, 2, 3, 4, NUM_OF_LANES,
+                   bank_states + det * 4 * NUM_OF_LANES);
+  }
+  init_oof_bank(NUM_OF_DETECTORS, slopes, FMIN, fknees, FSAMPLE, num_of_poles,
+                bank_oof_states);
+
+  benchmark("fill_vector_uniform", run_uniform, repeats, num);
+  benchmark("fill_vector_uniform_lanes", run_uniform_lanes, repeats, num);
+  benchmark("fill_vector_normal", run_normal, repeats, num);
+  benchmark("fill_vector_normal_lanes", run_normal_lanes, repeats, num);
+  benchmark("fill_vector_normal_counter", run_normal_counter, repeats, num);
+  benchmark("fill_vector_oof2", run_oof2, repeats, num);
+  benchmark("fill_vector_oof", run_oof, repeats, num);
+  benchmark("fill_vector_oof_lanes", run_oof_lanes, repeats, num);
+  benchmark("fill_matrix_oof", run_matrix_oof, repeats,
+            (int64_t)num * NUM_OF_DETECTORS);
+
+  free(output);
+  free(matrix);
+  free(oof2_state);
+  free(oof_state);
+  free(bank_oof_states);
+  return 0;
+}
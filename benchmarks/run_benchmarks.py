@@ -0,0 +1,462 @@
+#!/usr/bin/env python3
+# -*- encoding: utf-8 -*-
+
+'''Measure the throughput of the most time-consuming parts of Stripeline
+
+Run this script from the root of the repository, after having built the
+extensions (e.g., using ``python setup.py develop``)::
+
+    python benchmarks/run_benchmarks.py
+    python benchmarks/run_benchmarks.py --quick --filter maptools
+    python benchmarks/run_benchmarks.py --compare benchmarks/results/OLD.json
+
+Each benchmark is run for a number of samples and, where it matters, for a
+number of values of NSIDE. The fastest of several runs is reported, with its
+throughput in samples/s and bytes/s (the number of bytes is the amount of
+input and output data, not counting temporary arrays).
+
+The results are saved in a JSON file in ``benchmarks/results`` (see
+``--output-dir``), whose name contains the date and the git revision, so
+that regressions can be tracked over time. The option ``--compare`` prints
+the ratio between the new throughput and the one saved in an older file, and
+makes the script exit with an error if some benchmark got slower than
+``--tolerance``.
+
+The random number generators are measured by the C program
+``benchmarks/rng_bench.c``, which is compiled using the same flags used by
+``setup.py``.
+'''
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import re
+import subprocess
+import sys
+import tempfile
+import timeit
+
+import numpy as np
+
+REPO_PATH = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+sys.path.insert(0, REPO_PATH)
+
+# Same flags as RNG_COMPILE_FLAGS and OPENMP_FLAG in setup.py
+C_COMPILE_FLAGS = ['-O3', '-fno-math-errno', '-ffp-contract=off', '-fopenmp']
+
+SAMPLE_COUNTS = [10**5, 10**6, 10**7]
+QUICK_SAMPLE_COUNTS = [10**5]
+NSIDES = [64, 256, 1024]
+QUICK_NSIDES = [64]
+
+# Registry of the benchmarks: each function receives the parameters and
+# returns a tuple (function to time, number of samples, number of bytes)
+BENCHMARKS = []
+
+
+def benchmark(name, params):
+    '''Decorator that adds a function to BENCHMARKS
+
+    "params" is a function receiving the command-line arguments and
+    returning a list of dictionaries, one for each run.'''
+    def decorator(fn):
+        BENCHMARKS.append((name, params, fn))
+        return fn
+    return decorator
+
+
+def samples_only(args):
+    return [{'samples': x} for x in args.samples]
+
+
+def samples_and_nside(args):
+    return [{'samples': x, 'nside': y} for x in args.samples for y in args.nsides]
+
+
+def nside_only(args):
+    return [{'nside': x} for x in args.nsides]
+
+
+def random_quaternions(num):
+    quat = np.random.RandomState(1).normal(size=(num, 4))
+    return quat / np.linalg.norm(quat, axis=1)[:, np.newaxis]
+
+
+def strip_tod(samples, nside):
+    'Return random signals (4xN), polarization angles, and pixel indexes'
+    import healpy
+
+    rng = np.random.RandomState(2)
+    signals = rng.normal(size=(4, samples))
+    psi = rng.uniform(-np.pi, np.pi, size=samples)
+    pixidx = rng.randint(healpy.nside2npix(nside), size=samples)
+    return signals, psi, pixidx
+
+
+def scanning_strategy(samples):
+    import stripeline.scanning as sc
+
+    return sc.ScanningStrategy(wheel3_rpm=1.0,
+                               wheel2_angle0_deg=45.0,
+                               latitude_deg=28.3,
+                               overall_time_s=samples / 50.0,
+                               sampling_frequency_hz=50.0)
+
+
+@benchmark('quaternions.qmul', samples_only)
+def bench_qmul(samples):
+    import stripeline.quaternions as q
+
+    q1, q2 = random_quaternions(samples), random_quaternions(samples)[::-1]
+    return (lambda: q.qmul(q1, q2)), samples, 3 * q1.nbytes
+
+
+@benchmark('quaternions.qmul_c', samples_only)
+def bench_qmul_c(samples):
+    import stripeline.quaternions as q
+
+    # The (4, n) views of C-ordered (n, 4) matrices are passed to f2py
+    # without being copied
+    q1 = random_quaternions(samples).T
+    q2 = np.ascontiguousarray(random_quaternions(samples)[::-1]).T
+    return (lambda: q.qmul_c(q1, q2)), samples, 3 * q1.nbytes
+
+
+@benchmark('quaternions.qrotate', samples_only)
+def bench_qrotate(samples):
+    import stripeline.quaternions as q
+
+    quat = random_quaternions(samples)
+    vec = np.tile([0.0, 0.0, 1.0], (samples, 1))
+    return ((lambda: q.qrotate(vec, quat)), samples,
+            quat.nbytes + 2 * vec.nbytes)
+
+
+@benchmark('quaternions.qrotate_c', samples_only)
+def bench_qrotate_c(samples):
+    import stripeline.quaternions as q
+
+    quat = random_quaternions(samples).T
+    vec = np.tile([0.0, 0.0, 1.0], (samples, 1)).T
+    return ((lambda: q.qrotate_c(vec, quat)), samples,
+            quat.nbytes + 2 * vec.nbytes)
+
+
+@benchmark('scanning.generate_pointings', samples_and_nside)
+def bench_generate_pointings(samples, nside):
+    import stripeline.scanning as sc
+
+    scanning = scanning_strategy(samples)
+    return ((lambda: sc.generate_pointings(scanning, nside=nside)),
+            samples, samples * (4 * 8 + 8))
+
+
+@benchmark('scanning.generate_pointings_interpolated', samples_only)
+def bench_generate_pointings_interpolated(samples):
+    import stripeline.scanning as sc
+
+    scanning = scanning_strategy(samples)
+    return ((lambda: sc.generate_pointings(scanning, max_error_arcsec=1.0)),
+            samples, samples * 4 * 8)
+
+
+@benchmark('maptools.binned_map', samples_and_nside)
+def bench_binned_map(samples, nside):
+    import healpy
+    import stripeline.maptools as mt
+
+    signals, _, pixidx = strip_tod(samples, nside)
+    npix = healpy.nside2npix(nside)
+    return ((lambda: mt.binned_map(signals[0], pixidx, npix)), samples,
+            signals[0].nbytes + pixidx.nbytes + npix * 16)
+
+
+@benchmark('maptools.binned_map_strip', samples_and_nside)
+def bench_binned_map_strip(samples, nside):
+    import healpy
+    import stripeline.maptools as mt
+    import stripeline.timetools as tt
+
+    signals, psi, pixidx = strip_tod(samples, nside)
+
+    class MemoryToiProvider(tt.ToiProvider):
+        def get_signal(self, det_idx):
+            return signals[tt.DET_NAMES.get(det_idx, det_idx)]
+
+        def get_pixel_index(self, nside, nest=False, lonlat=False):
+            return pixidx
+
+        def get_polarization_angle(self):
+            return psi
+
+    provider = MemoryToiProvider(0, 1)
+    npix = healpy.nside2npix(nside)
+    return ((lambda: mt.binned_map_strip(nside, provider)), samples,
+            signals.nbytes + psi.nbytes + pixidx.nbytes + npix * 4 * 8)
+
+
+@benchmark('maptools.ConditionMatrix.to_map', nside_only)
+def bench_condition_matrix(nside):
+    import healpy
+    import stripeline.maptools as mt
+
+    npix = healpy.nside2npix(nside)
+    _, psi, pixidx = strip_tod(10 * npix, nside)
+    cond = mt.ConditionMatrix(npix)
+    cond.update(pixidx.astype('int32'), psi)
+    return (lambda: cond.to_map()), npix, cond.matr.nbytes + npix * 8
+
+
+def polarimeter_benchmark(samples, nside, nest, dtype):
+    'Return the benchmark of a kernel of todsim using an interleaved map'
+    import healpy
+    import stripeline.scanning as sc
+    import stripeline.skymodel as sm
+    import stripeline.todsim as todsim
+
+    # Use a real scan, so that the pixel indexes have the same locality as
+    # in a simulation
+    scanning = scanning_strategy(samples)
+    pointings = np.ascontiguousarray(
+        sc.compute_pointings(scanning, [0, 0, 1], 0.0, samples))
+    pixidx = sc.compute_pixel_indexes(scanning, [0, 0, 1], 0.0, samples,
+                                      nside=nside, nest=nest)
+
+    npix = healpy.nside2npix(nside)
+    maps = np.random.RandomState(4).normal(size=(3, npix))
+    model = sm.SkyModel.from_maps(*maps, nest=nest, dtype=dtype)
+    kernel = todsim.tod_polarimeter_iqu_f32 if dtype == 'float32' \
+        else todsim.tod_polarimeter_iqu
+    det_output = np.empty((4, samples))
+    sigma = np.ones(4)
+
+    def run():
+        kernel(model.iqu, pixidx, pointings, sigma, 0, 0, det_output)
+
+    return run, samples, pointings.nbytes + pixidx.nbytes + det_output.nbytes
+
+
+@benchmark('todsim.tod_polarimeter', samples_and_nside)
+def bench_tod_polarimeter(samples, nside):
+    import healpy
+    import stripeline.scanning as sc
+    import stripeline.todsim as todsim
+
+    scanning = scanning_strategy(samples)
+    pointings = np.ascontiguousarray(
+        sc.compute_pointings(scanning, [0, 0, 1], 0.0, samples))
+    pixidx = sc.compute_pixel_indexes(scanning, [0, 0, 1], 0.0, samples,
+                                      nside=nside)
+    sky_i, sky_q, sky_u = np.random.RandomState(4).normal(
+        size=(3, healpy.nside2npix(nside)))
+    det_output = np.empty((4, samples))
+    sigma = np.ones(4)
+
+    def run():
+        todsim.tod_polarimeter(sky_i, sky_q, sky_u, pixidx, pointings, sigma,
+                               0, 0, det_output)
+
+    return run, samples, pointings.nbytes + pixidx.nbytes + det_output.nbytes
+
+
+@benchmark('todsim.tod_polarimeter_iqu', samples_and_nside)
+def bench_tod_polarimeter_iqu(samples, nside):
+    return polarimeter_benchmark(samples, nside, nest=False, dtype='float64')
+
+
+@benchmark('todsim.tod_polarimeter_iqu_nest', samples_and_nside)
+def bench_tod_polarimeter_iqu_nest(samples, nside):
+    return polarimeter_benchmark(samples, nside, nest=True, dtype='float64')
+
+
+@benchmark('todsim.tod_polarimeter_iqu_nest_f32', samples_and_nside)
+def bench_tod_polarimeter_iqu_nest_f32(samples, nside):
+    return polarimeter_benchmark(samples, nside, nest=True, dtype='float32')
+
+
+@benchmark('timetools._load_array_from_fits', samples_only)
+def bench_load_array_from_fits(samples):
+    from astropy.io import fits
+    import stripeline.timetools as tt
+
+    # The file is deleted when the object is garbage-collected
+    tmp_file = tempfile.NamedTemporaryFile(suffix='.fits')
+    names = ['TIME', 'THETA', 'PHI', 'PSI', 'DETQ1', 'DETQ2', 'DETU1', 'DETU2']
+    rng = np.random.RandomState(3)
+    cols = [fits.Column(name=x, format='D', array=rng.normal(size=samples))
+            for x in names]
+    fits.BinTableHDU.from_columns(cols).writeto(tmp_file.name, overwrite=True)
+
+    segments = [tt.ToiFileSegment(file_name=tmp_file.name, first_element=0,
+                                  num_of_elements=samples)]
+    cols_to_read = [tt.FitsColumn(hdu=1, column=x) for x in names]
+
+    # The default argument keeps the temporary file alive as long as "run"
+    def run(tmp_file=tmp_file):
+        tt._load_array_from_fits(segments, cols_to_read)
+
+    return run, samples, samples * 8 * len(names)
+
+
+def time_benchmark(fn, repeats):
+    'Return the fastest time needed to run "fn", in seconds'
+    timer = timeit.Timer(fn)
+    # Calibrate the number of calls, so that short benchmarks are accurate
+    number, _ = timer.autorange()
+    return min(timer.repeat(repeat=repeats, number=number)) / number
+
+
+def run_python_benchmarks(args):
+    results = []
+    for name, params, fn in BENCHMARKS:
+        if args.filter and not re.search(args.filter, name):
+            continue
+
+        for cur_params in params(args):
+            kernel, samples, nbytes = fn(**cur_params)
+            elapsed = time_benchmark(kernel, args.repeats)
+            result = {'name': name,
+                      'params': cur_params,
+                      'samples': samples,
+                      'time_s': elapsed,
+                      'samples_per_s': samples / elapsed,
+                      'bytes_per_s': nbytes / elapsed}
+            print_result(result)
+            results.append(result)
+
+    return results
+
+
+def run_c_benchmarks(args):
+    'Compile and run rng_bench.c, returning the results'
+    results = []
+    with tempfile.TemporaryDirectory() as tmpdir:
+        executable = os.path.join(tmpdir, 'rng_bench')
+        subprocess.check_call([args.cc] + C_COMPILE_FLAGS +
+                              ['-I', os.path.join(REPO_PATH, 'stripeline'),
+                               os.path.join(REPO_PATH, 'benchmarks',
+                                            'rng_bench.c'),
+                               os.path.join(REPO_PATH, 'stripeline', 'rng.c'),
+                               '-lm', '-o', executable])
+
+        for samples in args.samples:
+            output = subprocess.check_output([executable, str(samples),
+                                              str(args.repeats)])
+            for line in output.decode('utf-8').splitlines():
+                result = json.loads(line)
+                if args.filter and not re.search(args.filter, result['name']):
+                    continue
+
+                result['params'] = {'samples': samples}
+                print_result(result)
+                results.append(result)
+
+    return results
+
+
+def print_result(result):
+    params = ', '.join(['{0}={1}'.format(key, val)
+                        for key, val in sorted(result['params'].items())])
+    print('{0:45s} {1:30s} {2:10.3g} samples/s {3:10.3g} B/s'
+          .format(result['name'], params, result['samples_per_s'],
+                  result['bytes_per_s']))
+
+
+def result_key(result):
+    return (result['name'], tuple(sorted(result['params'].items())))
+
+
+def compare_results(old_file_name, results, tolerance):
+    '''Print the speedup with respect to an older file
+
+    Return the number of benchmarks which are slower than the old ones by
+    more than "tolerance" (a fraction).'''
+    with open(old_file_name, 'rt') as f:
+        old_results = {result_key(x): x for x in json.load(f)['results']}
+
+    num_of_regressions = 0
+    print('\nComparison with {0}'.format(old_file_name))
+    for cur_result in results:
+        old_result = old_results.get(result_key(cur_result))
+        if old_result is None:
+            continue
+
+        ratio = cur_result['samples_per_s'] / old_result['samples_per_s']
+        flag = ''
+        if ratio < 1.0 - tolerance:
+            flag = '  <-- REGRESSION'
+            num_of_regressions += 1
+
+        print('{0:45s} {1:30s} {2:6.2f}x{3}'.format(
+            cur_result['name'],
+            ', '.join(['{0}={1}'.format(key, val)
+                       for key, val in sorted(cur_result['params'].items())]),
+            ratio, flag))
+
+    return num_of_regressions
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(['git', 'rev-parse', '--short', 'HEAD'],
+                                       cwd=REPO_PATH).decode('ascii').strip()
+    except (OSError, subprocess.CalledProcessError):
+        return 'unknown'
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--quick', action='store_true',
+                        help='Use only the smallest number of samples and NSIDE')
+    parser.add_argument('--filter', type=str, default=None,
+                        help='Regular expression selecting the benchmarks')
+    parser.add_argument('--repeats', type=int, default=5,
+                        help='Number of runs of each benchmark (default: 5)')
+    parser.add_argument('--output-dir', type=str,
+                        default=os.path.join(REPO_PATH, 'benchmarks', 'results'),
+                        help='Directory where to save the results')
+    parser.add_argument('--compare', type=str, default=None,
+                        help='JSON file produced by a previous run')
+    parser.add_argument('--tolerance', type=float, default=0.1,
+                        help='Slowdown reported as a regression by --compare '
+                        '(default: 0.1, i.e., 10%%)')
+    parser.add_argument('--cc', type=str, default=os.environ.get('CC', 'cc'),
+                        help='C compiler used for the rng benchmarks')
+    parser.add_argument('--no-c', action='store_true',
+                        help='Do not run the C benchmarks')
+    args = parser.parse_args()
+
+    args.samples = QUICK_SAMPLE_COUNTS if args.quick else SAMPLE_COUNTS
+    args.nsides = QUICK_NSIDES if args.quick else NSIDES
+
+    results = []
+    if not args.no_c:
+        results += run_c_benchmarks(args)
+    results += run_python_benchmarks(args)
+
+    now = datetime.datetime.now()
+    revision = git_revision()
+    os.makedirs(args.output_dir, exist_ok=True)
+    output_file_name = os.path.join(
+        args.output_dir,
+        '{0}-{1}.json'.format(now.strftime('%Y%m%d-%H%M%S'), revision))
+    with open(output_file_name, 'wt') as f:
+        json.dump({'date': now.isoformat(),
+                   'git_revision': revision,
+                   'host': platform.node(),
+                   'machine': platform.machine(),
+                   'python': platform.python_version(),
+                   'numpy': np.__version__,
+                   'omp_num_threads': os.environ.get('OMP_NUM_THREADS'),
+                   'results': results}, f, indent=1)
+    print('\nResults saved in {0}'.format(output_file_name))
+
+    if args.compare:
+        if compare_results(args.compare, results, args.tolerance) > 0:
+            sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
@@ -10,6 +10,11 @@ AUTHOR_EMAIL = 'maurizio.tomasi@unimi.it'
 LICENSE = 'MIT'
 URL = 'https://github.com/ziotom78/stripeline'
 FORTRAN2003_FLAG = '-std=f2003'
+# The multi-lane kernels in rng.c rely on the auto-vectorizer. Contraction
+# into FMA instructions is disabled, so that the random numbers are the same
+# regardless of the instruction set picked at runtime.
+RNG_COMPILE_FLAGS = ['-O3', '-fno-math-errno', '-ffp-contract=off']
+OPENMP_FLAG = '-fopenmp'
 
 
 # Utility function to read the README file.
@@ -30,13 +35,37 @@ def configuration(parent_package='', top_path=None):
                             extra_f90_compile_args=[FORTRAN2003_FLAG]),
                     Extension('stripeline.quaternions',
                             sources=['stripeline/_quaternions.f90'],
+                            f2py_options=['skip:', 'rotate_one', ':'],
                             extra_f90_compile_args=[FORTRAN2003_FLAG]),
+                    Extension('stripeline._scanning',
+                            sources=['stripeline/_scanning.f90'],
+                            f2py_options=['only:', 'pointing_timeline',
+                                          'interpolated_pointing_timeline',
+                                          'estimate_interpolation_error',
+                                          'pixel_timeline',
+                                          'pointing_pixel_timeline',
+                                          'focal_plane_timeline',
+                                          ':'],
+                            extra_f90_compile_args=[FORTRAN2003_FLAG,
+                                                    OPENMP_FLAG],
+                            extra_link_args=[OPENMP_FLAG]),
                     Extension('stripeline._maptools',
                             sources=['stripeline/_maptools.f90'],
-                            extra_f90_compile_args=[FORTRAN2003_FLAG]),
+                            extra_f90_compile_args=[FORTRAN2003_FLAG,
+                                                    OPENMP_FLAG],
+                            extra_link_args=[OPENMP_FLAG]),
                     Extension('stripeline.rng',
                             sources=['stripeline/rng.pyf',
-                                        'stripeline/rng.c'])]
+                                        'stripeline/rng.c'],
+                            extra_compile_args=RNG_COMPILE_FLAGS + [OPENMP_FLAG],
+                            extra_link_args=[OPENMP_FLAG]),
+                    Extension('stripeline.todsim',
+                            sources=['stripeline/todsim.pyf',
+                                        'stripeline/todsim.c',
+                                        'stripeline/rng.c'],
+                            depends=['stripeline/rng.h'],
+                            extra_compile_args=RNG_COMPILE_FLAGS + [OPENMP_FLAG],
+                            extra_link_args=[OPENMP_FLAG])]
 
     config = Configuration(NAME, parent_package, top_path,
                             version=VERSION,
@@ -61,4 +61,361 @@ subroutine binned_map(signal, pixidx, mappixels, hits)
         end if
     end do
 
-end subroutine binned_map
\ No newline at end of file
+end subroutine binned_map
+
+! Parallel version of "binned_map", using OpenMP.
+!
+! Each thread accumulates its samples into a private partial map. Partial
+! maps are split in tiles of TILE_SIZE pixels, which are taken from a shared
+! pool only when a thread finds a sample falling in them: since the samples
+! handled by a thread are contiguous in time, they usually fall into a few
+! tiles, even for maps with a high resolution. At the end, the partial maps
+! are summed together in parallel, tile by tile. The pool can contain at most
+! "max_tiles" tiles (each taking TILE_SIZE * 16 bytes); once it is full, the
+! samples falling in new tiles are added directly into "mappixels" and
+! "hits" using atomic operations. Setting "max_tiles" to zero forces the use
+! of atomic operations for all the samples, without using additional memory.
+!
+! If "reset" is nonzero, "mappixels" and "hits" are set to zero before adding
+! the samples. If "normalize" is nonzero, each pixel of "mappixels" is then
+! divided by its number of hits. Calling the routine repeatedly with
+! reset = normalize = 0 accumulates several TODs in the same map.
+subroutine binned_map_omp(signal, pixidx, mappixels, hits, max_tiles, &
+    reset, normalize)
+    !$ use omp_lib
+    implicit none
+
+    real(kind=8), dimension(:), intent(in) :: signal
+    integer(kind=8), dimension(size(signal)), intent(in) :: pixidx
+    real(kind=8), dimension(:), intent(inout) :: mappixels
+    integer(kind=8), dimension(size(mappixels)), intent(inout) :: hits
+    integer(kind=8), intent(in) :: max_tiles
+    integer, intent(in) :: reset
+    integer, intent(in) :: normalize
+
+    integer(kind=8), parameter :: TILE_SIZE = 4096
+    integer(kind=8), parameter :: NO_TILE = 0, ATOMIC_TILE = -1
+
+    real(kind=8), allocatable :: tile_values(:, :)
+    integer(kind=8), allocatable :: tile_hits(:, :)
+    ! Index of the tile in the pool used by each thread for each part of the
+    ! map, or one of the constants NO_TILE and ATOMIC_TILE
+    integer(kind=8), allocatable :: tile_of(:, :)
+    integer(kind=8) :: num_of_map_tiles, pool_size, next_tile
+    integer(kind=8) :: i, pix, map_tile, tile, offset, first, last
+    integer :: num_of_threads, thread, cur_thread
+
+    num_of_threads = 1
+    !$ num_of_threads = omp_get_max_threads()
+
+    num_of_map_tiles = (size(mappixels, kind=8) + TILE_SIZE - 1) / TILE_SIZE
+    pool_size = min(max(max_tiles, 0_8), num_of_map_tiles * num_of_threads)
+    allocate(tile_values(TILE_SIZE, max(pool_size, 1_8)))
+    allocate(tile_hits(TILE_SIZE, max(pool_size, 1_8)))
+    allocate(tile_of(num_of_map_tiles, num_of_threads))
+    next_tile = 0
+
+    !$omp parallel default(shared) &
+    !$omp private(i, pix, map_tile, tile, offset, first, last, thread, cur_thread) &
+    !$omp num_threads(num_of_threads)
+
+    thread = 1
+    !$ thread = omp_get_thread_num() + 1
+
+    !$omp do schedule(static)
+    do map_tile = 1, num_of_map_tiles
+        tile_of(map_tile, :) = NO_TILE
+        if (reset /= 0) then
+            first = (map_tile - 1) * TILE_SIZE + 1
+            last = min(map_tile * TILE_SIZE, size(mappixels, kind=8))
+            mappixels(first:last) = 0.0
+            hits(first:last) = 0
+        end if
+    end do
+    !$omp end do
+
+    ! Accumulate the samples; the barrier at the end of the previous loop
+    ! ensures that "tile_of" has been initialized
+    !$omp do schedule(static)
+    do i = 1, size(signal, kind=8)
+        pix = pixidx(i) + 1
+        map_tile = (pix - 1) / TILE_SIZE + 1
+        offset = pix - (map_tile - 1) * TILE_SIZE
+        tile = tile_of(map_tile, thread)
+
+        if (tile == NO_TILE) then
+            !$omp atomic capture
+            next_tile = next_tile + 1
+            tile = next_tile
+            !$omp end atomic
+
+            if (tile > pool_size) then
+                tile = ATOMIC_TILE
+            else
+                tile_values(:, tile) = 0.0
+                tile_hits(:, tile) = 0
+            end if
+            tile_of(map_tile, thread) = tile
+        end if
+
+        if (tile == ATOMIC_TILE) then
+            !$omp atomic
+            mappixels(pix) = mappixels(pix) + signal(i)
+            !$omp atomic
+            hits(pix) = hits(pix) + 1
+        else
+            tile_values(offset, tile) = tile_values(offset, tile) + signal(i)
+            tile_hits(offset, tile) = tile_hits(offset, tile) + 1
+        end if
+    end do
+    !$omp end do
+
+    ! Sum the partial maps: each iteration touches a different part of the
+    ! map, so no synchronization is needed
+    !$omp do schedule(dynamic)
+    do map_tile = 1, num_of_map_tiles
+        first = (map_tile - 1) * TILE_SIZE + 1
+        last = min(map_tile * TILE_SIZE, size(mappixels, kind=8))
+
+        do cur_thread = 1, num_of_threads
+            tile = tile_of(map_tile, cur_thread)
+            if (tile > 0) then
+                mappixels(first:last) = mappixels(first:last) + &
+                    tile_values(1:last - first + 1, tile)
+                hits(first:last) = hits(first:last) + &
+                    tile_hits(1:last - first + 1, tile)
+            end if
+        end do
+
+        if (normalize /= 0) then
+            do pix = first, last
+                if (hits(pix) > 0) then
+                    mappixels(pix) = mappixels(pix) / hits(pix)
+                end if
+            end do
+        end if
+    end do
+    !$omp end do
+
+    !$omp end parallel
+
+    deallocate(tile_values, tile_hits, tile_of)
+
+end subroutine binned_map_omp
+
+
+! Accumulate the samples of a set of STRIP polarimeters into I, Q, U, and hit
+! maps and, optionally, into the pointing matrix, in one pass over the TOD.
+!
+! The four columns of "signals" contain the output of the Q1, Q2, U1, and U2
+! detectors. The Stokes parameters are I = Q1 + Q2 + U1 + U2, while Q and U
+! are computed from 2 (Q1 + Q2) and 2 (U1 + U2), rotated by -psi to go from
+! the reference frame of the instrument to the celestial frame.
+!
+! Each column of "accum" contains the accumulated values for one pixel:
+!
+! 1. sum of I;
+! 2. sum of Q;
+! 3. sum of U;
+! 4. number of hits;
+!
+! If "accum" has (at least) nine rows, rows 5-9 contain the sums of cos(2psi),
+! sin(2psi), cos^2(2psi), sin(2psi) cos(2psi), and sin^2(2psi). These are
+! the independent elements of the pointing matrix (see "update_condmatr").
+!
+! The samples are split among the OpenMP threads using the same strategy as
+! "binned_map_omp", and "max_tiles" has the same meaning (but each tile takes
+! TILE_SIZE * 8 * size(accum, 1) bytes). The samples are added to the values
+! already in "accum", which is never reset.
+subroutine bin_strip_samples(signals, psi, pixidx, accum, max_tiles)
+    !$ use omp_lib
+    implicit none
+
+    real(kind=8), dimension(:, :), intent(in) :: signals
+    real(kind=8), dimension(size(signals, 1)), intent(in) :: psi
+    integer(kind=8), dimension(size(signals, 1)), intent(in) :: pixidx
+    real(kind=8), dimension(:, :), intent(inout) :: accum
+    integer(kind=8), intent(in) :: max_tiles
+
+    integer(kind=8), parameter :: TILE_SIZE = 4096
+    integer(kind=8), parameter :: NO_TILE = 0, ATOMIC_TILE = -1
+    integer, parameter :: MAX_COMPONENTS = 9
+
+    real(kind=8), allocatable :: tile_values(:, :, :)
+    integer(kind=8), allocatable :: tile_of(:, :)
+    integer(kind=8) :: num_of_pixels, num_of_map_tiles, pool_size, next_tile
+    integer(kind=8) :: i, pix, map_tile, tile, offset, first, last
+    integer :: num_of_components, num_of_threads, thread, cur_thread, k
+    real(kind=8) :: values(MAX_COMPONENTS), q_instr, u_instr, cos2psi, sin2psi
+
+    num_of_components = min(size(accum, 1), MAX_COMPONENTS)
+    if (num_of_components > 4 .and. num_of_components < MAX_COMPONENTS) then
+        num_of_components = 4
+    end if
+
+    num_of_threads = 1
+    !$ num_of_threads = omp_get_max_threads()
+
+    num_of_pixels = size(accum, 2, kind=8)
+    num_of_map_tiles = (num_of_pixels + TILE_SIZE - 1) / TILE_SIZE
+    pool_size = min(max(max_tiles, 0_8), num_of_map_tiles * num_of_threads)
+    allocate(tile_values(num_of_components, TILE_SIZE, max(pool_size, 1_8)))
+    allocate(tile_of(num_of_map_tiles, num_of_threads))
+    tile_of = NO_TILE
+    next_tile = 0
+
+    !$omp parallel default(shared) &
+    !$omp private(i, pix, map_tile, tile, offset, first, last, thread, &
+    !$omp         cur_thread, k, values, q_instr, u_instr, cos2psi, sin2psi) &
+    !$omp num_threads(num_of_threads)
+
+    thread = 1
+    !$ thread = omp_get_thread_num() + 1
+
+    !$omp do schedule(static)
+    do i = 1, size(signals, 1, kind=8)
+        cos2psi = cos(2.0_8 * psi(i))
+        sin2psi = sin(2.0_8 * psi(i))
+        q_instr = 2.0_8 * (signals(i, 1) + signals(i, 2))
+        u_instr = 2.0_8 * (signals(i, 3) + signals(i, 4))
+
+        values(1) = signals(i, 1) + signals(i, 2) + signals(i, 3) + signals(i, 4)
+        values(2) = cos2psi * q_instr - sin2psi * u_instr
+        values(3) = sin2psi * q_instr + cos2psi * u_instr
+        values(4) = 1.0_8
+        values(5) = cos2psi
+        values(6) = sin2psi
+        values(7) = cos2psi * cos2psi
+        values(8) = sin2psi * cos2psi
+        values(9) = sin2psi * sin2psi
+
+        pix = pixidx(i) + 1
+        map_tile = (pix - 1) / TILE_SIZE + 1
+        offset = pix - (map_tile - 1) * TILE_SIZE
+        tile = tile_of(map_tile, thread)
+
+        if (tile == NO_TILE) then
+            !$omp atomic capture
+            next_tile = next_tile + 1
+            tile = next_tile
+            !$omp end atomic
+
+            if (tile > pool_size) then
+                tile = ATOMIC_TILE
+            else
+                tile_values(:, :, tile) = 0.0
+            end if
+            tile_of(map_tile, thread) = tile
+        end if
+
+        if (tile == ATOMIC_TILE) then
+            do k = 1, num_of_components
+                !$omp atomic
+                accum(k, pix) = accum(k, pix) + values(k)
+            end do
+        else
+            tile_values(1:num_of_components, offset, tile) = &
+                tile_values(1:num_of_components, offset, tile) + &
+                values(1:num_of_components)
+        end if
+    end do
+    !$omp end do
+
+    !$omp do schedule(dynamic)
+    do map_tile = 1, num_of_map_tiles
+        first = (map_tile - 1) * TILE_SIZE + 1
+        last = min(map_tile * TILE_SIZE, num_of_pixels)
+
+        do cur_thread = 1, num_of_threads
+            tile = tile_of(map_tile, cur_thread)
+            if (tile > 0) then
+                accum(1:num_of_components, first:last) = &
+                    accum(1:num_of_components, first:last) + &
+                    tile_values(:, 1:last - first + 1, tile)
+            end if
+        end do
+    end do
+    !$omp end do
+
+    !$omp end parallel
+
+    deallocate(tile_values, tile_of)
+
+end subroutine bin_strip_samples
+
+
+! Compute the inverse condition number of each 3x3 matrix in "m", whose rows
+! have the same layout used by "update_condmatr". Since the matrices are
+! symmetric, the condition number is the ratio between the largest and the
+! smallest absolute value of the eigenvalues, which are computed in closed
+! form (O. K. Smith, "Eigenvalues of a symmetric 3 x 3 matrix",
+! Communications of the ACM 4(4), 1961). Pixels with no hits, or whose
+! matrix is singular, are set to zero. The absolute error of the result is
+! of the order of 1e-8 in the worst case (singular matrices with two
+! vanishing eigenvalues), and much smaller otherwise.
+subroutine inv_condition_numbers(m, result)
+    implicit none
+
+    real(kind=8), dimension(:, :), intent(in) :: m
+    real(kind=8), dimension(size(m, 1)), intent(out) :: result
+
+    real(kind=8), parameter :: PI = 3.14159265358979323846_8
+    real(kind=8) :: a11, a12, a13, a22, a23, a33
+    real(kind=8) :: q, p, p1, p2, r, phi, det_b, eig1, eig2, eig3
+    real(kind=8) :: b11, b22, b33, min_eig, max_eig
+    integer(kind=8) :: i
+
+    !$omp parallel do default(shared) schedule(static) &
+    !$omp private(a11, a12, a13, a22, a23, a33, q, p, p1, p2, r, phi, det_b, &
+    !$omp         eig1, eig2, eig3, b11, b22, b33, min_eig, max_eig)
+    do i = 1, size(m, 1, kind=8)
+        if (m(i, 1) <= 0) then
+            result(i) = 0.0
+            cycle
+        end if
+
+        a11 = m(i, 1)
+        a12 = m(i, 2)
+        a13 = m(i, 3)
+        a22 = m(i, 5)
+        a23 = m(i, 6)
+        a33 = m(i, 9)
+
+        p1 = a12**2 + a13**2 + a23**2
+        q = (a11 + a22 + a33) / 3
+        p2 = (a11 - q)**2 + (a22 - q)**2 + (a33 - q)**2 + 2 * p1
+
+        if (p2 <= 0) then
+            ! The matrix is a multiple of the identity
+            result(i) = 1.0
+            cycle
+        end if
+
+        if (p1 <= tiny(p1) * p2) then
+            ! The matrix is diagonal
+            eig1 = a11
+            eig2 = a22
+            eig3 = a33
+        else
+            p = sqrt(p2 / 6)
+            b11 = (a11 - q) / p
+            b22 = (a22 - q) / p
+            b33 = (a33 - q) / p
+            det_b = b11 * (b22 * b33 - (a23 / p)**2) &
+                - (a12 / p) * ((a12 / p) * b33 - (a23 / p) * (a13 / p)) &
+                + (a13 / p) * ((a12 / p) * (a23 / p) - b22 * (a13 / p))
+            r = min(max(det_b / 2, -1.0_8), 1.0_8)
+            phi = acos(r) / 3
+
+            eig1 = q + 2 * p * cos(phi)
+            eig3 = q + 2 * p * cos(phi + 2 * PI / 3)
+            eig2 = 3 * q - eig1 - eig3
+        end if
+
+        min_eig = min(abs(eig1), abs(eig2), abs(eig3))
+        max_eig = max(abs(eig1), abs(eig2), abs(eig3))
+        result(i) = min_eig / max_eig
+    end do
+    !$omp end parallel do
+
+end subroutine inv_condition_numbers
@@ -159,4 +159,135 @@ subroutine qrotate(vec, quat, output)
      output(i, 3) = quat(i, 3) * tmpq(4) + quat(i, 4) * tmpq(3) &
          + quat(i, 1) * tmpq(2) - quat(i, 2) * tmpq(1)
   enddo
-end subroutine qrotate
\ No newline at end of file
+end subroutine qrotate
+! The routines below are equivalent to the ones above, but they work on
+! arrays of quaternions with shape (4, n) (and arrays of vectors with shape
+! (3, n)), so that the four components of each quaternion are contiguous in
+! memory. From Python, a C-ordered NumPy matrix "a" with shape (n, 4) can be
+! passed as "a.T" without being copied by f2py, and the result must be
+! transposed back, e.g.:
+!
+!     prod = qmul_c(a.T, b.T).T
+!
+! Unlike the routines above, the loops do not contain array slices, so that
+! the compiler can vectorize them.
+
+! Multiply two arrays of quaternions, see "qmul"
+subroutine qmul_c(a, b, output)
+  implicit none
+
+  real(kind=8), dimension(:, :), intent(in) :: a
+  real(kind=8), dimension(4, size(a, 2)), intent(in) :: b
+  real(kind=8), dimension(4, size(a, 2)), intent(out) :: output
+  integer :: i
+
+  do i = 1, size(a, 2)
+     output(1, i) = a(1, i) * b(4, i) + a(4, i) * b(1, i) + a(2, i) * b(3, i) - a(3, i) * b(2, i)
+     output(2, i) = a(2, i) * b(4, i) + a(4, i) * b(2, i) + a(3, i) * b(1, i) - a(1, i) * b(3, i)
+     output(3, i) = a(3, i) * b(4, i) + a(4, i) * b(3, i) + a(1, i) * b(2, i) - a(2, i) * b(1, i)
+     output(4, i) = a(4, i) * b(4, i) - a(1, i) * b(1, i) - a(2, i) * b(2, i) - a(3, i) * b(3, i)
+  enddo
+end subroutine qmul_c
+
+! Normalize an array of quaternions, see "qnorm"
+subroutine qnorm_c(q, output)
+  implicit none
+
+  real(kind=8), dimension(:, :), intent(in) :: q
+  real(kind=8), dimension(4, size(q, 2)), intent(out) :: output
+  real(kind=8) :: curnorm
+  real(kind=8) :: factor
+  integer :: i
+
+  do i = 1, size(q, 2)
+     curnorm = sqrt(q(1, i)**2 + q(2, i)**2 + q(3, i)**2 + q(4, i)**2)
+     ! Null quaternions stay null, without a branch in the loop
+     factor = 1.0d0 / max(curnorm, tiny(curnorm))
+     output(1, i) = q(1, i) * factor
+     output(2, i) = q(2, i) * factor
+     output(3, i) = q(3, i) * factor
+     output(4, i) = q(4, i) * factor
+  enddo
+end subroutine qnorm_c
+
+! Build rotation quaternions from axes and angles, see "qfromaxisangle"
+subroutine qfromaxisangle_c(axes, angles, output)
+  implicit none
+
+  real(kind=8), dimension(:, :), intent(in) :: axes
+  real(kind=8), dimension(size(axes, 2)), intent(in) :: angles
+  real(kind=8), dimension(4, size(axes, 2)), intent(out) :: output
+  real(kind=8) :: sinangle
+  integer :: i
+
+  do i = 1, size(axes, 2)
+     sinangle = sin(angles(i) / 2)
+     output(1, i) = sinangle * axes(1, i)
+     output(2, i) = sinangle * axes(2, i)
+     output(3, i) = sinangle * axes(3, i)
+     output(4, i) = cos(angles(i) / 2)
+  enddo
+end subroutine qfromaxisangle_c
+
+! Rotate an array of vectors using an array of rotation quaternions, see
+! "qrotate"
+subroutine qrotate_c(vec, quat, output)
+  implicit none
+
+  real(kind=8), dimension(:, :), intent(in) :: vec
+  real(kind=8), dimension(4, size(vec, 2)), intent(in) :: quat
+  real(kind=8), dimension(3, size(vec, 2)), intent(out) :: output
+  integer :: i
+
+  do i = 1, size(vec, 2)
+     call rotate_one(vec(1, i), vec(2, i), vec(3, i), &
+          quat(1, i), quat(2, i), quat(3, i), quat(4, i), &
+          output(1, i), output(2, i), output(3, i))
+  enddo
+end subroutine qrotate_c
+
+! Rotate an array of vectors using the product a * b of two arrays of
+! rotation quaternions. This is the same as calling "qrotate_c" on the
+! result of "qmul_c", but the product is never stored in memory.
+subroutine qmulrotate_c(vec, a, b, output)
+  implicit none
+
+  real(kind=8), dimension(:, :), intent(in) :: vec
+  real(kind=8), dimension(4, size(vec, 2)), intent(in) :: a
+  real(kind=8), dimension(4, size(vec, 2)), intent(in) :: b
+  real(kind=8), dimension(3, size(vec, 2)), intent(out) :: output
+  real(kind=8) :: q1, q2, q3, q4
+  integer :: i
+
+  do i = 1, size(vec, 2)
+     q1 = a(1, i) * b(4, i) + a(4, i) * b(1, i) + a(2, i) * b(3, i) - a(3, i) * b(2, i)
+     q2 = a(2, i) * b(4, i) + a(4, i) * b(2, i) + a(3, i) * b(1, i) - a(1, i) * b(3, i)
+     q3 = a(3, i) * b(4, i) + a(4, i) * b(3, i) + a(1, i) * b(2, i) - a(2, i) * b(1, i)
+     q4 = a(4, i) * b(4, i) - a(1, i) * b(1, i) - a(2, i) * b(2, i) - a(3, i) * b(3, i)
+     call rotate_one(vec(1, i), vec(2, i), vec(3, i), q1, q2, q3, q4, &
+          output(1, i), output(2, i), output(3, i))
+  enddo
+end subroutine qmulrotate_c
+
+! Rotate the vector (v1, v2, v3) using the quaternion (q1, q2, q3, q4). The
+! sequence of operations is the same as in "qrotate". Since the routine
+! works on scalars, the compiler inlines it in the loops above and keeps
+! them vectorizable.
+pure subroutine rotate_one(v1, v2, v3, q1, q2, q3, q4, out1, out2, out3)
+  implicit none
+
+  real(kind=8), intent(in) :: v1, v2, v3
+  real(kind=8), intent(in) :: q1, q2, q3, q4
+  real(kind=8), intent(out) :: out1, out2, out3
+  real(kind=8) :: t1, t2, t3, t4
+
+  ! tmpq = vec * inv(quat), where inv(quat) = (-q1, -q2, -q3, q4)
+  t1 =  v1 * q4 - v2 * q3 + v3 * q2
+  t2 =  v2 * q4 - v3 * q1 + v1 * q3
+  t3 =  v3 * q4 - v1 * q2 + v2 * q1
+  t4 =  v1 * q1 + v2 * q2 + v3 * q3
+
+  out1 = q1 * t4 + q4 * t1 + q2 * t3 - q3 * t2
+  out2 = q2 * t4 + q4 * t2 + q3 * t1 - q1 * t3
+  out3 = q3 * t4 + q4 * t3 + q1 * t2 - q2 * t1
+end subroutine rotate_one
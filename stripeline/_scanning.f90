@@ -0,0 +1,779 @@
+! Compiled kernels used by "scanning.py" to produce pointing timelines.
+!
+! Quaternions follow the same convention used in "_quaternions.f90", i.e.,
+!
+!     q = q[1] i + q[2] j + q[3] k + q[4],
+!
+! with the scalar as the last coefficient of the 4-element array.
+
+module scanning_kernels
+    implicit none
+
+    real(kind=8), parameter :: PI = 3.14159265358979323846264338327950288d0
+    real(kind=8), parameter :: SECONDS_PER_DAY = 86400.0d0
+    real(kind=8), dimension(3), parameter :: X_VEC = (/ 1.0d0, 0.0d0, 0.0d0 /)
+    real(kind=8), dimension(3), parameter :: Z_VEC = (/ 0.0d0, 0.0d0, 1.0d0 /)
+
+contains
+
+    ! Product of two quaternions, the same as "qmul" in "_quaternions.f90"
+    pure subroutine quat_mul(a, b, output)
+        real(kind=8), dimension(4), intent(in) :: a
+        real(kind=8), dimension(4), intent(in) :: b
+        real(kind=8), dimension(4), intent(out) :: output
+
+        output(1) = a(1) * b(4) + a(4) * b(1) + a(2) * b(3) - a(3) * b(2)
+        output(2) = a(2) * b(4) + a(4) * b(2) + a(3) * b(1) - a(1) * b(3)
+        output(3) = a(3) * b(4) + a(4) * b(3) + a(1) * b(2) - a(2) * b(1)
+        output(4) = a(4) * b(4) - a(1) * b(1) - a(2) * b(2) - a(3) * b(3)
+    end subroutine quat_mul
+
+    ! Rotate the 3-element vector "vec" using the quaternion "quat", using
+    ! the same sequence of operations as "qrotate" in "_quaternions.f90"
+    pure subroutine quat_rotate(vec, quat, output)
+        real(kind=8), dimension(3), intent(in) :: vec
+        real(kind=8), dimension(4), intent(in) :: quat
+        real(kind=8), dimension(3), intent(out) :: output
+
+        real(kind=8), dimension(4) :: tmpq
+        real(kind=8), dimension(4) :: invq
+
+        invq(1:3) = -quat(1:3)
+        invq(4) = quat(4)
+
+        tmpq(1) =  vec(1) * invq(4) + vec(2) * invq(3) - vec(3) * invq(2)
+        tmpq(2) =  vec(2) * invq(4) + vec(3) * invq(1) - vec(1) * invq(3)
+        tmpq(3) =  vec(3) * invq(4) + vec(1) * invq(2) - vec(2) * invq(1)
+        tmpq(4) = -vec(1) * invq(1) - vec(2) * invq(2) - vec(3) * invq(3)
+
+        output(1) = quat(1) * tmpq(4) + quat(4) * tmpq(1) &
+            + quat(2) * tmpq(3) - quat(3) * tmpq(2)
+        output(2) = quat(2) * tmpq(4) + quat(4) * tmpq(2) &
+            + quat(3) * tmpq(1) - quat(1) * tmpq(3)
+        output(3) = quat(3) * tmpq(4) + quat(4) * tmpq(3) &
+            + quat(1) * tmpq(2) - quat(2) * tmpq(1)
+    end subroutine quat_rotate
+
+    ! Rotation quaternion around "axis" (which is not normalized, like in
+    ! "qfromaxisangle") by "angle" radians
+    pure subroutine quat_from_axis_angle(axis, angle, output)
+        real(kind=8), dimension(3), intent(in) :: axis
+        real(kind=8), intent(in) :: angle
+        real(kind=8), dimension(4), intent(out) :: output
+
+        output(1:3) = sin(angle / 2) * axis
+        output(4) = cos(angle / 2)
+    end subroutine quat_from_axis_angle
+
+    ! Angle of a wheel rotating at "rpm" rotations per minute, same as
+    ! "time_to_rot_angle" in "scanning.py"
+    pure function rot_angle(time, rpm)
+        real(kind=8), intent(in) :: time
+        real(kind=8), intent(in) :: rpm
+        real(kind=8) :: rot_angle
+
+        if (abs(rpm) < tiny(rpm)) then
+            rot_angle = 0.0
+        else
+            rot_angle = 2 * PI * time * (rpm / 60.0d0)
+        end if
+    end function rot_angle
+
+    ! Spherical linear interpolation between the unit quaternions "a"
+    ! (t = 0) and "b" (t = 1). Since q and -q represent the same rotation,
+    ! the shortest arc is always used.
+    pure subroutine quat_slerp(a, b, t, output)
+        real(kind=8), dimension(4), intent(in) :: a
+        real(kind=8), dimension(4), intent(in) :: b
+        real(kind=8), intent(in) :: t
+        real(kind=8), dimension(4), intent(out) :: output
+
+        real(kind=8) :: cos_omega, omega, sin_omega, sign_b, wa, wb
+
+        cos_omega = dot_product(a, b)
+        sign_b = 1.0d0
+        if (cos_omega < 0) then
+            cos_omega = -cos_omega
+            sign_b = -1.0d0
+        end if
+
+        if (1.0d0 - cos_omega < 1.0d-12) then
+            ! The two quaternions are almost the same: the linear
+            ! interpolation is accurate and it avoids dividing by zero
+            wa = 1.0d0 - t
+            wb = t
+        else
+            omega = acos(min(cos_omega, 1.0d0))
+            sin_omega = sin(omega)
+            wa = sin((1.0d0 - t) * omega) / sin_omega
+            wb = sin(t * omega) / sin_omega
+        end if
+
+        output = wa * a + (sign_b * wb) * b
+    end subroutine quat_slerp
+
+    ! Attitude quaternion of the instrument at time "time", converting the
+    ! focal plane reference frame into the Earth's one. The quaternions
+    ! "qwheel2" and "qsite" do not depend on time: the caller computes them
+    ! once.
+    pure subroutine attitude(time, dir_vec, angle0_1, angle0_3, rpms, &
+        qwheel2, qsite, quat)
+        real(kind=8), intent(in) :: time
+        real(kind=8), dimension(3), intent(in) :: dir_vec
+        real(kind=8), intent(in) :: angle0_1
+        real(kind=8), intent(in) :: angle0_3
+        real(kind=8), dimension(2), intent(in) :: rpms
+        real(kind=8), dimension(4), intent(in) :: qwheel2
+        real(kind=8), dimension(4), intent(in) :: qsite
+        real(kind=8), dimension(4), intent(out) :: quat
+
+        real(kind=8), dimension(4) :: qwheel1, qwheel3, qearth, tmpq1, tmpq2
+
+        call quat_from_axis_angle(dir_vec, angle0_1 + rot_angle(time, rpms(1)), &
+            qwheel1)
+        call quat_from_axis_angle(Z_VEC, angle0_3 + rot_angle(time, rpms(2)), &
+            qwheel3)
+        call quat_from_axis_angle(Z_VEC, 2 * PI * time / SECONDS_PER_DAY, qearth)
+
+        ! Ground reference frame: qwheel3 * (qwheel2 * qwheel1)
+        call quat_mul(qwheel2, qwheel1, tmpq1)
+        call quat_mul(qwheel3, tmpq1, tmpq2)
+
+        ! Earth's centre: qearth * (qsite * ground)
+        call quat_mul(qsite, tmpq2, tmpq1)
+        call quat_mul(qearth, tmpq1, quat)
+    end subroutine attitude
+
+    ! Compute the colatitude, longitude, and polarization angle of the beam
+    ! "dir_vec" when the attitude of the instrument is "quat"
+    pure subroutine angles_from_attitude(quat, dir_vec, theta, phi, psi)
+        real(kind=8), dimension(4), intent(in) :: quat
+        real(kind=8), dimension(3), intent(in) :: dir_vec
+        real(kind=8), intent(out) :: theta
+        real(kind=8), intent(out) :: phi
+        real(kind=8), intent(out) :: psi
+
+        real(kind=8), dimension(3) :: dirs, poldirs
+
+        call quat_rotate(dir_vec, quat, dirs)
+        call quat_rotate(X_VEC, quat, poldirs)
+        call angles_from_directions(dirs, poldirs, theta, phi, psi)
+    end subroutine angles_from_attitude
+
+    ! Compute the colatitude, longitude, and polarization angle of a beam
+    ! pointing towards "dirs" (in the Earth's reference frame), whose
+    ! polarization axis is "poldirs"
+    pure subroutine angles_from_directions(dirs, poldirs, theta, phi, psi)
+        real(kind=8), dimension(3), intent(in) :: dirs
+        real(kind=8), dimension(3), intent(in) :: poldirs
+        real(kind=8), intent(out) :: theta
+        real(kind=8), intent(out) :: phi
+        real(kind=8), intent(out) :: psi
+
+        real(kind=8), dimension(3) :: northdir, cross
+        real(kind=8) :: norm, cos_theta, sin_theta, cos_phi, sin_phi
+        real(kind=8) :: cos_psi, sin_psi, orientation
+
+        ! Like "healpy.vec2ang", the longitude is in the range [0, 2π)
+        norm = sqrt(dot_product(dirs, dirs))
+        theta = acos(dirs(3) / norm)
+        phi = atan2(dirs(2), dirs(1))
+        if (phi < 0) phi = phi + 2 * PI
+
+        ! The north direction for a vector v is just -dv/dtheta. The sines
+        ! and cosines of theta and phi are taken from the components of
+        ! "dirs", which is cheaper than calling "sin" and "cos"
+        cos_theta = dirs(3) / norm
+        sin_theta = sqrt(dirs(1)**2 + dirs(2)**2) / norm
+        if (sin_theta > 0) then
+            cos_phi = dirs(1) / (norm * sin_theta)
+            sin_phi = dirs(2) / (norm * sin_theta)
+        else
+            ! At the poles, "atan2" returns phi = 0
+            cos_phi = 1.0
+            sin_phi = 0.0
+        end if
+
+        northdir(1) = -cos_theta * cos_phi
+        northdir(2) = -cos_theta * sin_phi
+        northdir(3) = sin_theta
+
+        cross(1) = northdir(2) * poldirs(3) - northdir(3) * poldirs(2)
+        cross(2) = northdir(3) * poldirs(1) - northdir(1) * poldirs(3)
+        cross(3) = northdir(1) * poldirs(2) - northdir(2) * poldirs(1)
+
+        ! Keep the same expressions (and clipping) used by the NumPy code
+        ! in "generate_pointings", so that the two produce the same angles
+        cos_psi = max(-1.0d0, min(1.0d0, dot_product(northdir, poldirs)))
+        sin_psi = max(-1.0d0, min(1.0d0, dot_product(cross, cross)))
+        psi = atan2(sin_psi, cos_psi)
+
+        orientation = dot_product(cross, dirs)
+        if (orientation < 0) then
+            psi = -psi
+        else if (orientation < tiny(orientation)) then
+            ! The orientation is zero
+            psi = 0.0
+        end if
+    end subroutine angles_from_directions
+
+    ! Angle (in radians) between the vectors "a" and "b"
+    pure function angle_between(a, b)
+        real(kind=8), dimension(3), intent(in) :: a
+        real(kind=8), dimension(3), intent(in) :: b
+        real(kind=8) :: angle_between
+
+        real(kind=8), dimension(3) :: cross
+
+        cross(1) = a(2) * b(3) - a(3) * b(2)
+        cross(2) = a(3) * b(1) - a(1) * b(3)
+        cross(3) = a(1) * b(2) - a(2) * b(1)
+        angle_between = atan2(sqrt(dot_product(cross, cross)), dot_product(a, b))
+    end function angle_between
+
+    ! Error of the interpolation between the attitudes "qstart" (time
+    ! "time0") and "qend" (time "time1"), estimated at the midpoint of the
+    ! interval, where it is largest. The result is the largest angle between
+    ! the exact and the interpolated directions of the beam and of the
+    ! polarization axis.
+    pure function interpolation_error(qstart, qend, time0, time1, dir_vec, &
+        angle0_1, angle0_3, rpms, qwheel2, qsite)
+        real(kind=8), dimension(4), intent(in) :: qstart
+        real(kind=8), dimension(4), intent(in) :: qend
+        real(kind=8), intent(in) :: time0
+        real(kind=8), intent(in) :: time1
+        real(kind=8), dimension(3), intent(in) :: dir_vec
+        real(kind=8), intent(in) :: angle0_1
+        real(kind=8), intent(in) :: angle0_3
+        real(kind=8), dimension(2), intent(in) :: rpms
+        real(kind=8), dimension(4), intent(in) :: qwheel2
+        real(kind=8), dimension(4), intent(in) :: qsite
+        real(kind=8) :: interpolation_error
+
+        real(kind=8), dimension(4) :: exact, interp
+        real(kind=8), dimension(3) :: exact_vec, interp_vec
+
+        call attitude(0.5d0 * (time0 + time1), dir_vec, angle0_1, angle0_3, &
+            rpms, qwheel2, qsite, exact)
+        call quat_slerp(qstart, qend, 0.5d0, interp)
+
+        call quat_rotate(dir_vec, exact, exact_vec)
+        call quat_rotate(dir_vec, interp, interp_vec)
+        interpolation_error = angle_between(exact_vec, interp_vec)
+
+        call quat_rotate(X_VEC, exact, exact_vec)
+        call quat_rotate(X_VEC, interp, interp_vec)
+        interpolation_error = max(interpolation_error, &
+            angle_between(exact_vec, interp_vec))
+    end function interpolation_error
+
+    ! Interleave the bits of "value" with zeroes: bit k goes to bit 2k
+    pure function spread_bits(value)
+        integer(kind=8), intent(in) :: value
+        integer(kind=8) :: spread_bits
+
+        integer :: bit
+
+        spread_bits = 0
+        do bit = 0, 29
+            if (btest(value, bit)) spread_bits = ibset(spread_bits, 2 * bit)
+        end do
+    end function spread_bits
+
+    ! Index of the HEALPix pixel containing the direction "vec" (which needs
+    ! not to be normalized). The algorithm is the same as the one used by
+    ! "loc2pix" in the HEALPix C++ library: near the poles, the sine of the
+    ! colatitude is taken from the vector to keep the result accurate. NESTED
+    ! indices require "nside" to be a power of two.
+    pure function vec2pix(nside, nest, vec) result(pixel)
+        integer(kind=8), intent(in) :: nside
+        logical, intent(in) :: nest
+        real(kind=8), dimension(3), intent(in) :: vec
+        integer(kind=8) :: pixel
+
+        real(kind=8) :: norm, z, za, phi, tt, tp, tmp, sth, temp1, temp2
+        integer(kind=8) :: jp, jm, ir, ip, kshift, ifp, ifm, ntt, face, ix, iy
+
+        norm = sqrt(dot_product(vec, vec))
+        z = vec(3) / norm
+        za = abs(z)
+        phi = atan2(vec(2), vec(1))
+        if (phi < 0) phi = phi + 2 * PI
+
+        tt = phi / (0.5d0 * PI)
+        if (tt >= 4) tt = tt - 4
+
+        if (za <= 2.0d0 / 3.0d0) then
+            ! Equatorial region
+            temp1 = nside * (0.5d0 + tt)
+            temp2 = nside * (z * 0.75d0)
+            jp = int(temp1 - temp2, kind=8)
+            jm = int(temp1 + temp2, kind=8)
+
+            if (nest) then
+                ifp = jp / nside
+                ifm = jm / nside
+                if (ifp == ifm) then
+                    face = ior(ifp, 4_8)
+                else if (ifp < ifm) then
+                    face = ifp
+                else
+                    face = ifm + 8
+                end if
+                ix = modulo(jm, nside)
+                iy = nside - modulo(jp, nside) - 1
+            else
+                ir = nside + 1 + jp - jm
+                kshift = 1 - iand(ir, 1_8)
+                ip = modulo((jp + jm - nside + kshift + 1) / 2, 4 * nside)
+                pixel = 2 * nside * (nside - 1) + (ir - 1) * 4 * nside + ip
+                return
+            end if
+        else
+            ! Polar caps
+            if (za > 0.99d0) then
+                sth = sqrt(vec(1)**2 + vec(2)**2) / norm
+                tmp = nside * sth / sqrt((1.0d0 + za) / 3.0d0)
+            else
+                tmp = nside * sqrt(3.0d0 * (1.0d0 - za))
+            end if
+
+            if (nest) then
+                ntt = min(3_8, int(tt, kind=8))
+                tp = tt - ntt
+                jp = min(int(tp * tmp, kind=8), nside - 1)
+                jm = min(int((1.0d0 - tp) * tmp, kind=8), nside - 1)
+                if (z >= 0) then
+                    face = ntt
+                    ix = nside - jm - 1
+                    iy = nside - jp - 1
+                else
+                    face = ntt + 8
+                    ix = jp
+                    iy = jm
+                end if
+            else
+                tp = tt - int(tt)
+                jp = int(tp * tmp, kind=8)
+                jm = int((1.0d0 - tp) * tmp, kind=8)
+                ir = jp + jm + 1
+                ip = modulo(int(tt * ir, kind=8), 4 * ir)
+                if (z > 0) then
+                    pixel = 2 * ir * (ir - 1) + ip
+                else
+                    pixel = 12 * nside * nside - 2 * ir * (ir + 1) + ip
+                end if
+                return
+            end if
+        end if
+
+        pixel = face * nside * nside + spread_bits(ix) + 2 * spread_bits(iy)
+    end function vec2pix
+
+end module scanning_kernels
+
+! Compute the pointings of a beam with direction "dir_vec" (in the reference
+! frame of the focal plane) for "num" samples, the first taken at time
+! "start_time" and the others sampled with frequency "sampfreq".
+!
+! The parameters "wheel_angles0_deg" (initial angles of the three wheels),
+! "rpms" (rotation speed of wheels 1 and 3), and "latitude_deg" are the
+! fields of a "ScanningStrategy" object. The output matrix "pointings" has
+! the same content as the matrix passed by "generate_pointings" to its
+! callback (time, colatitude, longitude, polarization angle), but its shape
+! is (4, num): in this way, the four values of each sample are contiguous,
+! and the transposed matrix seen from NumPy is C-ordered.
+!
+! The quaternions of the second wheel and of the observing site do not
+! change with time, and they are computed once before the loop over the
+! samples. The loop is parallelized using OpenMP.
+subroutine pointing_timeline(wheel_angles0_deg, rpms, latitude_deg, dir_vec, &
+    start_time, sampfreq, pointings, num)
+    use scanning_kernels
+    implicit none
+    !f2py threadsafe
+
+    real(kind=8), dimension(3), intent(in) :: wheel_angles0_deg
+    real(kind=8), dimension(2), intent(in) :: rpms
+    real(kind=8), intent(in) :: latitude_deg
+    real(kind=8), dimension(3), intent(in) :: dir_vec
+    real(kind=8), intent(in) :: start_time
+    real(kind=8), intent(in) :: sampfreq
+    integer(kind=8), intent(in) :: num
+    real(kind=8), dimension(4, num), intent(out) :: pointings
+
+    real(kind=8), dimension(4) :: qwheel2, qsite, quat
+    real(kind=8) :: angle0_1, angle0_3, time
+    integer(kind=8) :: i
+
+    angle0_1 = wheel_angles0_deg(1) * (PI / 180.0d0)
+    angle0_3 = wheel_angles0_deg(3) * (PI / 180.0d0)
+
+    ! These do not depend on time
+    call quat_from_axis_angle(X_VEC, wheel_angles0_deg(2) * (PI / 180.0d0), &
+        qwheel2)
+    call quat_from_axis_angle(X_VEC, (90.0d0 - latitude_deg) * (PI / 180.0d0), &
+        qsite)
+
+    !$omp parallel do schedule(static) default(shared) private(i, quat, time)
+    do i = 1, num
+        time = start_time + (i - 1) / sampfreq
+
+        call attitude(time, dir_vec, angle0_1, angle0_3, rpms, qwheel2, qsite, &
+            quat)
+
+        pointings(1, i) = time
+        call angles_from_attitude(quat, dir_vec, pointings(2, i), &
+            pointings(3, i), pointings(4, i))
+    end do
+    !$omp end parallel do
+end subroutine pointing_timeline
+
+! Like "pointing_timeline", but the attitude of the instrument is computed
+! exactly only once every "decimation" samples; the attitude of the other
+! samples is interpolated using spherical linear interpolation (slerp).
+!
+! The value of "max_error" is the largest estimated angular error (in
+! radians) on the direction of the beam or of the polarization axis, and it
+! is computed by comparing the exact and interpolated attitudes at the
+! midpoint of every interval of the coarse grid. When "decimation" is 1,
+! the result is the same as "pointing_timeline".
+subroutine interpolated_pointing_timeline(wheel_angles0_deg, rpms, &
+    latitude_deg, dir_vec, start_time, sampfreq, decimation, pointings, &
+    max_error, num)
+    use scanning_kernels
+    implicit none
+    !f2py threadsafe
+
+    real(kind=8), dimension(3), intent(in) :: wheel_angles0_deg
+    real(kind=8), dimension(2), intent(in) :: rpms
+    real(kind=8), intent(in) :: latitude_deg
+    real(kind=8), dimension(3), intent(in) :: dir_vec
+    real(kind=8), intent(in) :: start_time
+    real(kind=8), intent(in) :: sampfreq
+    integer(kind=8), intent(in) :: decimation
+    integer(kind=8), intent(in) :: num
+    real(kind=8), dimension(4, num), intent(out) :: pointings
+    real(kind=8), intent(out) :: max_error
+
+    real(kind=8), dimension(:, :), allocatable :: coarse
+    real(kind=8), dimension(4) :: qwheel2, qsite, qstart, qend, quat
+    real(kind=8) :: angle0_1, angle0_3
+    real(kind=8) :: cos_omega, sin_omega, omega, cos_step, sin_step
+    real(kind=8) :: cos_cur, sin_cur, tmp, wa, wb
+    logical :: use_slerp
+    integer(kind=8) :: i, k, first, last, num_of_nodes
+
+    angle0_1 = wheel_angles0_deg(1) * (PI / 180.0d0)
+    angle0_3 = wheel_angles0_deg(3) * (PI / 180.0d0)
+
+    call quat_from_axis_angle(X_VEC, wheel_angles0_deg(2) * (PI / 180.0d0), &
+        qwheel2)
+    call quat_from_axis_angle(X_VEC, (90.0d0 - latitude_deg) * (PI / 180.0d0), &
+        qsite)
+
+    ! Nodes of the coarse grid: the last one is at or after the last sample
+    num_of_nodes = (num - 1) / decimation + 2
+    allocate(coarse(4, num_of_nodes))
+    max_error = 0.0
+
+    !$omp parallel default(shared) &
+    !$omp private(i, k, first, last, qstart, qend, quat, cos_omega, sin_omega, &
+    !$omp         omega, cos_step, sin_step, cos_cur, sin_cur, tmp, wa, wb, &
+    !$omp         use_slerp)
+
+    !$omp do schedule(static)
+    do k = 1, num_of_nodes
+        call attitude(start_time + ((k - 1) * decimation) / sampfreq, dir_vec, &
+            angle0_1, angle0_3, rpms, qwheel2, qsite, coarse(:, k))
+    end do
+    !$omp end do
+
+    ! With no decimation there is nothing to interpolate, and the error is
+    ! zero by definition
+    !$omp do schedule(static) reduction(max:max_error)
+    do k = 1, merge(num_of_nodes - 1, 0_8, decimation > 1)
+        max_error = max(max_error, interpolation_error(coarse(:, k), &
+            coarse(:, k + 1), start_time + ((k - 1) * decimation) / sampfreq, &
+            start_time + (k * decimation) / sampfreq, dir_vec, angle0_1, &
+            angle0_3, rpms, qwheel2, qsite))
+    end do
+    !$omp end do nowait
+
+    ! Each thread fills whole intervals of the coarse grid. Within an
+    ! interval, the angle of the slerp grows by the same amount at every
+    ! sample, so its sine and cosine are updated by a rotation instead of
+    ! calling trigonometric functions
+    !$omp do schedule(static)
+    do k = 1, num_of_nodes - 1
+        first = (k - 1) * decimation + 1
+        last = min(k * decimation, num)
+        if (first > num) cycle
+
+        qstart = coarse(:, k)
+        qend = coarse(:, k + 1)
+        cos_omega = dot_product(qstart, qend)
+        if (cos_omega < 0) then
+            cos_omega = -cos_omega
+            qend = -qend
+        end if
+
+        sin_omega = sqrt(max(0.0d0, 1.0d0 - cos_omega**2))
+        use_slerp = 1.0d0 - cos_omega >= 1.0d-12
+        if (use_slerp) then
+            omega = acos(min(cos_omega, 1.0d0))
+            cos_step = cos(omega / decimation)
+            sin_step = sin(omega / decimation)
+            sin_omega = sin(omega)
+        end if
+
+        ! cos_cur and sin_cur are the cosine and sine of omega * t
+        cos_cur = 1.0d0
+        sin_cur = 0.0d0
+        do i = first, last
+            if (use_slerp) then
+                wa = cos_cur - (cos_omega / sin_omega) * sin_cur
+                wb = sin_cur / sin_omega
+
+                tmp = cos_cur * cos_step - sin_cur * sin_step
+                sin_cur = sin_cur * cos_step + cos_cur * sin_step
+                cos_cur = tmp
+            else
+                wb = real(i - first, kind=8) / decimation
+                wa = 1.0d0 - wb
+            end if
+            quat = wa * qstart + wb * qend
+
+            pointings(1, i) = start_time + (i - 1) / sampfreq
+            call angles_from_attitude(quat, dir_vec, pointings(2, i), &
+                pointings(3, i), pointings(4, i))
+        end do
+    end do
+    !$omp end do
+
+    !$omp end parallel
+
+    deallocate(coarse)
+end subroutine interpolated_pointing_timeline
+
+! Return in "max_error" the error (in radians) that
+! "interpolated_pointing_timeline" would report for the same parameters,
+! without computing the pointings. This only requires two attitudes for
+! every "decimation" samples, and it is used to pick the decimation that
+! matches a given accuracy.
+subroutine estimate_interpolation_error(wheel_angles0_deg, rpms, &
+    latitude_deg, dir_vec, start_time, sampfreq, decimation, num, max_error)
+    use scanning_kernels
+    implicit none
+    !f2py threadsafe
+
+    real(kind=8), dimension(3), intent(in) :: wheel_angles0_deg
+    real(kind=8), dimension(2), intent(in) :: rpms
+    real(kind=8), intent(in) :: latitude_deg
+    real(kind=8), dimension(3), intent(in) :: dir_vec
+    real(kind=8), intent(in) :: start_time
+    real(kind=8), intent(in) :: sampfreq
+    integer(kind=8), intent(in) :: decimation
+    integer(kind=8), intent(in) :: num
+    real(kind=8), intent(out) :: max_error
+
+    real(kind=8), dimension(4) :: qwheel2, qsite, qstart, qend
+    real(kind=8) :: angle0_1, angle0_3, time0, time1
+    integer(kind=8) :: k, num_of_nodes
+
+    angle0_1 = wheel_angles0_deg(1) * (PI / 180.0d0)
+    angle0_3 = wheel_angles0_deg(3) * (PI / 180.0d0)
+
+    call quat_from_axis_angle(X_VEC, wheel_angles0_deg(2) * (PI / 180.0d0), &
+        qwheel2)
+    call quat_from_axis_angle(X_VEC, (90.0d0 - latitude_deg) * (PI / 180.0d0), &
+        qsite)
+
+    num_of_nodes = (num - 1) / decimation + 2
+    max_error = 0.0
+
+    !$omp parallel do schedule(static) default(shared) &
+    !$omp private(k, qstart, qend, time0, time1) reduction(max:max_error)
+    do k = 1, merge(num_of_nodes - 1, 0_8, decimation > 1)
+        time0 = start_time + ((k - 1) * decimation) / sampfreq
+        time1 = start_time + (k * decimation) / sampfreq
+        call attitude(time0, dir_vec, angle0_1, angle0_3, rpms, qwheel2, &
+            qsite, qstart)
+        call attitude(time1, dir_vec, angle0_1, angle0_3, rpms, qwheel2, &
+            qsite, qend)
+        max_error = max(max_error, interpolation_error(qstart, qend, time0, &
+            time1, dir_vec, angle0_1, angle0_3, rpms, qwheel2, qsite))
+    end do
+    !$omp end parallel do
+end subroutine estimate_interpolation_error
+
+! Compute the index of the HEALPix pixel observed by the beam "dir_vec" for
+! each of "num" samples, without computing the angles. The parameters are
+! the same as in "pointing_timeline"; "nside" is the resolution of the map
+! and "nest" selects the NESTED scheme instead of the RING one.
+subroutine pixel_timeline(wheel_angles0_deg, rpms, latitude_deg, dir_vec, &
+    start_time, sampfreq, nside, nest, pixidx, num)
+    use scanning_kernels
+    implicit none
+    !f2py threadsafe
+
+    real(kind=8), dimension(3), intent(in) :: wheel_angles0_deg
+    real(kind=8), dimension(2), intent(in) :: rpms
+    real(kind=8), intent(in) :: latitude_deg
+    real(kind=8), dimension(3), intent(in) :: dir_vec
+    real(kind=8), intent(in) :: start_time
+    real(kind=8), intent(in) :: sampfreq
+    integer(kind=8), intent(in) :: nside
+    logical, intent(in) :: nest
+    integer(kind=8), intent(in) :: num
+    integer(kind=8), dimension(num), intent(out) :: pixidx
+
+    real(kind=8), dimension(4) :: qwheel2, qsite, quat
+    real(kind=8), dimension(3) :: dirs
+    real(kind=8) :: angle0_1, angle0_3
+    integer(kind=8) :: i
+
+    angle0_1 = wheel_angles0_deg(1) * (PI / 180.0d0)
+    angle0_3 = wheel_angles0_deg(3) * (PI / 180.0d0)
+
+    call quat_from_axis_angle(X_VEC, wheel_angles0_deg(2) * (PI / 180.0d0), &
+        qwheel2)
+    call quat_from_axis_angle(X_VEC, (90.0d0 - latitude_deg) * (PI / 180.0d0), &
+        qsite)
+
+    !$omp parallel do schedule(static) default(shared) private(i, quat, dirs)
+    do i = 1, num
+        call attitude(start_time + (i - 1) / sampfreq, dir_vec, angle0_1, &
+            angle0_3, rpms, qwheel2, qsite, quat)
+        call quat_rotate(dir_vec, quat, dirs)
+        pixidx(i) = vec2pix(nside, nest, dirs)
+    end do
+    !$omp end parallel do
+end subroutine pixel_timeline
+
+! Same as "pointing_timeline", but the index of the HEALPix pixel of each
+! sample is computed in the same pass and saved in "pixidx" (see
+! "pixel_timeline")
+subroutine pointing_pixel_timeline(wheel_angles0_deg, rpms, latitude_deg, &
+    dir_vec, start_time, sampfreq, nside, nest, pointings, pixidx, num)
+    use scanning_kernels
+    implicit none
+    !f2py threadsafe
+
+    real(kind=8), dimension(3), intent(in) :: wheel_angles0_deg
+    real(kind=8), dimension(2), intent(in) :: rpms
+    real(kind=8), intent(in) :: latitude_deg
+    real(kind=8), dimension(3), intent(in) :: dir_vec
+    real(kind=8), intent(in) :: start_time
+    real(kind=8), intent(in) :: sampfreq
+    integer(kind=8), intent(in) :: nside
+    logical, intent(in) :: nest
+    integer(kind=8), intent(in) :: num
+    real(kind=8), dimension(4, num), intent(out) :: pointings
+    integer(kind=8), dimension(num), intent(out) :: pixidx
+
+    real(kind=8), dimension(4) :: qwheel2, qsite, quat
+    real(kind=8), dimension(3) :: dirs
+    real(kind=8) :: angle0_1, angle0_3, time
+    integer(kind=8) :: i
+
+    angle0_1 = wheel_angles0_deg(1) * (PI / 180.0d0)
+    angle0_3 = wheel_angles0_deg(3) * (PI / 180.0d0)
+
+    call quat_from_axis_angle(X_VEC, wheel_angles0_deg(2) * (PI / 180.0d0), &
+        qwheel2)
+    call quat_from_axis_angle(X_VEC, (90.0d0 - latitude_deg) * (PI / 180.0d0), &
+        qsite)
+
+    !$omp parallel do schedule(static) default(shared) &
+    !$omp private(i, quat, dirs, time)
+    do i = 1, num
+        time = start_time + (i - 1) / sampfreq
+        call attitude(time, dir_vec, angle0_1, angle0_3, rpms, qwheel2, qsite, &
+            quat)
+
+        pointings(1, i) = time
+        call angles_from_attitude(quat, dir_vec, pointings(2, i), &
+            pointings(3, i), pointings(4, i))
+
+        call quat_rotate(dir_vec, quat, dirs)
+        pixidx(i) = vec2pix(nside, nest, dirs)
+    end do
+    !$omp end parallel do
+end subroutine pointing_pixel_timeline
+
+! Compute the pointings of all the horns in the focal plane for "num"
+! samples. The attitude of the instrument is computed once per sample for
+! the boresight (the z axis of the focal plane, which is also the axis of
+! the first wheel), and then it is combined with the fixed rotation of each
+! horn. The quaternion offsets(:, k) rotates the boresight into the beam of
+! the k-th horn, as well as the x axis into its polarization axis.
+!
+! The other parameters are the same as in "pointing_timeline". The shape of
+! "pointings" is (4, num, num_of_horns), i.e., from NumPy it is a C-ordered
+! array with shape (num_of_horns, num, 4). If "pixidx" is not empty, it
+! must have shape (num, num_of_horns), and it is filled with the index of
+! the pixel observed by each horn (see "pixel_timeline").
+subroutine focal_plane_timeline(wheel_angles0_deg, rpms, latitude_deg, &
+    offsets, start_time, sampfreq, nside, nest, pointings, pixidx, num, &
+    num_of_horns)
+    use scanning_kernels
+    implicit none
+    !f2py threadsafe
+
+    real(kind=8), dimension(3), intent(in) :: wheel_angles0_deg
+    real(kind=8), dimension(2), intent(in) :: rpms
+    real(kind=8), intent(in) :: latitude_deg
+    integer(kind=8), intent(in) :: num_of_horns
+    real(kind=8), dimension(4, num_of_horns), intent(in) :: offsets
+    real(kind=8), intent(in) :: start_time
+    real(kind=8), intent(in) :: sampfreq
+    integer(kind=8), intent(in) :: nside
+    logical, intent(in) :: nest
+    integer(kind=8), intent(in) :: num
+    real(kind=8), dimension(4, num, num_of_horns), intent(out) :: pointings
+    integer(kind=8), dimension(:, :), intent(inout) :: pixidx
+
+    real(kind=8), dimension(3, num_of_horns) :: horn_dirs, horn_poldirs
+    real(kind=8), dimension(4) :: qwheel2, qsite, quat
+    real(kind=8), dimension(3) :: dirs, poldirs
+    real(kind=8) :: angle0_1, angle0_3, time
+    logical :: save_pixels
+    integer(kind=8) :: i, k
+
+    angle0_1 = wheel_angles0_deg(1) * (PI / 180.0d0)
+    angle0_3 = wheel_angles0_deg(3) * (PI / 180.0d0)
+
+    call quat_from_axis_angle(X_VEC, wheel_angles0_deg(2) * (PI / 180.0d0), &
+        qwheel2)
+    call quat_from_axis_angle(X_VEC, (90.0d0 - latitude_deg) * (PI / 180.0d0), &
+        qsite)
+
+    ! The direction and the polarization axis of each horn in the reference
+    ! frame of the focal plane do not depend on time
+    do k = 1, num_of_horns
+        call quat_rotate(Z_VEC, offsets(:, k), horn_dirs(:, k))
+        call quat_rotate(X_VEC, offsets(:, k), horn_poldirs(:, k))
+    end do
+
+    save_pixels = size(pixidx) > 0
+
+    !$omp parallel do schedule(static) default(shared) &
+    !$omp private(i, k, quat, dirs, poldirs, time)
+    do i = 1, num
+        time = start_time + (i - 1) / sampfreq
+        call attitude(time, Z_VEC, angle0_1, angle0_3, rpms, qwheel2, qsite, &
+            quat)
+
+        do k = 1, num_of_horns
+            call quat_rotate(horn_dirs(:, k), quat, dirs)
+            call quat_rotate(horn_poldirs(:, k), quat, poldirs)
+
+            pointings(1, i, k) = time
+            call angles_from_directions(dirs, poldirs, pointings(2, i, k), &
+                pointings(3, i, k), pointings(4, i, k))
+            if (save_pixels) pixidx(i, k) = vec2pix(nside, nest, dirs)
+        end do
+    end do
+    !$omp end parallel do
+end subroutine focal_plane_timeline
@@ -0,0 +1,301 @@
+#!/usr/bin/env python3
+# -*- encoding: utf-8 -*-
+
+'''Timers and counters for the stages of the pipeline
+
+The most time-consuming functions in stripeline (the pointing kernels, the
+noise generators, the TOD writers, the TOI providers, and the map-makers)
+record how much time they take and how many samples and bytes they process.
+Nothing is recorded unless the instrumentation has been enabled, either by
+calling :func:`enable` or by setting the environment variable
+``STRIPELINE_INSTRUMENTATION`` to the name of a JSON file; when it is
+disabled, each timer costs one function call and one test.
+
+Instrumentation is added to the code using :func:`timer` and :func:`count`::
+
+    import stripeline.instrumentation as instr
+
+    with instr.timer('mymodule.read', samples=len(data), nbytes=data.nbytes):
+        ...
+    instr.count('mymodule.files')
+
+Timers with the same name are summed: for each of them, the number of calls,
+the total and maximum duration, and the number of samples and bytes are
+kept. Counters are plain sums. Both are kept per process; :func:`aggregate`
+gathers them from all the MPI processes and computes the minimum, maximum,
+and mean over the ranks, which is useful to spot load imbalance (e.g., the
+time spent waiting in MPI reductions).
+'''
+
+import atexit
+import json
+import os
+import sys
+import threading
+import time
+
+# Environment variable containing the name of the output file. If it is set
+# when the module is imported, the instrumentation is enabled and the
+# statistics are saved at exit
+ENV_VARIABLE = 'STRIPELINE_INSTRUMENTATION'
+
+_enabled = False
+_lock = threading.Lock()
+
+# Name -> [calls, total time, maximum time, samples, bytes]
+_timers = {}
+# Name -> value
+_counters = {}
+
+# Parameters passed to "enable" for the statistics saved at exit
+_output_file = None
+_output_comm = None
+_atexit_registered = False
+
+
+class _Timer:
+    'Context manager returned by "timer" when the instrumentation is enabled'
+
+    __slots__ = ('name', 'samples', 'nbytes', 'start')
+
+    def __init__(self, name: str, samples: int, nbytes: int):
+        self.name = name
+        self.samples = samples
+        self.nbytes = nbytes
+
+    def __enter__(self):
+        self.start = time.perf_counter()
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        add_time(self.name, time.perf_counter() - self.start,
+                 self.samples, self.nbytes)
+        return False
+
+
+class _NullTimer:
+    'Context manager returned by "timer" when the instrumentation is disabled'
+
+    __slots__ = ()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        return False
+
+
+_NULL_TIMER = _NullTimer()
+
+
+def is_enabled() -> bool:
+    return _enabled
+
+
+def enable(output_file=None, comm=None):
+    '''Start recording timers and counters.
+
+    If `output_file` is not ``None``, the statistics are saved there in JSON
+    format when the program exits (see :func:`dump`). If `comm` is an MPI
+    communicator, the statistics are gathered from its processes, and only
+    the process with rank 0 writes the file; if it is ``None`` and mpi4py
+    has been initialized, ``MPI.COMM_WORLD`` is used. In both cases, all the
+    processes must exit normally, as gathering the statistics is a
+    collective operation.'''
+    global _enabled, _output_file, _output_comm, _atexit_registered
+
+    _enabled = True
+    if output_file is not None:
+        _output_file = output_file
+        _output_comm = comm
+        if not _atexit_registered:
+            atexit.register(_dump_at_exit)
+            _atexit_registered = True
+
+
+def disable():
+    '''Stop recording. The statistics recorded so far are kept.'''
+    global _enabled, _output_file
+    _enabled = False
+    _output_file = None
+
+
+def reset():
+    '''Forget all the statistics recorded so far'''
+    with _lock:
+        _timers.clear()
+        _counters.clear()
+
+
+def timer(name: str, samples=0, nbytes=0):
+    '''Return a context manager which measures the time spent in a block.
+
+    The time is added to the timer `name`, together with the number of
+    samples and bytes processed in the block.'''
+    if not _enabled:
+        return _NULL_TIMER
+    return _Timer(name, samples, nbytes)
+
+
+def add_time(name: str, seconds: float, samples=0, nbytes=0):
+    '''Add a measurement to the timer `name`'''
+    if not _enabled:
+        return
+
+    with _lock:
+        cur_timer = _timers.get(name)
+        if cur_timer is None:
+            _timers[name] = [1, seconds, seconds, samples, nbytes]
+        else:
+            cur_timer[0] += 1
+            cur_timer[1] += seconds
+            cur_timer[2] = max(cur_timer[2], seconds)
+            cur_timer[3] += samples
+            cur_timer[4] += nbytes
+
+
+def count(name: str, value=1):
+    '''Add `value` to the counter `name`'''
+    if not _enabled:
+        return
+
+    with _lock:
+        _counters[name] = _counters.get(name, 0) + value
+
+
+def local_statistics():
+    '''Return the statistics recorded by this process.
+
+    The result is a dictionary with two keys: ``timers`` maps the name of
+    each timer to a dictionary containing ``calls``, ``total_s``, ``max_s``,
+    ``samples``, and ``bytes``; ``counters`` maps the name of each counter
+    to its value.'''
+    with _lock:
+        timers = {name: {'calls': calls,
+                         'total_s': total,
+                         'max_s': max_time,
+                         'samples': samples,
+                         'bytes': nbytes}
+                  for name, (calls, total, max_time, samples, nbytes)
+                  in _timers.items()}
+        counters = dict(_counters)
+
+    return {'timers': timers, 'counters': counters}
+
+
+def merge(statistics):
+    '''Add statistics returned by :func:`local_statistics` to this process.
+
+    This is used to collect the measurements made by a pool of worker
+    processes.'''
+    if not _enabled:
+        return
+
+    with _lock:
+        for name, values in statistics['timers'].items():
+            cur_timer = _timers.setdefault(name, [0, 0.0, 0.0, 0, 0])
+            cur_timer[0] += values['calls']
+            cur_timer[1] += values['total_s']
+            cur_timer[2] = max(cur_timer[2], values['max_s'])
+            cur_timer[3] += values['samples']
+            cur_timer[4] += values['bytes']
+
+        for name, value in statistics['counters'].items():
+            _counters[name] = _counters.get(name, 0) + value
+
+
+def _summarize(per_rank):
+    'Return the minimum, maximum, mean, and sum of a list of values'
+    return {'min': min(per_rank),
+            'max': max(per_rank),
+            'mean': sum(per_rank) / len(per_rank),
+            'sum': sum(per_rank),
+            'per_rank': per_rank}
+
+
+def aggregate(comm=None):
+    '''Gather the statistics of all the MPI processes in `comm`.
+
+    This is a collective operation. The result is only returned by the
+    process with rank 0 (``None`` is returned by the others); if `comm` is
+    ``None``, only the statistics of this process are used.
+
+    The result has the same structure as the value returned by
+    :func:`local_statistics`, but each number is replaced by a dictionary
+    containing its ``min``, ``max``, ``mean``, and ``sum`` over the
+    processes, and the list of the values (``per_rank``). A timer or
+    counter which was not used by some process counts as zero there, but
+    ``max_s`` is only summarized as the maximum over all the processes. The
+    key ``num_of_processes`` contains the number of processes.'''
+
+    statistics = local_statistics()
+    if comm is None:
+        all_statistics = [statistics]
+    else:
+        all_statistics = comm.gather(statistics, root=0)
+        if comm.rank != 0:
+            return None
+
+    result = {'num_of_processes': len(all_statistics),
+              'timers': {},
+              'counters': {}}
+
+    timer_names = sorted(set([name for x in all_statistics
+                              for name in x['timers'].keys()]))
+    empty_timer = {'calls': 0, 'total_s': 0.0, 'max_s': 0.0,
+                   'samples': 0, 'bytes': 0}
+    for name in timer_names:
+        values = [x['timers'].get(name, empty_timer) for x in all_statistics]
+        cur_timer = {key: _summarize([x[key] for x in values])
+                     for key in ('calls', 'total_s', 'samples', 'bytes')}
+        cur_timer['max_s'] = max([x['max_s'] for x in values])
+        result['timers'][name] = cur_timer
+
+    counter_names = sorted(set([name for x in all_statistics
+                                for name in x['counters'].keys()]))
+    for name in counter_names:
+        result['counters'][name] = _summarize(
+            [x['counters'].get(name, 0) for x in all_statistics])
+
+    return result
+
+
+def dump(file_name: str, comm=None):
+    '''Save the output of :func:`aggregate` in a JSON file.
+
+    This is a collective operation when `comm` is not ``None``: only the
+    process with rank 0 writes the file.'''
+
+    result = aggregate(comm)
+    if result is None:
+        return
+
+    with open(file_name, 'wt') as f:
+        json.dump(result, f, indent=2, sort_keys=True)
+
+
+def _world_communicator():
+    'Return MPI.COMM_WORLD if mpi4py is being used, None otherwise'
+    if 'mpi4py.MPI' not in sys.modules:
+        return None
+
+    from mpi4py import MPI
+    if not MPI.Is_initialized() or MPI.Is_finalized():
+        return None
+
+    return MPI.COMM_WORLD
+
+
+def _dump_at_exit():
+    if _output_file is None:
+        return
+
+    comm = _output_comm
+    if comm is None:
+        comm = _world_communicator()
+
+    dump(_output_file, comm)
+
+
+if os.environ.get(ENV_VARIABLE):
+    enable(output_file=os.environ[ENV_VARIABLE])
@@ -4,6 +4,8 @@
 'Utilities to access the instrument database.'
 
 import os.path
+import numpy as np
+import yaml
 
 
 def instrument_db_path():
@@ -29,3 +31,22 @@ def scanning_strategy_db_file_name():
     'Return the name of the file containing the definition of the scanning strategy.'
 
     return os.path.join(instrument_db_path(), 'scanning_strategy.yaml')
+
+def load_horn_orientations(file_name=None):
+    '''Return the names and the beam directions of the horns in the focal plane.
+
+    The horns are read from the file returned by
+    :func:`focal_plane_db_file_name`, unless `file_name` is specified.
+    Return a pair: the first element is the list of the names of the horns,
+    sorted according to their ``id`` field; the second element is a Nx3
+    matrix containing the ``orientation`` of each horn.'''
+
+    if file_name is None:
+        file_name = focal_plane_db_file_name()
+
+    with open(file_name, 'rt') as f:
+        horns = yaml.safe_load(f)['horns']
+
+    names = sorted(horns.keys(), key=lambda x: horns[x]['id'])
+    return names, np.array([horns[x]['orientation'] for x in names],
+                           dtype=np.float64)
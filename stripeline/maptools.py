@@ -7,12 +7,90 @@
 from typing import Any
 
 import stripeline._maptools as _m
+import stripeline.instrumentation as instrumentation
 import stripeline.timetools as tt
-import stripeline.polarization as pol
 import numpy as np
 import healpy
 
 
+class SparsePixels:
+    '''Set of the pixels observed by a TOD
+
+    STRIP observes only a fraction of the sky, so storing maps with
+    ``healpy.nside2npix(nside)`` elements wastes memory. This class keeps the
+    sorted list of the observed pixels (:attr:`pixels`) and converts between
+    the *global* indices of the pixels in the full map and the *local* indices
+    in the compact list. Compact maps can be produced by passing local indices
+    to :func:`binned_map` and :func:`accumulate_strip_samples` (using
+    ``len(sparse_pixels)`` as the number of pixels) or to
+    :class:`ConditionMatrix`; :func:`binned_map_strip` does this automatically
+    if it receives a :class:`SparsePixels` object.
+
+    If ``comm`` is not ``None``, the set is the union of the pixels observed by
+    all the MPI processes, so that compact maps computed by different
+    processes can be summed element by element.
+
+    Example::
+
+        pixels = SparsePixels.from_pixidx([pixidx1, pixidx2], npix)
+        local_map, hits = binned_map(signal, pixels.local_index(pixidx1),
+                                     len(pixels))
+        healpy.write_map('map.fits', pixels.to_dense(local_map))
+    '''
+
+    def __init__(self, pixels, num_of_pixels: int, comm=None):
+        pixels = np.unique(np.asarray(pixels, dtype='int64'))
+        if comm:
+            pixels = np.unique(np.concatenate(comm.allgather(pixels)))
+
+        assert len(pixels) == 0 or (pixels[0] >= 0 and
+                                    pixels[-1] < num_of_pixels)
+        self.pixels = pixels
+        self.num_of_pixels = num_of_pixels
+
+    @classmethod
+    def from_pixidx(cls, pixidx_list, num_of_pixels: int, comm=None):
+        '''Build the set from a list of arrays of pixel indices
+
+        Each element of ``pixidx_list`` can be e.g. the result of
+        ``healpy.ang2pix`` for one chunk of the TOD.'''
+        uniques = [np.unique(x) for x in pixidx_list]
+        pixels = np.concatenate(uniques) if uniques else np.empty(0)
+        return cls(pixels, num_of_pixels, comm=comm)
+
+    @classmethod
+    def from_toi_provider(cls, nside: int, toi_provider, comm=None):
+        '''Build the set from the pointings returned by a ToiProvider'''
+        return cls(toi_provider.get_pixel_index(nside=nside),
+                   healpy.nside2npix(nside), comm=comm)
+
+    def __len__(self):
+        return len(self.pixels)
+
+    def local_index(self, pixidx):
+        '''Convert global pixel indices into indices in :attr:`pixels`
+
+        All the pixels in ``pixidx`` must belong to the set.'''
+        local = np.searchsorted(self.pixels, pixidx)
+        assert np.all(self.pixels[np.minimum(local, len(self) - 1)] == pixidx)
+        return local
+
+    def global_index(self, local_idx):
+        '''Convert indices in :attr:`pixels` into global pixel indices'''
+        return self.pixels[local_idx]
+
+    def to_dense(self, values, fill_value=0.0):
+        '''Expand a compact map into a full map
+
+        Pixels which are not in the set are set to ``fill_value`` (e.g.,
+        ``healpy.UNSEEN``).'''
+        assert len(values) == len(self)
+        result = np.full(self.num_of_pixels, fill_value,
+                         dtype=np.asarray(values).dtype)
+        result[self.pixels] = values
+        return result
+
+
 class ConditionMatrix:
     '''Compute the inverse condition number for pixels in a map
 
@@ -51,29 +129,34 @@ class ConditionMatrix:
         The arrays `pixidx` and `angle` must have the same number of elements.
         The first array associates each item in `angle` with a pixel in the sky.
         '''
-        print('pixidx.shape =', pixidx.shape)
-        print('matr.shape =', self.matr.shape)
         _m.update_condmatr(numpix=self.numpix, pixidx=pixidx,
                            angle=angle, m=self.matr)
 
+    def update_from_accumulator(self, accum):
+        '''Update the condition matrix with the pointing matrix in ``accum``.
+
+        The parameter must be an accumulator produced by
+        :func:`accumulate_strip_samples` with ``pointing_matrix=True``. This
+        avoids a second pass over the TOD, as the pointing matrix has already
+        been computed while binning the maps.'''
+        assert accum.shape == (ACCUM_COMPONENTS_WITH_MATRIX, self.numpix)
+        hits, cos2psi, sin2psi, cos2, sincos, sin2 = accum[3:]
+        for col, values in enumerate((hits, cos2psi, sin2psi,
+                                      cos2psi, cos2, sincos,
+                                      sin2psi, sincos, sin2)):
+            self.matr[:, col] += values
+
     def to_map(self):
         '''Compute the inverse condition numbers and return them as a map.
 
         A pixel in the map is set to zero either if it has not been seen
         (hit count is zero), or if the components I/Q/U cannot be determined
         at all.
-        '''
-        seen_mask = self.matr[:, 0] > 0
-        cond_map = np.zeros(self.numpix)
-
-        # Ordered list of all the pixels which have an hit count larger than 0
-        pixels = np.arange(self.matr.shape[0])[seen_mask]
 
-        for cur_pixel in pixels:
-            cond_map[cur_pixel] = 1.0 / \
-                np.linalg.cond(np.reshape(self.matr[cur_pixel], (3, 3)))
-
-        return cond_map
+        The computation is done in parallel for all the pixels, using the
+        closed-form expression for the eigenvalues of 3x3 symmetric matrices.
+        '''
+        return _m.inv_condition_numbers(self.matr)
 
 
 def nonoise_map(signal, pixidx, num_of_pixels):
@@ -105,7 +188,13 @@ def nonoise_map(signal, pixidx, num_of_pixels):
     return mappixels
 
 
-def binned_map(signal, pixidx, num_of_pixels):
+# Number of pixels in each tile of the partial maps used by binned_map (this
+# must match TILE_SIZE in _maptools.f90)
+BINNING_TILE_SIZE = 4096
+
+
+def binned_map(signal, pixidx, num_of_pixels, mappixels=None, hits=None,
+               reset=True, normalize=True, max_memory_mb=1024):
     '''Convert a timeline into a map assuming white noise with zero mean.
 
     This function estimates the map produced from ``signal`` (a vector
@@ -138,21 +227,182 @@ def binned_map(signal, pixidx, num_of_pixels):
 
         # Save both the sky map and the hit map
         healpy.write_map('map.fits', (m, hits))
+
+    The computation is split among the OpenMP threads (see the
+    ``OMP_NUM_THREADS`` environment variable). Each thread uses a private
+    partial map, whose memory is allocated only for the parts of the sky the
+    thread actually observes; ``max_memory_mb`` limits the overall amount of
+    memory used by the partial maps. When the limit is reached, the threads
+    update the result directly using atomic operations, which is slower; if
+    ``max_memory_mb`` is zero, atomic operations are used for all the samples.
+
+    Long TODs can be split in several calls. In this case, pass the same
+    ``mappixels`` and ``hits`` arrays (64-bit floats and integers) to each
+    call, set ``reset`` to ``False`` in all the calls but the first, and set
+    ``normalize`` to ``False`` in all the calls but the last::
+
+        mappixels = np.zeros(NPIX)
+        hits = np.zeros(NPIX, dtype='int64')
+        for cur_signal, cur_pixidx in chunks:
+            mt.binned_map(cur_signal, cur_pixidx, NPIX, mappixels, hits,
+                          reset=False, normalize=False)
+        mt.normalize_map(mappixels, hits)
     '''
 
     assert len(signal) == len(pixidx)
     assert isinstance(num_of_pixels, int)
     assert num_of_pixels > 0
 
-    mappixels = np.zeros(num_of_pixels)
-    hits = np.zeros(num_of_pixels, dtype='int')
+    if mappixels is None:
+        mappixels = np.zeros(num_of_pixels)
+    if hits is None:
+        hits = np.zeros(num_of_pixels, dtype='int64')
+    assert len(mappixels) == num_of_pixels and len(hits) == num_of_pixels
 
-    _m.binned_map(signal, pixidx, mappixels, hits)
+    max_tiles = int(max_memory_mb * 2**20) // (BINNING_TILE_SIZE * 16)
+    _m.binned_map_omp(signal, pixidx, mappixels, hits, max_tiles,
+                      int(reset), int(normalize))
 
     return mappixels, hits
 
 
-def binned_map_strip(nside: int, toi_provider: tt.ToiProvider, comm=None):
+def normalize_map(mappixels, hits):
+    '''Divide each pixel in ``mappixels`` by its number of hits
+
+    This is needed by maps accumulated using :func:`binned_map` with
+    ``normalize=False``. Pixels with no hits are left untouched.'''
+    mask = hits > 0
+    mappixels[mask] /= hits[mask]
+
+
+# Number of rows in the accumulators used by accumulate_strip_samples
+ACCUM_COMPONENTS = 4
+ACCUM_COMPONENTS_WITH_MATRIX = 9
+
+
+def accumulate_strip_samples(signals, psi, pixidx, num_of_pixels, accum=None,
+                             pointing_matrix=False, max_memory_mb=1024):
+    '''Bin the samples of a STRIP polarimeter in one pass.
+
+    The parameter ``signals`` is a 4xN matrix containing the output of the Q1,
+    Q2, U1, and U2 detectors; ``psi`` and ``pixidx`` contain the polarization
+    angle and the pixel index of each of the N samples.
+
+    Return an accumulator, i.e., a matrix with one column per pixel. Its rows
+    contain the sum of the I, Q, and U samples (Q and U being in the celestial
+    reference frame, see :func:`binned_map_strip`) and the number of hits. If
+    ``pointing_matrix`` is true, five more rows contain the sums of cos(2psi),
+    sin(2psi), cos²(2psi), sin(2psi)cos(2psi), and sin²(2psi), which can be
+    passed to :meth:`ConditionMatrix.update_from_accumulator`. The values for
+    each pixel are contiguous in memory.
+
+    If ``accum`` is not ``None``, the samples are added to it instead of
+    creating a new accumulator: this can be used to bin long TODs in several
+    chunks. Use :func:`accumulator_to_maps` to get the maps. The meaning of
+    ``max_memory_mb`` is the same as in :func:`binned_map`.'''
+
+    num_of_components = ACCUM_COMPONENTS_WITH_MATRIX if pointing_matrix \
+        else ACCUM_COMPONENTS
+    if accum is None:
+        accum = np.zeros((num_of_components, num_of_pixels), order='F')
+    assert accum.shape == (num_of_components, num_of_pixels)
+    assert accum.flags.f_contiguous
+
+    max_tiles = int(max_memory_mb * 2**20) // \
+        (BINNING_TILE_SIZE * 8 * num_of_components)
+
+    # Passing the transpose avoids a copy, as Fortran is column-major
+    with instrumentation.timer('maptools.bin_strip_samples',
+                               samples=len(psi)):
+        _m.bin_strip_samples(np.asarray(signals).T, psi, pixidx, accum,
+                             max_tiles)
+    return accum
+
+
+def accumulator_to_maps(accum):
+    '''Convert an accumulator into I, Q, U, and hit maps
+
+    The accumulator must have been produced by
+    :func:`accumulate_strip_samples`. Return a tuple containing the I, Q, U,
+    and hits maps. Pixels with no hits are set to zero.'''
+    hits = np.rint(accum[3]).astype('int')
+    mask = hits > 0
+    maps = []
+    for row in range(3):
+        cur_map = np.zeros(accum.shape[1])
+        cur_map[mask] = accum[row, mask] / hits[mask]
+        maps.append(cur_map)
+
+    return (maps[0], maps[1], maps[2], hits)
+
+
+def _sum_buffer(comm, buffer, root=None):
+    '''Sum "buffer" over the processes in "comm", in place
+
+    If "root" is None, every process gets the result; otherwise, only the
+    process with rank "root" does.'''
+    from mpi4py import MPI
+
+    if root is None:
+        comm.Allreduce(MPI.IN_PLACE, buffer, op=MPI.SUM)
+    elif comm.rank == root:
+        comm.Reduce(MPI.IN_PLACE, buffer, op=MPI.SUM, root=root)
+    else:
+        comm.Reduce(buffer, None, op=MPI.SUM, root=root)
+
+
+def reduce_accumulator(accum, comm, root=None, hierarchical=False):
+    '''Sum an accumulator over all the MPI processes, in place
+
+    The accumulator (see :func:`accumulate_strip_samples`) is sent as one
+    contiguous buffer, without making copies. If ``root`` is ``None``, all the
+    processes get the result; otherwise, only the process with rank ``root``
+    does, and the content of ``accum`` is undefined in the others.
+
+    If ``hierarchical`` is true, the accumulators are first summed among the
+    processes running on the same node (using shared memory), and then among
+    one process per node. This reduces the traffic over the network when
+    there are many processes per node.'''
+
+    # Since the accumulator is contiguous, this is a view and not a copy
+    assert accum.flags.f_contiguous or accum.flags.c_contiguous
+    buffer = np.ravel(accum, order='K')
+
+    # This includes the time spent waiting for the slowest process
+    with instrumentation.timer('maptools.reduce_accumulator',
+                               nbytes=buffer.nbytes):
+        _reduce_buffer(comm, buffer, root, hierarchical)
+
+
+def _reduce_buffer(comm, buffer, root, hierarchical):
+    'Implementation of reduce_accumulator'
+    from mpi4py import MPI
+
+    if not hierarchical:
+        _sum_buffer(comm, buffer, root)
+        return
+
+    # Make the target process the leader of its node, so that the inter-node
+    # step ends on it
+    target = 0 if root is None else root
+    key = 0 if comm.rank == target else comm.rank + 1
+    node_comm = comm.Split_type(MPI.COMM_TYPE_SHARED, key=key)
+    is_leader = node_comm.rank == 0
+    leader_comm = comm.Split(0 if is_leader else MPI.UNDEFINED, key=key)
+
+    _sum_buffer(node_comm, buffer, root=0)
+    if is_leader:
+        _sum_buffer(leader_comm, buffer, None if root is None else 0)
+        leader_comm.Free()
+
+    if root is None:
+        node_comm.Bcast(buffer, root=0)
+    node_comm.Free()
+
+
+def binned_map_strip(nside: int, toi_provider: tt.ToiProvider, comm=None,
+                     pixels: SparsePixels = None, root=None,
+                     hierarchical=False):
     '''Compute a sky map from a set of TOI using a binning algorithm.
 
     Read the TOI using ``toi_provider`` and produce maps with their
@@ -169,42 +419,110 @@ def binned_map_strip(nside: int, toi_provider: tt.ToiProvider, comm=None):
     - Polarization angle psi, used to convert Q, U pairs from the reference
       frame of the instrument to the celestial reference frame.
 
+    If ``pixels`` is not ``None``, the maps only contain the pixels in the
+    set, in the same order as ``pixels.pixels``: this saves memory and reduces
+    the amount of data exchanged among MPI processes. Use
+    :meth:`SparsePixels.to_dense` to expand them into full Healpix maps. When
+    using MPI, the set must have been built using the same communicator.
+
+    When using MPI, the maps are summed using :func:`reduce_accumulator`,
+    which is passed ``root`` and ``hierarchical``. If ``root`` is not
+    ``None``, only the process with that rank gets the maps, and the other
+    processes return ``None``; this is faster if only one process needs to
+    save the maps.
+
     Return a tuple containing the I, Q, U, and hits maps.'''
 
-    signals = np.array([toi_provider.get_signal(i) for i in range(4)])
-
-    # Compute Q and U and transform them in the celestial reference frame
-    q_cel, u_cel = pol.rotate_qu(q_from=2.0 * (signals[0, :] + signals[1, :]),
-                                 u_from=2.0 * (signals[2, :] + signals[3, :]),
-                                 psi=toi_provider.get_polarization_angle(),
-                                 inverse=True)
-
-    # Compute the local maps
-    npix = healpy.nside2npix(nside)
-    pixidx = toi_provider.get_pixel_index(nside=nside)
-    local_i, local_hits = binned_map(signal=np.sum(signals, axis=0),
-                                     pixidx=pixidx,
-                                     num_of_pixels=npix)
-    local_q, local_hits = binned_map(signal=q_cel,
-                                     pixidx=pixidx,
-                                     num_of_pixels=npix)
-    local_u, local_hits = binned_map(signal=u_cel,
-                                     pixidx=pixidx,
-                                     num_of_pixels=npix)
+    # Read the quantities used here with one pass over the input files, if
+    # the provider supports it
+    with instrumentation.timer('maptools.read_toi'):
+        load = getattr(toi_provider, 'load', None)
+        if load is not None:
+            load(['signals', 'psi', 'pointings'])
+        signals = np.array([toi_provider.get_signal(i) for i in range(4)])
+        psi = toi_provider.get_polarization_angle()
+
+    # I, Q, U, and hits are computed in one pass over the samples
+    with instrumentation.timer('maptools.pixel_index', samples=len(psi)):
+        pixidx = toi_provider.get_pixel_index(nside=nside)
+        if pixels is not None:
+            pixidx = pixels.local_index(pixidx)
+    npix = len(pixels) if pixels is not None else healpy.nside2npix(nside)
+
+    accum = accumulate_strip_samples(
+        signals=signals,
+        psi=psi,
+        pixidx=pixidx,
+        num_of_pixels=npix)
+
+    return _reduce_strip_maps(accum, comm, root, hierarchical)
+
+
+def _reduce_strip_maps(accum, comm, root, hierarchical):
+    '''Combine the accumulators of the MPI processes and return the maps'''
 
     if comm:
         # Combine the maps produced by each MPI process
-        global_hits = comm.allreduce(local_hits)
+        reduce_accumulator(accum, comm, root=root, hierarchical=hierarchical)
+        if root is not None and comm.rank != root:
+            return None
+
+    return accumulator_to_maps(accum)
+
 
-        global_i = comm.allreduce(local_i * local_hits)
-        global_q = comm.allreduce(local_q * local_hits)
-        global_u = comm.allreduce(local_u * local_hits)
+# Default number of samples read at a time by streaming_map_strip. Each
+# block keeps eight 64-bit columns in memory (time, pointings, and the
+# four detectors), i.e., 64 MB
+STREAMING_BLOCK_SIZE = 2**20
 
-        # Normalize by the number of hits
-        mask = global_hits > 0
-        for cur_map in (global_i, global_q, global_u):
-            cur_map[mask] /= global_hits[mask]
 
-        return (global_i, global_q, global_u, global_hits)
+def streaming_map_strip(nside: int, toi_provider: tt.ToiProvider,
+                        block_size=STREAMING_BLOCK_SIZE, comm=None,
+                        pixels: SparsePixels = None, root=None,
+                        hierarchical=False,
+                        condition_matrix: ConditionMatrix = None,
+                        prefetch=False):
+    '''Compute a sky map from a set of TOI, reading them in blocks.
+
+    This function produces the same maps as :func:`binned_map_strip`, and
+    the meaning of ``nside``, ``comm``, ``pixels``, ``root``, and
+    ``hierarchical`` is the same. However, the TOI are read using
+    :func:`stripeline.timetools.ToiProvider.iter_blocks`, and each block of
+    ``block_size`` samples is added to the maps before the next one is read.
+    Therefore, the memory used by each process does not depend on the length
+    of its TOI. If ``prefetch`` is true, the next block is read by a
+    background thread while the current one is being binned.
+
+    If ``condition_matrix`` is not ``None``, it is updated with the samples
+    of this process (see :meth:`ConditionMatrix.update_from_accumulator`),
+    before the maps are summed over the MPI processes. In this case, its
+    number of pixels must be the same as the maps.
+
+    Return a tuple containing the I, Q, U, and hits maps.'''
 
-    return (local_i, local_q, local_u, local_hits)
+    npix = len(pixels) if pixels is not None else healpy.nside2npix(nside)
+    pointing_matrix = condition_matrix is not None
+    num_of_components = ACCUM_COMPONENTS_WITH_MATRIX if pointing_matrix \
+        else ACCUM_COMPONENTS
+    accum = np.zeros((num_of_components, npix), order='F')
+
+    for block in toi_provider.iter_blocks(block_size, prefetch=prefetch):
+        with instrumentation.timer('maptools.pixel_index',
+                                   samples=len(block.psi)):
+            pixidx = healpy.ang2pix(nside, block.theta, block.phi)
+            if pixels is not None:
+                pixidx = pixels.local_index(pixidx)
+
+        accumulate_strip_samples(signals=block.signals,
+                                 psi=block.psi,
+                                 pixidx=pixidx,
+                                 num_of_pixels=npix,
+                                 accum=accum,
+                                 pointing_matrix=pointing_matrix)
+
+    if pointing_matrix:
+        condition_matrix.update_from_accumulator(accum)
+        # The rows of the pointing matrix are not needed by the maps
+        accum = np.asfortranarray(accum[:ACCUM_COMPONENTS])
+
+    return _reduce_strip_maps(accum, comm, root, hierarchical)
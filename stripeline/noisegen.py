@@ -1,10 +1,199 @@
 #!/usr/bin/env python3
 # -*- encoding: utf-8 -*-
 
+import ctypes
+import functools
 import numpy as np
+import stripeline.instrumentation as instrumentation
 import stripeline.rng as rng
 
 
+def _instrumented(method):
+    '''Record the calls to a method filling an array with noise
+
+    The array must be the first parameter after "self". The timer is named
+    after the class and the method, e.g., "noisegen.OofRNG.fill_vector".'''
+    name = 'noisegen.' + method.__qualname__
+
+    @functools.wraps(method)
+    def wrapper(self, array, *args, **kwargs):
+        if not instrumentation.is_enabled():
+            return method(self, array, *args, **kwargs)
+
+        with instrumentation.timer(name, samples=array.size,
+                                   nbytes=array.nbytes):
+            return method(self, array, *args, **kwargs)
+
+    return wrapper
+
+
+def _jump_state(state, log2_steps: int):
+    'Advance a xorshift state by 2^log2_steps steps'
+    if log2_steps < 0 or log2_steps >= 128:
+        raise ValueError('log2_steps must be in the range [0, 128)')
+    rng.jump_rng(state, log2_steps)
+
+
+def _skip_state(state, num_of_steps: int):
+    'Advance a xorshift state by num_of_steps steps'
+    if num_of_steps < 0:
+        raise ValueError('num_of_steps must be non-negative')
+    rng.skip_rng(state, num_of_steps)
+
+
+def _jump_lanes(lane_state, log2_steps: int):
+    'Advance each lane of a multi-lane state by 2^log2_steps steps'
+    num_of_lanes = len(lane_state) // 4
+    for lane in range(num_of_lanes):
+        cur_state = lane_state[lane::num_of_lanes].copy()
+        _jump_state(cur_state, log2_steps)
+        lane_state[lane::num_of_lanes] = cur_state
+
+
+def _skip_lanes(lane_state, next_lane, num_of_steps: int):
+    'Skip num_of_steps numbers in the interleaved stream of a multi-lane state'
+    if num_of_steps < 0:
+        raise ValueError('num_of_steps must be non-negative')
+
+    num_of_lanes = len(lane_state) // 4
+    for lane in range(num_of_lanes):
+        # Number of elements in the interleaved stream produced by this lane
+        steps = num_of_steps // num_of_lanes
+        if (lane - next_lane[0]) % num_of_lanes < num_of_steps % num_of_lanes:
+            steps += 1
+
+        cur_state = lane_state[lane::num_of_lanes].copy()
+        _skip_state(cur_state, steps)
+        lane_state[lane::num_of_lanes] = cur_state
+
+    next_lane[0] = (next_lane[0] + num_of_steps) % num_of_lanes
+
+
+# Signatures of the functions in rng.c with 64-bit lengths and strided arrays,
+# which are called through ctypes instead of f2py (see _nogil_call). The
+# arguments "array, num, stride" are always the last three.
+_PTR = ctypes.c_void_p
+_I32 = ctypes.c_int32
+_I64 = ctypes.c_int64
+_NOGIL_SIGNATURES = {
+    'fill_vector_uniform_64': [_PTR],
+    'fill_vector_uniform_lanes_64': [_PTR, _I32, _PTR],
+    'fill_vector_normal_64': [_PTR, _PTR, _PTR],
+    'fill_vector_normal_lanes_64': [_PTR, _I32, _PTR, _PTR, _PTR],
+    'fill_vector_uniform_counter_64': [_I32, _I32, _I64],
+    'fill_vector_normal_counter_64': [_I32, _I32, _I64],
+    'fill_vector_oof2_64': [_PTR, _PTR, _PTR, _PTR],
+    'fill_vector_oof2_lanes_64': [_PTR, _I32, _PTR, _PTR, _PTR, _PTR],
+    'fill_vector_oof_64': [_PTR, _PTR, _PTR, _PTR, _I32],
+    'fill_vector_oof_lanes_64': [_PTR, _I32, _PTR, _PTR, _PTR, _PTR, _I32],
+    'filter_oof_64': [_PTR, _I32, _I32],
+}
+_nogil_functions = {}
+
+
+def _nogil_call(name, *args):
+    '''Call the function "name" in rng.c, releasing the GIL
+
+    Arguments that are NumPy arrays are passed as pointers to their first
+    element; they must be contiguous, apart from the last one, which is the
+    array to be filled and can be any writable 1-D array of 64-bit floats.'''
+    if not _nogil_functions:
+        # The f2py extension module is a shared library which exports the
+        # functions in rng.c
+        library = ctypes.CDLL(rng.__file__)
+        for func_name, arg_types in _NOGIL_SIGNATURES.items():
+            func = getattr(library, func_name)
+            func.argtypes = arg_types + [_PTR, _I64, _I64]
+            func.restype = None
+            _nogil_functions[func_name] = func
+
+    *args, array = args
+    if array.ndim != 1 or array.dtype != np.float64:
+        raise ValueError('the array must be a 1-D array of 64-bit floats')
+    if not array.flags.writeable:
+        raise ValueError('the array must be writable')
+    if array.strides[0] % array.itemsize != 0:
+        raise ValueError('the stride of the array must be a multiple of '
+                         '{0} bytes'.format(array.itemsize))
+
+    c_args = []
+    for cur_arg in args:
+        if isinstance(cur_arg, np.ndarray):
+            assert cur_arg.flags.c_contiguous
+            c_args.append(cur_arg.ctypes.data)
+        else:
+            c_args.append(cur_arg)
+
+    _nogil_functions[name](*c_args, array.ctypes.data, len(array),
+                           array.strides[0] // array.itemsize)
+
+
+# Identifiers of the generators in the snapshots produced by rng.c, used to
+# check that a snapshot is restored into the same kind of generator
+_SNAPSHOT_KINDS = {
+    'FlatRNG': 1,
+    'MultiLaneFlatRNG': 2,
+    'NormalRNG': 3,
+    'Oof2RNG': 4,
+    'OofRNG': 5,
+    'CounterRNG': 6,
+}
+
+
+def _save_snapshot(kind: str, state, next_lane=None, empty=None, gset=None,
+                   filter_state=None) -> bytes:
+    'Pack the state of a generator into a sequence of bytes'
+    if filter_state is None:
+        filter_state = np.empty(0)
+
+    snapshot = np.zeros(rng.rng_snapshot_size(len(state), len(filter_state)),
+                        dtype='int8')
+    rng.save_rng_snapshot(_SNAPSHOT_KINDS[kind], state,
+                          0 if next_lane is None else next_lane[0],
+                          1 if empty is None else empty[0],
+                          0.0 if gset is None else gset[0],
+                          filter_state, snapshot)
+    return snapshot.tobytes()
+
+
+def _load_snapshot(snapshot: bytes, kind: str, state, next_lane=None,
+                   empty=None, gset=None, filter_state=None):
+    'Unpack a sequence of bytes produced by _save_snapshot into the arrays'
+    if next_lane is None:
+        next_lane = np.zeros(1, dtype='int32')
+    if empty is None:
+        empty = np.ones(1, dtype='int8')
+    if gset is None:
+        gset = np.zeros(1, dtype='float64')
+    if filter_state is None:
+        filter_state = np.empty(0)
+
+    result = rng.load_rng_snapshot(np.frombuffer(snapshot, dtype='int8'),
+                                   _SNAPSHOT_KINDS[kind], state, next_lane,
+                                   empty, gset, filter_state)
+    if result == 1:
+        raise ValueError('invalid snapshot')
+    elif result == 2:
+        raise ValueError('the snapshot was not produced by a {0} with the '
+                         'same parameters'.format(kind))
+
+
+# Algorithms used to produce Gaussian numbers:
+#
+# - "reference": Marsaglia's polar method applied to the scalar xorshift
+#   generator, which matches the output of "absrand";
+# - "vectorized": Box-Muller transform applied to blocks of numbers produced
+#   by the multi-lane generator (see MultiLaneFlatRNG), which is several times
+#   faster.
+GAUSSIAN_MODES = ('reference', 'vectorized')
+
+
+def _check_gaussian_mode(mode: str):
+    if mode not in GAUSSIAN_MODES:
+        raise ValueError('invalid mode "{0}", valid choices are {1}'
+                         .format(mode, ', '.join(GAUSSIAN_MODES)))
+
+
 class FlatRNG:
     'Random number generator with uniform distribution in the range [0, 1['
 
@@ -25,6 +214,113 @@ class FlatRNG:
         'Fill the ``array`` vector with a sequence of pseudorandom numbers'
         rng.fill_vector_uniform(self.state, array)
 
+    def fill_vector_nogil(self, array):
+        '''Fill the ``array`` vector like :meth:`fill_vector`, without the GIL.
+
+        The Python GIL is released during the computation, so that several
+        threads can fill arrays at the same time, each with its own
+        generator. Moreover, ``array`` can be any writable 1-D array of 64-bit
+        floats, including non-contiguous views, which are filled in place, and
+        its length is not limited to 2^31 elements. The numbers are the same
+        produced by :meth:`fill_vector`.'''
+        _nogil_call('fill_vector_uniform_64', self.state, array)
+
+    def jump(self, log2_steps: int):
+        '''Advance the generator by 2^``log2_steps`` numbers.
+
+        This is faster than calling :meth:`next` repeatedly, as the cost grows
+        only linearly with ``log2_steps``. It can be used to split the period
+        of the generator into non-overlapping substreams, e.g., one for each
+        MPI process.'''
+        _jump_state(self.state, log2_steps)
+
+    def skip(self, num_of_steps: int):
+        '''Advance the generator by ``num_of_steps`` numbers.
+
+        After the call, the generator is in the same state as if
+        :meth:`next` had been called ``num_of_steps`` times. The cost is
+        proportional to the logarithm of ``num_of_steps``.'''
+        _skip_state(self.state, num_of_steps)
+
+    def snapshot(self) -> bytes:
+        '''Return a snapshot of the state of the generator.
+
+        The result is a short sequence of bytes, which can be saved (e.g., in
+        the header of a FITS file) and passed later to :meth:`restore` to
+        resume the generation of numbers from this point. Snapshots use the
+        native byte order of the machine.'''
+        return _save_snapshot('FlatRNG', self.state)
+
+    def restore(self, snapshot: bytes):
+        '''Restore the state saved by :meth:`snapshot`.
+
+        A ``ValueError`` exception is raised if ``snapshot`` was not produced
+        by the same kind of generator.'''
+        _load_snapshot(snapshot, 'FlatRNG', self.state)
+
+
+class MultiLaneFlatRNG:
+    '''Vectorized random number generator with uniform distribution in [0, 1[
+
+    This generator keeps ``num_of_lanes`` independent xorshift generators and
+    interleaves their output, so that the generation can be done using SIMD
+    instructions. It is several times faster than :class:`FlatRNG`, but it
+    produces a different sequence of numbers: use :class:`FlatRNG` if you need
+    to match the output of "absrand".
+
+    The first lane produces the same numbers as :class:`FlatRNG` initialized
+    with the same seeds, and each subsequent lane is shifted forward by 2^64
+    steps. The number of lanes should be 4, 8, or 16, as these cases have been
+    optimized; any other positive number works, but it is slower.
+    '''
+
+    def __init__(self, x_init=0, y_init=0, z_init=0, w_init=0, num_of_lanes=8):
+        if num_of_lanes < 1:
+            raise ValueError('num_of_lanes must be positive')
+
+        self.num_of_lanes = num_of_lanes
+        self.lane_state = rng.init_rng_lanes(x_init, y_init, z_init, w_init,
+                                             num_of_lanes)
+        self.next_lane = np.zeros(1, dtype='int32')
+
+    def next(self):
+        'Return a new pseudorandom number'
+        return rng.rand_uniform_lanes(self.lane_state, self.next_lane)
+
+    def fill_vector(self, array):
+        'Fill the ``array`` vector with a sequence of pseudorandom numbers'
+        rng.fill_vector_uniform_lanes(self.lane_state, self.next_lane, array)
+
+    def fill_vector_nogil(self, array):
+        'Like :meth:`fill_vector`, see :meth:`FlatRNG.fill_vector_nogil`'
+        _nogil_call('fill_vector_uniform_lanes_64', self.lane_state,
+                    self.num_of_lanes, self.next_lane, array)
+
+    def jump(self, log2_steps: int):
+        '''Advance each lane by 2^``log2_steps`` steps.
+
+        Since lanes are 2^64 steps apart, the substreams produced by
+        different jumps do not overlap as long as their overall length is
+        smaller than 2^64.'''
+        _jump_lanes(self.lane_state, log2_steps)
+
+    def skip(self, num_of_steps: int):
+        '''Advance the generator by ``num_of_steps`` numbers.
+
+        After the call, the generator is in the same state as if
+        :meth:`next` had been called ``num_of_steps`` times.'''
+        _skip_lanes(self.lane_state, self.next_lane, num_of_steps)
+
+    def snapshot(self) -> bytes:
+        'Return a snapshot of the state, see :meth:`FlatRNG.snapshot`'
+        return _save_snapshot('MultiLaneFlatRNG', self.lane_state,
+                              self.next_lane)
+
+    def restore(self, snapshot: bytes):
+        'Restore the state saved by :meth:`snapshot`'
+        _load_snapshot(snapshot, 'MultiLaneFlatRNG', self.lane_state,
+                       self.next_lane)
+
 
 class NormalRNG:
     '''Random number generator with Gaussian distribution
@@ -37,67 +333,610 @@ class NormalRNG:
         sigma = 1.36
         num = mean + rng.next() * sigma
 
+    The parameter ``mode`` selects the algorithm (see ``GAUSSIAN_MODES``): the
+    default, ``reference``, matches the output of "absrand", while
+    ``vectorized`` is much faster but produces a different sequence. In the
+    latter case, ``num_of_lanes`` is passed to :class:`MultiLaneFlatRNG`.
     '''
 
-    def __init__(self, x_init=0, y_init=0, z_init=0, w_init=0):
-        self.state = rng.init_rng(x_init, y_init, z_init, w_init)
+    def __init__(self, x_init=0, y_init=0, z_init=0, w_init=0,
+                 mode='reference', num_of_lanes=8):
+        _check_gaussian_mode(mode)
+        self.mode = mode
+        if mode == 'reference':
+            self.state = rng.init_rng(x_init, y_init, z_init, w_init)
+        else:
+            self.lane_state = rng.init_rng_lanes(x_init, y_init, z_init,
+                                                 w_init, num_of_lanes)
+            self.next_lane = np.zeros(1, dtype='int32')
         self.empty = np.ones(1, dtype='int8')
         self.gset = np.zeros(1, dtype='float64')
 
     def next(self):
         'Return a new pseudorandom number'
-        return rng.rand_normal(self.state, self.empty, self.gset)
+        if self.mode == 'reference':
+            return rng.rand_normal(self.state, self.empty, self.gset)
+
+        result = np.empty(1)
+        self.fill_vector(result)
+        return result[0]
 
     def fill_vector(self, array):
         'Fill the ``array`` vector with a sequence of pseudorandom numbers'
-        rng.fill_vector_normal(self.state, self.empty, self.gset, array)
+        if self.mode == 'reference':
+            rng.fill_vector_normal(self.state, self.empty, self.gset, array)
+        else:
+            rng.fill_vector_normal_lanes(self.lane_state, self.next_lane,
+                                         self.empty, self.gset, array)
+
+    def fill_vector_nogil(self, array):
+        'Like :meth:`fill_vector`, see :meth:`FlatRNG.fill_vector_nogil`'
+        if self.mode == 'reference':
+            _nogil_call('fill_vector_normal_64', self.state, self.empty,
+                        self.gset, array)
+        else:
+            _nogil_call('fill_vector_normal_lanes_64', self.lane_state,
+                        len(self.lane_state) // 4, self.next_lane, self.empty,
+                        self.gset, array)
+
+    def jump(self, log2_steps: int):
+        '''Advance the underlying uniform generator by 2^``log2_steps`` steps.
+
+        Since the Gaussian generator uses a variable number of uniform numbers
+        for each sample, the jump is measured in terms of *uniform* draws, not
+        of Gaussian samples. Any cached Gaussian number is discarded. This is
+        useful to split the period of the generator into non-overlapping
+        substreams.'''
+        if self.mode == 'reference':
+            _jump_state(self.state, log2_steps)
+        else:
+            _jump_lanes(self.lane_state, log2_steps)
+        self.empty[0] = 1
+
+    def skip(self, num_of_steps: int):
+        '''Advance the underlying uniform generator by ``num_of_steps`` steps.
+
+        See :meth:`jump` for a few caveats.'''
+        if self.mode == 'reference':
+            _skip_state(self.state, num_of_steps)
+        else:
+            _skip_lanes(self.lane_state, self.next_lane, num_of_steps)
+        self.empty[0] = 1
+
+    def _uniform_state(self):
+        'Return the state and the index of the next lane (if any)'
+        if self.mode == 'reference':
+            return self.state, None
+        return self.lane_state, self.next_lane
+
+    def snapshot(self) -> bytes:
+        '''Return a snapshot of the state, see :meth:`FlatRNG.snapshot`.
+
+        The snapshot can only be restored into a generator using the same
+        ``mode`` and ``num_of_lanes``.'''
+        state, next_lane = self._uniform_state()
+        return _save_snapshot('NormalRNG', state, next_lane, self.empty,
+                              self.gset)
+
+    def restore(self, snapshot: bytes):
+        'Restore the state saved by :meth:`snapshot`'
+        state, next_lane = self._uniform_state()
+        _load_snapshot(snapshot, 'NormalRNG', state, next_lane, self.empty,
+                       self.gset)
+
+
+def _to_int32(value: int, name: str):
+    'Convert an unsigned 32-bit integer into the signed value used by rng.c'
+    if value < 0 or value >= 2**32:
+        raise ValueError('{0} must be in the range [0, 2^32)'.format(name))
+    return value - 2**32 if value >= 2**31 else value
+
+
+class CounterRNG:
+    '''Counter-based random number generator
+
+    Unlike the other generators in this module, which are sequential, this
+    class uses the Philox4x32-10 algorithm: the number with index ``i`` in the
+    sequence is a function of ``seed``, ``stream_id``, and ``i`` alone. Thus,
+    any chunk of the sequence can be produced independently from the others,
+    in any order and on any MPI process. A typical usage is to use the index
+    of the detector as ``stream_id`` and the index of the sample as the
+    position in the sequence.
+
+    The parameter ``distribution`` can be either ``uniform`` (numbers in
+    [0, 1[) or ``normal`` (Gaussian distribution with mean=0 and sigma=1).
+    Both ``seed`` and ``stream_id`` must be in the range [0, 2^32).
+
+    Example::
+
+        rng = CounterRNG(seed=1, stream_id=detector_idx)
+        # Samples 1000000...1000999 of the sequence
+        chunk = np.empty(1000)
+        rng.fill_vector(chunk, first_sample=1000000)
+    '''
+
+    DISTRIBUTIONS = ('uniform', 'normal')
+
+    def __init__(self, seed=0, stream_id=0, distribution='normal'):
+        if distribution not in CounterRNG.DISTRIBUTIONS:
+            raise ValueError('invalid distribution "{0}", valid choices are {1}'
+                             .format(distribution,
+                                     ', '.join(CounterRNG.DISTRIBUTIONS)))
+
+        self.seed = _to_int32(seed, 'seed')
+        self.stream_id = _to_int32(stream_id, 'stream_id')
+        self.distribution = distribution
+        self.position = 0
+
+    def next(self):
+        'Return the number at the current position and advance by one'
+        result = np.empty(1)
+        self.fill_vector(result)
+        return result[0]
+
+    @_instrumented
+    def fill_vector(self, array, first_sample=None):
+        '''Fill ``array`` with a sequence of pseudorandom numbers.
+
+        The numbers start from index ``first_sample`` in the sequence; if it
+        is ``None``, the current position is used. In both cases, the position
+        is moved after the last number written in ``array``.'''
+        if first_sample is None:
+            first_sample = self.position
+        if first_sample < 0:
+            raise ValueError('first_sample must be non-negative')
+
+        if self.distribution == 'uniform':
+            rng.fill_vector_uniform_counter(self.seed, self.stream_id,
+                                            first_sample, array)
+        else:
+            rng.fill_vector_normal_counter(self.seed, self.stream_id,
+                                           first_sample, array)
+        self.position = first_sample + len(array)
+
+    @_instrumented
+    def fill_vector_nogil(self, array, first_sample=None):
+        'Like :meth:`fill_vector`, see :meth:`FlatRNG.fill_vector_nogil`'
+        if first_sample is None:
+            first_sample = self.position
+        if first_sample < 0:
+            raise ValueError('first_sample must be non-negative')
+
+        if self.distribution == 'uniform':
+            _nogil_call('fill_vector_uniform_counter_64', self.seed,
+                        self.stream_id, first_sample, array)
+        else:
+            _nogil_call('fill_vector_normal_counter_64', self.seed,
+                        self.stream_id, first_sample, array)
+        self.position = first_sample + len(array)
+
+    def seek(self, position: int):
+        'Move to the number with index ``position`` in the sequence'
+        if position < 0:
+            raise ValueError('position must be non-negative')
+        self.position = position
+
+    def snapshot(self) -> bytes:
+        'Return a snapshot of the state, see :meth:`FlatRNG.snapshot`'
+        # The 64-bit position is split in two 32-bit words
+        state = np.array([self.seed, self.stream_id,
+                          self.position & 0xFFFFFFFF, self.position >> 32],
+                         dtype='int64').astype('uint32').view('int32')
+        return _save_snapshot('CounterRNG', state)
+
+    def restore(self, snapshot: bytes):
+        'Restore the state saved by :meth:`snapshot`'
+        state = np.zeros(4, dtype='int32')
+        _load_snapshot(snapshot, 'CounterRNG', state)
+        pos_low, pos_high = (int(x) for x in state[2:].view('uint32'))
+        self.seed, self.stream_id = int(state[0]), int(state[1])
+        self.position = pos_low + (pos_high << 32)
 
 
 class Oof2RNG:
     '''Random number generator with spectral power 1/f^2
 
-    The random numbers have zero mean.
+    The random numbers have zero mean. The parameters ``mode`` and
+    ``num_of_lanes`` select the Gaussian generator, see :class:`NormalRNG`.
+    If ``lookahead`` is true, :meth:`fill_vector` uses a faster formulation of
+    the filter, whose results match the exact computation only to rounding.
     '''
 
     def __init__(self, fmin, fknee, fsample,
-                 x_init=0, y_init=0, z_init=0, w_init=0):
-        self.flat_state = rng.init_rng(x_init, y_init, z_init, w_init)
-        self.empty = np.ones(1, dtype='int8')
-        self.gset = np.zeros(1, dtype='float64')
+                 x_init=0, y_init=0, z_init=0, w_init=0,
+                 mode='reference', num_of_lanes=8, lookahead=False):
+        self.normal_rng = NormalRNG(x_init, y_init, z_init, w_init,
+                                    mode=mode, num_of_lanes=num_of_lanes)
         self.oof2_state = rng.init_oof2(fmin, fknee, fsample)
+        self.lookahead = lookahead
 
     def next(self):
         'Return a new pseudorandom number'
-        return rng.rand_oof2(self.flat_state, self.empty,
-                             self.gset, self.oof2_state)
+        if self.normal_rng.mode == 'reference':
+            return rng.rand_oof2(self.normal_rng.state, self.normal_rng.empty,
+                                 self.normal_rng.gset, self.oof2_state)
 
+        result = np.empty(1)
+        self.fill_vector(result)
+        return result[0]
+
+    @_instrumented
     def fill_vector(self, array):
         'Fill the ``array`` vector with a sequence of pseudorandom numbers'
-        rng.fill_vector_oof2(self.flat_state, self.empty, self.gset,
-                             self.oof2_state, array)
+        gauss = self.normal_rng
+        if self.lookahead:
+            gauss.fill_vector(array)
+            rng.filter_oof(self.oof2_state, 1, 1, array)
+        elif gauss.mode == 'reference':
+            rng.fill_vector_oof2(gauss.state, gauss.empty, gauss.gset,
+                                 self.oof2_state, array)
+        else:
+            rng.fill_vector_oof2_lanes(gauss.lane_state, gauss.next_lane,
+                                       gauss.empty, gauss.gset,
+                                       self.oof2_state, array)
+
+    @_instrumented
+    def fill_vector_nogil(self, array):
+        'Like :meth:`fill_vector`, see :meth:`FlatRNG.fill_vector_nogil`'
+        gauss = self.normal_rng
+        if self.lookahead:
+            gauss.fill_vector_nogil(array)
+            _nogil_call('filter_oof_64', self.oof2_state, 1, 1, array)
+        elif gauss.mode == 'reference':
+            _nogil_call('fill_vector_oof2_64', gauss.state, gauss.empty,
+                        gauss.gset, self.oof2_state, array)
+        else:
+            _nogil_call('fill_vector_oof2_lanes_64', gauss.lane_state,
+                        len(gauss.lane_state) // 4, gauss.next_lane,
+                        gauss.empty, gauss.gset, self.oof2_state, array)
+
+    def jump(self, log2_steps: int):
+        '''Advance the underlying uniform generator by 2^``log2_steps`` steps.
+
+        See :meth:`NormalRNG.jump`. The state of the filter is left
+        untouched.'''
+        self.normal_rng.jump(log2_steps)
+
+    def skip(self, num_of_steps: int):
+        '''Advance the underlying uniform generator by ``num_of_steps`` steps.
+
+        See :meth:`NormalRNG.jump` for a few caveats.'''
+        self.normal_rng.skip(num_of_steps)
+
+    def snapshot(self) -> bytes:
+        '''Return a snapshot of the state, see :meth:`FlatRNG.snapshot`.
+
+        The snapshot includes the state of the filter. It can only be restored
+        into a generator using the same ``mode`` and ``num_of_lanes``.'''
+        state, next_lane = self.normal_rng._uniform_state()
+        return _save_snapshot('Oof2RNG', state, next_lane,
+                              self.normal_rng.empty, self.normal_rng.gset,
+                              self.oof2_state)
+
+    def restore(self, snapshot: bytes):
+        'Restore the state saved by :meth:`snapshot`'
+        state, next_lane = self.normal_rng._uniform_state()
+        _load_snapshot(snapshot, 'Oof2RNG', state, next_lane,
+                       self.normal_rng.empty, self.normal_rng.gset,
+                       self.oof2_state)
 
 
 class OofRNG:
     '''Random number generator with spectral power 1/f^a
 
-    The random numbers have zero mean. The value of a must be in the range [-2, 0).'''
+    The random numbers have zero mean. The value of a must be in the range
+    [-2, 0). The parameters ``mode`` and ``num_of_lanes`` select the Gaussian
+    generator, see :class:`NormalRNG`, and ``lookahead`` selects the
+    formulation of the filters, see :class:`Oof2RNG`.'''
 
     def __init__(self, alpha, fmin, fknee, fsample,
-                 x_init=0, y_init=0, z_init=0, w_init=0):
-        self.flat_state = rng.init_rng(x_init, y_init, z_init, w_init)
-        self.empty = np.ones(1, dtype='int8')
-        self.gset = np.zeros(1, dtype='float64')
+                 x_init=0, y_init=0, z_init=0, w_init=0,
+                 mode='reference', num_of_lanes=8, lookahead=False):
+        self.normal_rng = NormalRNG(x_init, y_init, z_init, w_init,
+                                    mode=mode, num_of_lanes=num_of_lanes)
         self.oof_state = np.empty(rng.oof_state_size(fmin, fknee, fsample),
                                   dtype='float64')
         self.num_of_states = rng.init_oof(alpha, fmin, fknee, fsample,
                                           self.oof_state)
+        self.lookahead = lookahead
 
     def next(self):
         'Return a new pseudorandom number'
-        return rng.rand_oof(self.flat_state, self.empty,
-                            self.gset, self.oof_state, self.num_of_states)
+        gauss = self.normal_rng
+        if gauss.mode == 'reference':
+            return rng.rand_oof(gauss.state, gauss.empty, gauss.gset,
+                                self.oof_state, self.num_of_states)
+
+        result = np.empty(1)
+        self.fill_vector(result)
+        return result[0]
+
+    @_instrumented
+    def fill_vector(self, array):
+        'Fill the ``array`` vector with a sequence of pseudorandom numbers'
+        gauss = self.normal_rng
+        if self.lookahead:
+            gauss.fill_vector(array)
+            rng.filter_oof(self.oof_state, self.num_of_states, 1, array)
+        elif gauss.mode == 'reference':
+            rng.fill_vector_oof(gauss.state, gauss.empty, gauss.gset,
+                                self.oof_state, self.num_of_states, array)
+        else:
+            rng.fill_vector_oof_lanes(gauss.lane_state, gauss.next_lane,
+                                      gauss.empty, gauss.gset,
+                                      self.oof_state, self.num_of_states,
+                                      array)
+
+    @_instrumented
+    def fill_vector_nogil(self, array):
+        'Like :meth:`fill_vector`, see :meth:`FlatRNG.fill_vector_nogil`'
+        gauss = self.normal_rng
+        if self.lookahead:
+            gauss.fill_vector_nogil(array)
+            _nogil_call('filter_oof_64', self.oof_state, self.num_of_states, 1,
+                        array)
+        elif gauss.mode == 'reference':
+            _nogil_call('fill_vector_oof_64', gauss.state, gauss.empty,
+                        gauss.gset, self.oof_state, self.num_of_states, array)
+        else:
+            _nogil_call('fill_vector_oof_lanes_64', gauss.lane_state,
+                        len(gauss.lane_state) // 4, gauss.next_lane,
+                        gauss.empty, gauss.gset, self.oof_state,
+                        self.num_of_states, array)
+
+    def jump(self, log2_steps: int):
+        '''Advance the underlying uniform generator by 2^``log2_steps`` steps.
+
+        See :meth:`NormalRNG.jump`. The state of the filters is left
+        untouched.'''
+        self.normal_rng.jump(log2_steps)
+
+    def skip(self, num_of_steps: int):
+        '''Advance the underlying uniform generator by ``num_of_steps`` steps.
+
+        See :meth:`NormalRNG.jump` for a few caveats.'''
+        self.normal_rng.skip(num_of_steps)
+
+    def snapshot(self) -> bytes:
+        '''Return a snapshot of the state, see :meth:`FlatRNG.snapshot`.
+
+        The snapshot includes the state of the filters. It can only be
+        restored into a generator created with the same ``fmin``, ``fknee``,
+        ``fsample``, ``mode``, and ``num_of_lanes``.'''
+        state, next_lane = self.normal_rng._uniform_state()
+        return _save_snapshot('OofRNG', state, next_lane,
+                              self.normal_rng.empty, self.normal_rng.gset,
+                              self.oof_state)
+
+    def restore(self, snapshot: bytes):
+        'Restore the state saved by :meth:`snapshot`'
+        state, next_lane = self.normal_rng._uniform_state()
+        _load_snapshot(snapshot, 'OofRNG', state, next_lane,
+                       self.normal_rng.empty, self.normal_rng.gset,
+                       self.oof_state)
+
+
+class NoiseBank:
+    '''Generator of 1/f^a noise for a set of detectors
+
+    This class produces the same kind of noise as :class:`OofRNG`, but it
+    handles many detectors at once: the state of all the generators is kept in
+    a few arrays, and :meth:`fill_matrix` fills a matrix with one row per
+    detector using a single call to the C library. The loop over the detectors
+    runs in parallel using OpenMP.
 
+    The parameters ``fknee``, ``alpha``, and ``sigma`` contain one value per
+    detector (scalars are broadcast to all the detectors). The output of each
+    detector is the output of :class:`OofRNG` multiplied by ``sigma``, i.e., the
+    level of the white noise above the knee frequency.
+
+    The generator of detector ``i`` is initialized using the seeds
+    ``x_init``, ``y_init``, ``z_init``, and ``w_init`` and then jumped ahead by
+    ``i`` × 2^64 steps (see :meth:`FlatRNG.jump`), so that detectors never share
+    their random numbers. The parameters ``mode``, ``num_of_lanes``, and
+    ``lookahead`` have the same meaning as in :class:`OofRNG`.
+
+    Example::
+
+        bank = NoiseBank(fknee=[0.01, 0.02, 0.03, 0.02],
+                         alpha=-1.0,
+                         sigma=[1e-3, 2e-3, 1e-3, 1.5e-3],
+                         fmin=1e-5,
+                         fsample=50.0)
+        tod = np.empty((bank.num_of_detectors, 100000))
+        bank.fill_matrix(tod)
+    '''
+
+    def __init__(self, fknee, alpha, sigma, fmin, fsample,
+                 x_init=0, y_init=0, z_init=0, w_init=0,
+                 mode='reference', num_of_lanes=8, lookahead=False):
+        _check_gaussian_mode(mode)
+
+        fknee, alpha, sigma = [np.ascontiguousarray(x, dtype='float64')
+                               for x in np.broadcast_arrays(fknee, alpha, sigma)]
+        if fknee.ndim != 1:
+            raise ValueError('fknee, alpha, and sigma must be vectors')
+
+        self.num_of_detectors = len(fknee)
+        self.mode = mode
+        self.lookahead = lookahead
+        self.sigma = sigma
+        self.num_of_poles = max([rng.oof_state_size(fmin, x, fsample)
+                                 for x in fknee]) // rng.oof2_state_size()
+        self.oof_states = rng.init_oof_bank(alpha, fmin, fknee, fsample,
+                                            self.num_of_poles)
+
+        if mode == 'reference':
+            num_of_lanes = 1
+
+        # Lanes are 2^64 steps apart from each other: give each detector
+        # "num_of_lanes" consecutive lanes and store them in one row
+        lanes = rng.init_rng_lanes(x_init, y_init, z_init, w_init,
+                                   self.num_of_detectors * num_of_lanes)
+        self.flat_states = np.ascontiguousarray(
+            np.reshape(lanes, (4, self.num_of_detectors, num_of_lanes))
+            .transpose(1, 0, 2)
+            .reshape(self.num_of_detectors, 4 * num_of_lanes))
+        self.next_lane = np.zeros(self.num_of_detectors, dtype='int32')
+        self.empty = np.ones(self.num_of_detectors, dtype='int8')
+        self.gset = np.zeros(self.num_of_detectors, dtype='float64')
+
+    @_instrumented
+    def fill_matrix(self, array):
+        '''Fill ``array`` with a sequence of pseudorandom numbers.
+
+        The parameter must be a C-contiguous matrix of float64 values, with
+        one row per detector.'''
+        if array.ndim != 2 or array.shape[0] != self.num_of_detectors:
+            raise ValueError('the array must have {0} rows'
+                             .format(self.num_of_detectors))
+
+        rng.fill_matrix_oof(self.flat_states, self.next_lane, self.empty,
+                            self.gset, self.oof_states, self.num_of_poles,
+                            self.sigma, 1 if self.lookahead else 0, array)
+
+
+def oof_psd(freq_hz, fknee, alpha, sigma, fsample, fmin=0.0):
+    '''Return the one-sided power spectral density of 1/f^a noise.
+
+    The PSD is computed at the frequencies in ``freq_hz`` using the model
+
+        P(f) = (2 sigma^2 / fsample) * (1 + (f / fknee)^alpha),
+
+    where ``alpha`` must be negative, as in :class:`OofRNG`, and ``sigma`` is
+    the RMS of the white noise. Below ``fmin``, the PSD is kept constant.
+    The result can be passed to :class:`PsdNoiseRNG`.'''
+
+    freq_hz = np.maximum(np.asarray(freq_hz, dtype='float64'), fmin)
+    white = 2.0 * sigma**2 / fsample
+    with np.errstate(divide='ignore'):
+        return white * (1.0 + (freq_hz / fknee)**alpha)
+
+
+def load_tabulated_psd(entry):
+    '''Read a tabulated PSD from a dictionary.
+
+    The dictionary (e.g., the entry of a polarimeter in the instrument database,
+    see :func:`stripeline.instrumentdb.detector_db_file_name`) must contain the
+    keys ``psd_freq_hz`` and ``psd_k2_per_hz``, two lists of equal length with
+    the frequencies and the values of the one-sided PSD. Return a pair of NumPy
+    arrays that can be passed to :class:`PsdNoiseRNG`.'''
+
+    freq_hz = np.array(entry['psd_freq_hz'], dtype='float64')
+    psd = np.array(entry['psd_k2_per_hz'], dtype='float64')
+    if freq_hz.shape != psd.shape or freq_hz.ndim != 1:
+        raise ValueError('PSD frequencies and values must be two lists '
+                         'with the same length')
+
+    return freq_hz, psd
+
+
+class PsdNoiseRNG:
+    '''Random number generator with an arbitrary power spectral density
+
+    Unlike :class:`OofRNG`, which uses a cascade of recursive filters, this
+    class shapes white noise in the frequency domain: it builds a FIR filter
+    whose response follows the PSD tabulated in ``freq_hz`` and ``psd``
+    (one-sided, in units^2/Hz) and convolves it with a stream of Gaussian
+    numbers using FFTs. The convolution is computed with the overlap-add
+    method, so that the memory usage does not depend on the length of the
+    timeline and consecutive calls to :meth:`fill_vector` join seamlessly. The
+    cost per sample is O(log ``filter_length``), regardless of the shape of
+    the spectrum.
+
+    The PSD is interpolated linearly in log-log space; outside the range in
+    ``freq_hz`` it is kept constant. The filter has ``filter_length`` taps
+    (rounded up to an even number), and its frequency resolution is
+    ``fsample / filter_length``: features of the spectrum below this
+    frequency are not reproduced. The default is the smallest power of two
+    such that the resolution is finer than the lowest frequency in
+    ``freq_hz``, up to :attr:`MAX_DEFAULT_FILTER_LENGTH` taps (about 1
+    million, i.e., some tens of MB for the FFTs); longer filters must be
+    requested explicitly.
+
+    The parameters ``x_init``, ``y_init``, ``z_init``, ``w_init``, ``mode``,
+    and ``num_of_lanes`` are passed to :class:`NormalRNG`, which produces the
+    white noise.
+
+    Example::
+
+        freq = np.logspace(-5, np.log10(25.0), 100)
+        rng = PsdNoiseRNG(freq_hz=freq,
+                          psd=oof_psd(freq, fknee=0.05, alpha=-1.0,
+                                      sigma=1e-3, fsample=50.0),
+                          fsample=50.0)
+        tod = np.empty(1000000)
+        rng.fill_vector(tod)
+
+    Here ``fsample / freq[0]`` would require 2^23 taps, so the default
+    filter is capped and the PSD is flat below ~5e-5 Hz.
+    '''
+
+    # Upper limit for the default value of "filter_length"
+    MAX_DEFAULT_FILTER_LENGTH = 2**20
+
+    def __init__(self, freq_hz, psd, fsample, filter_length=None,
+                 x_init=0, y_init=0, z_init=0, w_init=0,
+                 mode='reference', num_of_lanes=8):
+        freq_hz = np.asarray(freq_hz, dtype='float64')
+        psd = np.asarray(psd, dtype='float64')
+        if np.any(freq_hz <= 0.0) or np.any(psd <= 0.0):
+            raise ValueError('frequencies and PSD values must be positive')
+        if np.any(np.diff(freq_hz) <= 0.0):
+            raise ValueError('frequencies must be sorted in increasing order')
+
+        if filter_length is None:
+            needed = 2**int(np.ceil(np.log2(fsample / freq_hz[0])))
+            filter_length = min(needed, self.MAX_DEFAULT_FILTER_LENGTH)
+        self.filter_length = max(2, filter_length + filter_length % 2)
+        self.fsample = fsample
+        self.normal_rng = NormalRNG(x_init, y_init, z_init, w_init,
+                                    mode=mode, num_of_lanes=num_of_lanes)
+
+        # A unit-variance white noise has a one-sided PSD equal to
+        # 2 / fsample, so this is the gain needed to get "psd"
+        fft_freq = np.fft.rfftfreq(self.filter_length, d=1.0 / fsample)
+        fft_freq[0] = fft_freq[1]
+        log_psd = np.interp(np.log(fft_freq), np.log(freq_hz), np.log(psd))
+        gain = np.sqrt(np.exp(log_psd) * fsample / 2.0)
+
+        # Zero-phase impulse response, shifted so that it becomes causal
+        impulse = np.roll(np.fft.irfft(gain, n=self.filter_length),
+                          self.filter_length // 2)
+
+        # Each FFT convolves one block of "block_size" white noise samples
+        # with the impulse response
+        self.fft_length = 2 * self.filter_length
+        self.block_size = self.fft_length - self.filter_length + 1
+        self.filter_fft = np.fft.rfft(impulse, n=self.fft_length)
+        self.white = np.empty(self.block_size)
+        self.tail = np.zeros(self.filter_length - 1)
+        self.ready = np.empty(0)
+
+        # Discard the first block, as it contains the transient of the filter
+        self._next_block()
+        self.ready = np.empty(0)
+
+    def _next_block(self):
+        'Convolve a new block of white noise and append it to "self.ready"'
+        self.normal_rng.fill_vector(self.white)
+        conv = np.fft.irfft(np.fft.rfft(self.white, n=self.fft_length) *
+                            self.filter_fft, n=self.fft_length)
+
+        # The first samples overlap with the tail of the previous block
+        conv[:len(self.tail)] += self.tail
+        self.tail = conv[self.block_size:self.block_size + len(self.tail)]
+        self.ready = np.concatenate((self.ready, conv[:self.block_size]))
+
+    @_instrumented
     def fill_vector(self, array):
         'Fill the ``array`` vector with a sequence of pseudorandom numbers'
-        rng.fill_vector_oof(self.flat_state, self.empty, self.gset,
-                            self.oof_state, self.num_of_states, array)
+        start = 0
+        while start < len(array):
+            if len(self.ready) == 0:
+                self._next_block()
+
+            count = min(len(self.ready), len(array) - start)
+            array[start:start + count] = self.ready[:count]
+            self.ready = self.ready[count:]
+            start += count
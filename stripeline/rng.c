@@ -36,6 +36,9 @@
 #include <math.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include "rng.h"
 
 const double PI = 3.14159265358979323846;
 const double scale_factor = 1.0 / (1.0 + (double)0xFFFFFFFF);
@@ -104,6 +107,133 @@ void init_rng(int32_t x_start, int32_t y_start, int32_t z_start,
 
 /******************************************************************************/
 
+/* Jump-ahead
+ *
+ * The xorshift transform is linear over GF(2), so advancing the
+ * state by n steps is equivalent to multiplying the 128-bit state
+ * vector by T^n, where T is the 128x128 bit matrix describing one
+ * call to NEXT_STATE. We store matrices column by column (each column
+ * is a 128-bit vector packed in four words) and compute T^n by
+ * repeated squaring, so that the cost is O(log n) instead of O(n). */
+
+#define RNG_STATE_BITS 128
+
+typedef uint32_t rng_matrix[RNG_STATE_BITS][4];
+
+static void matrix_times_vector(rng_matrix m, const uint32_t *vec,
+                                uint32_t *result)
+{
+  uint32_t tmp[4] = {0, 0, 0, 0};
+  int bit;
+  for (bit = 0; bit < RNG_STATE_BITS; ++bit)
+  {
+    if ((vec[bit / 32] >> (bit % 32)) & 1)
+    {
+      tmp[0] ^= m[bit][0];
+      tmp[1] ^= m[bit][1];
+      tmp[2] ^= m[bit][2];
+      tmp[3] ^= m[bit][3];
+    }
+  }
+
+  result[0] = tmp[0];
+  result[1] = tmp[1];
+  result[2] = tmp[2];
+  result[3] = tmp[3];
+}
+
+/* Compute m = m * m */
+static void square_matrix(rng_matrix m)
+{
+  rng_matrix result;
+  int col;
+  for (col = 0; col < RNG_STATE_BITS; ++col)
+  {
+    matrix_times_vector(m, m[col], result[col]);
+  }
+
+  for (col = 0; col < RNG_STATE_BITS; ++col)
+  {
+    m[col][0] = result[col][0];
+    m[col][1] = result[col][1];
+    m[col][2] = result[col][2];
+    m[col][3] = result[col][3];
+  }
+}
+
+/* Build the matrix implementing one step of the generator */
+static void init_step_matrix(rng_matrix m)
+{
+  int bit;
+  for (bit = 0; bit < RNG_STATE_BITS; ++bit)
+  {
+    m[bit][0] = m[bit][1] = m[bit][2] = m[bit][3] = 0;
+    m[bit][bit / 32] = ((uint32_t)1) << (bit % 32);
+    NEXT_STATE(m[bit]);
+  }
+}
+
+/* Advance the state by 2^log2_steps steps (0 <= log2_steps < 128).
+ * This is useful to split the period of the generator in
+ * non-overlapping substreams. */
+static void init_jump_matrix(rng_matrix m, int32_t log2_steps)
+{
+  int32_t i;
+
+  init_step_matrix(m);
+  for (i = 0; i < log2_steps; ++i)
+  {
+    square_matrix(m);
+  }
+}
+
+void jump_rng(int32_t *state, int32_t log2_steps)
+{
+  uint32_t *ustate = (uint32_t *)state;
+  rng_matrix m;
+
+  if (log2_steps < 0 || log2_steps >= RNG_STATE_BITS)
+    return;
+
+  init_jump_matrix(m, log2_steps);
+  matrix_times_vector(m, ustate, ustate);
+}
+
+/* Advance the state by "num_of_steps" steps, as if "num_of_steps"
+ * numbers had been drawn with "rand_uniform". */
+void skip_rng(int32_t *state, int64_t num_of_steps)
+{
+  uint32_t *ustate = (uint32_t *)state;
+  uint64_t steps = (uint64_t)num_of_steps;
+  rng_matrix m;
+
+  if (num_of_steps <= 0)
+    return;
+
+  /* For short jumps, the brute-force approach is faster */
+  if (steps < RNG_STATE_BITS)
+  {
+    while (steps-- > 0)
+    {
+      NEXT_STATE(ustate);
+    }
+    return;
+  }
+
+  init_step_matrix(m);
+  while (steps > 0)
+  {
+    if (steps & 1)
+      matrix_times_vector(m, ustate, ustate);
+
+    steps >>= 1;
+    if (steps > 0)
+      square_matrix(m);
+  }
+}
+
+/******************************************************************************/
+
 /* Return a random uniform number in the interval [0, 1[ */
 double rand_uniform(int32_t *state)
 {
@@ -127,6 +257,229 @@ void fill_vector_uniform(int32_t *state, double *array, int num)
 
 /******************************************************************************/
 
+/* Multi-lane generator
+ *
+ * The scalar generator cannot be vectorized, as each number depends
+ * on the previous one. The multi-lane generator keeps "num_of_lanes"
+ * independent xorshift states and interleaves their output: the
+ * element "i" of the output comes from lane "i % num_of_lanes". The
+ * states are stored as a structure of arrays, so that word "w" of
+ * lane "l" is lane_state[w * num_of_lanes + l]: in this way, the
+ * loop over the lanes can be mapped to SIMD registers.
+ *
+ * Lane 0 starts from the same state as "init_rng", and lane "l" is
+ * jumped ahead by l * 2^64 steps, so that lanes never overlap.
+ *
+ * The variable "next_lane" keeps track of the lane to be used for the
+ * next number, so that consecutive calls to "fill_vector_uniform_lanes"
+ * produce the same stream regardless of the length of each call. */
+
+#define LANE_JUMP_LOG2 64
+
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && \
+    defined(__linux__)
+/* Compile the kernels for several instruction sets and let the dynamic
+ * loader pick the best one for the CPU at runtime */
+#define RNG_SIMD_DISPATCH \
+  __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define RNG_SIMD_DISPATCH
+#endif
+
+/* Convert a 32-bit unsigned integer into a double in [0, 1[. The
+ * result is the same as "value * scale_factor", but it only uses
+ * signed conversions, which most instruction sets can vectorize. */
+#define UINT32_TO_UNIFORM(value) \
+  (((double)(int32_t)((value) ^ 0x80000000u) + 2147483648.0) * scale_factor)
+
+void init_rng_lanes(int32_t x_start, int32_t y_start, int32_t z_start,
+                    int32_t w_start, int32_t num_of_lanes,
+                    int32_t *lane_state)
+{
+  uint32_t *ulane_state = (uint32_t *)lane_state;
+  uint32_t cur_state[4];
+  rng_matrix m;
+  int32_t lane;
+  int word;
+
+  init_rng(x_start, y_start, z_start, w_start, (int32_t *)cur_state);
+  if (num_of_lanes > 1)
+    init_jump_matrix(m, LANE_JUMP_LOG2);
+
+  for (lane = 0; lane < num_of_lanes; ++lane)
+  {
+    if (lane > 0)
+      matrix_times_vector(m, cur_state, cur_state);
+
+    for (word = 0; word < 4; ++word)
+    {
+      ulane_state[word * num_of_lanes + lane] = cur_state[word];
+    }
+  }
+}
+
+/******************************************************************************/
+
+static uint32_t lane_next_state(uint32_t *ulane_state, int32_t num_of_lanes,
+                                int32_t lane)
+{
+  uint32_t *x = ulane_state + lane;
+  uint32_t *y = x + num_of_lanes;
+  uint32_t *z = y + num_of_lanes;
+  uint32_t *w = z + num_of_lanes;
+  uint32_t tmp = *x ^ (*x << 11);
+
+  *x = *y;
+  *y = *z;
+  *z = *w;
+  *w = (*w ^ (*w >> 19)) ^ (tmp ^ (tmp >> 8));
+
+  return *w;
+}
+
+/* Compute the new value of the last word of a xorshift state, given
+ * the first ("x") and last ("w") words. The caller is responsible to
+ * rotate the other words. */
+#define XORSHIFT_WORD(x, w) \
+  (((w) ^ ((w) >> 19)) ^ (((x) ^ ((x) << 11)) ^ (((x) ^ ((x) << 11)) >> 8)))
+
+/* Produce "num_of_rows" rows of "NUM_OF_LANES" numbers each. The
+ * number of lanes is a compile-time constant, so that the compiler
+ * can keep the state in vector registers. The main loop is unrolled
+ * four times: in this way the four words of the state swap their
+ * roles at each step and return to their place at the end of the
+ * iteration, so that no register moves are needed. */
+#define DEFINE_LANES_KERNEL(NUM_OF_LANES)                                     \
+  RNG_SIMD_DISPATCH                                                           \
+  static void fill_rows_##NUM_OF_LANES(uint32_t *ulane_state, double *array, \
+                                       int num_of_rows)                       \
+  {                                                                           \
+    uint32_t x[NUM_OF_LANES], y[NUM_OF_LANES];                                \
+    uint32_t z[NUM_OF_LANES], w[NUM_OF_LANES];                                \
+    int row = 0;                                                              \
+    int lane;                                                                 \
+                                                                              \
+    for (lane = 0; lane < NUM_OF_LANES; ++lane)                               \
+    {                                                                         \
+      x[lane] = ulane_state[lane];                                            \
+      y[lane] = ulane_state[NUM_OF_LANES + lane];                             \
+      z[lane] = ulane_state[2 * NUM_OF_LANES + lane];                         \
+      w[lane] = ulane_state[3 * NUM_OF_LANES + lane];                         \
+    }                                                                         \
+                                                                              \
+    for (; row + 4 <= num_of_rows; row += 4)                                  \
+    {                                                                         \
+      double *cur_row = array + (size_t)row * NUM_OF_LANES;                   \
+      for (lane = 0; lane < NUM_OF_LANES; ++lane)                             \
+      {                                                                       \
+        x[lane] = XORSHIFT_WORD(x[lane], w[lane]);                            \
+        y[lane] = XORSHIFT_WORD(y[lane], x[lane]);                            \
+        z[lane] = XORSHIFT_WORD(z[lane], y[lane]);                            \
+        w[lane] = XORSHIFT_WORD(w[lane], z[lane]);                            \
+        cur_row[lane] = UINT32_TO_UNIFORM(x[lane]);                           \
+        cur_row[NUM_OF_LANES + lane] = UINT32_TO_UNIFORM(y[lane]);            \
+        cur_row[2 * NUM_OF_LANES + lane] = UINT32_TO_UNIFORM(z[lane]);        \
+        cur_row[3 * NUM_OF_LANES + lane] = UINT32_TO_UNIFORM(w[lane]);        \
+      }                                                                       \
+    }                                                                         \
+                                                                              \
+    for (; row < num_of_rows; ++row)                                          \
+    {                                                                         \
+      double *cur_row = array + (size_t)row * NUM_OF_LANES;                   \
+      for (lane = 0; lane < NUM_OF_LANES; ++lane)                             \
+      {                                                                       \
+        const uint32_t new_w = XORSHIFT_WORD(x[lane], w[lane]);               \
+        x[lane] = y[lane];                                                    \
+        y[lane] = z[lane];                                                    \
+        z[lane] = w[lane];                                                    \
+        w[lane] = new_w;                                                      \
+        cur_row[lane] = UINT32_TO_UNIFORM(new_w);                             \
+      }                                                                       \
+    }                                                                         \
+                                                                              \
+    for (lane = 0; lane < NUM_OF_LANES; ++lane)                               \
+    {                                                                         \
+      ulane_state[lane] = x[lane];                                            \
+      ulane_state[NUM_OF_LANES + lane] = y[lane];                             \
+      ulane_state[2 * NUM_OF_LANES + lane] = z[lane];                         \
+      ulane_state[3 * NUM_OF_LANES + lane] = w[lane];                         \
+    }                                                                         \
+  }
+
+DEFINE_LANES_KERNEL(4)
+DEFINE_LANES_KERNEL(8)
+DEFINE_LANES_KERNEL(16)
+
+/* Fallback for an arbitrary number of lanes */
+static void fill_rows_generic(uint32_t *ulane_state, int32_t num_of_lanes,
+                              double *array, int num_of_rows)
+{
+  int row;
+  int32_t lane;
+
+  for (row = 0; row < num_of_rows; ++row)
+  {
+    for (lane = 0; lane < num_of_lanes; ++lane)
+    {
+      array[(size_t)row * num_of_lanes + lane] =
+          lane_next_state(ulane_state, num_of_lanes, lane) * scale_factor;
+    }
+  }
+}
+
+/******************************************************************************/
+
+double rand_uniform_lanes(int32_t *lane_state, int32_t num_of_lanes,
+                          int32_t *next_lane)
+{
+  const uint32_t value =
+      lane_next_state((uint32_t *)lane_state, num_of_lanes, *next_lane);
+
+  *next_lane = (*next_lane + 1) % num_of_lanes;
+  return value * scale_factor;
+}
+
+/******************************************************************************/
+
+void fill_vector_uniform_lanes(int32_t *lane_state, int32_t num_of_lanes,
+                               int32_t *next_lane, double *array, int num)
+{
+  uint32_t *ulane_state = (uint32_t *)lane_state;
+  int i = 0;
+  int num_of_rows;
+
+  /* Finish the row left incomplete by the previous call */
+  while (*next_lane != 0 && i < num)
+  {
+    array[i++] = rand_uniform_lanes(lane_state, num_of_lanes, next_lane);
+  }
+
+  num_of_rows = (num - i) / num_of_lanes;
+  switch (num_of_lanes)
+  {
+  case 4:
+    fill_rows_4(ulane_state, array + i, num_of_rows);
+    break;
+  case 8:
+    fill_rows_8(ulane_state, array + i, num_of_rows);
+    break;
+  case 16:
+    fill_rows_16(ulane_state, array + i, num_of_rows);
+    break;
+  default:
+    fill_rows_generic(ulane_state, num_of_lanes, array + i, num_of_rows);
+  }
+  i += num_of_rows * num_of_lanes;
+
+  /* Start a new row with the remaining elements */
+  while (i < num)
+  {
+    array[i++] = rand_uniform_lanes(lane_state, num_of_lanes, next_lane);
+  }
+}
+
+/******************************************************************************/
+
 double rand_normal(int32_t *state, int8_t *empty, double *gset)
 {
   if (*empty)
@@ -166,6 +519,350 @@ void fill_vector_normal(int32_t *state, int8_t *empty, double *gset,
 
 /******************************************************************************/
 
+/* Vectorized Gaussian generator
+ *
+ * The polar method used by "rand_normal" cannot be vectorized, because
+ * of its rejection loop. The functions below use the Box-Muller
+ * transform instead, which needs exactly two uniform numbers for each
+ * pair of Gaussian numbers. The uniform numbers are produced in
+ * blocks by the multi-lane generator, and the transform is applied to
+ * the whole block in a branch-free loop. Since the standard "log",
+ * "sin" and "cos" functions cannot be inlined and vectorized by the
+ * compiler, we provide our own implementations here; they are based
+ * on the polynomial kernels used by fdlibm, and their accuracy is a
+ * few ULPs in the (limited) range of inputs used here.
+ *
+ * The "empty"/"gset" pair is used as in "rand_normal" to keep the
+ * second number of a pair when an odd number of samples is requested. */
+
+#define NORMAL_BLOCK_PAIRS 256
+
+static double bits_to_double(uint64_t bits)
+{
+  double result;
+  memcpy(&result, &bits, sizeof(result));
+  return result;
+}
+
+static uint64_t double_to_bits(double value)
+{
+  uint64_t result;
+  memcpy(&result, &value, sizeof(result));
+  return result;
+}
+
+/* Natural logarithm of a normal, positive number */
+static inline double fast_log(double x)
+{
+  const double ln2_hi = 6.93147180369123816490e-01;
+  const double ln2_lo = 1.90821492927058770002e-10;
+  const double lg1 = 6.666666666666735130e-01;
+  const double lg2 = 3.999999999940941908e-01;
+  const double lg3 = 2.857142874366239149e-01;
+  const double lg4 = 2.222219843214978396e-01;
+  const double lg5 = 1.818357216161805012e-01;
+  const double lg6 = 1.531383769920937332e-01;
+  const double lg7 = 1.479819860511658591e-01;
+
+  const uint64_t bits = double_to_bits(x);
+  const uint64_t mantissa = bits & 0x000FFFFFFFFFFFFFull;
+  /* "i" is nonzero if the mantissa is larger than sqrt(2): in this
+   * case, we divide it by two, so that it falls in [sqrt(2)/2, sqrt(2)[ */
+  const uint64_t i = (mantissa + 0x00095F6400000000ull) & 0x0010000000000000ull;
+  const double m = bits_to_double(mantissa | (i ^ 0x3FF0000000000000ull));
+  /* Convert the exponent into a double by placing it in the mantissa
+   * of 2^52: unlike an integer conversion, this can be vectorized on
+   * every instruction set */
+  const double dk =
+      bits_to_double(0x4330000000000000ull | ((bits >> 52) + (i >> 52))) -
+      (4503599627370496.0 + 1023.0);
+
+  const double f = m - 1.0;
+  const double s = f / (2.0 + f);
+  const double z = s * s;
+  const double w = z * z;
+  const double t1 = w * (lg2 + w * (lg4 + w * lg6));
+  const double t2 = z * (lg1 + w * (lg3 + w * (lg5 + w * lg7)));
+  const double r = t2 + t1;
+  const double hfsq = 0.5 * f * f;
+
+  return dk * ln2_hi - ((hfsq - (s * (hfsq + r) + dk * ln2_lo)) - f);
+}
+
+/* Sine and cosine of an angle in [-pi/4, pi/4] */
+static inline double kernel_sin(double x)
+{
+  const double s1 = -1.66666666666666324348e-01;
+  const double s2 = 8.33333333332248946124e-03;
+  const double s3 = -1.98412698298579493134e-04;
+  const double s4 = 2.75573137070700676789e-06;
+  const double s5 = -2.50507602534068634195e-08;
+  const double s6 = 1.58969099521155010221e-10;
+  const double z = x * x;
+  const double v = z * x;
+  const double r = s2 + z * (s3 + z * (s4 + z * (s5 + z * s6)));
+
+  return x + v * (s1 + z * r);
+}
+
+static inline double kernel_cos(double x)
+{
+  const double c1 = 4.16666666666666019037e-02;
+  const double c2 = -1.38888888888741095749e-03;
+  const double c3 = 2.48015872894767294178e-05;
+  const double c4 = -2.75573143513906633035e-07;
+  const double c5 = 2.08757232129817482790e-09;
+  const double c6 = -1.13596475577881948265e-11;
+  const double z = x * x;
+  const double r = z * (c1 + z * (c2 + z * (c3 + z * (c4 + z * (c5 + z * c6)))));
+  const double hz = 0.5 * z;
+  const double w = 1.0 - hz;
+
+  return w + (((1.0 - w) - hz) + z * r);
+}
+
+/* Apply the Box-Muller transform to "num_of_pairs" pairs of uniform
+ * numbers. The pair "i" is made by uniform[2i] (radius) and
+ * uniform[2i + 1] (angle), and it produces array[2i] and
+ * array[2i + 1]: in this way, the sequence of Gaussian numbers does
+ * not depend on the size of the blocks.
+ *
+ * The angle 2 pi u is split into a quadrant q = round(4u) and an
+ * offset in [-pi/4, pi/4]. The rounding is done by adding and
+ * subtracting 1.5 * 2^52, which leaves q in the lowest bits of the
+ * sum; the rotation by q * pi/2 is then implemented by swapping sine
+ * and cosine and flipping their sign bits, so that the loop has no
+ * branches. */
+#define ROUNDING_MAGIC 6755399441055744.0
+
+RNG_SIMD_DISPATCH
+static void box_muller(const double *uniform, double *array, int num_of_pairs)
+{
+  int i;
+
+  for (i = 0; i < num_of_pairs; ++i)
+  {
+    const double radius = sqrt(-2.0 * fast_log(1.0 - uniform[2 * i]));
+    const double quarters = 4.0 * uniform[2 * i + 1];
+    const double rounded = quarters + ROUNDING_MAGIC;
+    const uint64_t quadrant = double_to_bits(rounded) & 3;
+    const double x = (quarters - (rounded - ROUNDING_MAGIC)) * (0.5 * PI);
+    const uint64_t sin_bits = double_to_bits(kernel_sin(x));
+    const uint64_t cos_bits = double_to_bits(kernel_cos(x));
+    /* Odd quadrants swap sine and cosine */
+    const uint64_t swap = -(quadrant & 1);
+    uint64_t c = (cos_bits & ~swap) | (sin_bits & swap);
+    uint64_t s = (sin_bits & ~swap) | (cos_bits & swap);
+
+    /* The cosine is negative in quadrants 1 and 2, the sine in 2 and 3 */
+    c ^= (((quadrant + 1) >> 1) & 1) << 63;
+    s ^= ((quadrant >> 1) & 1) << 63;
+
+    array[2 * i] = radius * bits_to_double(c);
+    array[2 * i + 1] = radius * bits_to_double(s);
+  }
+}
+
+/******************************************************************************/
+
+void fill_vector_normal_lanes(int32_t *lane_state, int32_t num_of_lanes,
+                              int32_t *next_lane, int8_t *empty, double *gset,
+                              double *array, int num)
+{
+  double uniform[2 * NORMAL_BLOCK_PAIRS];
+  double pair[2];
+  int i = 0;
+
+  if (num > 0 && !(*empty))
+  {
+    array[i++] = *gset;
+    *empty = 1;
+  }
+
+  while (num - i >= 2)
+  {
+    int num_of_pairs = (num - i) / 2;
+    if (num_of_pairs > NORMAL_BLOCK_PAIRS)
+      num_of_pairs = NORMAL_BLOCK_PAIRS;
+
+    fill_vector_uniform_lanes(lane_state, num_of_lanes, next_lane, uniform,
+                              2 * num_of_pairs);
+    box_muller(uniform, array + i, num_of_pairs);
+    i += 2 * num_of_pairs;
+  }
+
+  if (i < num)
+  {
+    fill_vector_uniform_lanes(lane_state, num_of_lanes, next_lane, uniform, 2);
+    box_muller(uniform, pair, 1);
+    array[i] = pair[0];
+    *gset = pair[1];
+    *empty = 0;
+  }
+}
+
+/******************************************************************************/
+
+/* Counter-based generator: Philox4x32-10 (J. K. Salmon et al., "Parallel
+ * random numbers: as easy as 1, 2, 3", SC'11). Each block of four 32-bit
+ * numbers is a pure function of a 64-bit key and of a 128-bit counter, so
+ * that any sample can be computed without producing the ones before it.
+ *
+ * The key is made by the seed and by the stream id (e.g., the index of
+ * the detector); the first two words of the counter contain the index of
+ * the block (four samples each), and the third word tells the kind of
+ * stream, so that the uniform and Gaussian streams with the same key are
+ * independent. Gaussian samples 2i and 2i + 1 are computed from uniform
+ * numbers 2i and 2i + 1 using "box_muller". */
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+#define PHILOX_ROUNDS 10
+
+#define COUNTER_KIND_UNIFORM 0
+#define COUNTER_KIND_NORMAL 1
+#define COUNTER_BLOCK_SIZE 4
+
+static inline void philox4x32(const uint32_t *counter, uint32_t key0, uint32_t key1,
+                       uint32_t *result)
+{
+  uint32_t c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+  int round;
+
+  for (round = 0; round < PHILOX_ROUNDS; ++round)
+  {
+    const uint64_t prod0 = (uint64_t)PHILOX_M0 * c0;
+    const uint64_t prod1 = (uint64_t)PHILOX_M1 * c2;
+
+    c0 = (uint32_t)(prod1 >> 32) ^ c1 ^ key0;
+    c1 = (uint32_t)prod1;
+    c2 = (uint32_t)(prod0 >> 32) ^ c3 ^ key1;
+    c3 = (uint32_t)prod0;
+    key0 += PHILOX_W0;
+    key1 += PHILOX_W1;
+  }
+
+  result[0] = c0;
+  result[1] = c1;
+  result[2] = c2;
+  result[3] = c3;
+}
+
+/* Compute "num_of_blocks" consecutive blocks of uniform numbers, starting
+ * from block "first_block". Blocks are independent, so the loop is
+ * vectorized across them */
+RNG_SIMD_DISPATCH
+static void philox_uniform_blocks(uint32_t key0, uint32_t key1, uint32_t kind,
+                                  uint64_t first_block, int num_of_blocks,
+                                  double *array)
+{
+  int i;
+
+  for (i = 0; i < num_of_blocks; ++i)
+  {
+    const uint64_t block = first_block + (uint64_t)i;
+    const uint32_t counter[4] = {(uint32_t)block, (uint32_t)(block >> 32),
+                                 kind, 0};
+    uint32_t result[COUNTER_BLOCK_SIZE];
+
+    philox4x32(counter, key0, key1, result);
+    array[COUNTER_BLOCK_SIZE * i] = UINT32_TO_UNIFORM(result[0]);
+    array[COUNTER_BLOCK_SIZE * i + 1] = UINT32_TO_UNIFORM(result[1]);
+    array[COUNTER_BLOCK_SIZE * i + 2] = UINT32_TO_UNIFORM(result[2]);
+    array[COUNTER_BLOCK_SIZE * i + 3] = UINT32_TO_UNIFORM(result[3]);
+  }
+}
+
+/* Fill "array" with the uniform numbers having index
+ * first_sample...first_sample + num - 1 in the stream */
+static void fill_counter_uniform(uint32_t key0, uint32_t key1, uint32_t kind,
+                                 int64_t first_sample, double *array, int num)
+{
+  uint64_t block = (uint64_t)first_sample / COUNTER_BLOCK_SIZE;
+  int offset = (int)((uint64_t)first_sample % COUNTER_BLOCK_SIZE);
+  double partial[COUNTER_BLOCK_SIZE];
+  int num_of_blocks;
+  int i = 0;
+
+  if (num > 0 && offset != 0)
+  {
+    philox_uniform_blocks(key0, key1, kind, block++, 1, partial);
+    while (offset < COUNTER_BLOCK_SIZE && i < num)
+      array[i++] = partial[offset++];
+  }
+
+  num_of_blocks = (num - i) / COUNTER_BLOCK_SIZE;
+  philox_uniform_blocks(key0, key1, kind, block, num_of_blocks, array + i);
+  block += (uint64_t)num_of_blocks;
+  i += COUNTER_BLOCK_SIZE * num_of_blocks;
+
+  if (i < num)
+  {
+    philox_uniform_blocks(key0, key1, kind, block, 1, partial);
+    for (offset = 0; i < num; ++offset)
+      array[i++] = partial[offset];
+  }
+}
+
+void philox_block(const int32_t *counter, int32_t seed, int32_t stream_id,
+                  int32_t *result)
+{
+  philox4x32((const uint32_t *)counter, (uint32_t)seed, (uint32_t)stream_id,
+             (uint32_t *)result);
+}
+
+void fill_vector_uniform_counter(int32_t seed, int32_t stream_id,
+                                 int64_t first_sample, double *array, int num)
+{
+  fill_counter_uniform((uint32_t)seed, (uint32_t)stream_id,
+                       COUNTER_KIND_UNIFORM, first_sample, array, num);
+}
+
+void fill_vector_normal_counter(int32_t seed, int32_t stream_id,
+                                int64_t first_sample, double *array, int num)
+{
+  const uint32_t key0 = (uint32_t)seed;
+  const uint32_t key1 = (uint32_t)stream_id;
+  double uniform[2 * NORMAL_BLOCK_PAIRS];
+  double pair[2];
+  int64_t sample = first_sample;
+  int i = 0;
+
+  /* An odd first sample is the second element of its pair */
+  if (num > 0 && (sample & 1))
+  {
+    fill_counter_uniform(key0, key1, COUNTER_KIND_NORMAL, sample - 1,
+                         uniform, 2);
+    box_muller(uniform, pair, 1);
+    array[i++] = pair[1];
+    ++sample;
+  }
+
+  while (num - i >= 2)
+  {
+    int num_of_pairs = (num - i) / 2;
+    if (num_of_pairs > NORMAL_BLOCK_PAIRS)
+      num_of_pairs = NORMAL_BLOCK_PAIRS;
+
+    fill_counter_uniform(key0, key1, COUNTER_KIND_NORMAL, sample, uniform,
+                         2 * num_of_pairs);
+    box_muller(uniform, array + i, num_of_pairs);
+    i += 2 * num_of_pairs;
+    sample += 2 * num_of_pairs;
+  }
+
+  if (i < num)
+  {
+    fill_counter_uniform(key0, key1, COUNTER_KIND_NORMAL, sample, uniform, 2);
+    box_muller(uniform, pair, 1);
+    array[i] = pair[0];
+  }
+}
+
+/******************************************************************************/
+
 int32_t oof2_state_size(void)
 {
   return 5;
@@ -206,6 +903,89 @@ double oof2_filter(double *oof2_state, double x2)
 
 /******************************************************************************/
 
+/* Block-wise filtering
+ *
+ * Applying all the oof2 sections to one sample before moving to the
+ * next one leaves little room for instruction-level parallelism, as
+ * each section is a recurrence. The functions below process the
+ * samples in blocks of OOF_BLOCK_SIZE elements (small enough to stay
+ * in the L1 cache), running each section over the whole block before
+ * moving to the next one ("pole-major" order).
+ *
+ * Each section is split in a FIR part (c0 x[n] + c1 x[n-1]), which
+ * has no loop-carried dependency and can be vectorized, and a IIR
+ * part (y[n] = fir[n] + d0 y[n-1]). The operations are associated in
+ * the same way as in "oof2_filter", so the result is exactly the same.
+ *
+ * If "lookahead" is nonzero, the IIR part is reformulated as
+ *
+ *     y[n] = g[n] + d0^4 y[n-4],
+ *     g[n] = fir[n] + d0 fir[n-1] + d0^2 fir[n-2] + d0^3 fir[n-3],
+ *
+ * which has four independent chains and is therefore faster. The
+ * result matches the exact computation only to rounding. */
+
+#define OOF_BLOCK_SIZE 1024
+#define OOF_LOOKAHEAD 4
+
+RNG_SIMD_DISPATCH
+static void oof2_filter_block(double *oof2_state, double *array, int num,
+                              int32_t lookahead)
+{
+  const double c0 = OOF2_C0(oof2_state);
+  const double c1 = OOF2_C1(oof2_state);
+  const double d0 = OOF2_D0(oof2_state);
+  double fir[OOF_BLOCK_SIZE];
+  double y1 = OOF2_Y1(oof2_state);
+  int i;
+
+  if (num <= 0)
+    return;
+
+  fir[0] = c0 * array[0] + c1 * OOF2_X1(oof2_state);
+  for (i = 1; i < num; ++i)
+  {
+    fir[i] = c0 * array[i] + c1 * array[i - 1];
+  }
+  OOF2_X1(oof2_state) = array[num - 1];
+
+  if (!lookahead || num <= OOF_LOOKAHEAD)
+  {
+    for (i = 0; i < num; ++i)
+    {
+      y1 = fir[i] + d0 * y1;
+      array[i] = y1;
+    }
+  }
+  else
+  {
+    const double d0_2 = d0 * d0;
+    const double d0_3 = d0_2 * d0;
+    const double d0_4 = d0_2 * d0_2;
+
+    for (i = 0; i < OOF_LOOKAHEAD; ++i)
+    {
+      y1 = fir[i] + d0 * y1;
+      array[i] = y1;
+    }
+
+    /* Iterate backwards, so that "fir" can be overwritten with "g" */
+    for (i = num - 1; i >= OOF_LOOKAHEAD; --i)
+    {
+      fir[i] += d0 * fir[i - 1] + d0_2 * fir[i - 2] + d0_3 * fir[i - 3];
+    }
+
+    for (i = OOF_LOOKAHEAD; i < num; ++i)
+    {
+      array[i] = fir[i] + d0_4 * array[i - OOF_LOOKAHEAD];
+    }
+  }
+
+  OOF2_Y1(oof2_state) = array[num - 1];
+}
+
+/******************************************************************************/
+
 double rand_oof2(int32_t *flat_state, int8_t *empty, double *gset,
                  double *oof2_state)
 {
@@ -218,10 +998,14 @@ double rand_oof2(int32_t *flat_state, int8_t *empty, double *gset,
 void fill_vector_oof2(int32_t *flat_state, int8_t *empty, double *gset,
                       double *oof2_state, double *array, int num)
 {
-  int i;
-  for (i = 0; i < num; ++i)
+  int start;
+  for (start = 0; start < num; start += OOF_BLOCK_SIZE)
   {
-    array[i] = rand_oof2(flat_state, empty, gset, oof2_state);
+    const int block_size =
+        (num - start < OOF_BLOCK_SIZE) ? (num - start) : OOF_BLOCK_SIZE;
+
+    fill_vector_normal(flat_state, empty, gset, array + start, block_size);
+    oof2_filter_block(oof2_state, array + start, block_size, 0);
   }
 }
 
@@ -288,13 +1072,416 @@ double rand_oof(int32_t *flat_state, int8_t *empty, double *gset,
 
 /******************************************************************************/
 
+/* Apply the cascade of oof2 filters to "array" (in place) */
+void filter_oof(double *oof_state, int32_t oof_state_size, int32_t lookahead,
+                double *array, int num)
+{
+  int start;
+  int32_t i;
+
+  for (start = 0; start < num; start += OOF_BLOCK_SIZE)
+  {
+    const int block_size =
+        (num - start < OOF_BLOCK_SIZE) ? (num - start) : OOF_BLOCK_SIZE;
+
+    for (i = 0; i < oof_state_size; ++i)
+    {
+      oof2_filter_block(oof_state + i * oof2_state_size(), array + start,
+                        block_size, lookahead);
+    }
+  }
+}
+
+/******************************************************************************/
+
 void fill_vector_oof(int32_t *flat_state, int8_t *empty, double *gset,
                      double *oof_state, int32_t oof_state_size,
                      double *array, int num)
 {
-  int i;
-  for (i = 0; i < num; ++i)
+  int start;
+  for (start = 0; start < num; start += OOF_BLOCK_SIZE)
+  {
+    const int block_size =
+        (num - start < OOF_BLOCK_SIZE) ? (num - start) : OOF_BLOCK_SIZE;
+
+    fill_vector_normal(flat_state, empty, gset, array + start, block_size);
+    filter_oof(oof_state, oof_state_size, 0, array + start, block_size);
+  }
+}
+
+/******************************************************************************/
+
+/* Same as "fill_vector_oof2" and "fill_vector_oof", but the
+ * Gaussian numbers are produced by "fill_vector_normal_lanes" */
+
+void fill_vector_oof2_lanes(int32_t *lane_state, int32_t num_of_lanes,
+                            int32_t *next_lane, int8_t *empty, double *gset,
+                            double *oof2_state, double *array, int num)
+{
+  int start;
+  for (start = 0; start < num; start += OOF_BLOCK_SIZE)
+  {
+    const int block_size =
+        (num - start < OOF_BLOCK_SIZE) ? (num - start) : OOF_BLOCK_SIZE;
+
+    fill_vector_normal_lanes(lane_state, num_of_lanes, next_lane, empty, gset,
+                             array + start, block_size);
+    oof2_filter_block(oof2_state, array + start, block_size, 0);
+  }
+}
+
+void fill_vector_oof_lanes(int32_t *lane_state, int32_t num_of_lanes,
+                           int32_t *next_lane, int8_t *empty, double *gset,
+                           double *oof_state, int32_t oof_state_size,
+                           double *array, int num)
+{
+  int start;
+  for (start = 0; start < num; start += OOF_BLOCK_SIZE)
+  {
+    const int block_size =
+        (num - start < OOF_BLOCK_SIZE) ? (num - start) : OOF_BLOCK_SIZE;
+
+    fill_vector_normal_lanes(lane_state, num_of_lanes, next_lane, empty, gset,
+                             array + start, block_size);
+    filter_oof(oof_state, oof_state_size, 0, array + start, block_size);
+  }
+}
+
+/******************************************************************************/
+
+/* Multi-detector generation
+ *
+ * A "noise bank" is the set of generators for "num_of_detectors"
+ * detectors. Instead of one object per detector, it is stored as a
+ * structure of arrays:
+ *
+ * - flat_states: num_of_detectors rows of "state_size" words each,
+ *   containing either a xorshift state (4 words, "reference" mode) or
+ *   a multi-lane state (4 * num_of_lanes words);
+ * - next_lane: one element per detector, used only by multi-lane
+ *   states (see "fill_vector_uniform_lanes");
+ * - empty, gset: one element per detector, as in "rand_normal";
+ * - oof_states: num_of_detectors rows of "num_of_poles" oof2 sections
+ *   each. Detectors needing less sections are padded with sections
+ *   that leave the samples unchanged (see "init_oof_bank");
+ * - sigma: the white noise level of each detector.
+ *
+ * The output is a num_of_detectors x num matrix (row-major). The
+ * loop over the detectors is parallelized using OpenMP. */
+
+/* Initialize the 1/f filters of a noise bank: "slope" and "fknee"
+ * have "num_of_detectors" elements, and "num_of_poles" must be at
+ * least the maximum value of "num_of_oof_poles" over the detectors */
+void init_oof_bank(int32_t num_of_detectors, const double *slope, double fmin,
+                   const double *fknee, double fsample, int32_t num_of_poles,
+                   double *oof_states)
+{
+  int32_t det;
+
+  for (det = 0; det < num_of_detectors; ++det)
   {
-    array[i] = rand_oof(flat_state, empty, gset, oof_state, oof_state_size);
+    double *cur_state =
+        oof_states + (size_t)det * num_of_poles * oof2_state_size();
+    int32_t pole = init_oof(slope[det], fmin, fknee[det], fsample, cur_state);
+
+    for (; pole < num_of_poles; ++pole)
+    {
+      double *cur_section = cur_state + pole * oof2_state_size();
+      OOF2_C0(cur_section) = 1.0;
+      OOF2_C1(cur_section) = 0.0;
+      OOF2_D0(cur_section) = 0.0;
+      OOF2_X1(cur_section) = 0.0;
+      OOF2_Y1(cur_section) = 0.0;
+    }
+  }
+}
+
+/******************************************************************************/
+
+void fill_matrix_oof(int32_t *flat_states, int32_t num_of_detectors,
+                     int32_t state_size, int32_t *next_lane, int8_t *empty,
+                     double *gset,
+                     double *oof_states, int32_t num_of_poles,
+                     const double *sigma, int32_t lookahead, double *array,
+                     int num)
+{
+  int32_t det;
+
+#pragma omp parallel for schedule(dynamic)
+  for (det = 0; det < num_of_detectors; ++det)
+  {
+    int32_t *cur_state = flat_states + (size_t)det * state_size;
+    double *cur_oof_state =
+        oof_states + (size_t)det * num_of_poles * oof2_state_size();
+    double *cur_row = array + (size_t)det * num;
+    int start, i;
+
+    for (start = 0; start < num; start += OOF_BLOCK_SIZE)
+    {
+      const int block_size =
+          (num - start < OOF_BLOCK_SIZE) ? (num - start) : OOF_BLOCK_SIZE;
+
+      if (state_size == 4)
+      {
+        fill_vector_normal(cur_state, empty + det, gset + det,
+                           cur_row + start, block_size);
+      }
+      else
+      {
+        fill_vector_normal_lanes(cur_state, state_size / 4, next_lane + det,
+                                 empty + det, gset + det, cur_row + start,
+                                 block_size);
+      }
+
+      filter_oof(cur_oof_state, num_of_poles, lookahead, cur_row + start,
+                 block_size);
+
+      for (i = start; i < start + block_size; ++i)
+      {
+        cur_row[i] *= sigma[det];
+      }
+    }
   }
 }
+
+/******************************************************************************/
+
+/* Entry points with 64-bit lengths and strided arrays.
+ *
+ * Each function ending with "_64" produces the same numbers as the function
+ * with the same name without the suffix, but it takes the number of elements
+ * as an "int64_t" and it accesses them as array[0], array[stride],
+ * array[2 * stride]..., where "stride" is measured in elements and can be
+ * negative. The work is split in chunks: contiguous arrays are passed
+ * directly to the original functions, while strided ones go through a small
+ * buffer on the stack.
+ *
+ * Like the rest of this file, these functions only touch the state passed as
+ * argument, so that several threads can call them at the same time using
+ * different states. The Python wrappers in "noisegen.py" call them through
+ * "ctypes", which releases the GIL. */
+
+#define STRIDED_BUFFER_SIZE 1024
+#define CONTIGUOUS_CHUNK_SIZE (1 << 30)
+
+/* Evaluate FILL on consecutive chunks of "array", with "dest" pointing to
+ * "count" contiguous elements. If GATHER is nonzero, "dest" contains the
+ * current values of the elements, as FILL modifies them in place */
+#define STRIDED_LOOP(array, num, stride, GATHER, FILL)                        \
+  do                                                                          \
+  {                                                                           \
+    double buffer[STRIDED_BUFFER_SIZE];                                       \
+    int64_t done = 0;                                                         \
+    while (done < (num))                                                      \
+    {                                                                         \
+      const int64_t max_count =                                               \
+          ((stride) == 1) ? CONTIGUOUS_CHUNK_SIZE : STRIDED_BUFFER_SIZE;      \
+      const int count =                                                       \
+          (int)(((num)-done < max_count) ? (num)-done : max_count);           \
+      double *const base = (array) + done * (stride);                         \
+      double *const dest = ((stride) == 1) ? base : buffer;                   \
+      int k;                                                                  \
+      if ((stride) != 1 && (GATHER))                                          \
+        for (k = 0; k < count; ++k)                                           \
+          buffer[k] = base[k * (stride)];                                     \
+      FILL;                                                                   \
+      if ((stride) != 1)                                                      \
+        for (k = 0; k < count; ++k)                                           \
+          base[k * (stride)] = buffer[k];                                     \
+      done += count;                                                          \
+    }                                                                         \
+  } while (0)
+
+void fill_vector_uniform_64(int32_t *state, double *array, int64_t num,
+                            int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 0, fill_vector_uniform(state, dest, count));
+}
+
+void fill_vector_uniform_lanes_64(int32_t *lane_state, int32_t num_of_lanes,
+                                  int32_t *next_lane, double *array,
+                                  int64_t num, int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 0,
+               fill_vector_uniform_lanes(lane_state, num_of_lanes, next_lane,
+                                         dest, count));
+}
+
+void fill_vector_normal_64(int32_t *state, int8_t *empty, double *gset,
+                           double *array, int64_t num, int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 0,
+               fill_vector_normal(state, empty, gset, dest, count));
+}
+
+void fill_vector_normal_lanes_64(int32_t *lane_state, int32_t num_of_lanes,
+                                 int32_t *next_lane, int8_t *empty,
+                                 double *gset, double *array, int64_t num,
+                                 int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 0,
+               fill_vector_normal_lanes(lane_state, num_of_lanes, next_lane,
+                                        empty, gset, dest, count));
+}
+
+void fill_vector_uniform_counter_64(int32_t seed, int32_t stream_id,
+                                    int64_t first_sample, double *array,
+                                    int64_t num, int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 0,
+               fill_vector_uniform_counter(seed, stream_id, first_sample + done,
+                                           dest, count));
+}
+
+void fill_vector_normal_counter_64(int32_t seed, int32_t stream_id,
+                                   int64_t first_sample, double *array,
+                                   int64_t num, int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 0,
+               fill_vector_normal_counter(seed, stream_id, first_sample + done,
+                                          dest, count));
+}
+
+void fill_vector_oof2_64(int32_t *flat_state, int8_t *empty, double *gset,
+                         double *oof2_state, double *array, int64_t num,
+                         int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 0,
+               fill_vector_oof2(flat_state, empty, gset, oof2_state, dest,
+                                count));
+}
+
+void fill_vector_oof2_lanes_64(int32_t *lane_state, int32_t num_of_lanes,
+                               int32_t *next_lane, int8_t *empty, double *gset,
+                               double *oof2_state, double *array, int64_t num,
+                               int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 0,
+               fill_vector_oof2_lanes(lane_state, num_of_lanes, next_lane,
+                                      empty, gset, oof2_state, dest, count));
+}
+
+void fill_vector_oof_64(int32_t *flat_state, int8_t *empty, double *gset,
+                        double *oof_state, int32_t oof_state_size,
+                        double *array, int64_t num, int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 0,
+               fill_vector_oof(flat_state, empty, gset, oof_state,
+                               oof_state_size, dest, count));
+}
+
+void fill_vector_oof_lanes_64(int32_t *lane_state, int32_t num_of_lanes,
+                              int32_t *next_lane, int8_t *empty, double *gset,
+                              double *oof_state, int32_t oof_state_size,
+                              double *array, int64_t num, int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 0,
+               fill_vector_oof_lanes(lane_state, num_of_lanes, next_lane,
+                                     empty, gset, oof_state, oof_state_size,
+                                     dest, count));
+}
+
+void filter_oof_64(double *oof_state, int32_t oof_state_size,
+                   int32_t lookahead, double *array, int64_t num,
+                   int64_t stride)
+{
+  STRIDED_LOOP(array, num, stride, 1,
+               filter_oof(oof_state, oof_state_size, lookahead, dest, count));
+}
+
+/******************************************************************************/
+
+/* Snapshots of the state of a generator.
+ *
+ * A snapshot is a sequence of bytes containing everything is needed to
+ * resume the generation of numbers from the point where the snapshot was
+ * taken: the xorshift (or counter) state, the index of the next lane, the
+ * cached Gaussian number, and the state of the filters. The layout is the
+ * following, using the native byte order:
+ *
+ * offset  0: magic string "RNGS"
+ * offset  4: version of the layout (int32)
+ * offset  8: kind of generator (int32, chosen by the caller)
+ * offset 12: number of elements in "state" (int32)
+ * offset 16: number of elements in "filter_state" (int32)
+ * offset 20: index of the next lane (int32)
+ * offset 24: flag "empty" (int8, followed by 7 padding bytes)
+ * offset 32: cached Gaussian number "gset" (double)
+ * offset 40: "state" (int32 array), followed by "filter_state" (double
+ *            array)
+ *
+ * The "kind" field allows the caller to check that the snapshot is being
+ * loaded into the same kind of generator which produced it. */
+
+#define SNAPSHOT_MAGIC "RNGS"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 40
+
+#define SNAPSHOT_OK 0
+#define SNAPSHOT_INVALID 1
+#define SNAPSHOT_MISMATCH 2
+
+int32_t rng_snapshot_size(int32_t state_size, int32_t filter_state_size)
+{
+  return SNAPSHOT_HEADER_SIZE + state_size * (int32_t)sizeof(int32_t) +
+         filter_state_size * (int32_t)sizeof(double);
+}
+
+void save_rng_snapshot(int32_t kind, const int32_t *state, int32_t state_size,
+                       int32_t next_lane, int8_t empty, double gset,
+                       const double *filter_state, int32_t filter_state_size,
+                       int8_t *snapshot)
+{
+  const int32_t header[] = {SNAPSHOT_VERSION, kind, state_size,
+                            filter_state_size, next_lane};
+  char *dest = (char *)snapshot;
+
+  memset(dest, 0, SNAPSHOT_HEADER_SIZE);
+  memcpy(dest, SNAPSHOT_MAGIC, 4);
+  memcpy(dest + 4, header, sizeof(header));
+  memcpy(dest + 24, &empty, sizeof(empty));
+  memcpy(dest + 32, &gset, sizeof(gset));
+
+  dest += SNAPSHOT_HEADER_SIZE;
+  memcpy(dest, state, state_size * sizeof(int32_t));
+  dest += state_size * sizeof(int32_t);
+  memcpy(dest, filter_state, filter_state_size * sizeof(double));
+}
+
+/* Restore the state saved by "save_rng_snapshot". The sizes of the arrays
+ * and "kind" must match the ones in the snapshot, otherwise nothing is
+ * modified. Return SNAPSHOT_OK in case of success, SNAPSHOT_INVALID if the
+ * bytes do not contain a valid snapshot, and SNAPSHOT_MISMATCH if the
+ * snapshot has been produced by a different kind of generator. */
+int32_t load_rng_snapshot(const int8_t *snapshot, int32_t snapshot_size,
+                          int32_t kind, int32_t *state, int32_t state_size,
+                          int32_t *next_lane, int8_t *empty, double *gset,
+                          double *filter_state, int32_t filter_state_size)
+{
+  const char *src = (const char *)snapshot;
+  int32_t header[5];
+
+  if (snapshot_size < SNAPSHOT_HEADER_SIZE ||
+      memcmp(src, SNAPSHOT_MAGIC, 4) != 0)
+    return SNAPSHOT_INVALID;
+
+  memcpy(header, src + 4, sizeof(header));
+  if (header[0] != SNAPSHOT_VERSION ||
+      snapshot_size != rng_snapshot_size(header[2], header[3]))
+    return SNAPSHOT_INVALID;
+
+  if (header[1] != kind || header[2] != state_size ||
+      header[3] != filter_state_size)
+    return SNAPSHOT_MISMATCH;
+
+  *next_lane = header[4];
+  memcpy(empty, src + 24, sizeof(*empty));
+  memcpy(gset, src + 32, sizeof(*gset));
+
+  src += SNAPSHOT_HEADER_SIZE;
+  memcpy(state, src, state_size * sizeof(int32_t));
+  src += state_size * sizeof(int32_t);
+  memcpy(filter_state, src, filter_state_size * sizeof(double));
+
+  return SNAPSHOT_OK;
+}
@@ -0,0 +1,160 @@
+/******************************************************************************
+ * rng.h
+ *
+ * Public interface of the random number generators implemented in "rng.c",
+ * for use by other C modules in Stripeline. See "rng.c" for a description
+ * of each function.
+ *
+ ******************************************************************************/
+
+#ifndef STRIPELINE_RNG_H
+#define STRIPELINE_RNG_H
+
+#include <stdint.h>
+
+void init_rng(int32_t x_start, int32_t y_start, int32_t z_start,
+              int32_t w_start, int32_t *state);
+
+void jump_rng(int32_t *state, int32_t log2_steps);
+
+void skip_rng(int32_t *state, int64_t num_of_steps);
+
+double rand_uniform(int32_t *state);
+
+void fill_vector_uniform(int32_t *state, double *array, int num);
+
+void init_rng_lanes(int32_t x_start, int32_t y_start, int32_t z_start,
+                    int32_t w_start, int32_t num_of_lanes,
+                    int32_t *lane_state);
+
+double rand_uniform_lanes(int32_t *lane_state, int32_t num_of_lanes,
+                          int32_t *next_lane);
+
+void fill_vector_uniform_lanes(int32_t *lane_state, int32_t num_of_lanes,
+                               int32_t *next_lane, double *array, int num);
+
+double rand_normal(int32_t *state, int8_t *empty, double *gset);
+
+void fill_vector_normal(int32_t *state, int8_t *empty, double *gset,
+                        double *array, int num);
+
+void fill_vector_normal_lanes(int32_t *lane_state, int32_t num_of_lanes,
+                              int32_t *next_lane, int8_t *empty, double *gset,
+                              double *array, int num);
+
+void philox_block(const int32_t *counter, int32_t seed, int32_t stream_id,
+                  int32_t *result);
+
+void fill_vector_uniform_counter(int32_t seed, int32_t stream_id,
+                                 int64_t first_sample, double *array, int num);
+
+void fill_vector_normal_counter(int32_t seed, int32_t stream_id,
+                                int64_t first_sample, double *array, int num);
+
+int32_t oof2_state_size(void);
+
+void init_oof2(double fmin, double fknee, double fsample, double *oof2_state);
+
+double oof2_filter(double *oof2_state, double x2);
+
+double rand_oof2(int32_t *flat_state, int8_t *empty, double *gset,
+                 double *oof2_state);
+
+void fill_vector_oof2(int32_t *flat_state, int8_t *empty, double *gset,
+                      double *oof2_state, double *array, int num);
+
+int32_t num_of_oof_poles(double fmin, double fknee, double fsample);
+
+int32_t oof_state_size(double fmin, double fknee, double fsample);
+
+int32_t init_oof(double slope, double fmin, double fknee, double fsample,
+                 double *oof_state);
+
+double rand_oof(int32_t *flat_state, int8_t *empty, double *gset,
+                double *oof_state, int32_t oof_state_size);
+
+void filter_oof(double *oof_state, int32_t oof_state_size, int32_t lookahead,
+                double *array, int num);
+
+void fill_vector_oof(int32_t *flat_state, int8_t *empty, double *gset,
+                     double *oof_state, int32_t oof_state_size,
+                     double *array, int num);
+
+void fill_vector_oof2_lanes(int32_t *lane_state, int32_t num_of_lanes,
+                            int32_t *next_lane, int8_t *empty, double *gset,
+                            double *oof2_state, double *array, int num);
+
+void fill_vector_oof_lanes(int32_t *lane_state, int32_t num_of_lanes,
+                           int32_t *next_lane, int8_t *empty, double *gset,
+                           double *oof_state, int32_t oof_state_size,
+                           double *array, int num);
+
+void init_oof_bank(int32_t num_of_detectors, const double *slope, double fmin,
+                   const double *fknee, double fsample, int32_t num_of_poles,
+                   double *oof_states);
+
+void fill_matrix_oof(int32_t *flat_states, int32_t num_of_detectors,
+                     int32_t state_size, int32_t *next_lane, int8_t *empty,
+                     double *gset,
+                     double *oof_states, int32_t num_of_poles,
+                     const double *sigma, int32_t lookahead, double *array,
+                     int num);
+
+void fill_vector_uniform_64(int32_t *state, double *array, int64_t num,
+                            int64_t stride);
+
+void fill_vector_uniform_lanes_64(int32_t *lane_state, int32_t num_of_lanes,
+                                  int32_t *next_lane, double *array,
+                                  int64_t num, int64_t stride);
+
+void fill_vector_normal_64(int32_t *state, int8_t *empty, double *gset,
+                           double *array, int64_t num, int64_t stride);
+
+void fill_vector_normal_lanes_64(int32_t *lane_state, int32_t num_of_lanes,
+                                 int32_t *next_lane, int8_t *empty,
+                                 double *gset, double *array, int64_t num,
+                                 int64_t stride);
+
+void fill_vector_uniform_counter_64(int32_t seed, int32_t stream_id,
+                                    int64_t first_sample, double *array,
+                                    int64_t num, int64_t stride);
+
+void fill_vector_normal_counter_64(int32_t seed, int32_t stream_id,
+                                   int64_t first_sample, double *array,
+                                   int64_t num, int64_t stride);
+
+void fill_vector_oof2_64(int32_t *flat_state, int8_t *empty, double *gset,
+                         double *oof2_state, double *array, int64_t num,
+                         int64_t stride);
+
+void fill_vector_oof2_lanes_64(int32_t *lane_state, int32_t num_of_lanes,
+                               int32_t *next_lane, int8_t *empty, double *gset,
+                               double *oof2_state, double *array, int64_t num,
+                               int64_t stride);
+
+void fill_vector_oof_64(int32_t *flat_state, int8_t *empty, double *gset,
+                        double *oof_state, int32_t oof_state_size,
+                        double *array, int64_t num, int64_t stride);
+
+void fill_vector_oof_lanes_64(int32_t *lane_state, int32_t num_of_lanes,
+                              int32_t *next_lane, int8_t *empty, double *gset,
+                              double *oof_state, int32_t oof_state_size,
+                              double *array, int64_t num, int64_t stride);
+
+void filter_oof_64(double *oof_state, int32_t oof_state_size,
+                   int32_t lookahead, double *array, int64_t num,
+                   int64_t stride);
+
+int32_t rng_snapshot_size(int32_t state_size, int32_t filter_state_size);
+
+void save_rng_snapshot(int32_t kind, const int32_t *state, int32_t state_size,
+                       int32_t next_lane, int8_t empty, double gset,
+                       const double *filter_state, int32_t filter_state_size,
+                       int8_t *snapshot);
+
+int32_t load_rng_snapshot(const int8_t *snapshot, int32_t snapshot_size,
+                          int32_t kind, int32_t *state, int32_t state_size,
+                          int32_t *next_lane, int8_t *empty, double *gset,
+                          double *filter_state, int32_t filter_state_size);
+
+#endif
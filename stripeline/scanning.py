@@ -44,13 +44,17 @@ Here is a short example which shows how to use these facilities::
                           tod_callback=save_tod)
 
 This module provides the class :class:`~stripeline.scanning.TodWriter`, which
-saves pointing information in FITS files.
+saves pointing information in FITS files, and the class
+:class:`~stripeline.scanning.AsyncTodWriter`, which runs such a callback in a
+background thread while the next chunk is being computed.
 '''
 
 import logging as log
 import io
 import os.path
+import queue
 import sys
+import threading
 from typing import Any
 import click
 import healpy
@@ -58,8 +62,10 @@ import numpy as np
 from astropy.io import fits
 import yaml
 
-import stripeline.quaternions as q
+import stripeline._scanning as _scanning
+import stripeline.instrumentation as instrumentation
 import stripeline.timetools as timetools
+import stripeline.todfile as todfile
 
 
 class ScanningStrategy:
@@ -187,11 +193,371 @@ def time_to_rot_angle(time_vec: Any, rpm: float) -> Any:
         return 2 * np.pi * time_vec * (rpm / 60.0)
 
 
+def compute_pointings(scanning: ScanningStrategy,
+                      dir_vec,
+                      start_time: float,
+                      num_of_samples: int) -> Any:
+    '''Compute the pointings of a beam for a range of times.
+
+    Return a matrix with `num_of_samples` rows and four columns, with the
+    same content as the one passed by
+    :meth:`~stripeline.scanning.generate_pointings` to its callback. The
+    first sample is taken at time `start_time`, the others are spaced
+    according to `scanning.sampling_frequency_hz`.
+
+    The computation is done by a compiled kernel, which hoists the
+    quaternions that do not depend on time out of the loop over the samples
+    and runs the loop in parallel using OpenMP. No temporary array is
+    allocated apart from the result.'''
+
+    with instrumentation.timer('scanning.pointing_timeline',
+                               samples=num_of_samples):
+        pointings = _scanning.pointing_timeline(
+            num=num_of_samples,
+            **_kernel_arguments(scanning, dir_vec, start_time))
+
+    # The kernel returns a 4xn Fortran-ordered matrix: its transpose is a
+    # C-ordered nx4 matrix, and no copy is needed
+    return pointings.T
+
+
+def _kernel_arguments(scanning: ScanningStrategy, dir_vec, start_time: float):
+    'Return the arguments shared by all the kernels in stripeline._scanning'
+
+    return {'wheel_angles0_deg': [scanning.wheel1_angle0_deg,
+                                  scanning.wheel2_angle0_deg,
+                                  scanning.wheel3_angle0_deg],
+            'rpms': [scanning.wheel1_rpm, scanning.wheel3_rpm],
+            'latitude_deg': scanning.latitude_deg,
+            'dir_vec': np.asarray(dir_vec, dtype=np.float64),
+            'start_time': start_time,
+            'sampfreq': scanning.sampling_frequency_hz}
+
+
+def estimate_interpolation_error(scanning: ScanningStrategy,
+                                 dir_vec,
+                                 start_time: float,
+                                 num_of_samples: int,
+                                 decimation: int) -> float:
+    '''Return the error of :meth:`interpolate_pointings` in arcseconds.
+
+    The error is estimated without computing the pointings, and it is the
+    same value that :meth:`interpolate_pointings` would return with the same
+    parameters.'''
+
+    error_rad = _scanning.estimate_interpolation_error(
+        decimation=decimation,
+        num=num_of_samples,
+        **_kernel_arguments(scanning, dir_vec, start_time))
+    return np.rad2deg(error_rad) * 3600.0
+
+
+def choose_decimation(scanning: ScanningStrategy,
+                      dir_vec,
+                      start_time: float,
+                      num_of_samples: int,
+                      max_error_arcsec: float) -> int:
+    '''Return the largest decimation whose interpolation error is acceptable.
+
+    The result can be passed as the `decimation` parameter to
+    :meth:`interpolate_pointings`: the error on the direction of the beam and
+    of the polarization axis will not exceed `max_error_arcsec`.'''
+
+    assert max_error_arcsec > 0.0
+
+    if num_of_samples <= 1:
+        return 1
+
+    # The error of the interpolation scales with the square of the length
+    # of each interval: start from a guess based on a one-second grid
+    decimation = int(min(num_of_samples,
+                         max(2, scanning.sampling_frequency_hz)))
+    error = estimate_interpolation_error(scanning, dir_vec, start_time,
+                                         num_of_samples, decimation)
+    if error == 0.0:
+        return num_of_samples
+
+    decimation = int(np.clip(decimation * np.sqrt(max_error_arcsec / error),
+                             1, num_of_samples))
+    while decimation > 1 and \
+            estimate_interpolation_error(scanning, dir_vec, start_time,
+                                         num_of_samples,
+                                         decimation) > max_error_arcsec:
+        decimation = max(1, min(decimation - 1, decimation * 3 // 4))
+
+    return decimation
+
+
+def interpolate_pointings(scanning: ScanningStrategy,
+                          dir_vec,
+                          start_time: float,
+                          num_of_samples: int,
+                          decimation=None,
+                          max_error_arcsec=None):
+    '''Compute pointings by interpolating the attitude of the instrument.
+
+    This is like :meth:`compute_pointings`, but the attitude of the
+    instrument is computed exactly only once every `decimation` samples; for
+    the other samples, it is interpolated using spherical linear
+    interpolation (slerp). If `decimation` is ``None``, the largest value
+    which keeps the error below `max_error_arcsec` is used (see
+    :meth:`choose_decimation`).
+
+    Return a pair containing the pointing matrix and the maximum error (in
+    arcseconds) on the direction of the beam and of the polarization axis,
+    estimated at the midpoint of each interpolation interval.'''
+
+    if decimation is None:
+        assert max_error_arcsec is not None, \
+            'either decimation or max_error_arcsec must be specified'
+        with instrumentation.timer('scanning.choose_decimation'):
+            decimation = choose_decimation(scanning, dir_vec, start_time,
+                                           num_of_samples, max_error_arcsec)
+
+    assert decimation >= 1
+
+    with instrumentation.timer('scanning.interpolated_pointing_timeline',
+                               samples=num_of_samples):
+        pointings, error_rad = _scanning.interpolated_pointing_timeline(
+            decimation=decimation,
+            num=num_of_samples,
+            **_kernel_arguments(scanning, dir_vec, start_time))
+    return pointings.T, np.rad2deg(error_rad) * 3600.0
+
+
+def _check_nside(nside: int, nest: bool):
+    if nside < 1 or (nest and (nside & (nside - 1)) != 0):
+        raise ValueError('invalid value for nside ({0})'.format(nside))
+
+
+def compute_pixel_indexes(scanning: ScanningStrategy,
+                          dir_vec,
+                          start_time: float,
+                          num_of_samples: int,
+                          nside: int,
+                          nest=False) -> Any:
+    '''Compute the HEALPix pixels observed by a beam for a range of times.
+
+    The parameters have the same meaning as in :meth:`compute_pointings`.
+    The pixel indexes (RING scheme, or NESTED if `nest` is ``True``) are
+    computed directly from the direction of the beam, without computing the
+    angles, and they are the same as the ones returned by
+    ``healpy.ang2pix(nside, theta, phi, nest=nest)``. Return an array of
+    64-bit integers.'''
+
+    _check_nside(nside, nest)
+    with instrumentation.timer('scanning.pixel_timeline',
+                               samples=num_of_samples):
+        return _scanning.pixel_timeline(
+            nside=nside,
+            nest=nest,
+            num=num_of_samples,
+            **_kernel_arguments(scanning, dir_vec, start_time))
+
+
+def horn_offsets(directions) -> Any:
+    '''Return the rotation quaternions of a set of horns in the focal plane.
+
+    The parameter `directions` is a Nx3 matrix containing the direction of
+    the beam of each horn, in the reference frame of the focal plane (e.g.,
+    the ``orientation`` fields returned by
+    :func:`stripeline.instrumentdb.load_horn_orientations`). Return a Nx4
+    matrix whose rows are the quaternions of the smallest rotations that
+    bring the boresight (the z axis) into each direction. These can be
+    passed to :func:`compute_focal_plane_pointings`.'''
+
+    directions = np.atleast_2d(np.asarray(directions, dtype=np.float64))
+    directions = directions / np.linalg.norm(directions, axis=1)[:, np.newaxis]
+
+    # For unit vectors z and d, the quaternion [z × d, 1 + z·d] (normalized)
+    # rotates z into d by the angle between them
+    result = np.column_stack((-directions[:, 1],
+                              directions[:, 0],
+                              np.zeros(len(directions)),
+                              1.0 + directions[:, 2]))
+    norms = np.linalg.norm(result, axis=1)
+
+    # A direction opposite to the boresight: turn around the x axis
+    opposite = norms < 1e-12
+    result[opposite] = [1.0, 0.0, 0.0, 0.0]
+    norms[opposite] = 1.0
+
+    return result / norms[:, np.newaxis]
+
+
+def _rotate_boresight(offsets) -> Any:
+    'Return the directions of the horns, given the rows of "offsets"'
+
+    x, y, z, w = offsets.T
+    return np.column_stack((2 * (x * z + w * y),
+                            2 * (y * z - w * x),
+                            1 - 2 * (x**2 + y**2)))
+
+
+def compute_focal_plane_pointings(scanning: ScanningStrategy,
+                                  offsets,
+                                  start_time: float,
+                                  num_of_samples: int,
+                                  nside=None,
+                                  nest=False):
+    '''Compute the pointings of many horns for a range of times.
+
+    The attitude of the boresight is computed only once per sample, and it
+    is then combined with the rotation quaternion of each horn, i.e., each
+    row of the Nx4 matrix `offsets` (see :func:`horn_offsets`). The first
+    wheel rotates around the boresight. With a single horn whose offset is
+    the identity, the result is the same as :func:`compute_pointings` with
+    ``dir_vec=[0, 0, 1]``.
+
+    For the other horns, the result is *not* the same as
+    :func:`compute_pointings` with `dir_vec` set to the direction of the
+    horn, because the two use different models of the focal plane. Here the
+    first wheel turns the whole focal plane around the boresight, and the
+    polarization axis of each horn is the x axis rotated by its offset;
+    :func:`compute_pointings` turns the first wheel around `dir_vec` and
+    uses the x axis as the polarization axis. The directions only agree
+    when the angle of the first wheel is zero, and the polarization angles
+    differ in any case.
+
+    Return a pair. The first element is an array with shape (N,
+    `num_of_samples`, 4), where the k-th element is the pointing matrix of
+    the k-th horn (see :meth:`generate_pointings`). If `nside` is not
+    ``None``, the second element contains the pixel indexes with shape (N,
+    `num_of_samples`), otherwise it is ``None``.'''
+
+    offsets = np.atleast_2d(np.asarray(offsets, dtype=np.float64))
+    if nside is not None:
+        _check_nside(nside, nest)
+        pixidx = np.empty((len(offsets), num_of_samples), dtype=np.int64)
+    else:
+        pixidx = np.empty((0, 0), dtype=np.int64)
+
+    args = _kernel_arguments(scanning, [0.0, 0.0, 1.0], start_time)
+    del args['dir_vec']
+    with instrumentation.timer('scanning.focal_plane_timeline',
+                               samples=num_of_samples * len(offsets)):
+        pointings = _scanning.focal_plane_timeline(offsets=offsets.T,
+                                                   nside=nside or 0,
+                                                   nest=nest,
+                                                   pixidx=pixidx.T,
+                                                   num=num_of_samples,
+                                                   **args)
+
+    # Both arrays were filled in Fortran order: transposing them gives
+    # C-ordered arrays whose first index is the horn
+    return pointings.T, (pixidx if nside is not None else None)
+
+
+def _run_chunk(scanning: ScanningStrategy, dir_vec, chunk_idx: int,
+               cur_chunk: timetools.TimeChunk, tod_callback, decimation,
+               max_error_arcsec, nside, nest, horn_offsets):
+    '''Compute one chunk for generate_pointings and pass it to the callback
+
+    Return the maximum interpolation error in arcseconds. This is a module
+    function, so that it can be run by the processes of a pool.'''
+
+    interpolate = (decimation is not None) or (max_error_arcsec is not None)
+    error = 0.0
+    start_time, samples_per_chunk = cur_chunk
+    if horn_offsets is not None:
+        pointings, pixidx = compute_focal_plane_pointings(
+            scanning=scanning,
+            offsets=horn_offsets,
+            start_time=start_time,
+            num_of_samples=samples_per_chunk,
+            nside=nside,
+            nest=nest)
+    elif interpolate:
+        pointings, error = interpolate_pointings(
+            scanning=scanning,
+            dir_vec=dir_vec,
+            start_time=start_time,
+            num_of_samples=samples_per_chunk,
+            decimation=decimation,
+            max_error_arcsec=max_error_arcsec)
+        log.info('chunk %d: maximum interpolation error is %.3g arcsec',
+                 chunk_idx, error)
+        if nside is not None:
+            # The pixels must match the interpolated directions (computing
+            # them from the exact attitude would also cost as much as not
+            # interpolating at all)
+            with instrumentation.timer('scanning.ang2pix',
+                                       samples=samples_per_chunk):
+                pixidx = healpy.ang2pix(nside, pointings[:, 1],
+                                        pointings[:, 2],
+                                        nest=nest).astype(np.int64)
+    elif nside is not None:
+        # Pointings and pixels are computed in the same pass
+        with instrumentation.timer('scanning.pointing_pixel_timeline',
+                                   samples=samples_per_chunk):
+            pointings, pixidx = _scanning.pointing_pixel_timeline(
+                nside=nside,
+                nest=nest,
+                num=samples_per_chunk,
+                **_kernel_arguments(scanning, dir_vec, start_time))
+        pointings = pointings.T
+    else:
+        pointings = compute_pointings(scanning=scanning,
+                                      dir_vec=dir_vec,
+                                      start_time=start_time,
+                                      num_of_samples=samples_per_chunk)
+
+    instrumentation.count('scanning.chunks')
+    instrumentation.count('scanning.samples', samples_per_chunk)
+    if tod_callback is not None:
+        extra_args = {'pixidx': pixidx} if nside is not None else {}
+        # With an AsyncTodWriter, this is the time spent waiting for the
+        # writer to accept the chunk
+        with instrumentation.timer('scanning.tod_callback',
+                                   samples=samples_per_chunk):
+            tod_callback(pointings=pointings,
+                         scanning=scanning,
+                         dir_vec=dir_vec,
+                         index=chunk_idx,
+                         **extra_args)
+
+    return error
+
+
+# Callback used by the processes of the pool in generate_pointings. It is
+# passed once when each process starts, rather than with every chunk, as it
+# might contain large objects (e.g., the sky maps of stripsim.TodWriter)
+_pool_callback = None
+
+
+def _init_pool_process(tod_callback, instrumentation_enabled):
+    global _pool_callback
+    _pool_callback = tod_callback
+    if instrumentation_enabled:
+        instrumentation.enable()
+    else:
+        instrumentation.disable()
+
+
+def _run_pool_chunk(*args):
+    '''Run _run_chunk in a process of the pool
+
+    Return the interpolation error and the statistics recorded while
+    computing the chunk, which are merged into the ones of the parent
+    process.'''
+    instrumentation.reset()
+    error = _run_chunk(*args[:4], _pool_callback, *args[4:])
+    return error, instrumentation.local_statistics()
+
+
 def generate_pointings(scanning: ScanningStrategy,
                        dir_vec=[0, 0, 1],
                        num_of_chunks=1,
                        tod_callback=None,
-                       time0_s=0.0):
+                       time0_s=0.0,
+                       first_chunk=0,
+                       decimation=None,
+                       max_error_arcsec=None,
+                       nside=None,
+                       nest=False,
+                       horn_offsets=None,
+                       comm=None,
+                       num_of_processes=1):
     '''Generate a set of pointing directions.
 
     Simulate the scanning of the sky with the parameters provided in `scanning`,
@@ -199,7 +565,9 @@ def generate_pointings(scanning: ScanningStrategy,
     whenever a new chunk of samples has been calculated. (It is fine if it is
     set to ``None``: in this case, pointings will be silently thrown away once
     they have been computed.) The value `time0_s` specifies the time of the
-    first sample.
+    first sample. Chunks whose index is smaller than `first_chunk` are skipped
+    without computing them: this is useful to resume a simulation that was
+    interrupted.
 
     The callback must accept the following parameters:
 
@@ -210,74 +578,156 @@ def generate_pointings(scanning: ScanningStrategy,
     - `dir_vec`: copy of the parameter passed to this function;
     - `index`: counter which keeps track of how many times the callback has been
       called, starting from 0.
+
+    If either `decimation` or `max_error_arcsec` is specified, the attitude
+    of the instrument is computed on a coarser grid and interpolated (see
+    :meth:`interpolate_pointings`): this is much faster, as the scanning is
+    slow compared with the sampling frequency. The function returns the
+    maximum interpolation error across all the chunks, in arcseconds (zero
+    if no interpolation was used).
+
+    If `nside` is not ``None``, the callback receives one more parameter,
+    `pixidx`, which contains the index of the HEALPix pixel observed by each
+    sample (RING scheme, or NESTED if `nest` is ``True``). The indexes are
+    computed together with the pointings, and they are the same as the ones
+    returned by ``healpy.ang2pix``. (When the attitude is interpolated, the
+    pixels are computed by ``healpy.ang2pix`` from the interpolated angles.)
+
+    To simulate many horns at once, pass their rotation quaternions in
+    `horn_offsets` (see :func:`horn_offsets` and
+    :func:`compute_focal_plane_pointings`); in this case `dir_vec` is
+    ignored. The attitude of the boresight is computed only once per sample,
+    and the callback receives a block with shape (horns, samples, 4) in
+    `pointings`, the direction of each horn (Nx3 matrix) in `dir_vec`, and,
+    if `nside` is specified, a (horns, samples) block in `pixidx`. This mode
+    does not support interpolation. Apart from the boresight, the pointings
+    differ from the ones computed with `dir_vec` set to the direction of
+    each horn, as the first wheel turns the focal plane around the
+    boresight and the polarization axes are rotated with the horns (see
+    :func:`compute_focal_plane_pointings`).
+
+    Each chunk is a self-contained time range, so the chunks can be computed
+    in parallel:
+
+    - If `comm` is an MPI communicator, the chunks are split among its
+      processes in a round-robin fashion (chunk ``i`` goes to rank
+      ``i % comm.size``). Each process calls `tod_callback` only for its own
+      chunks, so that each process writes its own files. The maximum
+      interpolation error is computed over all the processes.
+
+    - If `num_of_processes` is greater than one, the chunks (of this MPI
+      process, if `comm` is given) are computed by a pool of local
+      processes. In this case `tod_callback` must be picklable (e.g., a
+      :class:`~stripeline.scanning.TodWriter`, but not an
+      :class:`~stripeline.scanning.AsyncTodWriter`), and it is called by the
+      processes in the pool, in no particular order. The processes are
+      started using the "spawn" method, so the module defining the callback
+      must be importable. Since the compiled kernels use OpenMP, consider
+      setting ``OMP_NUM_THREADS``.
+
+    The result does not depend on how the chunks are distributed. (The noise
+    added by :class:`stripeline.stripsim.TodWriter` only depends on the
+    index of each sample, not on the chunk containing it.)
     '''
-    x_vec = np.array([1, 0, 0])
-    z_vec = np.array([0, 0, 1])
+    interpolate = (decimation is not None) or (max_error_arcsec is not None)
+    max_error = 0.0
+    if nside is not None:
+        _check_nside(nside, nest)
+
+    if horn_offsets is not None:
+        if interpolate:
+            raise ValueError('interpolation is not supported when '
+                             'horn_offsets is specified')
+
+        horn_offsets = np.atleast_2d(np.asarray(horn_offsets,
+                                                dtype=np.float64))
+        dir_vec = _rotate_boresight(horn_offsets)
 
     chunks = timetools.split_time_range(time_length=scanning.overall_time_s,
                                         num_of_chunks=num_of_chunks,
                                         sampfreq=scanning.sampling_frequency_hz,
                                         time0=time0_s)
-    for chunk_idx, cur_chunk in enumerate(chunks):
-        start_time, samples_per_chunk = cur_chunk
-
-        time_vec = start_time + \
-            np.arange(samples_per_chunk) / scanning.sampling_frequency_hz
-
-        # Determine the angle of each wheel (the second wheel is the simplest)
-        wheel1_angle = np.deg2rad(scanning.wheel1_angle0_deg) + time_to_rot_angle(
-            time_vec, scanning.wheel1_rpm)
-        wheel3_angle = np.deg2rad(scanning.wheel3_angle0_deg) + time_to_rot_angle(
-            time_vec, scanning.wheel3_rpm)
-
-        tile_dir = np.reshape(np.tile(dir_vec, time_vec.size), (-1, 3))
-        tile_x = np.reshape(np.tile(x_vec, time_vec.size), (-1, 3))
-        tile_z = np.reshape(np.tile(z_vec, time_vec.size), (-1, 3))
-        # Build the wheel quaternions
-        qwheel1 = q.qfromaxisangle(tile_dir, wheel1_angle)
-        qwheel2 = np.reshape(
-            np.tile(
-                q.qfromaxisangle(
-                    [x_vec], [np.deg2rad(scanning.wheel2_angle0_deg)]),
-                time_vec.size), (-1, 4))
-        qwheel3 = q.qfromaxisangle(tile_z, wheel3_angle)
-
-        # This is in the ground's reference frame
-        ground_quat = q.qmul(qwheel3, q.qmul(qwheel2, qwheel1))
-
-        # Now we convert from the ground reference frame to the Earth's centre
-        location_quat = np.reshape(
-            np.tile(
-                q.qfromaxisangle(
-                    [x_vec], [np.deg2rad(90.0 - scanning.latitude_deg)]),
-                time_vec.size), (-1, 4))
-        earth_rot_quat = q.qfromaxisangle(tile_z,
-                                          2 * np.pi * time_vec / 86400.0)
-        quat = q.qmul(earth_rot_quat, q.qmul(location_quat, ground_quat))
-        dirs = q.qrotate(tile_dir, quat)
-        poldirs = q.qrotate(tile_x, quat)
-        theta, phi = healpy.vec2ang(dirs)
-
-        # The north direction for a vector v is just -dv/dtheta, as
-        # theta is the colatitude and moves along the meridian
-        thetapol, phipol = healpy.vec2ang(dirs)
-        northdir = np.column_stack((-np.cos(thetapol) * np.cos(phipol),
-                                    -np.cos(thetapol) * np.sin(phipol),
-                                    np.sin(thetapol)))
-
-        # The counterclockwise/clockwise measurement of the polarization angle
-        # is determined by the ordering of the terms in the call to "np.cross"
-        cos_psi = np.clip(np.sum(northdir * poldirs, axis=1), -1.0, 1.0)
-        cross = np.cross(northdir, poldirs)
-        sin_psi = np.clip(np.sum(cross * cross, axis=1), -1.0, 1.0)
-        psi = np.arctan2(sin_psi, cos_psi)
-        psi *= np.sign(np.sum(cross * dirs, axis=1))
-
-        if tod_callback is not None:
-            tod_callback(pointings=np.column_stack((time_vec, theta, phi, psi)),
-                         scanning=scanning,
-                         dir_vec=dir_vec,
-                         index=chunk_idx)
+    chunk_indexes = range(first_chunk, len(chunks))
+    if comm:
+        chunk_indexes = [x for x in chunk_indexes if x % comm.size == comm.rank]
+
+    # The parameters of "_run_chunk", except for the callback
+    chunk_args = [((scanning, dir_vec, chunk_idx, chunks[chunk_idx]),
+                   (decimation, max_error_arcsec, nside, nest, horn_offsets))
+                  for chunk_idx in chunk_indexes]
+    if num_of_processes > 1:
+        from concurrent.futures import ProcessPoolExecutor
+        import multiprocessing
+
+        # The processes are not forked, as the OpenMP runtime (libgomp) does
+        # not work in a child forked after the parent has used it
+        with ProcessPoolExecutor(max_workers=num_of_processes,
+                                 mp_context=multiprocessing.get_context(
+                                     'spawn'),
+                                 initializer=_init_pool_process,
+                                 initargs=(tod_callback,
+                                           instrumentation.is_enabled())) \
+                as executor:
+            futures = [executor.submit(_run_pool_chunk, *(x + y))
+                       for x, y in chunk_args]
+            # "result" raises again any exception raised by the callback
+            errors = []
+            for cur_future in futures:
+                error, statistics = cur_future.result()
+                errors.append(error)
+                instrumentation.merge(statistics)
+    else:
+        errors = [_run_chunk(*x, tod_callback, *y) for x, y in chunk_args]
+
+    max_error = max([max_error] + errors)
+    if comm:
+        from mpi4py import MPI
+        # The time spent here is mostly spent waiting for the slowest process
+        with instrumentation.timer('scanning.allreduce'):
+            max_error = comm.allreduce(max_error, op=MPI.MAX)
+
+    return max_error
+
+
+def count_written_file(file_name: str):
+    '''Update the instrumentation counters after a TOD file has been written'''
+    if instrumentation.is_enabled():
+        instrumentation.count('io.files_written')
+        instrumentation.count('io.bytes_written', os.path.getsize(file_name))
+
+
+def pixel_index_dtype(pixidx) -> str:
+    '''Return the smallest integer type able to save the pixel indexes'''
+    return 'int32' if len(pixidx) == 0 or \
+        np.max(pixidx) <= np.iinfo(np.int32).max else 'int64'
+
+
+def tod_metadata(pointings, scanning: ScanningStrategy, dir_vec, index: int):
+    '''Return the metadata saved in the chunked TOD files
+
+    The result is a dictionary with the same keys as the FITS headers written
+    by :class:`~stripeline.scanning.TodWriter`, plus the key ``SCANNING``
+    containing the YAML representation of `scanning`.'''
+
+    with io.StringIO() as yaml_text:
+        scanning.save(stream=yaml_text)
+        scanning_yaml = yaml_text.getvalue()
+
+    return {'FSTTIME': float(pointings[0, 0]),
+            'LSTTIME': float(pointings[-1, 0]),
+            'DIRX': float(dir_vec[0]),
+            'DIRY': float(dir_vec[1]),
+            'DIRZ': float(dir_vec[2]),
+            'SAMPFREQ': float(scanning.sampling_frequency_hz),
+            'SITELAT': float(scanning.latitude_deg),
+            'W1RPM': float(scanning.wheel1_rpm),
+            'W3RPM': float(scanning.wheel3_rpm),
+            'W1ANG0': float(scanning.wheel1_angle0_deg),
+            'W2ANG0': float(scanning.wheel2_angle0_deg),
+            'W3ANG0': float(scanning.wheel3_angle0_deg),
+            'TIMELEN': float(scanning.overall_time_s),
+            'TODIDX': int(index),
+            'SCANNING': scanning_yaml}
 
 
 class TodWriter:
@@ -297,23 +747,93 @@ class TodWriter:
     parameter to separate the files in chunks. The number of times `writer` is
     called depends on the parameter `num_of_chunks` passed to
     :meth:`~stripeline.scanning.generate_pointings`.
+
+    If :meth:`~stripeline.scanning.generate_pointings` is asked to compute
+    pixel indexes (parameter `nside`), they are saved in the column
+    ``PIXIDX``.
+
+    If `file_format` is ``'chunked'``, the TODs are saved using
+    :class:`stripeline.todfile.ChunkedTodWriter` instead of FITS files. The
+    time is not saved, as it is implied by the sampling frequency, and the
+    pixel indexes are saved as 32-bit integers; each column is compressed.
+    The values of the FITS keywords are saved in the metadata of the file,
+    and the scanning strategy in the key ``SCANNING``.
+
+    By default the chunked files contain the angles ``THETA`` and ``PHI``
+    even if the pixel indexes are saved too, so that the TOD can be
+    projected at any resolution. If `save_angles` is ``False``, only the
+    pixel indexes and ``PSI`` are saved: this is twice as compact, but
+    the pointings are known only up to the size of a pixel. In this case
+    you must pass the `nside` and `nest` used to compute the indexes, which
+    are saved in the metadata keys ``NSIDE`` and ``NEST`` (see
+    :class:`stripeline.timetools.ChunkedToiProvider`).
     '''
 
     def __init__(self,
                  outdir='.',
-                 file_name_mask='pointings_{index:04d}.fits'):
+                 file_name_mask='pointings_{index:04d}.fits',
+                 file_format='fits',
+                 save_angles=True,
+                 nside=None,
+                 nest=False):
+        assert file_format in ('fits', 'chunked')
+        if not save_angles:
+            if file_format != 'chunked':
+                raise ValueError('save_angles=False requires the chunked '
+                                 'file format')
+            if nside is None:
+                raise ValueError('save_angles=False requires nside')
+
         self.outdir = outdir
         self.file_name_mask = file_name_mask
+        self.file_format = file_format
+        self.save_angles = save_angles
+        self.nside = nside
+        self.nest = nest
 
     def __call__(self,
                  pointings,
                  scanning: ScanningStrategy,
                  dir_vec,
-                 index: int):
+                 index: int,
+                 pixidx=None):
         ''' Save a TOD into a FITS file'''
 
         file_name = os.path.join(self.outdir,
                                  self.file_name_mask.format(index=index))
+        if self.file_format == 'chunked':
+            if not self.save_angles and pixidx is None:
+                raise ValueError('the pixel indexes are needed when the '
+                                 'angles are not saved')
+
+            # Indexes of the angles in "pointings"
+            angles = [('THETA', 1), ('PHI', 2), ('PSI', 3)]
+            if not self.save_angles:
+                angles = angles[2:]
+            columns = [todfile.TodColumn(name, 'float64', 'rad')
+                       for name, _ in angles]
+            values = {name: pointings[:, col] for name, col in angles}
+            if pixidx is not None:
+                columns.append(todfile.TodColumn('PIXIDX',
+                                                 pixel_index_dtype(pixidx)))
+                values['PIXIDX'] = pixidx
+
+            metadata = tod_metadata(pointings, scanning, dir_vec, index)
+            if self.nside is not None:
+                metadata['NSIDE'] = int(self.nside)
+                metadata['NEST'] = bool(self.nest)
+
+            with instrumentation.timer('scanning.write_tod',
+                                       samples=len(pointings)):
+                with todfile.ChunkedTodWriter(file_name, columns,
+                                              sampfreq=scanning.sampling_frequency_hz,
+                                              first_time=pointings[0, 0],
+                                              metadata=metadata) as f:
+                    f.write(**values)
+            count_written_file(file_name)
+            log.info('file "%s" written successfully', file_name)
+            return
+
         cols = [
             fits.Column(name=name, format=fmt, unit=unit, array=arr)
             for name, fmt, unit, arr in (('TIME', 'D', 's', pointings[:, 0]),
@@ -322,6 +842,8 @@ class TodWriter:
                                          ('PHI', 'D', 'rad', pointings[:, 2]),
                                          ('PSI', 'D', 'rad', pointings[:, 3]))
         ]
+        if pixidx is not None:
+            cols.append(fits.Column(name='PIXIDX', format='K', array=pixidx))
         hdu = fits.BinTableHDU.from_columns(cols, name='TOD')
         hdu.header['FSTTIME'] = (
             pointings[0, 0], 'Time of the first sample in the file [s]')
@@ -354,10 +876,96 @@ class TodWriter:
             primhdu = fits.PrimaryHDU(data=raw_bytes)
 
         hdulist = fits.HDUList([primhdu, hdu])
-        hdulist.writeto(file_name, clobber=True)
+        with instrumentation.timer('scanning.write_tod',
+                                   samples=len(pointings)):
+            hdulist.writeto(file_name, clobber=True)
+        count_written_file(file_name)
         log.info('file "%s" written successfully', file_name)
 
 
+class AsyncTodWriter:
+    '''Run a TOD callback in a background thread.
+
+    This class wraps a callback for :meth:`~stripeline.scanning.generate_pointings`
+    (e.g., a :class:`~stripeline.scanning.TodWriter`): each call puts the
+    chunk in a queue and returns immediately, and a worker thread passes the
+    chunks to the callback in the same order. In this way, the next chunk is
+    computed while the previous one is being written to disk. The compiled
+    kernels release the GIL, and so do most of the time-consuming parts of
+    FITS writing (e.g., gzip compression).
+
+    At most `max_pending` chunks wait in the queue: when it is full, the
+    caller blocks until the worker has finished with the oldest chunk, so
+    that no more than ``max_pending + 1`` chunks are kept in memory. If the
+    callback raises an exception, the remaining chunks are dropped, and the
+    exception is raised again by the next call or by :meth:`close`.
+
+    Use the object as a context manager, so that all the chunks have been
+    written when the ``with`` block ends::
+
+        with AsyncTodWriter(TodWriter(outdir='/storage')) as writer:
+            generate_pointings(..., tod_callback=writer)
+    '''
+
+    def __init__(self, callback, max_pending=1):
+        assert max_pending > 0
+        self.callback = callback
+        self._queue = queue.Queue(maxsize=max_pending)
+        self._error = None
+        self._thread = threading.Thread(target=self._worker, daemon=True)
+        self._thread.start()
+
+    def _worker(self):
+        while True:
+            kwargs = self._queue.get()
+            if kwargs is None:
+                return
+
+            if self._error is None:
+                try:
+                    self.callback(**kwargs)
+                except Exception as exc:
+                    self._error = exc
+
+    def _raise_error(self):
+        if self._error is not None:
+            exc, self._error = self._error, None
+            raise exc
+
+    def __call__(self, **kwargs):
+        '''Queue a chunk; the parameters are passed to the callback.'''
+        self._raise_error()
+        if not self._thread.is_alive():
+            raise RuntimeError('the writer has already been closed')
+
+        self._queue.put(kwargs)
+
+    def close(self):
+        '''Wait until all the queued chunks have been written.
+
+        If the callback has raised an exception, it is raised again here.'''
+        if self._thread.is_alive():
+            self._queue.put(None)
+            self._thread.join()
+
+        self._raise_error()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        if exc_type is None:
+            self.close()
+        else:
+            # Do not hide the exception that is being raised
+            try:
+                self.close()
+            except Exception:
+                log.exception('error while writing the TOD')
+
+        return False
+
+
 @click.command()
 @click.argument('output_path')
 @click.option('--input-file',
@@ -416,9 +1024,49 @@ class TodWriter:
               help='Pointing direction of the main beam with respect to '
               'the focal plane (3D vector, written as a comma-separated list '
               'of 3 numbers)')
+@click.option('--max-error',
+              'max_error_arcsec',
+              type=float,
+              default=None,
+              help='Interpolate the attitude of the instrument, keeping the '
+              'pointing error below this value [arcsec]')
+@click.option('--async-write',
+              'async_write',
+              is_flag=True,
+              help='Write each chunk to disk while the next one is being '
+              'computed')
+@click.option('--format',
+              'file_format',
+              type=click.Choice(['fits', 'chunked']),
+              default='fits',
+              help='Format of the output files')
+@click.option('--pixels-only',
+              'pixels_nside',
+              type=int,
+              default=None,
+              help='Save the HEALPix pixel indexes (RING scheme) at this '
+              'NSIDE instead of the angles THETA and PHI (only with '
+              '--format chunked)')
+@click.option('--mpi',
+              'use_mpi',
+              is_flag=True,
+              help='Split the chunks among the MPI processes')
+@click.option('--processes',
+              'num_of_processes',
+              type=int,
+              default=1,
+              help='Number of local processes computing the chunks in '
+              'parallel')
+@click.option('--instrumentation',
+              'instrumentation_file',
+              type=str,
+              default=None,
+              help='Save the time spent in each stage and the amount of '
+              'data processed in this JSON file')
 def main(output_path, input_file, wheel1_rpm, wheel3_rpm, wheel1_angle0, wheel2_angle0,
          wheel3_angle0, latitude, time_length, sampfreq, num_of_chunks,
-         direction):
+         direction, max_error_arcsec, async_write, file_format,
+         pixels_nside, use_mpi, num_of_processes, instrumentation_file):
     '''This function is called when the script is ran from the command line.'''
 
     log.basicConfig(
@@ -437,6 +1085,22 @@ def main(output_path, input_file, wheel1_rpm, wheel3_rpm, wheel1_angle0, wheel2_
                   'three floating-point numbers (es., "0,0,1")')
         sys.exit(1)
 
+    if async_write and num_of_processes > 1:
+        log.error('--async-write cannot be used together with --processes')
+        sys.exit(1)
+
+    if pixels_nside is not None and file_format != 'chunked':
+        log.error('--pixels-only requires --format chunked')
+        sys.exit(1)
+
+    comm = None
+    if use_mpi:
+        from mpi4py import MPI
+        comm = MPI.COMM_WORLD
+
+    if instrumentation_file is not None:
+        instrumentation.enable(output_file=instrumentation_file, comm=comm)
+
     scanning = ScanningStrategy()
     if input_file is not None:
         with open(input_file, 'rt') as f:
@@ -461,11 +1125,31 @@ def main(output_path, input_file, wheel1_rpm, wheel3_rpm, wheel1_angle0, wheel2_
 
     scanning.validate()
 
-    writer = TodWriter(output_path)
-    generate_pointings(scanning=scanning,
-                       dir_vec=direction,
-                       num_of_chunks=num_of_chunks,
-                       tod_callback=writer)
+    if file_format == 'chunked':
+        writer = TodWriter(output_path,
+                           file_name_mask='pointings_{index:04d}.stod',
+                           file_format=file_format,
+                           save_angles=pixels_nside is None,
+                           nside=pixels_nside)
+    else:
+        writer = TodWriter(output_path)
+    if async_write:
+        writer = AsyncTodWriter(writer)
+
+    try:
+        max_error = generate_pointings(scanning=scanning,
+                                       dir_vec=direction,
+                                       num_of_chunks=num_of_chunks,
+                                       tod_callback=writer,
+                                       max_error_arcsec=max_error_arcsec,
+                                       comm=comm,
+                                       num_of_processes=num_of_processes,
+                                       nside=pixels_nside)
+    finally:
+        if async_write:
+            writer.close()
+    if max_error_arcsec is not None:
+        log.info('maximum pointing error: %.3g arcsec', max_error)
 
 
 if __name__ == '__main__':
@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+# -*- encoding: utf-8 -*-
+
+'''Sky maps used to simulate the output of the detectors
+
+A :class:`SkyModel` keeps the I, Q, and U maps in one matrix with one row per
+pixel, so that the three Stokes parameters of a pixel are next to each other
+in memory. When a TOD is simulated, each sample needs one of these rows,
+and with large maps (e.g., NSIDE 2048, 50 million pixels) almost every
+sample finds it out of the cache: using this layout, one cache miss is
+enough instead of three. The maps can also be stored
+
+- in the NESTED scheme, where pixels close on the sky tend to be close in
+  memory, so that consecutive samples along a scan often share cache lines
+  and memory pages;
+- as 32-bit floating-point numbers, which halves the size of the maps. (The
+  computation is still done in double precision.)
+
+In MPI programs, the processes running on the same node can share one
+read-only copy of the maps, instead of keeping one copy each (see
+:meth:`SkyModel.read`).
+'''
+
+import healpy
+import numpy as np
+
+# Number of values stored for each pixel (I, Q, U)
+NUM_OF_STOKES_PARAMS = 3
+
+SUPPORTED_DTYPES = (np.dtype('float32'), np.dtype('float64'))
+
+
+def node_communicator(comm):
+    '''Return a communicator containing the processes in `comm` that run on
+    the same node as this process (and can therefore share memory)'''
+    from mpi4py import MPI
+
+    return comm.Split_type(MPI.COMM_TYPE_SHARED, key=comm.rank)
+
+
+class SkyModel:
+    '''Maps of the Stokes parameters I, Q, and U, interleaved per pixel
+
+    The maps are stored in the field :attr:`iqu`, a read-only C-contiguous
+    matrix with one row for each pixel and three columns (I, Q, U). The
+    pixels are ordered according to the RING scheme, or the NESTED scheme if
+    `nest` is ``True``: the pixel indexes passed to :meth:`sample` and to the
+    TOD simulator must use the same scheme (see the parameter `nest` of
+    :func:`stripeline.scanning.generate_pointings`). `dtype` can be either
+    ``'float64'`` or ``'float32'``.
+
+    Objects are usually built using :meth:`from_maps` or :meth:`read`. If
+    `node_comm` is not ``None`` (see :func:`node_communicator`), the matrix
+    is allocated in memory shared by the processes in that communicator, and
+    it is filled by :meth:`set_maps`. Shared maps must be released by calling
+    :meth:`close` on all the processes (this does not free `node_comm`).
+    '''
+
+    def __init__(self, nside: int, nest=False, dtype='float64', node_comm=None):
+        self.nside = nside
+        self.nest = nest
+        self.dtype = np.dtype(dtype)
+        if self.dtype not in SUPPORTED_DTYPES:
+            raise ValueError('unsupported type "{0}" for the sky maps'
+                             .format(dtype))
+
+        self.num_of_pixels = healpy.nside2npix(nside)
+        self._node_comm = node_comm
+        self._owns_node_comm = False
+        self._window = None
+
+        shape = (self.num_of_pixels, NUM_OF_STOKES_PARAMS)
+        if node_comm is None:
+            self.iqu = np.zeros(shape, dtype=self.dtype)
+        else:
+            from mpi4py import MPI
+
+            # Only the first process of the node allocates the memory; the
+            # other ones get a pointer to it
+            nbytes = self.num_of_pixels * NUM_OF_STOKES_PARAMS * \
+                self.dtype.itemsize if node_comm.rank == 0 else 0
+            self._window = MPI.Win.Allocate_shared(nbytes,
+                                                   self.dtype.itemsize,
+                                                   comm=node_comm)
+            buffer, itemsize = self._window.Shared_query(0)
+            assert itemsize == self.dtype.itemsize
+            self.iqu = np.ndarray(buffer=buffer, dtype=self.dtype,
+                                  shape=shape)
+
+    @property
+    def is_writer(self) -> bool:
+        '''``True`` if this process must provide the maps to :meth:`set_maps`'''
+        return self._node_comm is None or self._node_comm.rank == 0
+
+    def set_maps(self, sky_i, sky_q, sky_u, input_nest=False):
+        '''Copy the I, Q, and U maps into the matrix.
+
+        The maps use the RING scheme, or the NESTED scheme if `input_nest`
+        is ``True``; they are reordered if needed. If the memory is shared,
+        this must be called by all the processes in the node communicator,
+        but only the one for which :attr:`is_writer` is true needs to pass
+        the maps (the others can pass ``None``). The matrix becomes
+        read-only.'''
+
+        if self.is_writer:
+            self.iqu.flags.writeable = True
+            for col, cur_map in enumerate((sky_i, sky_q, sky_u)):
+                cur_map = np.asarray(cur_map)
+                if len(cur_map) != self.num_of_pixels:
+                    raise ValueError('the maps must have {0} pixels'
+                                     .format(self.num_of_pixels))
+
+                if input_nest != self.nest:
+                    cur_map = healpy.reorder(
+                        cur_map,
+                        inp='NESTED' if input_nest else 'RING',
+                        out='NESTED' if self.nest else 'RING')
+                self.iqu[:, col] = cur_map
+
+        if self._node_comm is not None:
+            # The other processes must not read the maps before they have
+            # been written
+            self._node_comm.Barrier()
+
+        self.iqu.flags.writeable = False
+
+    @classmethod
+    def from_maps(cls, sky_i, sky_q, sky_u, nest=False, dtype='float64',
+                  input_nest=False):
+        '''Build a sky model from three Healpix maps.
+
+        The maps use the RING scheme, or the NESTED scheme if `input_nest`
+        is ``True``. The meaning of `nest` and `dtype` is the same as in the
+        constructor.'''
+
+        result = cls(healpy.get_nside(sky_i), nest=nest, dtype=dtype)
+        result.set_maps(sky_i, sky_q, sky_u, input_nest=input_nest)
+        return result
+
+    @classmethod
+    def read(cls, file_name: str, nest=False, dtype='float64', comm=None):
+        '''Read the I, Q, and U maps from the first three columns of a FITS
+        file.
+
+        If `comm` is an MPI communicator, the maps are kept in shared
+        memory: they are read by one process for each node, and the other
+        processes on the same node use its copy. This is a collective
+        operation.'''
+
+        node_comm = node_communicator(comm) if comm is not None else None
+
+        maps = None
+        nside = None
+        if node_comm is None or node_comm.rank == 0:
+            maps = healpy.read_map(file_name, field=(0, 1, 2), nest=nest)
+            nside = healpy.get_nside(maps[0])
+
+        if node_comm is not None:
+            nside = node_comm.bcast(nside, root=0)
+            maps = maps if maps is not None else (None, None, None)
+
+        result = cls(nside, nest=nest, dtype=dtype, node_comm=node_comm)
+        result._owns_node_comm = node_comm is not None
+        # "read_map" has already converted the maps to the right scheme
+        result.set_maps(*maps, input_nest=nest)
+        return result
+
+    def pixel_index(self, theta, phi):
+        '''Return the indexes of the rows of :attr:`iqu` corresponding to
+        the directions (`theta`, `phi`)'''
+        return healpy.ang2pix(self.nside, theta, phi, nest=self.nest)
+
+    def sample(self, pixidx):
+        '''Return a Nx3 matrix containing the I, Q, and U values of the
+        pixels in `pixidx`'''
+        return self.iqu[pixidx]
+
+    def close(self):
+        '''Release the shared memory used by the maps.
+
+        This is a collective operation on the node communicator. The object
+        cannot be used any longer.'''
+        self.iqu = None
+        if self._window is not None:
+            self._window.Free()
+            self._window = None
+        if self._owns_node_comm:
+            self._node_comm.Free()
+        self._node_comm = None
+
+    def __getstate__(self):
+        # Shared memory cannot be passed to another process: the copy
+        # (e.g., in a process pool) gets a private array
+        state = self.__dict__.copy()
+        state['iqu'] = np.array(self.iqu)
+        for key in ('_window', '_node_comm', '_owns_node_comm'):
+            del state[key]
+        return state
+
+    def __setstate__(self, state):
+        self.__dict__.update(state)
+        self._node_comm = None
+        self._owns_node_comm = False
+        self._window = None
+        self.iqu.flags.writeable = False
@@ -2,66 +2,157 @@
 # -*- encoding: utf-8 -*-
 
 import numpy as np
+import base64
 import click
-import healpy
 import os
 import io
 import logging as log
+import sys
 from astropy.io import fits
-from typing import Any, Dict, List
-import scanning
-import paramfile
+from typing import Any, Dict, List, Union
+import stripeline.scanning as scanning
+import stripeline.paramfile as paramfile
+import stripeline.instrumentation as instrumentation
+import stripeline.noisegen as noisegen
+import stripeline.skymodel as skymodel
+import stripeline.todsim as todsim
+import stripeline.todfile as todfile
+
+# Imported by name, as the parameter "scanning" of TodWriter.__call__ hides
+# the module
+from stripeline.scanning import count_written_file
+
+
+# Names of the detectors of a polarimeter: the noise of the k-th detector uses
+# the k-th stream of the counter-based generator
+DETECTOR_NAMES = ('Q1', 'Q2', 'U1', 'U2')
+
+
+def draw_noise_seed() -> int:
+    '''Return a random seed for the noise generator
+
+    The seed comes from NumPy's global generator, so that it can be fixed by
+    calling ``np.random.seed``.'''
+    return int(np.random.randint(0, 2**31))
+
+
+def noise_state_snapshot(seed: int, first_sample: int) -> str:
+    '''Return the state of the noise generator at some sample as a string
+
+    The result is the snapshot of a :class:`stripeline.noisegen.CounterRNG`,
+    encoded in base64 so that it can be saved in a FITS header. Use
+    :func:`restore_noise_state` to decode it.'''
+    rng = noisegen.CounterRNG(seed=seed)
+    rng.seek(first_sample)
+    return base64.b64encode(rng.snapshot()).decode('ascii')
+
+
+def restore_noise_state(header, det_idx: Union[int, str]) -> noisegen.CounterRNG:
+    '''Rebuild the noise generator of one detector from the header of a TOD file
+
+    The header must contain the ``RNGSTATE`` keyword written by
+    :class:`TodWriter`. The detector is given either by its index or by its
+    name (see :data:`DETECTOR_NAMES`). The generator is positioned at the
+    first sample of the file: the numbers it produces are the noise of the
+    detector, before it is multiplied by the RMS.'''
+    if isinstance(det_idx, str):
+        det_idx = DETECTOR_NAMES.index(det_idx)
+
+    rng = noisegen.CounterRNG()
+    rng.restore(base64.b64decode(header['RNGSTATE']))
+    rng.stream_id = det_idx
+    return rng
 
 
 class TodWriter:
+    '''Simulate the output of a polarimeter and save it in a file.
+
+    This is a callback for :func:`stripeline.scanning.generate_pointings`.
+    The sky is either given by three RING maps (`sky_map_I`, `sky_map_Q`,
+    and `sky_map_U`), or by a :class:`stripeline.skymodel.SkyModel` passed
+    as `sky_map_I`, with the other two maps set to ``None``. In the latter
+    case, the pixel indexes passed by
+    :func:`stripeline.scanning.generate_pointings` must use the scheme of
+    the model (see its field `nest`).
+
+    The white noise of the detectors is drawn using the seed in the
+    parameter ``noise_seed`` (an integer in the range [0, 2^31)). If it is
+    missing, a random seed is used, so that every simulation gets a
+    different realization. In both cases, the seed is saved in the keyword
+    ``RNGSEED`` of each file, together with the state of the generator
+    (``RNGSTATE``).'''
+
     def __init__(self,
                  sky_map_I,
                  sky_map_Q,
                  sky_map_U,
                  parameters: Dict[str, Any],
                  outdir='.',
-                 file_name_mask='TOI_{index:04d}.fits'):
-        self.sky_map_I = sky_map_I
-        self.sky_map_Q = sky_map_Q
-        self.sky_map_U = sky_map_U
+                 file_name_mask='TOI_{index:04d}.fits',
+                 file_format='fits'):
+        assert file_format in ('fits', 'chunked')
+        # Convert the maps once, so that the compiled kernel does not need to
+        # make a copy of them for every chunk
+        if isinstance(sky_map_I, skymodel.SkyModel):
+            assert sky_map_Q is None and sky_map_U is None
+            self.sky_model = sky_map_I
+        else:
+            self.sky_model = skymodel.SkyModel.from_maps(sky_map_I, sky_map_Q,
+                                                         sky_map_U)
         self.parameters = parameters
+        self.noise_sigma = np.array([parameters['wn_sigma_det_{0}_k'.format(x)]
+                                     for x in DETECTOR_NAMES],
+                                    dtype='float64')
+        self.noise_seed = parameters.get('noise_seed')
+        if self.noise_seed is None:
+            self.noise_seed = draw_noise_seed()
+            log.info('using the random seed %d for the noise', self.noise_seed)
         self.outdir = outdir
         self.file_name_mask = file_name_mask
+        self.file_format = file_format
 
     def __call__(self,
                  pointings,
                  scanning: scanning.ScanningStrategy,
                  dir_vec,
-                 index: int):
+                 index: int,
+                 pixidx=None):
         ''' Save a TOD into a FITS file'''
 
         file_name = os.path.join(self.outdir,
                                  self.file_name_mask.format(index=index))
-        pixidx = healpy.ang2pix(healpy.get_nside(
-            self.sky_map_Q), pointings[:, 1], pointings[:, 2])
-
-        TOI_I_sky = self.sky_map_I[pixidx]
-        TOI_Q_sky = self.sky_map_Q[pixidx]
-        TOI_U_sky = self.sky_map_U[pixidx]
-
-        TwoPsi = pointings[:, 3] * 2
-        TOI_I_beam = TOI_I_sky
-        TOI_Q_beam = TOI_Q_sky * np.cos(TwoPsi) - TOI_U_sky * np.sin(TwoPsi)
-        TOI_U_beam = TOI_Q_sky * np.sin(TwoPsi) + TOI_U_sky * np.cos(TwoPsi)
-
-        det_output_Q1 = 1 / 4 * (TOI_I_beam + TOI_Q_beam)
-        det_output_Q2 = 1 / 4 * (TOI_I_beam - TOI_Q_beam)
-        det_output_U1 = 1 / 4 * (TOI_I_beam + TOI_U_beam)
-        det_output_U2 = 1 / 4 * (TOI_I_beam - TOI_U_beam)
-
-        det_output_Q1 += np.random.normal(
-            scale=self.parameters['wn_sigma_det_Q1_k'], size=len(det_output_Q1))
-        det_output_Q2 += np.random.normal(
-            scale=self.parameters['wn_sigma_det_Q2_k'], size=len(det_output_Q2))
-        det_output_U1 += np.random.normal(
-            scale=self.parameters['wn_sigma_det_U1_k'], size=len(det_output_U1))
-        det_output_U2 += np.random.normal(
-            scale=self.parameters['wn_sigma_det_U2_k'], size=len(det_output_U2))
+        if pixidx is None:
+            with instrumentation.timer('stripsim.ang2pix',
+                                       samples=len(pointings)):
+                pixidx = self.sky_model.pixel_index(pointings[:, 1],
+                                                    pointings[:, 2])
+        elif len(pixidx) > 0 and (pixidx.min() < 0 or
+                                  pixidx.max() >= self.sky_model.num_of_pixels):
+            # The kernels do not check the indexes they use to read the maps
+            # (e.g., "nside" in generate_pointings might not match the maps)
+            raise ValueError('the pixel indexes must be in the range '
+                             '[0, {0})'.format(self.sky_model.num_of_pixels))
+
+        # The noise of each sample depends only on its index, so that the
+        # result does not depend on the way the TOD is split in chunks
+        first_sample = int(round(pointings[0, 0] *
+                                 scanning.sampling_frequency_hz))
+        det_output = np.empty((4, len(pixidx)))
+        if self.sky_model.dtype == np.dtype('float32'):
+            kernel = todsim.tod_polarimeter_iqu_f32
+        else:
+            kernel = todsim.tod_polarimeter_iqu
+        with instrumentation.timer('stripsim.tod_polarimeter',
+                                   samples=det_output.size,
+                                   nbytes=det_output.nbytes):
+            kernel(self.sky_model.iqu, pixidx, pointings, self.noise_sigma,
+                   self.noise_seed, first_sample, det_output)
+        det_output_Q1, det_output_Q2, det_output_U1, det_output_U2 = det_output
+
+        if self.file_format == 'chunked':
+            self._write_chunked(file_name, pointings, scanning, dir_vec, index,
+                                pixidx, det_output, first_sample)
+            return
 
         cols = [
             fits.Column(name=name, format=fmt, unit=unit, array=arr)
@@ -100,6 +191,13 @@ class TodWriter:
         hdu.header['TIMELEN'] = (
             scanning.overall_time_s, 'Time span of the *whole* sim [s]')
         hdu.header['TODIDX'] = (index, '0-based index of this file')
+        hdu.header['FSTSAMP'] = (first_sample,
+                                 'Index of the first sample in the file')
+        hdu.header['RNGSEED'] = (self.noise_seed,
+                                 'Seed of the noise generator')
+        hdu.header['RNGSTATE'] = (noise_state_snapshot(self.noise_seed,
+                                                       first_sample),
+                                  'State of the noise generator (base64)')
 
         with io.StringIO() as primary_data:
             scanning.save(stream=primary_data)
@@ -107,7 +205,46 @@ class TodWriter:
             primhdu = fits.PrimaryHDU(data=raw_bytes)
 
         hdulist = fits.HDUList([primhdu, hdu])
-        hdulist.writeto(file_name, clobber=True)
+        with instrumentation.timer('stripsim.write_tod',
+                                   samples=len(pixidx)):
+            hdulist.writeto(file_name, clobber=True)
+        count_written_file(file_name)
+        log.info('file "%s" written successfully', file_name)
+
+    def _write_chunked(self, file_name, pointings, strategy, dir_vec, index,
+                       pixidx, det_output, first_sample):
+        '''Save a TOD using :class:`stripeline.todfile.ChunkedTodWriter`
+
+        The pointings are replaced by the indexes of the pixels in the sky
+        maps, and the polarization angle and the detector outputs are saved
+        as 32-bit floating-point numbers.'''
+
+        columns = [todfile.TodColumn('PIXIDX', scanning.pixel_index_dtype(pixidx)),
+                   todfile.TodColumn('PSI', 'float32', 'rad')]
+        columns += [todfile.TodColumn(x, 'float32', 'K')
+                    for x in ('DETQ1', 'DETQ2', 'DETU1', 'DETU2')]
+
+        metadata = scanning.tod_metadata(pointings, strategy, dir_vec, index)
+        metadata['NSIDE'] = self.sky_model.nside
+        metadata['NEST'] = self.sky_model.nest
+        metadata['FSTSAMP'] = first_sample
+        metadata['RNGSEED'] = self.noise_seed
+        metadata['RNGSTATE'] = noise_state_snapshot(self.noise_seed,
+                                                    first_sample)
+
+        with instrumentation.timer('stripsim.write_tod',
+                                   samples=len(pixidx)):
+            with todfile.ChunkedTodWriter(file_name, columns,
+                                          sampfreq=strategy.sampling_frequency_hz,
+                                          first_time=pointings[0, 0],
+                                          metadata=metadata) as f:
+                f.write(PIXIDX=pixidx,
+                        PSI=pointings[:, 3],
+                        DETQ1=det_output[0],
+                        DETQ2=det_output[1],
+                        DETU1=det_output[2],
+                        DETU2=det_output[3])
+        count_written_file(file_name)
         log.info('file "%s" written successfully', file_name)
 
 
@@ -115,19 +252,84 @@ class TodWriter:
 @click.argument('parameter_file', nargs=-1)
 @click.argument('sky_map_filename')
 @click.argument('output_path')
-def main(parameter_file, sky_map_filename, output_path):
+@click.option('--num-of-chunks', default=1, type=int,
+              help='Number of files to produce (default: 1)')
+@click.option('--first-chunk', default=0, type=int,
+              help='Index of the first file to produce, to resume an '
+              'interrupted simulation (default: 0)')
+@click.option('--async-write', 'async_write', is_flag=True,
+              help='Write each file while the next chunk is being computed')
+@click.option('--format', 'file_format', default='fits',
+              type=click.Choice(['fits', 'chunked']),
+              help='Format of the output files (default: fits)')
+@click.option('--mpi', 'use_mpi', is_flag=True,
+              help='Split the files to produce among the MPI processes. The '
+              'processes on the same node share one copy of the sky map')
+@click.option('--nest', 'nest', is_flag=True,
+              help='Keep the sky map in NESTED order, which makes sampling '
+              'large maps faster')
+@click.option('--single-precision', 'single_precision', is_flag=True,
+              help='Keep the sky map in single precision, to save memory')
+@click.option('--processes', 'num_of_processes', default=1, type=int,
+              help='Number of local processes producing the files in '
+              'parallel (default: 1)')
+@click.option('--instrumentation', 'instrumentation_file', default=None,
+              type=str,
+              help='Save the time spent in each stage and the amount of '
+              'data processed in this JSON file')
+def main(parameter_file, sky_map_filename, output_path, num_of_chunks,
+         first_chunk, async_write, file_format, use_mpi, nest,
+         single_precision, num_of_processes, instrumentation_file):
+
+    if async_write and num_of_processes > 1:
+        log.error('--async-write cannot be used together with --processes')
+        sys.exit(1)
+
+    comm = None
+    if use_mpi:
+        from mpi4py import MPI
+        comm = MPI.COMM_WORLD
+
+    if instrumentation_file is not None:
+        instrumentation.enable(output_file=instrumentation_file, comm=comm)
 
     strategy = scanning.ScanningStrategy()
     parameters = paramfile.load_yaml_files(parameter_file)
     strategy.load(parameters)
+    if comm is not None and parameters.get('noise_seed') is None:
+        # All the processes must use the same seed, otherwise the noise
+        # would depend on how the chunks are split among them
+        parameters['noise_seed'] = comm.bcast(draw_noise_seed(), root=0)
 
     # 0 = Temperature, 1 = Stokes Parameter Q, 2=Stokes Parameter U
-    sky_map = healpy.read_map(sky_map_filename, field=(0, 1, 2))
+    sky_model = skymodel.SkyModel.read(sky_map_filename, nest=nest,
+                                       dtype='float32' if single_precision
+                                       else 'float64',
+                                       comm=comm)
+
+    if file_format == 'chunked':
+        writer = TodWriter(sky_model, None, None, parameters,
+                           output_path, file_name_mask='TOI_{index:04d}.stod',
+                           file_format=file_format)
+    else:
+        writer = TodWriter(sky_model, None, None, parameters, output_path)
+    if async_write:
+        writer = scanning.AsyncTodWriter(writer)
 
-    writer = TodWriter(sky_map[0], sky_map[1],
-                       sky_map[2], parameters, output_path)
+    # The pixel indexes are computed by the pointing kernel, using the same
+    # scheme as the sky model
+    try:
+        scanning.generate_pointings(strategy, [0, 0, 1], num_of_chunks, writer,
+                                    first_chunk=first_chunk,
+                                    nside=sky_model.nside,
+                                    nest=sky_model.nest,
+                                    comm=comm,
+                                    num_of_processes=num_of_processes)
+    finally:
+        if async_write:
+            writer.close()
 
-    scanning.generate_pointings(strategy, [0, 0, 1], 1, writer)
+    sky_model.close()
 
 
 if __name__ == '__main__':
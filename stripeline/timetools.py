@@ -1,10 +1,18 @@
 #!/usr/bin/env python3
 # -*- encoding: utf-8 -*-
 
-from collections import namedtuple
+from collections import namedtuple, OrderedDict
+from itertools import groupby
+import json
+import os
+import queue
+import threading
 from typing import List, Union
+import healpy
 import numpy as np
 from astropy.io import fits
+import stripeline.instrumentation as instrumentation
+import stripeline.todfile as todfile
 
 
 TimeChunk = namedtuple('TimeChunk', 'start_time num_of_samples')
@@ -41,6 +49,71 @@ DET_NAMES = {'Q1': 0,
              }
 
 
+ToiBlock = namedtuple(
+    'ToiBlock', ['first_sample', 'time', 'theta', 'phi', 'psi', 'signals']
+)
+
+# Names of the quantities that can be passed to ToiProvider.load: the
+# pointings are the colatitude and the longitude, and the signals are the
+# outputs of the four detectors
+TOI_QUANTITIES = ('time', 'pointings', 'psi', 'signals')
+
+
+def _prefetch_iterator(iterable):
+    '''Iterate over `iterable`, computing the next element in a thread.
+
+    While the caller processes one element, a background thread produces
+    the next one. Exceptions raised by the thread are raised again in the
+    caller.'''
+
+    items = queue.Queue(maxsize=1)
+    stop = threading.Event()
+    end_marker = object()
+
+    def put(item) -> bool:
+        # Wait until there is room in the queue, unless the caller stops in
+        # the meantime: return False in this case
+        while not stop.is_set():
+            try:
+                items.put(item, timeout=0.1)
+                return True
+            except queue.Full:
+                pass
+        return False
+
+    def producer():
+        iterator = iter(iterable)
+        try:
+            # Check "stop" before asking for the next element, so that no
+            # element is computed after the caller has stopped
+            while not stop.is_set():
+                try:
+                    cur_item = next(iterator)
+                except StopIteration:
+                    put((end_marker, None))
+                    return
+                if not put((cur_item, None)):
+                    return
+        except Exception as exc:
+            put((end_marker, exc))
+
+    thread = threading.Thread(target=producer, daemon=True)
+    thread.start()
+    try:
+        while True:
+            cur_item, exc = items.get()
+            if exc is not None:
+                raise exc
+            if cur_item is end_marker:
+                return
+            yield cur_item
+    finally:
+        # If the caller has stopped early, the thread notices it at its next
+        # attempt to put an element in the queue
+        stop.set()
+        thread.join()
+
+
 class ToiProvider:
     '''Load a TOI and split it evenly among MPI processes.
 
@@ -56,8 +129,19 @@ class ToiProvider:
     :func:`stripeline.timetools.ToiProvider.get_pointings`, and
     :func:`stripeline.timetools.ToiProvider.get_pixel_index` can be used by
     processes to read the chunk of data which belongs to each.
+
+    The pixel indexes returned by
+    :func:`stripeline.timetools.ToiProvider.get_pixel_index` are cached, so
+    that running several map-makers with the same resolution does not
+    recompute them. At most :attr:`PIXIDX_CACHE_SIZE` resolutions are kept.
+
+    Long TOIs can be read in blocks of samples using
+    :func:`stripeline.timetools.ToiProvider.iter_blocks`, so that only one
+    block at a time needs to be kept in memory.
     '''
 
+    PIXIDX_CACHE_SIZE = 4
+
     def __init__(self, rank: int, num_of_processes: int):
         '''Create a new object.
 
@@ -68,6 +152,17 @@ class ToiProvider:
         self.rank = rank
         self.num_of_processes = num_of_processes
         self.total_num_of_samples = 0
+        self._pixidx_cache = OrderedDict()
+
+    def load(self, quantities=None):
+        '''Read the TOI in memory before the getters are called.
+
+        The parameter `quantities` is a list of the names in
+        :data:`TOI_QUANTITIES` that the caller is going to use; if it is
+        ``None``, all of them are loaded. Classes that read from files can
+        override this to read the data in one pass; the default
+        implementation does nothing.'''
+        del quantities
 
     def get_time(self):
         '''Return a vector containing the time of each sample in the TOI.
@@ -86,10 +181,21 @@ class ToiProvider:
         TOI.
 
         Only the part of the TOI that belongs to the rank of this process is
-        returned.'''
+        returned. The result is cached: do not modify it in place.'''
+
+        key = (nside, nest, lonlat)
+        if key in self._pixidx_cache:
+            self._pixidx_cache.move_to_end(key)
+            return self._pixidx_cache[key]
+
+        theta, phi = self.get_pointings()
+        pixidx = healpy.ang2pix(nside, theta, phi, nest=nest, lonlat=lonlat)
 
-        theta, phi, psi = self.get_pointings()
-        return healpy.ang2pix(nside, theta, phi, nest=nest, lonlat=lonlat)
+        self._pixidx_cache[key] = pixidx
+        while len(self._pixidx_cache) > self.PIXIDX_CACHE_SIZE:
+            self._pixidx_cache.popitem(last=False)
+
+        return pixidx
 
     def get_pointings(self):
         '''Return two vectors containing the colatitude and longitude for each
@@ -108,19 +214,192 @@ class ToiProvider:
 
         return None
 
+    def get_num_of_local_samples(self) -> int:
+        '''Return the number of samples in the part of the TOI that belongs
+        to the rank of this process.'''
+
+        return len(self.get_time())
+
+    def read_block(self, first_sample: int, num_of_samples: int) -> ToiBlock:
+        '''Return a block of samples from the part of the TOI that belongs to
+        the rank of this process.
 
-ToiFile = namedtuple('ToiFile', ['file_name', 'num_of_samples'])
+        The block starts from sample `first_sample` (counting from the first
+        sample of this process) and contains `num_of_samples` samples. Return
+        a :class:`stripeline.timetools.ToiBlock` object, whose field
+        `signals` is a 4xN matrix (Q1, Q2, U1, U2).
 
+        This implementation slices the arrays returned by the getters;
+        classes that read from files should override it to read only the
+        samples in the block.'''
 
-def read_fits_file_information(file_name: str, hdu=1) -> ToiFile:
+        end = first_sample + num_of_samples
+        theta, phi = self.get_pointings()
+        return ToiBlock(first_sample=first_sample,
+                        time=self.get_time()[first_sample:end],
+                        theta=theta[first_sample:end],
+                        phi=phi[first_sample:end],
+                        psi=self.get_polarization_angle()[first_sample:end],
+                        signals=np.array([self.get_signal(i)[first_sample:end]
+                                          for i in range(len(DET_NAMES))]))
+
+    def iter_blocks(self, block_size: int, prefetch=False):
+        '''Iterate over the part of the TOI that belongs to the rank of this
+        process, in blocks of `block_size` samples.
+
+        Each element is a :class:`stripeline.timetools.ToiBlock` object; the
+        last block can be shorter than `block_size`. Blocks can span several
+        files. If `prefetch` is true, the next block is read by a background
+        thread while the caller processes the current one: this hides the
+        time spent reading files, at the cost of keeping two blocks in
+        memory.'''
+
+        assert block_size > 0
+        num_of_samples = self.get_num_of_local_samples()
+        blocks = (self.read_block(start, min(block_size, num_of_samples - start))
+                  for start in range(0, num_of_samples, block_size))
+
+        if prefetch:
+            blocks = _prefetch_iterator(blocks)
+
+        yield from blocks
+
+
+ToiFile = namedtuple('ToiFile', ['file_name', 'num_of_samples',
+                                 'first_time', 'last_time', 'mtime'])
+ToiFile.__new__.__defaults__ = (None, None, None)
+
+
+def read_fits_file_information(file_name: str, hdu=1, time_col=None) -> ToiFile:
     '''Read the number of rows in the first tabular HDU of a FITS file
 
+    The time of the first and last sample is read from the keywords
+    ``FSTTIME`` and ``LSTTIME`` of the HDU (see
+    :class:`stripeline.scanning.TodWriter`). If they are missing and
+    `time_col` (a :class:`stripeline.timetools.FitsColumn`) is not ``None``,
+    the first and last element of that column are used; otherwise, the
+    times are ``None``.
+
     Return a :class:`stripeline.timetools.ToiFile` object.
     '''
-    with fits.open(file_name) as fin:
-        num_of_samples = fin[hdu].header['NAXIS2']
+    mtime = os.path.getmtime(file_name)
+    with fits.open(file_name, memmap=True) as fin:
+        header = fin[hdu].header
+        num_of_samples = header['NAXIS2']
+        first_time = header.get('FSTTIME')
+        last_time = header.get('LSTTIME')
+        if (first_time is None or last_time is None) and \
+                time_col is not None and num_of_samples > 0:
+            times = fin[time_col.hdu].data.field(time_col.column)
+            first_time, last_time = times[0], times[-1]
+
+    return ToiFile(file_name=file_name,
+                   num_of_samples=num_of_samples,
+                   first_time=float(first_time) if first_time is not None else None,
+                   last_time=float(last_time) if last_time is not None else None,
+                   mtime=mtime)
+
+
+def _load_toi_index(index_file: str):
+    '''Read the index saved by _save_toi_index
+
+    Return a dictionary associating file names with ToiFile objects. If the
+    index does not exist or cannot be decoded, the dictionary is empty.'''
+    if index_file is None or not os.path.exists(index_file):
+        return {}
+
+    try:
+        with open(index_file, 'rt') as f:
+            return {x['file_name']: ToiFile(**x) for x in json.load(f)}
+    except (ValueError, KeyError, TypeError):
+        return {}
+
+
+def _save_toi_index(index_file: str, toi_files):
+    'Write a list of ToiFile objects into a JSON file'
+    # Writing a temporary file and renaming it prevents other programs from
+    # reading a truncated index
+    tmp_file_name = index_file + '.tmp'
+    with open(tmp_file_name, 'wt') as f:
+        json.dump([x._asdict() for x in toi_files], f, indent=1)
+    os.replace(tmp_file_name, index_file)
+
+
+def scan_fits_files(file_names: List[str], hdu=1, time_col=None, comm=None,
+                    index_file=None) -> List[ToiFile]:
+    '''Read the information about a set of FITS files
+
+    Call :func:`stripeline.timetools.read_fits_file_information` on each
+    file in `file_names` (the meaning of `hdu` and `time_col` is the same),
+    and return a list of :class:`stripeline.timetools.ToiFile` objects in the
+    same order.
+
+    If `comm` is not ``None``, each MPI process reads one file every
+    ``comm.size`` ones, and the results are gathered by all the processes.
+
+    If `index_file` is not ``None``, it is the path of a JSON file containing
+    the information read by previous calls: files whose modification time
+    has not changed are not opened again. The index is updated by the first
+    MPI process if some file has changed; files that are not in
+    `file_names` are kept in it, so that several runs can share one index.'''
+
+    rank, size = (comm.rank, comm.size) if comm else (0, 1)
+
+    cached = _load_toi_index(index_file) if rank == 0 else None
+    if comm:
+        cached = comm.bcast(cached, root=0)
+
+    my_files = []  # Type: List[ToiFile]
+    for cur_file in file_names[rank::size]:
+        entry = cached.get(cur_file)
+        if entry is None or entry.mtime != os.path.getmtime(cur_file) or \
+                (time_col is not None and entry.first_time is None and
+                 entry.num_of_samples > 0):
+            entry = read_fits_file_information(cur_file, hdu=hdu,
+                                               time_col=time_col)
+        my_files.append(entry)
+
+    if comm:
+        gathered = comm.allgather(my_files)
+        result = [None] * len(file_names)
+        for cur_rank, cur_files in enumerate(gathered):
+            result[cur_rank::size] = cur_files
+    else:
+        result = my_files
+
+    if index_file is not None and rank == 0 and \
+            any([cached.get(x.file_name) != x for x in result]):
+        new_index = dict(cached)
+        new_index.update({x.file_name: x for x in result})
+        _save_toi_index(index_file, sorted(new_index.values(),
+                                           key=lambda x: x.file_name))
+
+    return result
+
+
+def select_time_range(toi_files: List[ToiFile], start_time=None,
+                      end_time=None) -> List[ToiFile]:
+    '''Return the files containing samples within a time range
+
+    The range goes from `start_time` to `end_time` (both included); if any
+    of them is ``None``, the range is not limited on that side. The files are
+    selected using the fields `first_time` and `last_time`, and the order of
+    `toi_files` is kept.'''
 
-    return ToiFile(file_name=file_name, num_of_samples=num_of_samples)
+    if start_time is None and end_time is None:
+        return list(toi_files)
+
+    result = []  # Type: List[ToiFile]
+    for cur_file in toi_files:
+        if cur_file.first_time is None or cur_file.last_time is None:
+            raise ValueError('the time span of file "{0}" is unknown'
+                             .format(cur_file.file_name))
+
+        if (start_time is None or cur_file.last_time >= start_time) and \
+                (end_time is None or cur_file.first_time <= end_time):
+            result.append(cur_file)
+
+    return result
 
 
 def split_into_n(length: int, num_of_segments: int) -> List[int]:
@@ -211,47 +490,121 @@ def _load_array_from_fits(segments: List[ToiFileSegment], cols_to_read: List[Fit
     The chunks to read from each FITS file are specified in the parameter `segments`,
     while the columns to read are in `cols_to_read`. The function returns a tuple
     containing all the data from the columns (each in a NumPy array) in the same
-    order as in `cols_to_read`.'''
-
-    arrays = [np.array([], dtype=np.float64) for i in range(len(cols_to_read))]
+    order as in `cols_to_read`.
+
+    The output arrays are allocated once, with native byte order and 64-bit
+    floating point type. Each FITS file is opened only once for all the
+    columns (consecutive segments in the same file share it), and it is
+    memory-mapped, so that only the rows in each segment are actually read
+    from disk and converted.'''
+
+    total_length = sum([x.num_of_elements for x in segments])
+    arrays = tuple([np.empty(total_length, dtype=np.float64)
+                    for i in range(len(cols_to_read))])
+
+    position = 0
+    with instrumentation.timer('timetools.read_fits',
+                               samples=total_length * len(cols_to_read),
+                               nbytes=sum([x.nbytes for x in arrays])):
+        for file_name, file_segments in groupby(segments,
+                                                key=lambda x: x.file_name):
+            instrumentation.count('io.files_read')
+            with fits.open(file_name, memmap=True) as f:
+                for cur_segment in file_segments:
+                    start = cur_segment.first_element
+                    end = cur_segment.first_element + \
+                        cur_segment.num_of_elements
+                    for col_idx, cur_col in enumerate(cols_to_read):
+                        # "field" returns a view of the memory-mapped table:
+                        # only the rows in [start:end] are read and
+                        # byte-swapped
+                        arrays[col_idx][position:position + end - start] = \
+                            f[cur_col.hdu].data.field(cur_col.column)[start:end]
+
+                    position += end - start
+
+    instrumentation.count('io.bytes_read', sum([x.nbytes for x in arrays]))
+    return arrays
+
+
+def _slice_segments(segments: List[ToiFileSegment],
+                    first_sample: int,
+                    num_of_samples: int) -> List[ToiFileSegment]:
+    '''Return the segments that cover a range of samples.
+
+    The range starts from `first_sample` and contains `num_of_samples`
+    samples; samples are counted from the first element of `segments`, as if
+    the segments were concatenated.'''
+
+    result = []  # Type: List[ToiFileSegment]
+    end = first_sample + num_of_samples
+    position = 0
     for cur_segment in segments:
-        start = cur_segment.first_element
-        end = cur_segment.first_element + cur_segment.num_of_elements
-        with fits.open(cur_segment.file_name) as f:
-            # TODO: maybe this is not the most efficient way to load
-            # chunks of data from a FITS column
-            cur_chunk_arr = [f[x.hdu].data.field(x.column)[start:end]
-                             for x in cols_to_read]
+        if position >= end:
+            break
+
+        start = max(first_sample, position)
+        stop = min(end, position + cur_segment.num_of_elements)
+        if start < stop:
+            result.append(ToiFileSegment(file_name=cur_segment.file_name,
+                                         first_element=cur_segment.first_element +
+                                         start - position,
+                                         num_of_elements=stop - start))
 
-            for col_idx in range(len(cols_to_read)):
-                arrays[col_idx] = np.concatenate(
-                    [arrays[col_idx], cur_chunk_arr[col_idx]])
+        position += cur_segment.num_of_elements
+
+    return result
 
-    return tuple(arrays)
+
+def _count_local_segments(segments: List[ToiFileSegment]):
+    '''Record the amount of data assigned to this process
+
+    Comparing these counters among the MPI processes shows how well the
+    files have been split by assign_toi_files_to_processes.'''
+    instrumentation.count('timetools.local_samples',
+                          sum([x.num_of_elements for x in segments]))
+    instrumentation.count('timetools.local_segments', len(segments))
 
 
 class FitsToiProvider(ToiProvider):
     '''Distribute a TOI saved in FITS files among MPI processes.
 
     This class specializes :class:`stripeline.timetools.ToiProvider` in order to
-    load the TOI from a set of FITS files.'''
+    load the TOI from a set of FITS files.
+
+    Columns are kept in a cache once they have been read, so that calling
+    the getters many times (e.g., once for each detector) does not read the
+    files again. The method :func:`stripeline.timetools.FitsToiProvider.load`
+    reads many columns in one pass over the files. The cache never uses more
+    than `cache_size_mb` megabytes: when it is full, the least recently used
+    columns are dropped. The arrays returned by the getters are read-only
+    views of the cache.
+
+    The FITS headers are read in parallel by the MPI processes (see
+    :func:`stripeline.timetools.scan_fits_files`); if `index_file` is not
+    ``None``, the information is saved there and reused when the object is
+    created again. If `start_time` or `end_time` are specified, only the
+    files containing samples in that time range are used (whole files are
+    selected, not single samples).'''
 
     def __init__(self,
                  rank: int,
                  num_of_processes: int,
                  file_names: List[str],
                  file_layout: FitsTableLayout,
-                 comm=None):
+                 comm=None,
+                 cache_size_mb=2048,
+                 index_file=None,
+                 start_time=None,
+                 end_time=None):
         ToiProvider.__init__(self, rank, num_of_processes)
 
         self.file_layout = file_layout
-        self.fits_files = []  # Type: List[ToiFile]
-        if rank == 0 or comm is None:
-            for cur_file in file_names:
-                self.fits_files.append(read_fits_file_information(cur_file))
-
-        if comm:
-            self.fits_files = comm.bcast(self.fits_files, root=0)
+        # Type: List[ToiFile]
+        self.fits_files = select_time_range(
+            scan_fits_files(file_names, time_col=file_layout.time_col,
+                            comm=comm, index_file=index_file),
+            start_time, end_time)
 
         self.total_num_of_samples = sum(
             [x.num_of_samples for x in self.fits_files])
@@ -260,6 +613,91 @@ class FitsToiProvider(ToiProvider):
 
         self.segments_per_process = assign_toi_files_to_processes(self.samples_per_process,
                                                                   self.fits_files)
+        _count_local_segments(self.segments_per_process[rank])
+
+        self.cache_size_mb = cache_size_mb
+        self._column_cache = OrderedDict()  # Type: Dict[FitsColumn, Any]
+
+    def _layout_columns(self, quantities=TOI_QUANTITIES) -> List[FitsColumn]:
+        'Return the columns containing the quantities named in "quantities"'
+        layout = self.file_layout
+        columns = {'time': [layout.time_col],
+                   'pointings': [layout.theta_col, layout.phi_col],
+                   'psi': [layout.psi_col],
+                   'signals': list(layout.signal_cols)}
+        return [x for name in quantities for x in columns[name]]
+
+    def _cache_bytes(self) -> int:
+        return sum([x.nbytes for x in self._column_cache.values()])
+
+    def _store_in_cache(self, column: FitsColumn, array):
+        array.flags.writeable = False
+        self._column_cache[column] = array
+        self._column_cache.move_to_end(column)
+
+        # Evict the least recently used columns, but keep at least the one
+        # that has just been added
+        max_bytes = self.cache_size_mb * 1024 * 1024
+        while len(self._column_cache) > 1 and self._cache_bytes() > max_bytes:
+            self._column_cache.popitem(last=False)
+
+    def load(self, quantities=None):
+        '''Read many columns in a single pass over the FITS files.
+
+        The parameter `quantities` has the same meaning as in
+        :func:`stripeline.timetools.ToiProvider.load`. Columns that are
+        already in the cache are not read again. Only the columns that fit
+        in the cache are read: the others are read one at a time by the
+        getters, so that the memory used never exceeds the size of the cache
+        by more than one column.'''
+
+        if quantities is None:
+            quantities = TOI_QUANTITIES
+        self._load_columns(self._layout_columns(quantities))
+
+    def _load_columns(self, columns: List[FitsColumn]):
+        'Read the columns in "columns" that fit in the cache, in one pass'
+
+        missing = []
+        for cur_col in columns:
+            if cur_col in self._column_cache:
+                self._column_cache.move_to_end(cur_col)
+            elif cur_col not in missing:
+                missing.append(cur_col)
+
+        # All the columns have the same size. The ones requested by the
+        # caller which are already in the cache must stay there
+        column_bytes = self.get_num_of_local_samples() * \
+            np.dtype(np.float64).itemsize
+        if column_bytes > 0:
+            free_bytes = self.cache_size_mb * 1024 * 1024 - \
+                sum([self._column_cache[x].nbytes for x in set(columns)
+                     if x in self._column_cache])
+            missing = missing[:max(0, int(free_bytes // column_bytes))]
+
+        if not missing:
+            return
+
+        arrays = _load_array_from_fits(segments=self.segments_per_process[self.rank],
+                                       cols_to_read=missing)
+        for cur_col, cur_array in zip(missing, arrays):
+            self._store_in_cache(cur_col, cur_array)
+
+    def get_column(self, column: FitsColumn):
+        '''Return the part of a column that belongs to the rank of this process.
+
+        The column is read from the cache, if possible.'''
+
+        if column in self._column_cache:
+            instrumentation.count('timetools.cache_hits')
+            self._column_cache.move_to_end(column)
+            return self._column_cache[column]
+
+        instrumentation.count('timetools.cache_misses')
+        result = _load_array_from_fits(segments=self.segments_per_process[self.rank],
+                                       cols_to_read=[column])[0]
+        self._store_in_cache(column, result)
+        return result
 
     def get_time(self):
         '''Return a vector containing the time of each sample in the TOI.
@@ -267,9 +705,7 @@ class FitsToiProvider(ToiProvider):
         Only the part of the TOI that belongs to the rank of this process
         is returned.'''
 
-        result = _load_array_from_fits(segments=self.segments_per_process[self.rank],
-                                       cols_to_read=[self.file_layout.time_col])
-        return result[0]
+        return self.get_column(self.file_layout.time_col)
 
     def get_signal(self, det_idx: Union[int, str]):
         '''Return a vector containing the signal from the TOI.
@@ -290,10 +726,7 @@ class FitsToiProvider(ToiProvider):
         if type(det_idx) is str:
             det_idx = DET_NAMES[det_idx]
 
-        result = _load_array_from_fits(segments=self.segments_per_process[self.rank],
-                                       cols_to_read=[self.file_layout.signal_cols[det_idx]])
-
-        return result[0]
+        return self.get_column(self.file_layout.signal_cols[det_idx])
 
     def get_pointings(self):
         '''Return two vectors containing the colatitude and longitude for each
@@ -302,11 +735,10 @@ class FitsToiProvider(ToiProvider):
         Only the part of the TOI that belongs to the rank of this process is
         returned.'''
 
-        theta, phi = _load_array_from_fits(segments=self.segments_per_process[self.rank],
-                                           cols_to_read=[self.file_layout.theta_col,
-                                                         self.file_layout.phi_col])
-
-        return theta, phi
+        self._load_columns([self.file_layout.theta_col,
+                            self.file_layout.phi_col])
+        return (self.get_column(self.file_layout.theta_col),
+                self.get_column(self.file_layout.phi_col))
 
     def get_polarization_angle(self):
         '''Return two vectors containing the colatitude and longitude for each
@@ -314,7 +746,228 @@ class FitsToiProvider(ToiProvider):
         Only the part of the TOI that belongs to the rank of this process is
         returned.'''
 
-        psi = _load_array_from_fits(segments=self.segments_per_process[self.rank],
-                                    cols_to_read=[self.file_layout.psi_col])
+        return self.get_column(self.file_layout.psi_col)
+
+    def get_num_of_local_samples(self) -> int:
+        '''Return the number of samples in the part of the TOI that belongs
+        to the rank of this process.'''
+
+        return int(self.samples_per_process[self.rank])
+
+    def read_block(self, first_sample: int, num_of_samples: int) -> ToiBlock:
+        '''Return a block of samples from the part of the TOI that belongs to
+        the rank of this process.
+
+        See :func:`stripeline.timetools.ToiProvider.read_block`. Only the rows
+        in the block are read from the FITS files, with one pass over them;
+        columns that are already in the cache are sliced instead. The block
+        is not stored in the cache.'''
+
+        layout = self.file_layout
+        columns = self._layout_columns()
+        end = first_sample + num_of_samples
+
+        missing = [x for x in columns if x not in self._column_cache]
+        segments = _slice_segments(self.segments_per_process[self.rank],
+                                   first_sample, num_of_samples)
+        arrays = {}
+        if missing:
+            arrays = dict(zip(missing, _load_array_from_fits(segments=segments,
+                                                             cols_to_read=missing)))
+        for cur_col in columns:
+            if cur_col not in arrays:
+                arrays[cur_col] = self._column_cache[cur_col][first_sample:end]
+
+        return ToiBlock(first_sample=first_sample,
+                        time=arrays[layout.time_col],
+                        theta=arrays[layout.theta_col],
+                        phi=arrays[layout.phi_col],
+                        psi=arrays[layout.psi_col],
+                        signals=np.array([arrays[x] for x in layout.signal_cols]))
+
+
+# Names of the columns used by ChunkedToiProvider, in the same order as
+# DET_NAMES. These are the names used by the TOD writers in stripeline
+CHUNKED_SIGNAL_NAMES = ['DETQ1', 'DETQ2', 'DETU1', 'DETU2']
+
+
+class ChunkedToiProvider(ToiProvider):
+    '''Distribute a TOI saved in chunked binary files among MPI processes.
+
+    This class specializes :class:`stripeline.timetools.ToiProvider` in order to
+    load the TOI from files written by
+    :class:`stripeline.todfile.ChunkedTodWriter`. The columns must be named
+    ``THETA``, ``PHI``, ``PSI``, and `signal_names`; the time is computed
+    from the sampling frequency.
+
+    If the files contain a ``PIXIDX`` column and their metadata contain the
+    keys ``NSIDE`` and ``NEST``, the pixel indexes saved in the files are
+    returned by :func:`stripeline.timetools.ToiProvider.get_pixel_index`
+    for that resolution. In this case, ``THETA`` and ``PHI`` are optional:
+    if they are missing, the pointings are the centers of the pixels.
+
+    Only the chunks containing the samples of this process are read.'''
+
+    def __init__(self,
+                 rank: int,
+                 num_of_processes: int,
+                 file_names: List[str],
+                 comm=None,
+                 signal_names=CHUNKED_SIGNAL_NAMES):
+        ToiProvider.__init__(self, rank, num_of_processes)
+
+        self.signal_names = list(signal_names)
+        self.tod_files = []  # Type: List[todfile.ChunkedTodFile]
+        if rank == 0 or comm is None:
+            for cur_file in file_names:
+                self.tod_files.append(todfile.ChunkedTodFile(cur_file))
+
+        if comm:
+            self.tod_files = comm.bcast(self.tod_files, root=0)
+
+        self._files_by_name = {x.file_name: x for x in self.tod_files}
+        toi_files = [ToiFile(file_name=x.file_name, num_of_samples=x.num_of_samples)
+                     for x in self.tod_files]
+
+        self.total_num_of_samples = sum([x.num_of_samples for x in toi_files])
+        self.samples_per_process = split_into_n(self.total_num_of_samples,
+                                                num_of_processes)
+        self.segments_per_process = assign_toi_files_to_processes(self.samples_per_process,
+                                                                  toi_files)
+        _count_local_segments(self.segments_per_process[rank])
+
+        # Resolution of the pixel indexes saved in the files, if all of them
+        # share the same one
+        self.pixidx_resolution = None
+        if self.tod_files and self._has_column('PIXIDX'):
+            resolutions = set([(x.metadata.get('NSIDE'), x.metadata.get('NEST'))
+                               for x in self.tod_files])
+            if len(resolutions) == 1 and None not in list(resolutions)[0]:
+                self.pixidx_resolution = resolutions.pop()
+
+    def _read_column(self, name: str, first_sample=0, num_of_samples=None):
+        '''Read a range of samples of a column from the part of the TOI that
+        belongs to the rank of this process'''
+
+        if num_of_samples is None:
+            num_of_samples = self.get_num_of_local_samples() - first_sample
+
+        segments = _slice_segments(self.segments_per_process[self.rank],
+                                   first_sample, num_of_samples)
+        with instrumentation.timer('timetools.read_chunked',
+                                   samples=num_of_samples):
+            parts = [self._files_by_name[x.file_name].read(name,
+                                                            x.first_element,
+                                                            x.num_of_elements)
+                     for x in segments]
+            result = np.concatenate(parts) if parts else np.empty(0)
+
+        instrumentation.count('io.bytes_read', result.nbytes)
+        return result
+
+    def _has_column(self, name: str) -> bool:
+        return all([x.has_column(name) for x in self.tod_files])
+
+    def get_num_of_local_samples(self) -> int:
+        return int(self.samples_per_process[self.rank])
+
+    def get_time(self):
+        '''Return a vector containing the time of each sample in the TOI.
+
+        Only the part of the TOI that belongs to the rank of this process
+        is returned.'''
+
+        return self._read_column(todfile.TIME_COLUMN)
+
+    def get_signal(self, det_idx: Union[int, str]):
+        '''Return a vector containing the signal from the TOI.
+
+        See :func:`stripeline.timetools.FitsToiProvider.get_signal`.
+        The result is always a 64-bit floating-point vector.'''
+
+        if type(det_idx) is str:
+            det_idx = DET_NAMES[det_idx]
+
+        return self._read_column(self.signal_names[det_idx]).astype(np.float64,
+                                                                    copy=False)
+
+    def _stored_pixidx(self, first_sample=0, num_of_samples=None):
+        return self._read_column('PIXIDX', first_sample,
+                                 num_of_samples).astype(np.int64, copy=False)
+
+    def _pointings(self, first_sample=0, num_of_samples=None):
+        if self._has_column('THETA') and self._has_column('PHI'):
+            return (self._read_column('THETA', first_sample, num_of_samples),
+                    self._read_column('PHI', first_sample, num_of_samples))
+
+        if self.pixidx_resolution is None:
+            raise ValueError('the files contain neither the pointings nor '
+                             'the pixel indexes')
+
+        nside, nest = self.pixidx_resolution
+        return healpy.pix2ang(nside, self._stored_pixidx(first_sample,
+                                                         num_of_samples),
+                              nest=nest)
+
+    def get_pointings(self):
+        '''Return two vectors containing the colatitude and longitude for each
+        sample in the TOI.
+
+        If the files only contain the pixel indexes, the pointings are the
+        centers of the pixels. Only the part of the TOI that belongs to the
+        rank of this process is returned.'''
+
+        return self._pointings()
+
+    def get_pixel_index(self, nside: int, nest=False, lonlat=False):
+        '''Return a vector containing the pixel index for each sample in the
+        TOI.
+
+        If the files contain the pixel indexes for the same value of `nside`,
+        they are used instead of computing them from the pointings.'''
+
+        if lonlat or self.pixidx_resolution is None or \
+                self.pixidx_resolution[0] != nside:
+            return ToiProvider.get_pixel_index(self, nside, nest=nest,
+                                               lonlat=lonlat)
+
+        key = (nside, nest, lonlat)
+        if key not in self._pixidx_cache:
+            pixidx = self._stored_pixidx()
+            if bool(self.pixidx_resolution[1]) != bool(nest):
+                pixidx = healpy.ring2nest(nside, pixidx) if nest \
+                    else healpy.nest2ring(nside, pixidx)
+            self._pixidx_cache[key] = pixidx
+            while len(self._pixidx_cache) > self.PIXIDX_CACHE_SIZE:
+                self._pixidx_cache.popitem(last=False)
+
+        self._pixidx_cache.move_to_end(key)
+        return self._pixidx_cache[key]
+
+    def get_polarization_angle(self):
+        '''Return a vector containing the polarization angle for each sample
+        in the TOI.
+
+        Only the part of the TOI that belongs to the rank of this process is
+        returned.'''
 
-        return psi[0]
+        return self._read_column('PSI').astype(np.float64, copy=False)
+
+    def read_block(self, first_sample: int, num_of_samples: int) -> ToiBlock:
+        '''Return a block of samples from the part of the TOI that belongs to
+        the rank of this process.
+
+        See :func:`stripeline.timetools.ToiProvider.read_block`. Only the
+        chunks overlapping the block are read.'''
+
+        theta, phi = self._pointings(first_sample, num_of_samples)
+        return ToiBlock(
+            first_sample=first_sample,
+            time=self._read_column(todfile.TIME_COLUMN, first_sample,
+                                   num_of_samples),
+            theta=theta,
+            phi=phi,
+            psi=self._read_column('PSI', first_sample,
+                                  num_of_samples).astype(np.float64, copy=False),
+            signals=np.array([self._read_column(x, first_sample, num_of_samples)
+                              for x in self.signal_names], dtype=np.float64))
@@ -0,0 +1,325 @@
+#!/usr/bin/env python3
+# -*- encoding: utf-8 -*-
+
+'''Chunked binary files containing TODs
+
+The files written by :class:`ChunkedTodWriter` are a compact alternative to
+FITS tables. Each column has its own data type (e.g., 32-bit floating point
+numbers for the detectors and 32-bit integers for the pixel indexes), and
+integer columns can be used to store quantized floating-point values. The time
+of the samples is not saved, as it is implied by the time of the first sample
+and by the sampling frequency.
+
+The samples are split in chunks with the same number of samples, and each
+column of each chunk is saved (and optionally compressed) separately. An
+index at the end of the file records where each chunk is, so that
+:class:`ChunkedTodFile` can read any range of samples from any column without
+reading the rest of the file.
+
+The layout of a file is the following:
+
+- An 8-byte magic string (:data:`MAGIC`) and the version of the format as a
+  32-bit little-endian integer;
+- The data of each chunk, one column after the other;
+- The index, a UTF-8 JSON object containing the list of the columns, the
+  offset and size of the data of each column in each chunk, and any metadata
+  passed to the writer;
+- The offset of the index as a 64-bit little-endian integer, followed by the
+  magic string again.
+
+Compressed data are byte-shuffled before being passed to zlib, i.e., the first
+bytes of all the values are stored together, then the second bytes, etc. This
+is the same technique used by the "shuffle" filter of HDF5, and it makes
+floating-point numbers much easier to compress.
+'''
+
+from collections import namedtuple
+import json
+import struct
+import zlib
+import numpy as np
+
+MAGIC = b'STRIPTOD'
+FORMAT_VERSION = 1
+
+# Default number of samples in each chunk
+DEFAULT_CHUNK_SIZE = 65536
+
+# Name of the column containing the time, which is never saved
+TIME_COLUMN = 'TIME'
+
+_HEADER = struct.Struct('<8sI')
+_TRAILER = struct.Struct('<Q8s')
+
+TodColumn = namedtuple('TodColumn', ['name', 'dtype', 'unit', 'scale'])
+TodColumn.__new__.__defaults__ = ('', None)
+TodColumn.__doc__ = '''Description of a column in a chunked TOD file
+
+The field `dtype` is the NumPy type used to save the values (e.g.,
+``'float32'`` or ``'int32'``). If `scale` is not ``None``, the values are
+quantized: the file contains the integer nearest to ``value / scale``, and
+values are multiplied by `scale` again when they are read. ``unit`` is free
+text.'''
+
+
+def _shuffle(data: bytes, itemsize: int) -> bytes:
+    'Group together the bytes with the same position in each value'
+    if itemsize == 1:
+        return data
+    return np.frombuffer(data, dtype='uint8').reshape(-1, itemsize).T.tobytes()
+
+
+def _unshuffle(data: bytes, itemsize: int) -> bytes:
+    'Invert the transformation done by _shuffle'
+    if itemsize == 1:
+        return data
+    return np.frombuffer(data, dtype='uint8').reshape(itemsize, -1).T.tobytes()
+
+
+def _encode_column(column: TodColumn, values, compression_level: int) -> bytes:
+    'Convert the values of a column in a chunk into the bytes to be saved'
+    dtype = np.dtype(column.dtype).newbyteorder('<')
+    values = np.asarray(values)
+    if column.scale is not None:
+        values = np.rint(values / column.scale)
+        info = np.iinfo(dtype)
+        if len(values) > 0 and (values.min() < info.min or
+                                values.max() > info.max):
+            raise ValueError('column "{0}" cannot be quantized using {1} with '
+                             'step {2}'.format(column.name, column.dtype,
+                                               column.scale))
+
+    data = np.ascontiguousarray(values, dtype=dtype).tobytes()
+    if compression_level > 0:
+        data = zlib.compress(_shuffle(data, dtype.itemsize), compression_level)
+
+    return data
+
+
+def _decode_column(column: TodColumn, data: bytes, compressed: bool):
+    'Convert the bytes saved by _encode_column into an array'
+    dtype = np.dtype(column.dtype).newbyteorder('<')
+    if compressed:
+        data = _unshuffle(zlib.decompress(data), dtype.itemsize)
+
+    values = np.frombuffer(data, dtype=dtype).astype(dtype.newbyteorder('='))
+    if column.scale is not None:
+        values = values * column.scale
+
+    return values
+
+
+class ChunkedTodWriter:
+    '''Write a TOD into a chunked binary file
+
+    The parameter `columns` is a list of :class:`TodColumn` objects, and
+    `sampfreq` and `first_time` determine the time of each sample. Samples
+    are added using :meth:`write`, and they are saved every `chunk_size`
+    samples. If `compression_level` is not zero, each column of each chunk
+    is compressed using zlib with that level (1 is the fastest, 9 the
+    slowest). The dictionary `metadata` is saved in the index of the file,
+    and it must be serializable using JSON.
+
+    The file is complete only after :meth:`close` has been called; the
+    object can be used as a context manager::
+
+        columns = [TodColumn('PIXIDX', 'int32'),
+                   TodColumn('PSI', 'float32', 'rad'),
+                   TodColumn('DETQ1', 'float32', 'K')]
+        with ChunkedTodWriter('tod.stod', columns, sampfreq=50.0) as f:
+            f.write(PIXIDX=pixidx, PSI=psi, DETQ1=q1)
+    '''
+
+    def __init__(self, file_name: str, columns, sampfreq: float,
+                 first_time=0.0, chunk_size=DEFAULT_CHUNK_SIZE,
+                 compression_level=6, metadata=None):
+        assert chunk_size > 0
+        self.file_name = file_name
+        self.columns = [TodColumn(*x) for x in columns]
+        assert TIME_COLUMN not in [x.name for x in self.columns]
+        self.sampfreq = float(sampfreq)
+        self.first_time = float(first_time)
+        self.chunk_size = int(chunk_size)
+        self.compression_level = int(compression_level)
+        self.metadata = dict(metadata) if metadata is not None else {}
+        self.num_of_samples = 0
+
+        self._chunks = []
+        self._pending = {x.name: [] for x in self.columns}
+        self._num_of_pending = 0
+
+        self._file = open(file_name, 'wb')
+        self._file.write(_HEADER.pack(MAGIC, FORMAT_VERSION))
+
+    def write(self, **values):
+        '''Append samples to the file
+
+        Pass one array for each column, using the names of the columns as
+        keywords. All the arrays must have the same length.'''
+
+        assert set(values.keys()) == set(self._pending.keys())
+        lengths = set([len(x) for x in values.values()])
+        assert len(lengths) == 1
+        length = lengths.pop()
+
+        # Keep a copy of the samples, as the caller might reuse the arrays.
+        # The pieces are joined only when a chunk is saved
+        for name, cur_values in values.items():
+            self._pending[name].append(np.array(cur_values))
+        self._num_of_pending += length
+
+        while self._num_of_pending >= self.chunk_size:
+            self._flush(self.chunk_size)
+
+    def _flush(self, num_of_samples: int):
+        'Save the first "num_of_samples" pending samples as a new chunk'
+
+        chunk_columns = []
+        for cur_column in self.columns:
+            # Join the pieces passed to "write" since the last chunk; if
+            # more chunks are saved in a row, they are views of this array
+            pending = self._pending[cur_column.name]
+            pending = pending[0] if len(pending) == 1 else np.concatenate(pending)
+            data = _encode_column(cur_column, pending[:num_of_samples],
+                                  self.compression_level)
+            chunk_columns.append([self._file.tell(), len(data)])
+            self._file.write(data)
+            self._pending[cur_column.name] = [pending[num_of_samples:]]
+
+        self._chunks.append({'first_sample': self.num_of_samples,
+                             'num_of_samples': num_of_samples,
+                             'columns': chunk_columns})
+        self.num_of_samples += num_of_samples
+        self._num_of_pending -= num_of_samples
+
+    def close(self):
+        '''Save the remaining samples and the index, and close the file'''
+
+        if self._file is None:
+            return
+
+        try:
+            if self._num_of_pending > 0:
+                self._flush(self._num_of_pending)
+
+            index = {'version': FORMAT_VERSION,
+                     'num_of_samples': self.num_of_samples,
+                     'sampfreq': self.sampfreq,
+                     'first_time': self.first_time,
+                     'chunk_size': self.chunk_size,
+                     'compressed': self.compression_level > 0,
+                     'columns': [x._asdict() for x in self.columns],
+                     'chunks': self._chunks,
+                     'metadata': self.metadata}
+            index_offset = self._file.tell()
+            self._file.write(json.dumps(index).encode('utf-8'))
+            self._file.write(_TRAILER.pack(index_offset, MAGIC))
+        finally:
+            self._file.close()
+            self._file = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, exc_type, exc_value, traceback):
+        self.close()
+        return False
+
+
+class ChunkedTodFile:
+    '''Read a TOD saved by :class:`ChunkedTodWriter`
+
+    Creating the object only reads the index of the file. Use :meth:`read`
+    to load a range of samples from a column. The following fields are
+    available:
+
+    - `file_name`;
+    - `num_of_samples`: number of samples in the file;
+    - `sampfreq`: sampling frequency [Hz];
+    - `first_time`: time of the first sample [s];
+    - `columns`: list of :class:`TodColumn` objects;
+    - `metadata`: the dictionary passed to the writer.
+    '''
+
+    def __init__(self, file_name: str):
+        self.file_name = file_name
+        with open(file_name, 'rb') as f:
+            magic, version = _HEADER.unpack(f.read(_HEADER.size))
+            if magic != MAGIC:
+                raise ValueError('"{0}" is not a chunked TOD file'
+                                 .format(file_name))
+            if version != FORMAT_VERSION:
+                raise ValueError('unsupported version {0} in "{1}"'
+                                 .format(version, file_name))
+
+            f.seek(-_TRAILER.size, 2)
+            index_offset, magic = _TRAILER.unpack(f.read(_TRAILER.size))
+            if magic != MAGIC:
+                raise ValueError('"{0}" is truncated'.format(file_name))
+
+            trailer_offset = f.tell() - _TRAILER.size
+            f.seek(index_offset)
+            index = json.loads(f.read(trailer_offset - index_offset)
+                               .decode('utf-8'))
+
+        self.num_of_samples = index['num_of_samples']
+        self.sampfreq = index['sampfreq']
+        self.first_time = index['first_time']
+        self.compressed = index['compressed']
+        self.columns = [TodColumn(**x) for x in index['columns']]
+        self.metadata = index['metadata']
+        self._chunks = index['chunks']
+        self._chunk_starts = np.array([x['first_sample'] for x in self._chunks],
+                                      dtype='int64')
+        self._column_idx = {x.name: i for i, x in enumerate(self.columns)}
+
+    def column_names(self):
+        '''Return the names of the columns, including the implicit time'''
+        return [TIME_COLUMN] + [x.name for x in self.columns]
+
+    def has_column(self, name: str) -> bool:
+        return name == TIME_COLUMN or name in self._column_idx
+
+    def read(self, name: str, first_sample=0, num_of_samples=None):
+        '''Read a range of samples from a column
+
+        The range starts from `first_sample` and contains `num_of_samples`
+        samples (if ``None``, up to the end of the file). Only the chunks
+        overlapping the range are read. The time of the samples can be read
+        using the column ``TIME``.'''
+
+        if num_of_samples is None:
+            num_of_samples = self.num_of_samples - first_sample
+        end = first_sample + num_of_samples
+        assert 0 <= first_sample and end <= self.num_of_samples
+
+        if name == TIME_COLUMN:
+            return self.first_time + \
+                np.arange(first_sample, end, dtype='float64') / self.sampfreq
+
+        if name not in self._column_idx:
+            raise KeyError('no column "{0}" in "{1}"'.format(name,
+                                                             self.file_name))
+        col_idx = self._column_idx[name]
+        column = self.columns[col_idx]
+
+        first_chunk = max(np.searchsorted(self._chunk_starts, first_sample,
+                                          side='right') - 1, 0)
+        parts = []
+        with open(self.file_name, 'rb') as f:
+            for cur_chunk in self._chunks[first_chunk:]:
+                chunk_start = cur_chunk['first_sample']
+                if chunk_start >= end:
+                    break
+
+                offset, nbytes = cur_chunk['columns'][col_idx]
+                f.seek(offset)
+                values = _decode_column(column, f.read(nbytes),
+                                        self.compressed)
+                parts.append(values[max(first_sample - chunk_start, 0):
+                                    end - chunk_start])
+
+        if not parts:
+            return np.empty(0, dtype=_decode_column(column, b'', False).dtype)
+
+        return np.concatenate(parts)
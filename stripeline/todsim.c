@@ -0,0 +1,191 @@
+/******************************************************************************
+ * todsim.c
+ *
+ * Simulation of the output of a Strip polarimeter, given a pointing
+ * timeline and the maps of the Stokes parameters I, Q, and U.
+ *
+ ******************************************************************************
+ *
+ * IMPLEMENTATION NOTES
+ *
+ * The code here replaces a chain of NumPy expressions, each of them
+ * producing a temporary array as long as the timeline. Here everything is
+ * computed in one pass over the samples: sky sampling, rotation of the
+ * polarization angle, response of the polarimeter, and white noise. The
+ * timeline is processed in blocks of TOD_BLOCK_SIZE samples, so that the
+ * Gaussian numbers for one block stay in the cache until they are used.
+ *
+ * The white noise is produced by the counter-based generator in "rng.c"
+ * (see "fill_vector_normal_counter"): the noise of detector k at sample i
+ * only depends on the seed, on k, and on i. Therefore, the result does not
+ * depend on how the timeline is split in chunks.
+ *
+ * The sky can be passed either as three separate maps or as one matrix
+ * with the I, Q, and U values of each pixel next to each other (see
+ * "stripeline.skymodel.SkyModel"). In the latter case, the three values
+ * needed by each sample are in the same cache line, so that sampling a map
+ * larger than the cache costs one miss per sample instead of three. The
+ * kernels share the code in "polarimeter_block", which is inlined in each
+ * of them with a constant layout, so that the test on the layout is
+ * removed by the compiler.
+ *
+ * Like "rng.c", the code has been written with the aim of being wrapped
+ * automatically using "f2py".
+ *
+ ******************************************************************************/
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rng.h"
+
+#define TOD_BLOCK_SIZE 1024
+
+/* Order of the detectors in the output matrix */
+#define TOD_Q1 0
+#define TOD_Q2 1
+#define TOD_U1 2
+#define TOD_U2 3
+#define TOD_NUM_OF_DETECTORS 4
+
+/* Layouts of the sky maps accepted by "polarimeter_block" */
+#define SKY_SEPARATE 0 /* Three arrays: I, Q, U */
+#define SKY_IQU 1      /* One array of doubles: I, Q, U for each pixel */
+#define SKY_IQU_F32 2  /* Like SKY_IQU, but using floats */
+
+/* Simulate the samples in [start, start + count), with count not larger
+ * than TOD_BLOCK_SIZE. "sky" points to the three maps (SKY_SEPARATE) or
+ * to the interleaved map (in sky[0]); see "tod_polarimeter" for the other
+ * parameters. */
+static inline void polarimeter_block(int layout, const void *const sky[3],
+                                     const int64_t *pixidx,
+                                     const double *pointings,
+                                     const double *sigma, int32_t seed,
+                                     int64_t first_sample, double *det_output,
+                                     int num, int start, int count)
+{
+  double noise[TOD_NUM_OF_DETECTORS][TOD_BLOCK_SIZE];
+  double *q1 = det_output + TOD_Q1 * (int64_t)num;
+  double *q2 = det_output + TOD_Q2 * (int64_t)num;
+  double *u1 = det_output + TOD_U1 * (int64_t)num;
+  double *u2 = det_output + TOD_U2 * (int64_t)num;
+  int det;
+  int i;
+
+  for (det = 0; det < TOD_NUM_OF_DETECTORS; ++det)
+    fill_vector_normal_counter(seed, det, first_sample + start, noise[det],
+                               count);
+
+  for (i = 0; i < count; ++i)
+  {
+    const int64_t sample = start + i;
+    const int64_t pixel = pixidx[sample];
+    const double two_psi = 2.0 * pointings[4 * sample + 3];
+    const double cos_two_psi = cos(two_psi);
+    const double sin_two_psi = sin(two_psi);
+    double i_sky, q_sky, u_sky;
+    double q_beam, u_beam;
+
+    if (layout == SKY_SEPARATE)
+    {
+      i_sky = ((const double *)sky[0])[pixel];
+      q_sky = ((const double *)sky[1])[pixel];
+      u_sky = ((const double *)sky[2])[pixel];
+    }
+    else if (layout == SKY_IQU)
+    {
+      const double *iqu = (const double *)sky[0] + 3 * pixel;
+      i_sky = iqu[0];
+      q_sky = iqu[1];
+      u_sky = iqu[2];
+    }
+    else
+    {
+      const float *iqu = (const float *)sky[0] + 3 * pixel;
+      i_sky = iqu[0];
+      q_sky = iqu[1];
+      u_sky = iqu[2];
+    }
+
+    q_beam = q_sky * cos_two_psi - u_sky * sin_two_psi;
+    u_beam = q_sky * sin_two_psi + u_sky * cos_two_psi;
+
+    q1[sample] = 0.25 * (i_sky + q_beam) + sigma[TOD_Q1] * noise[TOD_Q1][i];
+    q2[sample] = 0.25 * (i_sky - q_beam) + sigma[TOD_Q2] * noise[TOD_Q2][i];
+    u1[sample] = 0.25 * (i_sky + u_beam) + sigma[TOD_U1] * noise[TOD_U1][i];
+    u2[sample] = 0.25 * (i_sky - u_beam) + sigma[TOD_U2] * noise[TOD_U2][i];
+  }
+}
+
+/* Compute the output of the four detectors of a polarimeter.
+ *
+ * The pointing matrix "pointings" has "num" rows and four columns (time,
+ * colatitude, longitude, polarization angle), like the one passed by
+ * "scanning.generate_pointings" to its callback; only the last column is
+ * used here. "pixidx" contains the index of the pixel observed by each
+ * sample in the maps "sky_i", "sky_q", and "sky_u".
+ *
+ * The output matrix "det_output" has four rows (Q1, Q2, U1, U2), each
+ * containing "num" samples. The white noise added to the k-th row has RMS
+ * equal to sigma[k], and it is computed using the stream "k" of the
+ * counter-based generator with seed "seed". The first sample of the
+ * timeline has index "first_sample" in the stream. */
+void tod_polarimeter(const double *sky_i, const double *sky_q,
+                     const double *sky_u, const int64_t *pixidx,
+                     const double *pointings, const double *sigma,
+                     int32_t seed, int64_t first_sample, double *det_output,
+                     int num)
+{
+  const void *const sky[3] = {sky_i, sky_q, sky_u};
+  int start;
+
+  for (start = 0; start < num; start += TOD_BLOCK_SIZE)
+  {
+    const int count =
+        (num - start < TOD_BLOCK_SIZE) ? num - start : TOD_BLOCK_SIZE;
+    polarimeter_block(SKY_SEPARATE, sky, pixidx, pointings, sigma, seed,
+                      first_sample, det_output, num, start, count);
+  }
+}
+
+/* Like "tod_polarimeter", but the sky is a matrix with "npix" rows
+ * containing the I, Q, and U values of each pixel. ("npix" is only used by
+ * the f2py wrapper, to get the shape of the matrix.) */
+void tod_polarimeter_iqu(const double *sky_iqu, const int64_t *pixidx,
+                         const double *pointings, const double *sigma,
+                         int32_t seed, int64_t first_sample,
+                         double *det_output, int num, int64_t npix)
+{
+  const void *const sky[3] = {sky_iqu, NULL, NULL};
+  int start;
+
+  (void)npix;
+  for (start = 0; start < num; start += TOD_BLOCK_SIZE)
+  {
+    const int count =
+        (num - start < TOD_BLOCK_SIZE) ? num - start : TOD_BLOCK_SIZE;
+    polarimeter_block(SKY_IQU, sky, pixidx, pointings, sigma, seed,
+                      first_sample, det_output, num, start, count);
+  }
+}
+
+/* Like "tod_polarimeter_iqu", using a map of single-precision numbers. The
+ * computation is done in double precision */
+void tod_polarimeter_iqu_f32(const float *sky_iqu, const int64_t *pixidx,
+                             const double *pointings, const double *sigma,
+                             int32_t seed, int64_t first_sample,
+                             double *det_output, int num, int64_t npix)
+{
+  const void *const sky[3] = {sky_iqu, NULL, NULL};
+  int start;
+
+  (void)npix;
+  for (start = 0; start < num; start += TOD_BLOCK_SIZE)
+  {
+    const int count =
+        (num - start < TOD_BLOCK_SIZE) ? num - start : TOD_BLOCK_SIZE;
+    polarimeter_block(SKY_IQU_F32, sky, pixidx, pointings, sigma, seed,
+                      first_sample, det_output, num, start, count);
+  }
+}
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+# -*- encoding: utf-8 -*-
+
+import unittest as ut
+import json
+import os.path
+import tempfile
+
+import stripeline.instrumentation as instr
+
+
+class MockComm:
+    '''Pretend to be the process with rank 0 in a MPI communicator
+
+    The statistics of the other processes are passed to the constructor.'''
+
+    def __init__(self, other_statistics):
+        self.rank = 0
+        self.size = len(other_statistics) + 1
+        self.other_statistics = other_statistics
+
+    def gather(self, value, root):
+        assert root == 0
+        return [value] + self.other_statistics
+
+
+class TestInstrumentation(ut.TestCase):
+
+    def setUp(self):
+        instr.reset()
+
+    def tearDown(self):
+        instr.disable()
+        instr.reset()
+
+    def test_disabled(self):
+        instr.disable()
+        with instr.timer('test.timer', samples=10):
+            pass
+        instr.count('test.counter')
+
+        self.assertEqual(instr.local_statistics(),
+                         {'timers': {}, 'counters': {}})
+
+    def test_timers_and_counters(self):
+        instr.enable()
+        for i in range(3):
+            with instr.timer('test.timer', samples=10, nbytes=80):
+                pass
+        instr.count('test.counter')
+        instr.count('test.counter', 4)
+
+        # Timers are stopped by exceptions too
+        with self.assertRaises(ValueError):
+            with instr.timer('test.error'):
+                raise ValueError()
+
+        stats = instr.local_statistics()
+        self.assertEqual(sorted(stats['timers'].keys()),
+                         ['test.error', 'test.timer'])
+        timer = stats['timers']['test.timer']
+        self.assertEqual(timer['calls'], 3)
+        self.assertEqual(timer['samples'], 30)
+        self.assertEqual(timer['bytes'], 240)
+        self.assertTrue(0.0 <= timer['max_s'] <= timer['total_s'])
+        self.assertEqual(stats['counters'], {'test.counter': 5})
+
+        instr.merge(stats)
+        self.assertEqual(instr.local_statistics()['timers']['test.timer']
+                         ['calls'], 6)
+        self.assertEqual(instr.local_statistics()['counters'],
+                         {'test.counter': 10})
+
+    def test_aggregate(self):
+        instr.enable()
+        instr.add_time('test.timer', 2.0, samples=100)
+        instr.count('test.counter', 3)
+
+        other = {'timers': {'test.timer': {'calls': 2, 'total_s': 4.0,
+                                           'max_s': 3.0, 'samples': 300,
+                                           'bytes': 0}},
+                 'counters': {'test.other': 1}}
+        result = instr.aggregate(MockComm([other]))
+
+        self.assertEqual(result['num_of_processes'], 2)
+        timer = result['timers']['test.timer']
+        self.assertEqual(timer['calls']['per_rank'], [1, 2])
+        self.assertEqual(timer['total_s']['min'], 2.0)
+        self.assertEqual(timer['total_s']['max'], 4.0)
+        self.assertEqual(timer['total_s']['mean'], 3.0)
+        self.assertEqual(timer['samples']['sum'], 400)
+        self.assertEqual(timer['max_s'], 3.0)
+
+        # Counters missing in one process count as zero
+        self.assertEqual(result['counters']['test.counter']['per_rank'],
+                         [3, 0])
+        self.assertEqual(result['counters']['test.other']['per_rank'],
+                         [0, 1])
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            file_name = os.path.join(tmpdir, 'stats.json')
+            instr.dump(file_name, MockComm([other]))
+            with open(file_name, 'rt') as f:
+                self.assertEqual(json.load(f), result)
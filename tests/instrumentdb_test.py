@@ -6,6 +6,7 @@
 import os.path
 import unittest as ut
 
+import numpy as np
 import stripeline.instrumentdb as idb
 
 class TestInstrumentDb(ut.TestCase):
@@ -18,3 +19,11 @@ class TestInstrumentDb(ut.TestCase):
                           idb.scanning_strategy_db_file_name()):
             self.assertTrue(os.path.exists(file_name),
                             'File "{0}" not found'.format(file_name))
+
+    def test_horn_orientations(self):
+        names, orientations = idb.load_horn_orientations()
+        self.assertEqual(len(names), 49)
+        self.assertEqual(names[0], 'I0')
+        self.assertEqual(orientations.shape, (49, 3))
+        self.assertTrue(np.allclose(np.linalg.norm(orientations, axis=1), 1.0,
+                                    atol=1e-5))
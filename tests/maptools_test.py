@@ -4,7 +4,9 @@
 import unittest as ut
 
 import stripeline.maptools as mt
+import stripeline.timetools as tt
 import numpy as np
+import healpy
 from mpi4py import MPI
 
 
@@ -28,6 +30,25 @@ class TestMaptools(ut.TestCase):
 
         self.assertTrue(np.allclose(expected, cond.matr))
 
+    def test_condmatr_map(self):
+        numpix = 5
+        cond = mt.ConditionMatrix(numpix=numpix)
+        # Pixel 0 is never observed, pixel 1 is observed with only one angle
+        cond.update(pixidx=np.array([1, 1, 2, 2, 2, 3, 3, 4, 4, 4, 4],
+                                    dtype='int32'),
+                    angle=np.array([0.3, 0.3, 0.0, 0.25, 0.5, 0.1, 0.2,
+                                    0.0, 0.4, 0.8, 1.2]) * np.pi)
+
+        expected = np.zeros(numpix)
+        for pixel in range(2, numpix):
+            expected[pixel] = 1.0 / \
+                np.linalg.cond(np.reshape(cond.matr[pixel], (3, 3)))
+
+        result = cond.to_map()
+        self.assertTrue(np.allclose(expected, result, atol=1e-7))
+        self.assertEqual(result[0], 0.0)
+        self.assertAlmostEqual(result[1], 0.0, places=7)
+
 
 class TestMapMakers(ut.TestCase):
 
@@ -52,6 +73,95 @@ class TestMapMakers(ut.TestCase):
         self.assertTrue(np.array_equal(np.array([2, 0, 3, 1]), hits))
 
 
+    def testBinnedMapMemory(self):
+        # Enough pixels and samples to use several tiles and threads
+        num_of_pixels = 3 * mt.BINNING_TILE_SIZE + 5
+        pixidx = (np.arange(100000) * 13) % num_of_pixels
+        signal = np.sin(np.arange(100000, dtype='float64'))
+
+        reference = np.bincount(pixidx, weights=signal,
+                                minlength=num_of_pixels)
+        reference_hits = np.bincount(pixidx, minlength=num_of_pixels)
+        mask = reference_hits > 0
+        reference[mask] /= reference_hits[mask]
+
+        # Private tiles, no memory at all (atomic updates), and a pool which
+        # is too small to contain all the tiles
+        for max_memory_mb in (1024, 0, 0.1):
+            pixels, hits = mt.binned_map(signal, pixidx, num_of_pixels,
+                                         max_memory_mb=max_memory_mb)
+            self.assertTrue(np.allclose(reference, pixels))
+            self.assertTrue(np.array_equal(reference_hits, hits))
+
+    def testBinnedMapAccumulate(self):
+        reference_map = np.array([5.0, 0.0, 2.0, -1.0])
+        pixidx = np.array([0, 2, 2, 3, 0, 2], dtype='int')
+        signal = np.array([4.0, 1.0, 2.0, -1.0, 6.0, 3.0])
+
+        pixels = np.zeros(4)
+        hits = np.zeros(4, dtype='int64')
+        for start, stop in [(0, 2), (2, 5), (5, 6)]:
+            mt.binned_map(signal[start:stop], pixidx[start:stop], 4,
+                          pixels, hits, reset=False, normalize=False)
+        mt.normalize_map(pixels, hits)
+
+        self.assertTrue(np.allclose(reference_map, pixels))
+        self.assertTrue(np.array_equal(np.array([2, 0, 3, 1]), hits))
+
+    def testAccumulateStripSamples(self):
+        pixidx = np.array([0, 2, 2, 3, 0, 2], dtype='int')
+        psi = np.array([0.0, 0.25, 0.5, 0.0, np.pi / 4, 1.0])
+        signals = np.array([[1.0, 2.0, 3.0, 4.0, 5.0, 6.0],
+                            [0.5, 0.1, 0.2, 0.3, 0.4, 0.5],
+                            [2.0, 1.0, 0.0, -1.0, -2.0, -3.0],
+                            [0.1, 0.2, 0.3, 0.3, 0.2, 0.1]])
+
+        accum = mt.accumulate_strip_samples(signals, psi, pixidx, 4,
+                                            pointing_matrix=True)
+        self.assertEqual(accum.shape, (9, 4))
+
+        # Compare with a computation done sample by sample
+        q_instr = 2.0 * (signals[0] + signals[1])
+        u_instr = 2.0 * (signals[2] + signals[3])
+        cos2psi, sin2psi = np.cos(2 * psi), np.sin(2 * psi)
+        values = [np.sum(signals, axis=0),
+                  cos2psi * q_instr - sin2psi * u_instr,
+                  sin2psi * q_instr + cos2psi * u_instr,
+                  np.ones(len(psi)),
+                  cos2psi, sin2psi, cos2psi**2, sin2psi * cos2psi, sin2psi**2]
+        for row, cur_values in enumerate(values):
+            expected = np.bincount(pixidx, weights=cur_values, minlength=4)
+            self.assertTrue(np.allclose(accum[row], expected))
+
+        map_i, map_q, map_u, hits = mt.accumulator_to_maps(accum)
+        self.assertTrue(np.array_equal(hits, [2, 0, 3, 1]))
+        self.assertTrue(np.allclose(map_i[hits > 0],
+                                    accum[0, hits > 0] / hits[hits > 0]))
+        self.assertEqual(map_i[1], 0.0)
+
+        # The pointing matrix must match the one computed by ConditionMatrix
+        cond = mt.ConditionMatrix(numpix=4)
+        cond.update(pixidx=pixidx.astype('int32'), angle=psi)
+        cond_accum = mt.ConditionMatrix(numpix=4)
+        cond_accum.update_from_accumulator(accum)
+        self.assertTrue(np.allclose(cond.matr, cond_accum.matr))
+
+    def testSparsePixels(self):
+        pixidx = [np.array([40, 2, 2, 31]), np.array([2, 40, 7])]
+        pixels = mt.SparsePixels.from_pixidx(pixidx, 48)
+        self.assertEqual(len(pixels), 4)
+        self.assertTrue(np.array_equal(pixels.pixels, [2, 7, 31, 40]))
+
+        local = pixels.local_index(pixidx[0])
+        self.assertTrue(np.array_equal(local, [3, 0, 0, 2]))
+        self.assertTrue(np.array_equal(pixels.global_index(local), pixidx[0]))
+
+        signal = np.array([1.0, 2.0, 4.0, 3.0])
+        compact, hits = mt.binned_map(signal, local, len(pixels))
+        dense, dense_hits = mt.binned_map(signal, pixidx[0], 48)
+        self.assertTrue(np.allclose(pixels.to_dense(compact), dense))
+        self.assertTrue(np.array_equal(pixels.to_dense(hits), dense_hits))
+
 # This class is used to provide some mock data for the MPI-based tests
 class MockToiProvider:
     def __init__(self, rank):
@@ -121,6 +231,17 @@ class MockToiProvider:
         return self.psi[self.rank]
 
 
+class MockBlockToiProvider(MockToiProvider, tt.ToiProvider):
+    'The same TOI as MockToiProvider, read in blocks using ToiProvider'
+
+    def get_time(self):
+        return self.time[self.rank]
+
+    def get_pointings(self):
+        # The centers of the pixels in "pixidx"
+        return healpy.pix2ang(1, self.pixidx[self.rank])
+
+
 class TestMapMakersMPI(ut.TestCase):
     def testBinnedMapMPI(self):
         comm = MPI.COMM_WORLD
@@ -151,3 +272,58 @@ class TestMapMakersMPI(ut.TestCase):
         self.assertTrue(np.allclose(map_q, expected_map_q))
         self.assertTrue(np.allclose(map_u, expected_map_u))
         self.assertTrue(np.alltrue(hits == expected_hits))
+
+    def testBinnedMapSparseMPI(self):
+        comm = MPI.COMM_WORLD
+        provider = MockToiProvider(comm.rank)
+
+        dense = mt.binned_map_strip(1, provider, comm=comm)
+        pixels = mt.SparsePixels.from_toi_provider(1, provider, comm=comm)
+        sparse = mt.binned_map_strip(1, provider, comm=comm, pixels=pixels)
+
+        self.assertTrue(len(pixels) < len(dense[0]))
+        for dense_map, sparse_map in zip(dense, sparse):
+            self.assertEqual(len(sparse_map), len(pixels))
+            self.assertTrue(np.allclose(dense_map,
+                                        pixels.to_dense(sparse_map)))
+
+    def testReduceAccumulatorMPI(self):
+        comm = MPI.COMM_WORLD
+        provider = MockToiProvider(comm.rank)
+        expected = mt.binned_map_strip(1, provider, comm=comm)
+
+        for hierarchical in (False, True):
+            result = mt.binned_map_strip(1, provider, comm=comm,
+                                         hierarchical=hierarchical)
+            for expected_map, cur_map in zip(expected, result):
+                self.assertTrue(np.allclose(expected_map, cur_map))
+
+            root = comm.size - 1
+            result = mt.binned_map_strip(1, provider, comm=comm, root=root,
+                                         hierarchical=hierarchical)
+            if comm.rank == root:
+                for expected_map, cur_map in zip(expected, result):
+                    self.assertTrue(np.allclose(expected_map, cur_map))
+            else:
+                self.assertIsNone(result)
+
+    def testStreamingMapMPI(self):
+        comm = MPI.COMM_WORLD
+        provider = MockBlockToiProvider(comm.rank)
+        expected = mt.binned_map_strip(1, provider, comm=comm)
+
+        for prefetch in (False, True):
+            # Blocks of two samples do not divide the TOI of any process
+            cond = mt.ConditionMatrix(numpix=12)
+            result = mt.streaming_map_strip(1, provider, block_size=2,
+                                            comm=comm, condition_matrix=cond,
+                                            prefetch=prefetch)
+            for expected_map, cur_map in zip(expected, result):
+                self.assertTrue(np.allclose(expected_map, cur_map))
+
+            # The condition matrix only contains the samples of this process
+            expected_cond = mt.ConditionMatrix(numpix=12)
+            expected_cond.update(
+                pixidx=provider.pixidx[comm.rank].astype('int32'),
+                angle=provider.psi[comm.rank])
+            self.assertTrue(np.allclose(cond.matr, expected_cond.matr))
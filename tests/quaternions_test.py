@@ -142,3 +142,39 @@ class TestOperations(ut.TestCase):
         print('comp_dir =', comp_dir)
         print('prod_dir =', prod_dir)
         self.assertTrue(np.allclose(comp_dir, prod_dir))
+
+
+class TestContiguousLayout(ut.TestCase):
+    '''Check the routines working on quaternions stored in (n, 4) C arrays'''
+
+    def setUp(self):
+        np.random.seed(27)
+        self.num = 101
+        self.q1 = np.random.rand(self.num, 4)
+        self.q2 = np.random.rand(self.num, 4)
+        self.vec = np.random.rand(self.num, 3)
+        self.angles = np.random.rand(self.num) * 2 * np.pi
+
+    def test_product(self):
+        result = q.qmul_c(self.q1.T, self.q2.T).T
+        self.assertTrue(result.flags.c_contiguous)
+        self.assertTrue(np.allclose(result, q.qmul(self.q1, self.q2)))
+
+    def test_norm(self):
+        quat = np.copy(self.q1)
+        quat[3, :] = 0.0
+        self.assertTrue(np.allclose(q.qnorm_c(quat.T).T, q.qnorm(quat)))
+
+    def test_from_axisangle(self):
+        self.assertTrue(np.allclose(
+            q.qfromaxisangle_c(self.vec.T, self.angles).T,
+            q.qfromaxisangle(self.vec, self.angles)))
+
+    def test_rotation(self):
+        self.assertTrue(np.allclose(q.qrotate_c(self.vec.T, self.q1.T).T,
+                                    q.qrotate(self.vec, self.q1)))
+
+    def test_fused_product_and_rotation(self):
+        expected = q.qrotate(self.vec, q.qmul(self.q1, self.q2))
+        self.assertTrue(np.allclose(
+            q.qmulrotate_c(self.vec.T, self.q1.T, self.q2.T).T, expected))
@@ -71,6 +71,82 @@ class TestFlatRNG(ut.TestCase):
         rng.fill_vector(result)
         self.assertTrue(np.allclose(result, FLAT_REF_ARRAY))
 
+    def test_skip(self):
+        'Check that skipping numbers is the same as drawing them'
+
+        for num_of_steps in (0, 1, 7, 128, 1000, 12345):
+            reference = ng.FlatRNG()
+            for i in range(num_of_steps):
+                reference.next()
+
+            rng = ng.FlatRNG()
+            rng.skip(num_of_steps)
+            self.assertTrue(np.array_equal(rng.state, reference.state),
+                            msg='Skipping {0} numbers failed'.format(num_of_steps))
+
+        rng = ng.FlatRNG()
+        rng.skip(3)
+        self.assertAlmostEqual(rng.next(), FLAT_REF_ARRAY[3])
+
+    def test_jump(self):
+        'Check that jumping by 2^k steps is the same as skipping 2^k numbers'
+
+        for log2_steps in (0, 1, 5, 10, 16):
+            rng1 = ng.FlatRNG()
+            rng1.jump(log2_steps)
+
+            rng2 = ng.FlatRNG()
+            rng2.skip(2**log2_steps)
+            self.assertTrue(np.array_equal(rng1.state, rng2.state))
+
+        with self.assertRaises(ValueError):
+            ng.FlatRNG().jump(128)
+
+
+class TestMultiLaneFlatRNG(ut.TestCase):
+
+    def test_first_lane(self):
+        'Check that the first lane reproduces the scalar generator'
+
+        for num_of_lanes in (4, 8, 16):
+            rng = ng.MultiLaneFlatRNG(num_of_lanes=num_of_lanes)
+            result = np.empty(len(FLAT_REF_ARRAY) * num_of_lanes)
+            rng.fill_vector(result)
+            self.assertTrue(np.allclose(result[::num_of_lanes],
+                                        FLAT_REF_ARRAY))
+
+    def test_lanes(self):
+        'Check that each lane is jumped ahead by 2^64 steps'
+
+        rng = ng.MultiLaneFlatRNG(num_of_lanes=4)
+        result = np.empty(40)
+        rng.fill_vector(result)
+
+        for lane in range(4):
+            reference = ng.FlatRNG()
+            for i in range(lane):
+                reference.jump(64)
+
+            expected = np.empty(10)
+            reference.fill_vector(expected)
+            self.assertTrue(np.array_equal(result[lane::4], expected))
+
+    def test_chunks(self):
+        'Check that the sequence does not depend on the size of each call'
+
+        for num_of_lanes in (3, 8):
+            reference = np.empty(100)
+            ng.MultiLaneFlatRNG(num_of_lanes=num_of_lanes).fill_vector(reference)
+
+            rng = ng.MultiLaneFlatRNG(num_of_lanes=num_of_lanes)
+            result = np.empty(100)
+            result[0] = rng.next()
+            for start, end in ((1, 6), (6, 7), (7, 50), (50, 100)):
+                chunk = np.empty(end - start)
+                rng.fill_vector(chunk)
+                result[start:end] = chunk
+
+            self.assertTrue(np.array_equal(result, reference))
 
 class TestNormalRNG(ut.TestCase):
 
@@ -90,6 +166,34 @@ class TestNormalRNG(ut.TestCase):
         rng.fill_vector(result)
         self.assertTrue(np.allclose(result, NORMAL_REF_ARRAY))
 
+    def test_vectorized(self):
+        'Check the statistical properties of the vectorized generator'
+
+        rng = ng.NormalRNG(mode='vectorized')
+        result = np.empty(100000)
+        rng.fill_vector(result)
+        self.assertAlmostEqual(np.mean(result), 0.0, places=2)
+        self.assertAlmostEqual(np.std(result), 1.0, places=2)
+
+    def test_vectorized_chunks(self):
+        'Check that the vectorized sequence does not depend on the size of each call'
+
+        reference = np.empty(1001)
+        ng.NormalRNG(mode='vectorized').fill_vector(reference)
+
+        rng = ng.NormalRNG(mode='vectorized')
+        result = np.empty(1001)
+        result[0] = rng.next()
+        for start, end in ((1, 4), (4, 517), (517, 1001)):
+            chunk = np.empty(end - start)
+            rng.fill_vector(chunk)
+            result[start:end] = chunk
+
+        self.assertTrue(np.array_equal(result, reference))
+
+    def test_invalid_mode(self):
+        with self.assertRaises(ValueError):
+            ng.NormalRNG(mode='foo')
 
 class TestOof2RNG(ut.TestCase):
 
@@ -128,6 +232,257 @@ class TestOofRNG(ut.TestCase):
         rng.fill_vector(result)
         self.assertTrue(np.allclose(result, OOF_REF_ARRAY))
 
+    def test_blocks(self):
+        'Check that the block-wise filter matches the sample-by-sample one'
+
+        reference_rng = ng.OofRNG(**OOF_REF_PARAMS)
+        reference = np.array([reference_rng.next() for i in range(3000)])
+
+        rng = ng.OofRNG(**OOF_REF_PARAMS)
+        result = np.empty(3000)
+        for start, end in ((0, 1), (1, 1500), (1500, 3000)):
+            chunk = np.empty(end - start)
+            rng.fill_vector(chunk)
+            result[start:end] = chunk
+
+        self.assertTrue(np.array_equal(result, reference))
+
+    def test_lookahead(self):
+        'Check that the look-ahead filter matches the exact one to rounding'
+
+        reference = np.empty(3000)
+        ng.OofRNG(**OOF_REF_PARAMS).fill_vector(reference)
+
+        result = np.empty(3000)
+        ng.OofRNG(lookahead=True, **OOF_REF_PARAMS).fill_vector(result)
+
+        self.assertTrue(np.allclose(result, reference, rtol=0.0, atol=1e-10))
+
+    def test_vectorized(self):
+        'Check that the vectorized mode filters the vectorized Gaussian numbers'
+
+        white = np.empty(100)
+        ng.NormalRNG(mode='vectorized').fill_vector(white)
+
+        rng = ng.OofRNG(mode='vectorized', **OOF_REF_PARAMS)
+        result = np.empty(100)
+        rng.fill_vector(result)
+
+        # The first sample goes through the filters with zero initial state,
+        # so that it is just a scaled version of the white noise sample
+        self.assertFalse(np.allclose(result, white))
+        self.assertAlmostEqual(result[0] / white[0],
+                               OOF_REF_ARRAY[0] / NORMAL_REF_ARRAY[0])
+
+
+class TestNoiseBank(ut.TestCase):
+
+    def test_identity(self):
+        'Check that each detector matches an independent OofRNG'
+
+        sigma = [1.0, 2.5, 0.5]
+        bank = ng.NoiseBank(fknee=[0.05, 0.01, 0.2], alpha=-1.7,
+                            sigma=sigma, fmin=1.15e-5, fsample=1.0)
+        result = np.empty((3, 2000))
+        bank.fill_matrix(result[:, :1000])
+        bank.fill_matrix(result[:, 1000:])
+
+        for det_idx, fknee in enumerate([0.05, 0.01, 0.2]):
+            reference_rng = ng.OofRNG(alpha=-1.7, fmin=1.15e-5, fknee=fknee,
+                                      fsample=1.0)
+            for i in range(det_idx):
+                reference_rng.jump(64)
+            reference = np.empty(2000)
+            reference_rng.fill_vector(reference)
+
+            self.assertTrue(np.allclose(result[det_idx],
+                                        sigma[det_idx] * reference))
+
+        # The first detector uses the default seeds
+        self.assertAlmostEqual(result[0, 0], OOF_REF_ARRAY[0])
+
+    def test_vectorized(self):
+        bank = ng.NoiseBank(fknee=0.05, alpha=[-1.0, -2.0], sigma=1.0,
+                            fmin=1e-5, fsample=1.0, mode='vectorized')
+        result = np.zeros((2, 1001))
+        bank.fill_matrix(result)
+        self.assertFalse(np.allclose(result[0], result[1]))
+        self.assertTrue(np.all(result != 0.0))
+
+class TestPsdNoiseRNG(ut.TestCase):
+
+    def test_white_noise(self):
+        # A flat PSD must produce white noise with the expected variance
+        freq = np.array([1e-3, 0.5])
+        rng = ng.PsdNoiseRNG(freq_hz=freq,
+                             psd=ng.oof_psd(freq, fknee=1e-10, alpha=-1.0,
+                                            sigma=2.0, fsample=1.0),
+                             fsample=1.0, filter_length=64)
+        result = np.empty(100000)
+        rng.fill_vector(result)
+        self.assertAlmostEqual(np.std(result), 2.0, places=1)
+        self.assertAlmostEqual(np.mean(result), 0.0, places=1)
+
+    def test_chunks(self):
+        freq = np.logspace(-3, np.log10(0.5), 20)
+        psd = ng.oof_psd(freq, fknee=0.05, alpha=-1.7, sigma=1.0,
+                         fsample=1.0)
+
+        whole = np.empty(5000)
+        ng.PsdNoiseRNG(freq_hz=freq, psd=psd, fsample=1.0).fill_vector(whole)
+
+        chunks = np.empty(5000)
+        rng = ng.PsdNoiseRNG(freq_hz=freq, psd=psd, fsample=1.0)
+        for start, stop in [(0, 1), (1, 700), (700, 3000), (3000, 5000)]:
+            rng.fill_vector(chunks[start:stop])
+
+        self.assertTrue(np.allclose(whole, chunks))
+
+    def test_default_filter_length(self):
+        psd = [1.0, 1.0]
+        rng = ng.PsdNoiseRNG(freq_hz=[0.01, 0.5], psd=psd, fsample=1.0)
+        self.assertEqual(rng.filter_length, 128)
+
+        # Without a limit, this would need 2^30 taps
+        rng = ng.PsdNoiseRNG(freq_hz=[1e-9, 0.5], psd=psd, fsample=1.0)
+        self.assertEqual(rng.filter_length,
+                         ng.PsdNoiseRNG.MAX_DEFAULT_FILTER_LENGTH)
+
+    def test_tabulated_psd(self):
+        freq, psd = ng.load_tabulated_psd({'psd_freq_hz': [0.1, 1.0],
+                                           'psd_k2_per_hz': [4.0, 1.0]})
+        self.assertTrue(np.allclose(freq, [0.1, 1.0]))
+        self.assertTrue(np.allclose(psd, [4.0, 1.0]))
+
+        with self.assertRaises(ValueError):
+            ng.load_tabulated_psd({'psd_freq_hz': [0.1, 1.0],
+                                   'psd_k2_per_hz': [4.0]})
+
+class TestCounterRNG(ut.TestCase):
+
+    def test_philox(self):
+        # Known-answer test from the Random123 distribution
+        result = ng.rng.philox_block(np.zeros(4, dtype='int32'), 0, 0)
+        self.assertEqual([int(x) & 0xFFFFFFFF for x in result],
+                         [0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8])
+
+    def test_random_access(self):
+        for distribution in ng.CounterRNG.DISTRIBUTIONS:
+            rng = ng.CounterRNG(seed=5, stream_id=2 ** 32 - 1,
+                                distribution=distribution)
+            whole = np.empty(1001)
+            rng.fill_vector(whole)
+            self.assertEqual(rng.position, 1001)
+
+            # Chunks generated out of order, with odd boundaries
+            chunks = np.empty(1001)
+            for start, stop in [(513, 1001), (3, 513), (0, 3)]:
+                rng.fill_vector(chunks[start:stop], first_sample=start)
+            self.assertTrue(np.all(whole == chunks))
+
+            rng.seek(7)
+            self.assertEqual(rng.next(), whole[7])
+
+    def test_streams(self):
+        first = np.empty(100)
+        second = np.empty(100)
+        ng.CounterRNG(seed=1, stream_id=0).fill_vector(first)
+        ng.CounterRNG(seed=1, stream_id=1).fill_vector(second)
+        self.assertFalse(np.allclose(first, second))
+
+    def test_distributions(self):
+        result = np.empty(100000)
+        ng.CounterRNG(distribution='uniform').fill_vector(result)
+        self.assertTrue(np.all((result >= 0.0) & (result < 1.0)))
+        self.assertAlmostEqual(np.mean(result), 0.5, places=2)
+
+        ng.CounterRNG(distribution='normal').fill_vector(result)
+        self.assertAlmostEqual(np.mean(result), 0.0, places=1)
+        self.assertAlmostEqual(np.std(result), 1.0, places=1)
+
+        with self.assertRaises(ValueError):
+            ng.CounterRNG(distribution='poisson')
+        with self.assertRaises(ValueError):
+            ng.CounterRNG(seed=-1)
+
+class TestNoGIL(ut.TestCase):
+
+    def test_strided(self):
+        generators = [lambda: ng.FlatRNG(),
+                      lambda: ng.MultiLaneFlatRNG(),
+                      lambda: ng.NormalRNG(),
+                      lambda: ng.NormalRNG(mode='vectorized'),
+                      lambda: ng.CounterRNG(stream_id=3),
+                      lambda: ng.Oof2RNG(fmin=1e-5, fknee=0.05, fsample=1.0),
+                      lambda: ng.OofRNG(alpha=-1.5, fmin=1e-5, fknee=0.05,
+                                        fsample=1.0, mode='vectorized'),
+                      lambda: ng.OofRNG(alpha=-1.5, fmin=1e-5, fknee=0.05,
+                                        fsample=1.0, lookahead=True)]
+        for new_generator in generators:
+            reference = np.empty(3001)
+            new_generator().fill_vector(reference)
+
+            # Every third element, in reverse order
+            result = np.zeros(3 * 3001)
+            new_generator().fill_vector_nogil(result[::-3])
+            self.assertTrue(np.all(result[::-3] == reference))
+            self.assertTrue(np.all(result[1::3] == 0.0))
+
+    def test_threads(self):
+        from concurrent.futures import ThreadPoolExecutor
+
+        result = np.empty((4, 10000))
+        generators = [ng.NormalRNG(x_init=i + 1) for i in range(4)]
+        with ThreadPoolExecutor(max_workers=4) as executor:
+            list(executor.map(lambda i: generators[i].fill_vector_nogil(
+                result[i]), range(4)))
+
+        for i in range(4):
+            reference = np.empty(10000)
+            ng.NormalRNG(x_init=i + 1).fill_vector(reference)
+            self.assertTrue(np.all(result[i] == reference))
+
+    def test_invalid_array(self):
+        with self.assertRaises(ValueError):
+            ng.FlatRNG().fill_vector_nogil(np.empty(10, dtype='float32'))
+        with self.assertRaises(ValueError):
+            ng.FlatRNG().fill_vector_nogil(np.empty((2, 5)))
+
+class TestSnapshots(ut.TestCase):
+
+    def test_restore(self):
+        generators = [lambda: ng.FlatRNG(),
+                      lambda: ng.MultiLaneFlatRNG(num_of_lanes=4),
+                      lambda: ng.NormalRNG(),
+                      lambda: ng.NormalRNG(mode='vectorized'),
+                      lambda: ng.CounterRNG(seed=2 ** 32 - 1, stream_id=4),
+                      lambda: ng.Oof2RNG(fmin=1e-5, fknee=0.05, fsample=1.0),
+                      lambda: ng.OofRNG(alpha=-1.5, fmin=1e-5, fknee=0.05,
+                                        fsample=1.0)]
+        for new_generator in generators:
+            generator = new_generator()
+            # Use an odd number, so that a Gaussian number is cached
+            generator.fill_vector(np.empty(1001))
+            snapshot = generator.snapshot()
+
+            expected = np.empty(1000)
+            generator.fill_vector(expected)
+
+            restored = new_generator()
+            restored.restore(snapshot)
+            result = np.empty(1000)
+            restored.fill_vector(result)
+            self.assertTrue(np.all(result == expected))
+
+    def test_mismatch(self):
+        snapshot = ng.FlatRNG().snapshot()
+        with self.assertRaises(ValueError):
+            ng.NormalRNG().restore(snapshot)
+        with self.assertRaises(ValueError):
+            ng.NormalRNG(mode='vectorized').restore(
+                ng.NormalRNG().snapshot())
+        with self.assertRaises(ValueError):
+            ng.FlatRNG().restore(b'not a snapshot')
 
 if __name__ == '__main__':
     ut.main()
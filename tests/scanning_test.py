@@ -2,11 +2,63 @@
 # -*- encoding: utf-8 -*-
 
 import unittest as ut
+import os.path
+import tempfile
 
+import healpy
+import stripeline.quaternions as q
 import stripeline.scanning as sc
+import stripeline.todfile as tf
 import numpy as np
 
 
+def numpy_pointings(scanning: sc.ScanningStrategy, dir_vec, time_vec,
+                    offset=None):
+    '''Compute pointings using the array routines in stripeline.quaternions
+
+    This is the sequence of NumPy operations that the compiled kernel used by
+    generate_pointings is meant to reproduce. If "offset" is specified, it
+    is the quaternion of a horn, which is applied after the attitude of the
+    boresight "dir_vec".'''
+
+    x_vec = np.array([1., 0., 0.])
+    z_vec = np.array([0., 0., 1.])
+    num = time_vec.size
+    tile_dir = np.reshape(np.tile(dir_vec, num), (-1, 3))
+    tile_x = np.reshape(np.tile(x_vec, num), (-1, 3))
+    tile_z = np.reshape(np.tile(z_vec, num), (-1, 3))
+
+    wheel1_angle = np.deg2rad(scanning.wheel1_angle0_deg) + \
+        sc.time_to_rot_angle(time_vec, scanning.wheel1_rpm)
+    wheel3_angle = np.deg2rad(scanning.wheel3_angle0_deg) + \
+        sc.time_to_rot_angle(time_vec, scanning.wheel3_rpm)
+    qwheel1 = q.qfromaxisangle(tile_dir, wheel1_angle)
+    qwheel2 = q.qfromaxisangle(
+        tile_x, np.deg2rad(scanning.wheel2_angle0_deg) * np.ones(num))
+    qwheel3 = q.qfromaxisangle(tile_z, wheel3_angle)
+    ground_quat = q.qmul(qwheel3, q.qmul(qwheel2, qwheel1))
+
+    location_quat = q.qfromaxisangle(
+        tile_x, np.deg2rad(90.0 - scanning.latitude_deg) * np.ones(num))
+    earth_rot_quat = q.qfromaxisangle(tile_z, 2 * np.pi * time_vec / 86400.0)
+    quat = q.qmul(earth_rot_quat, q.qmul(location_quat, ground_quat))
+    if offset is not None:
+        quat = q.qmul(quat, np.reshape(np.tile(offset, num), (-1, 4)))
+    dirs = q.qrotate(tile_dir, quat)
+    poldirs = q.qrotate(tile_x, quat)
+    theta, phi = healpy.vec2ang(dirs)
+
+    northdir = np.column_stack((-np.cos(theta) * np.cos(phi),
+                                -np.cos(theta) * np.sin(phi),
+                                np.sin(theta)))
+    cos_psi = np.clip(np.sum(northdir * poldirs, axis=1), -1.0, 1.0)
+    cross = np.cross(northdir, poldirs)
+    sin_psi = np.clip(np.sum(cross * cross, axis=1), -1.0, 1.0)
+    psi = np.arctan2(sin_psi, cos_psi) * np.sign(np.sum(cross * dirs, axis=1))
+
+    return np.column_stack((time_vec, theta, phi, psi))
+
+
 class PointingStorage:
     def __init__(self):
         self.time = None
@@ -63,3 +115,314 @@ class TestScanning(ut.TestCase):
         self.assertTrue(np.allclose(storage.theta, np.deg2rad([
             90.0, 0.0, 90.0, 180.0
         ])), "theta is {0}".format(storage.theta))
+
+    def test_compiled_kernel(self):
+        scanning = sc.ScanningStrategy(wheel1_rpm=1.5,
+                                       wheel3_rpm=3.0,
+                                       wheel1_angle0_deg=12.0,
+                                       wheel2_angle0_deg=35.0,
+                                       wheel3_angle0_deg=-20.0,
+                                       latitude_deg=28.3,
+                                       overall_time_s=60.0,
+                                       sampling_frequency_hz=50.0)
+        dir_vec = np.array([0.1, 0.2, 0.97])
+        start_time = 1234.5
+        num = 3000
+
+        pointings = sc.compute_pointings(scanning=scanning,
+                                         dir_vec=dir_vec,
+                                         start_time=start_time,
+                                         num_of_samples=num)
+        self.assertEqual(pointings.shape, (num, 4))
+        self.assertTrue(pointings.flags.c_contiguous)
+
+        time_vec = start_time + np.arange(num) / scanning.sampling_frequency_hz
+        expected = numpy_pointings(scanning, dir_vec, time_vec)
+        self.assertTrue(np.allclose(pointings, expected, rtol=0, atol=1e-10))
+
+    def test_interpolation(self):
+        scanning = sc.ScanningStrategy(wheel1_rpm=0.0,
+                                       wheel3_rpm=1.0,
+                                       wheel1_angle0_deg=0.0,
+                                       wheel2_angle0_deg=20.0,
+                                       wheel3_angle0_deg=0.0,
+                                       latitude_deg=28.3,
+                                       overall_time_s=600.0,
+                                       sampling_frequency_hz=50.0)
+        dir_vec = [0.0, 0.1, 0.995]
+        num = 30000
+        exact = sc.compute_pointings(scanning, dir_vec, 100.0, num)
+
+        # With no decimation, nothing is interpolated
+        pointings, error = sc.interpolate_pointings(scanning, dir_vec, 100.0,
+                                                    num, decimation=1)
+        self.assertEqual(error, 0.0)
+        self.assertTrue(np.allclose(pointings, exact, rtol=0, atol=1e-12))
+
+        pointings, error = sc.interpolate_pointings(scanning, dir_vec, 100.0,
+                                                    num, decimation=250)
+        self.assertAlmostEqual(
+            error,
+            sc.estimate_interpolation_error(scanning, dir_vec, 100.0, num, 250))
+        self.assertTrue(np.allclose(pointings[:, 0], exact[:, 0]))
+        max_diff = np.rad2deg(np.max(np.abs(pointings[:, 1] - exact[:, 1])))
+        self.assertLessEqual(max_diff * 3600.0, error * 1.01)
+
+        # Ask for an accuracy target instead of a decimation factor
+        decimation = sc.choose_decimation(scanning, dir_vec, 100.0, num, 1.0)
+        self.assertGreater(decimation, 1)
+        pointings, error = sc.interpolate_pointings(scanning, dir_vec, 100.0,
+                                                    num, max_error_arcsec=1.0)
+        self.assertLessEqual(error, 1.0)
+
+    def test_pixel_indexes(self):
+        scanning = sc.ScanningStrategy(wheel1_rpm=0.0,
+                                       wheel3_rpm=1.0,
+                                       wheel1_angle0_deg=0.0,
+                                       wheel2_angle0_deg=20.0,
+                                       wheel3_angle0_deg=0.0,
+                                       latitude_deg=28.3,
+                                       overall_time_s=600.0,
+                                       sampling_frequency_hz=50.0)
+        dir_vec = [0.0, 0.1, 0.995]
+        num = 30000
+        pointings = sc.compute_pointings(scanning, dir_vec, 0.0, num)
+
+        for nest in (False, True):
+            expected = healpy.ang2pix(256, pointings[:, 1], pointings[:, 2],
+                                      nest=nest)
+            pixidx = sc.compute_pixel_indexes(scanning, dir_vec, 0.0, num,
+                                              nside=256, nest=nest)
+            self.assertEqual(pixidx.dtype, np.int64)
+            self.assertTrue(np.all(pixidx == expected))
+
+        with self.assertRaises(ValueError):
+            sc.compute_pixel_indexes(scanning, dir_vec, 0.0, num,
+                                     nside=100, nest=True)
+
+        # generate_pointings passes the pixels to the callback
+        storage = {}
+
+        def callback(pointings, scanning, dir_vec, index, pixidx):
+            storage['pointings'] = pointings
+            storage['pixidx'] = pixidx
+
+        scanning.overall_time_s = num / scanning.sampling_frequency_hz
+        sc.generate_pointings(scanning=scanning, dir_vec=dir_vec,
+                              num_of_chunks=1, tod_callback=callback,
+                              nside=256)
+        self.assertTrue(np.allclose(storage['pointings'], pointings))
+        self.assertTrue(np.all(storage['pixidx'] == healpy.ang2pix(
+            256, pointings[:, 1], pointings[:, 2])))
+
+        # With interpolation, the pixels follow the interpolated pointings
+        sc.generate_pointings(scanning=scanning, dir_vec=dir_vec,
+                              num_of_chunks=1, tod_callback=callback,
+                              nside=256, decimation=250)
+        self.assertTrue(np.all(storage['pixidx'] == healpy.ang2pix(
+            256, storage['pointings'][:, 1], storage['pointings'][:, 2])))
+
+    def test_focal_plane(self):
+        scanning = sc.ScanningStrategy(wheel1_rpm=1.5,
+                                       wheel3_rpm=3.0,
+                                       wheel1_angle0_deg=12.0,
+                                       wheel2_angle0_deg=35.0,
+                                       wheel3_angle0_deg=-20.0,
+                                       latitude_deg=28.3,
+                                       overall_time_s=60.0,
+                                       sampling_frequency_hz=50.0)
+        directions = np.array([[0.0, 0.0, 1.0],
+                               [-1.077670e-02, -1.876756e-02, 9.997658e-01],
+                               [0.1, 0.05, 0.9]])
+        offsets = sc.horn_offsets(directions)
+        self.assertTrue(np.allclose(offsets[0], [0.0, 0.0, 0.0, 1.0]))
+
+        num = 1000
+        pointings, pixidx = sc.compute_focal_plane_pointings(
+            scanning, offsets, 10.0, num, nside=128)
+        self.assertEqual(pointings.shape, (3, num, 4))
+        self.assertEqual(pixidx.shape, (3, num))
+
+        time_vec = 10.0 + np.arange(num) / scanning.sampling_frequency_hz
+        for horn_idx in range(len(directions)):
+            expected = numpy_pointings(scanning, [0.0, 0.0, 1.0], time_vec,
+                                       offset=offsets[horn_idx])
+            self.assertTrue(np.allclose(pointings[horn_idx], expected,
+                                        rtol=0, atol=1e-10))
+            self.assertTrue(np.all(pixidx[horn_idx] == healpy.ang2pix(
+                128, expected[:, 1], expected[:, 2])))
+
+        # The boresight is the same as the single-beam computation
+        self.assertTrue(np.allclose(
+            pointings[0],
+            sc.compute_pointings(scanning, [0.0, 0.0, 1.0], 10.0, num)))
+
+        storage = {}
+
+        def callback(pointings, scanning, dir_vec, index):
+            storage['pointings'] = pointings
+            storage['dir_vec'] = dir_vec
+
+        scanning.overall_time_s = num / scanning.sampling_frequency_hz
+        sc.generate_pointings(scanning=scanning, num_of_chunks=1,
+                              tod_callback=callback, time0_s=10.0,
+                              horn_offsets=offsets)
+        self.assertTrue(np.allclose(storage['pointings'], pointings))
+        self.assertTrue(np.allclose(
+            storage['dir_vec'],
+            directions / np.linalg.norm(directions, axis=1)[:, np.newaxis]))
+
+    def test_focal_plane_off_axis(self):
+        '''Compare the focal-plane mode with a beam along an off-axis horn
+
+        In the focal-plane mode, wheel 1 turns the whole focal plane around
+        the boresight, and the polarization axis is rotated with the horn.
+        With dir_vec set to the direction of the horn, wheel 1 turns around
+        dir_vec, and the polarization axis is the x axis.'''
+        direction = np.array([0.1, 0.05, 0.9])
+        direction /= np.linalg.norm(direction)
+        offsets = sc.horn_offsets(direction)
+        num = 200
+
+        for wheel1_rpm in (0.0, 1.5):
+            scanning = sc.ScanningStrategy(wheel1_rpm=wheel1_rpm,
+                                           wheel3_rpm=3.0,
+                                           wheel2_angle0_deg=35.0,
+                                           latitude_deg=28.3,
+                                           overall_time_s=60.0,
+                                           sampling_frequency_hz=50.0)
+            pointings = sc.compute_focal_plane_pointings(
+                scanning, offsets, 10.0, num)[0][0]
+            time_vec = 10.0 + np.arange(num) / scanning.sampling_frequency_hz
+            dirs = healpy.ang2vec(pointings[:, 1], pointings[:, 2])
+
+            # The horn points where a beam along its direction, turned
+            # around the boresight by wheel 1, would point
+            wheel1_angle = sc.time_to_rot_angle(time_vec, wheel1_rpm)
+            horn_dirs = q.qrotate(np.tile(direction, (num, 1)),
+                                  q.qfromaxisangle(np.tile([0., 0., 1.],
+                                                           (num, 1)),
+                                                   wheel1_angle))
+            for i in (0, num // 2, num - 1):
+                expected = sc.compute_pointings(scanning, horn_dirs[i],
+                                                time_vec[i], 1)
+                self.assertTrue(np.allclose(
+                    dirs[i], healpy.ang2vec(expected[0, 1], expected[0, 2]),
+                    rtol=0, atol=1e-10))
+
+            single = sc.compute_pointings(scanning, direction, 10.0, num)
+            if wheel1_rpm == 0.0:
+                # With wheel 1 at rest, only the polarization angle differs
+                self.assertTrue(np.allclose(
+                    dirs, healpy.ang2vec(single[:, 1], single[:, 2]),
+                    rtol=0, atol=1e-10))
+            else:
+                self.assertFalse(np.allclose(pointings[:, 1], single[:, 1]))
+            self.assertFalse(np.allclose(pointings[:, 3], single[:, 3]))
+
+    def test_async_writer(self):
+        scanning = sc.ScanningStrategy(wheel3_rpm=1.0,
+                                       wheel2_angle0_deg=45.0,
+                                       latitude_deg=28.3,
+                                       overall_time_s=40.0,
+                                       sampling_frequency_hz=50.0)
+
+        sync_chunks = []
+        async_chunks = []
+
+        def make_callback(storage):
+            def callback(pointings, scanning, dir_vec, index):
+                storage.append((index, pointings))
+            return callback
+
+        sc.generate_pointings(scanning=scanning, num_of_chunks=4,
+                              tod_callback=make_callback(sync_chunks))
+        with sc.AsyncTodWriter(make_callback(async_chunks)) as writer:
+            sc.generate_pointings(scanning=scanning, num_of_chunks=4,
+                                  tod_callback=writer)
+
+        # The chunks are written in the same order, and they are the same
+        self.assertEqual([x[0] for x in async_chunks], [0, 1, 2, 3])
+        for (_, sync_pnt), (_, async_pnt) in zip(sync_chunks, async_chunks):
+            self.assertTrue(np.allclose(sync_pnt, async_pnt))
+
+        # Errors in the callback are raised again in the caller
+        def failing_callback(pointings, scanning, dir_vec, index):
+            raise IOError('disk full')
+
+        writer = sc.AsyncTodWriter(failing_callback)
+        with self.assertRaises(IOError):
+            sc.generate_pointings(scanning=scanning, num_of_chunks=4,
+                                  tod_callback=writer)
+            writer.close()
+
+    def test_parallel_chunks(self):
+        scanning = sc.ScanningStrategy(wheel3_rpm=1.0,
+                                       wheel2_angle0_deg=45.0,
+                                       latitude_deg=28.3,
+                                       overall_time_s=40.0,
+                                       sampling_frequency_hz=50.0)
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            # The callback runs in other processes: the files are the only
+            # way to get the chunks back
+            writer = sc.TodWriter(outdir=tmpdir,
+                                  file_name_mask='tod_{index:04d}.stod',
+                                  file_format='chunked')
+            sc.generate_pointings(scanning=scanning, num_of_chunks=4,
+                                  tod_callback=writer, num_of_processes=2,
+                                  nside=64)
+
+            chunks = sc.timetools.split_time_range(
+                time_length=40.0, num_of_chunks=4, sampfreq=50.0)
+            for index, cur_chunk in enumerate(chunks):
+                tod = tf.ChunkedTodFile(os.path.join(
+                    tmpdir, 'tod_{0:04d}.stod'.format(index)))
+                self.assertEqual(tod.metadata['TODIDX'], index)
+
+                expected = sc.compute_pointings(scanning, [0, 0, 1],
+                                                cur_chunk.start_time,
+                                                cur_chunk.num_of_samples)
+                self.assertTrue(np.allclose(tod.read('TIME'), expected[:, 0]))
+                for col_idx, name in ((1, 'THETA'), (2, 'PHI'), (3, 'PSI')):
+                    self.assertTrue(np.allclose(tod.read(name),
+                                                expected[:, col_idx]))
+                self.assertTrue(np.all(tod.read('PIXIDX') == healpy.ang2pix(
+                    64, expected[:, 1], expected[:, 2])))
+
+    def test_chunked_pixels_only(self):
+        scanning = sc.ScanningStrategy(wheel3_rpm=1.0,
+                                       wheel2_angle0_deg=45.0,
+                                       latitude_deg=28.3,
+                                       overall_time_s=10.0,
+                                       sampling_frequency_hz=50.0)
+
+        with self.assertRaises(ValueError):
+            sc.TodWriter(save_angles=False, nside=64)
+        with self.assertRaises(ValueError):
+            sc.TodWriter(file_format='chunked', save_angles=False)
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            writer = sc.TodWriter(outdir=tmpdir,
+                                  file_name_mask='tod_{index:04d}.stod',
+                                  file_format='chunked',
+                                  save_angles=False,
+                                  nside=64)
+            sc.generate_pointings(scanning=scanning, num_of_chunks=1,
+                                  tod_callback=writer, nside=64)
+
+            tod = tf.ChunkedTodFile(os.path.join(tmpdir, 'tod_0000.stod'))
+            self.assertFalse(tod.has_column('THETA'))
+            self.assertFalse(tod.has_column('PHI'))
+            self.assertEqual(tod.metadata['NSIDE'], 64)
+            self.assertFalse(tod.metadata['NEST'])
+
+            expected = sc.compute_pointings(scanning, [0, 0, 1], 0.0, 500)
+            self.assertTrue(np.allclose(tod.read('PSI'), expected[:, 3]))
+            self.assertTrue(np.all(tod.read('PIXIDX') == healpy.ang2pix(
+                64, expected[:, 1], expected[:, 2])))
+
+            # Without pixel indexes, the pointings would be lost
+            with self.assertRaises(ValueError):
+                sc.generate_pointings(scanning=scanning, num_of_chunks=1,
+                                      tod_callback=writer)
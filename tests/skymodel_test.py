@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+# -*- encoding: utf-8 -*-
+
+import unittest as ut
+import pickle
+
+import healpy
+import stripeline.skymodel as sm
+import numpy as np
+
+
+class TestSkyModel(ut.TestCase):
+
+    def setUp(self):
+        self.nside = 4
+        npix = healpy.nside2npix(self.nside)
+        self.sky_i = np.arange(npix, dtype='float64')
+        self.sky_q = np.sin(self.sky_i)
+        self.sky_u = np.cos(self.sky_i)
+
+    def test_ring(self):
+        model = sm.SkyModel.from_maps(self.sky_i, self.sky_q, self.sky_u)
+        self.assertEqual(model.iqu.shape, (len(self.sky_i), 3))
+        self.assertTrue(model.iqu.flags.c_contiguous)
+        self.assertFalse(model.iqu.flags.writeable)
+
+        pixidx = np.array([0, 17, 5, 191])
+        self.assertTrue(np.all(model.sample(pixidx) ==
+                               np.column_stack((self.sky_i[pixidx],
+                                                self.sky_q[pixidx],
+                                                self.sky_u[pixidx]))))
+
+    def test_nest(self):
+        model = sm.SkyModel.from_maps(self.sky_i, self.sky_q, self.sky_u,
+                                      nest=True, dtype='float32')
+        self.assertEqual(model.iqu.dtype, np.dtype('float32'))
+
+        # The same direction gives the same values in both schemes
+        theta = np.linspace(0.1, 3.0, 20)
+        phi = np.linspace(0.0, 6.0, 20)
+        ring_pixidx = healpy.ang2pix(self.nside, theta, phi)
+        self.assertTrue(np.all(model.pixel_index(theta, phi) ==
+                               healpy.ang2pix(self.nside, theta, phi,
+                                              nest=True)))
+        self.assertTrue(np.allclose(model.sample(model.pixel_index(theta, phi)),
+                                    np.column_stack((self.sky_i[ring_pixidx],
+                                                     self.sky_q[ring_pixidx],
+                                                     self.sky_u[ring_pixidx])),
+                                    rtol=1e-6))
+
+        copy = pickle.loads(pickle.dumps(model))
+        self.assertTrue(copy.nest)
+        self.assertTrue(np.all(copy.iqu == model.iqu))
+        # The copy must not free the communicator of the original
+        self.assertIsNone(copy._node_comm)
+        self.assertFalse(copy._owns_node_comm)
+
+    def test_errors(self):
+        with self.assertRaises(ValueError):
+            sm.SkyModel(self.nside, dtype='int32')
+
+        model = sm.SkyModel(self.nside)
+        with self.assertRaises(ValueError):
+            model.set_maps(self.sky_i[:-1], self.sky_q[:-1], self.sky_u[:-1])
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+# -*- encoding: utf-8 -*-
+
+import unittest as ut
+import os.path
+import tempfile
+
+import healpy
+from astropy.io import fits
+import stripeline.scanning as sc
+import stripeline.stripsim as stripsim
+import stripeline.todfile as tf
+import numpy as np
+
+NSIDE = 4
+
+
+def make_writer(outdir, file_format, file_name_mask):
+    npix = healpy.nside2npix(NSIDE)
+    sky_i = np.arange(npix, dtype='float64')
+    parameters = {'wn_sigma_det_{0}_k'.format(x): 0.0
+                  for x in ('Q1', 'Q2', 'U1', 'U2')}
+    return stripsim.TodWriter(sky_i, np.zeros(npix), np.zeros(npix),
+                              parameters, outdir=outdir,
+                              file_name_mask=file_name_mask,
+                              file_format=file_format)
+
+
+class TestTodWriter(ut.TestCase):
+
+    def setUp(self):
+        self.scanning = sc.ScanningStrategy(wheel3_rpm=1.0,
+                                            wheel2_angle0_deg=45.0,
+                                            latitude_deg=28.3,
+                                            overall_time_s=10.0,
+                                            sampling_frequency_hz=10.0)
+
+    def run_writer(self, writer):
+        sc.generate_pointings(scanning=self.scanning, num_of_chunks=2,
+                              tod_callback=writer, nside=NSIDE)
+
+    def test_fits(self):
+        with tempfile.TemporaryDirectory() as tmpdir:
+            writer = make_writer(tmpdir, 'fits', 'TOI_{index:04d}.fits')
+            self.run_writer(writer)
+
+            for index in range(2):
+                file_name = os.path.join(tmpdir,
+                                         'TOI_{0:04d}.fits'.format(index))
+                with fits.open(file_name) as f:
+                    data = f['TOD'].data
+                    self.assertEqual(len(data), 50)
+                    self.assertEqual(f['TOD'].header['TODIDX'], index)
+                    self.assertEqual(f['TOD'].header['RNGSEED'],
+                                     writer.noise_seed)
+
+                    # Without noise and polarization, each detector measures
+                    # a quarter of the intensity
+                    pixidx = healpy.ang2pix(NSIDE, data.field('THETA'),
+                                            data.field('PHI'))
+                    self.assertTrue(np.allclose(data.field('DETQ1'),
+                                                0.25 * pixidx))
+
+    def test_chunked(self):
+        with tempfile.TemporaryDirectory() as tmpdir:
+            writer = make_writer(tmpdir, 'chunked', 'TOI_{index:04d}.stod')
+            self.run_writer(writer)
+
+            tod = tf.ChunkedTodFile(os.path.join(tmpdir, 'TOI_0001.stod'))
+            self.assertEqual(tod.num_of_samples, 50)
+            self.assertEqual(tod.metadata['NSIDE'], NSIDE)
+            self.assertTrue(np.allclose(tod.read('DETU2'),
+                                        0.25 * tod.read('PIXIDX'),
+                                        rtol=1e-6))
+
+    def test_noise_seed(self):
+        # Without an explicit seed, each simulation uses a different one
+        with tempfile.TemporaryDirectory() as tmpdir:
+            seeds = [make_writer(tmpdir, 'fits', 'TOI_{index:04d}.fits')
+                     .noise_seed for i in range(2)]
+        self.assertNotEqual(seeds[0], seeds[1])
+
+        npix = healpy.nside2npix(NSIDE)
+        parameters = {'wn_sigma_det_{0}_k'.format(x): 1.0
+                      for x in ('Q1', 'Q2', 'U1', 'U2')}
+        parameters['noise_seed'] = 12
+        writer = stripsim.TodWriter(np.zeros(npix), np.zeros(npix),
+                                    np.zeros(npix), parameters)
+        self.assertEqual(writer.noise_seed, 12)
+
+    def test_restore_noise_state(self):
+        npix = healpy.nside2npix(NSIDE)
+        parameters = {'wn_sigma_det_{0}_k'.format(x): 1.0
+                      for x in stripsim.DETECTOR_NAMES}
+        parameters['noise_seed'] = 12
+        with tempfile.TemporaryDirectory() as tmpdir:
+            # With no signal, the output of the detectors is the noise
+            writer = stripsim.TodWriter(np.zeros(npix), np.zeros(npix),
+                                        np.zeros(npix), parameters,
+                                        outdir=tmpdir)
+            self.run_writer(writer)
+
+            with fits.open(os.path.join(tmpdir, 'TOI_0001.fits')) as f:
+                header = f['TOD'].header
+                for det_idx, name in enumerate(stripsim.DETECTOR_NAMES):
+                    noise = np.empty(50)
+                    rng = stripsim.restore_noise_state(header, name)
+                    self.assertEqual(rng.stream_id, det_idx)
+                    rng.fill_vector(noise)
+                    self.assertTrue(np.allclose(
+                        f['TOD'].data.field('DET' + name), noise))
+
+    def test_pixel_range(self):
+        with tempfile.TemporaryDirectory() as tmpdir:
+            writer = make_writer(tmpdir, 'fits', 'TOI_{index:04d}.fits')
+            pointings = sc.compute_pointings(self.scanning, [0.0, 0.0, 1.0],
+                                             0.0, 10)
+
+            # E.g., pixels computed for a NSIDE larger than the maps'
+            npix = healpy.nside2npix(NSIDE)
+            for pixidx in (-1, npix):
+                with self.assertRaises(ValueError):
+                    writer(pointings=pointings, scanning=self.scanning,
+                           dir_vec=[0.0, 0.0, 1.0], index=0,
+                           pixidx=np.full(10, pixidx, dtype=np.int64))
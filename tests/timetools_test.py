@@ -2,8 +2,13 @@
 # -*- encoding: utf-8 -*-
 
 import unittest as ut
+import json
 import os.path
+import tempfile
+import threading
+import time
 
+import healpy
 import stripeline.timetools as tt
 import numpy as np
 
@@ -42,6 +47,26 @@ class TestTimeTools(ut.TestCase):
 class TestToiProviders(ut.TestCase):
     'Test classes like ToiProvider and FitsToiProvider'
 
+    def setUp(self):
+        # Three FITS files with the time, the pointings, and the signals of
+        # four detectors in separate HDUs
+        test_file_path = os.path.dirname(__file__)
+        self.file_names = [os.path.join(test_file_path, x)
+                           for x in ['toi_test_A.fits',
+                                     'toi_test_B.fits',
+                                     'toi_test_C.fits']]
+        self.file_layout = \
+            tt.FitsTableLayout(time_col=tt.FitsColumn(hdu=1, column='TIME'),
+                               theta_col=tt.FitsColumn(hdu=2, column=0),
+                               phi_col=tt.FitsColumn(hdu=2, column=1),
+                               psi_col=tt.FitsColumn(hdu=2, column=2),
+                               signal_cols=[
+                                   tt.FitsColumn(hdu=3, column='DET_Q1'),
+                                   tt.FitsColumn(hdu=3, column='DET_Q2'),
+                                   tt.FitsColumn(hdu=3, column='DET_U1'),
+                                   tt.FitsColumn(hdu=3, column='DET_U2')
+                               ])
+
     def test_split(self):
         'Verify that "split_into_n" returns the expected results.'
         self.assertEqual(tuple(tt.split_into_n(10, 4)), (2, 3, 2, 3))
@@ -89,30 +114,14 @@ class TestToiProviders(ut.TestCase):
     def test_fits_tois(self):
         'Verify that FitsToiProvider is able to load some real data from FITS files'
 
-        test_file_path = os.path.dirname(__file__)
-        file_names = [os.path.join(test_file_path, x) for x in ['toi_test_A.fits',
-                                                                'toi_test_B.fits',
-                                                                'toi_test_C.fits']]
-        file_layout = \
-            tt.FitsTableLayout(time_col=tt.FitsColumn(hdu=1, column='TIME'),
-                               theta_col=tt.FitsColumn(hdu=2, column=0),
-                               phi_col=tt.FitsColumn(hdu=2, column=1),
-                               psi_col=tt.FitsColumn(hdu=2, column=2),
-                               signal_cols=[
-                                   tt.FitsColumn(hdu=3, column='DET_Q1'),
-                                   tt.FitsColumn(hdu=3, column='DET_Q2'),
-                                   tt.FitsColumn(hdu=3, column='DET_U1'),
-                                   tt.FitsColumn(hdu=3, column='DET_U2')
-            ])
-
         # Create a set of FitsToiProviders, one for each MPI rank. Note that we do
         # *not* really use MPI here (comm is None): we just want to check that
         # the segment is loaded correctly for each rank
         num_of_processes = 2
         providers = [tt.FitsToiProvider(rank=i,
                                         num_of_processes=num_of_processes,
-                                        file_names=file_names,
-                                        file_layout=file_layout,
+                                        file_names=self.file_names,
+                                        file_layout=self.file_layout,
                                         comm=None)
                      for i in range(num_of_processes)]
 
@@ -135,9 +144,179 @@ class TestToiProviders(ut.TestCase):
         self.assertTrue(np.allclose(
             phi1, np.array([0.2, 0.4, 0.6, 0.0, 0.01, 0.02, 0.03, 0.04])))
 
+        # Check that get_pixel_index works and caches its result
+        pixidx = providers[1].get_pixel_index(nside=16)
+        self.assertTrue(np.all(pixidx == healpy.ang2pix(16, theta1, phi1)))
+        self.assertIs(providers[1].get_pixel_index(nside=16), pixidx)
+        self.assertTrue(np.all(providers[1].get_pixel_index(nside=16, nest=True) ==
+                               healpy.ang2pix(16, theta1, phi1, nest=True)))
+
         # Check that get_signal works, both when passing an integer and a string
         sig_from_idx = providers[0].get_signal(0)
         sig_from_name = providers[0].get_signal('Q1')
         self.assertTrue(np.allclose(sig_from_idx, sig_from_name))
         self.assertTrue(np.allclose(
             sig_from_idx, np.array([0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9])))
+
+    def test_load_array_from_fits(self):
+        'Check that segments are read correctly across files and columns'
+
+        test_file_path = os.path.dirname(__file__)
+        file_a = os.path.join(test_file_path, 'toi_test_A.fits')
+        file_b = os.path.join(test_file_path, 'toi_test_B.fits')
+        segments = [tt.ToiFileSegment(file_name=file_a, first_element=4,
+                                      num_of_elements=2),
+                    tt.ToiFileSegment(file_name=file_b, first_element=0,
+                                      num_of_elements=4),
+                    tt.ToiFileSegment(file_name=file_a, first_element=0,
+                                      num_of_elements=1)]
+        time, theta = tt._load_array_from_fits(
+            segments=segments,
+            cols_to_read=[tt.FitsColumn(hdu=1, column='TIME'),
+                          tt.FitsColumn(hdu=2, column=0)])
+
+        self.assertTrue(np.allclose(time, [5.0, 6.0, 7.0, 8.0, 9.0, 10.0, 1.0]))
+        self.assertTrue(np.allclose(theta, [0.4, 0.5, 0.6, 0.5, 0.4, 0.3, 0.0]))
+        for arr in (time, theta):
+            self.assertEqual(arr.dtype, np.dtype(np.float64))
+            self.assertTrue(arr.dtype.isnative)
+
+    def test_fits_column_cache(self):
+        'Check that FitsToiProvider keeps the columns it reads in a cache'
+
+        provider = tt.FitsToiProvider(rank=0, num_of_processes=2,
+                                      file_names=self.file_names,
+                                      file_layout=self.file_layout)
+        provider.load()
+        time = provider.get_time()
+        self.assertTrue(np.allclose(
+            time, np.array([1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0])))
+        self.assertIs(provider.get_time(), time)
+        self.assertFalse(time.flags.writeable)
+        self.assertTrue(np.allclose(
+            provider.get_signal('Q1'), np.array([0.3, 0.4, 0.5, 0.6, 0.7, 0.8, 0.9])))
+
+        # With no room in the cache, only the last column is kept
+        provider = tt.FitsToiProvider(rank=0, num_of_processes=2,
+                                      file_names=self.file_names,
+                                      file_layout=self.file_layout,
+                                      cache_size_mb=0)
+        provider.load()
+        self.assertEqual(len(provider._column_cache), 0)
+        time = provider.get_time()
+        self.assertTrue(np.allclose(
+            time, np.array([1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0])))
+        self.assertIs(provider.get_time(), time)
+        provider.get_polarization_angle()
+        self.assertIsNot(provider.get_time(), time)
+        self.assertTrue(np.allclose(provider.get_time(), time))
+
+        # Only the columns that fit in the cache are read by "load" (each
+        # column contains 7 samples)
+        provider = tt.FitsToiProvider(rank=0, num_of_processes=2,
+                                      file_names=self.file_names,
+                                      file_layout=self.file_layout,
+                                      cache_size_mb=2 * 7 * 8 / 2**20)
+        provider.load(['signals'])
+        self.assertEqual(len(provider._column_cache), 2)
+        self.assertTrue(np.allclose(
+            provider.get_signal('U2'), provider.get_signal(3)))
+
+    def test_fits_blocks(self):
+        'Check that FitsToiProvider.iter_blocks reads blocks across files'
+
+        provider = tt.FitsToiProvider(rank=1, num_of_processes=2,
+                                      file_names=self.file_names,
+                                      file_layout=self.file_layout)
+        self.assertEqual(provider.get_num_of_local_samples(), 8)
+
+        for prefetch in (False, True):
+            blocks = list(provider.iter_blocks(3, prefetch=prefetch))
+            self.assertEqual([x.first_sample for x in blocks], [0, 3, 6])
+            self.assertEqual([len(x.time) for x in blocks], [3, 3, 2])
+
+            self.assertTrue(np.allclose(np.concatenate([x.time for x in blocks]),
+                                        provider.get_time()))
+            theta, phi = provider.get_pointings()
+            self.assertTrue(np.allclose(np.concatenate([x.theta for x in blocks]),
+                                        theta))
+            self.assertTrue(np.allclose(np.concatenate([x.phi for x in blocks]),
+                                        phi))
+            self.assertTrue(np.allclose(np.concatenate([x.psi for x in blocks]),
+                                        provider.get_polarization_angle()))
+            signals = np.concatenate([x.signals for x in blocks], axis=1)
+            for det_idx in range(4):
+                self.assertTrue(np.allclose(signals[det_idx],
+                                            provider.get_signal(det_idx)))
+
+    def test_fits_blocks_early_exit(self):
+        'Check that the caller can stop reading blocks before the end'
+
+        provider = tt.FitsToiProvider(rank=1, num_of_processes=2,
+                                      file_names=self.file_names,
+                                      file_layout=self.file_layout)
+        num_of_threads = threading.active_count()
+        for prefetch in (False, True):
+            blocks = provider.iter_blocks(3, prefetch=prefetch)
+            self.assertEqual(next(blocks).first_sample, 0)
+            blocks.close()
+
+            # The background thread must have stopped
+            self.assertEqual(threading.active_count(), num_of_threads)
+
+        # The thread is waiting for room in the queue when the caller stops
+        read_items = []
+
+        def items():
+            for i in range(10):
+                read_items.append(i)
+                yield i
+
+        iterator = tt._prefetch_iterator(items())
+        self.assertEqual(next(iterator), 0)
+        time.sleep(0.2)
+        iterator.close()
+        self.assertEqual(threading.active_count(), num_of_threads)
+        self.assertEqual(read_items, [0, 1, 2])
+
+    def test_toi_index(self):
+        'Check that the information about FITS files is saved and reused'
+
+        time_col = self.file_layout.time_col
+
+        with tempfile.TemporaryDirectory() as tmpdir:
+            index_file = os.path.join(tmpdir, 'index.json')
+            toi_files = tt.scan_fits_files(self.file_names, time_col=time_col,
+                                           index_file=index_file)
+            self.assertEqual([x.num_of_samples for x in toi_files], [6, 4, 5])
+            self.assertEqual([(x.first_time, x.last_time) for x in toi_files],
+                             [(1.0, 6.0), (7.0, 10.0), (11.0, 15.0)])
+            self.assertTrue(os.path.exists(index_file))
+
+            # Files that have not changed are not read again: alter the
+            # index to check that its content is used
+            with open(index_file, 'rt') as f:
+                index = json.load(f)
+            index[0]['num_of_samples'] = 99
+            with open(index_file, 'wt') as f:
+                json.dump(index, f)
+
+            toi_files = tt.scan_fits_files(self.file_names, time_col=time_col,
+                                           index_file=index_file)
+            self.assertEqual(toi_files[0].num_of_samples, 99)
+
+        # Only the second file contains samples between 7.5 and 9.0
+        self.assertEqual(
+            [x.file_name for x in tt.select_time_range(toi_files, 7.5, 9.0)],
+            [self.file_names[1]])
+        self.assertEqual(len(tt.select_time_range(toi_files, end_time=7.0)), 2)
+        self.assertEqual(len(tt.select_time_range(toi_files)), 3)
+        with self.assertRaises(ValueError):
+            tt.select_time_range([tt.ToiFile('A.fits', 10)], start_time=1.0)
+
+        provider = tt.FitsToiProvider(rank=0, num_of_processes=1,
+                                      file_names=self.file_names,
+                                      file_layout=self.file_layout,
+                                      start_time=7.5, end_time=9.0)
+        self.assertTrue(np.allclose(provider.get_time(),
+                                    [7.0, 8.0, 9.0, 10.0]))
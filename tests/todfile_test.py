@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+# -*- encoding: utf-8 -*-
+
+import unittest as ut
+import os.path
+import tempfile
+
+import healpy
+import stripeline.timetools as tt
+import stripeline.todfile as tf
+import numpy as np
+
+
+def write_test_file(file_name, first_time, num_of_samples, nside=16,
+                    chunk_size=7, compression_level=6):
+    '''Write a file with PIXIDX, PSI, and the four detectors
+
+    Return a dictionary containing the values of each column.'''
+    rng = np.random.RandomState(num_of_samples)
+    values = {'PIXIDX': rng.randint(healpy.nside2npix(nside),
+                                    size=num_of_samples),
+              'PSI': rng.uniform(-np.pi, np.pi, size=num_of_samples)}
+    for name in tt.CHUNKED_SIGNAL_NAMES:
+        values[name] = rng.normal(size=num_of_samples)
+
+    columns = [tf.TodColumn('PIXIDX', 'int32'),
+               tf.TodColumn('PSI', 'float32', 'rad')]
+    columns += [tf.TodColumn(x, 'float32', 'K')
+                for x in tt.CHUNKED_SIGNAL_NAMES]
+    with tf.ChunkedTodWriter(file_name, columns, sampfreq=2.0,
+                             first_time=first_time, chunk_size=chunk_size,
+                             compression_level=compression_level,
+                             metadata={'NSIDE': nside, 'NEST': False}) as f:
+        # Write the samples in pieces that do not match the chunks
+        for start in range(0, num_of_samples, 5):
+            f.write(**{key: val[start:start + 5]
+                       for key, val in values.items()})
+
+    return values
+
+
+class TestTodFile(ut.TestCase):
+
+    def test_round_trip(self):
+        with tempfile.TemporaryDirectory() as tmpdir:
+            for compression_level in (0, 6):
+                file_name = os.path.join(tmpdir, 'test.stod')
+                values = write_test_file(file_name, first_time=10.0,
+                                         num_of_samples=33,
+                                         compression_level=compression_level)
+
+                tod = tf.ChunkedTodFile(file_name)
+                self.assertEqual(tod.num_of_samples, 33)
+                self.assertEqual(tod.metadata, {'NSIDE': 16, 'NEST': False})
+                self.assertEqual(tod.column_names()[:3],
+                                 ['TIME', 'PIXIDX', 'PSI'])
+
+                # The time is implicit
+                self.assertTrue(np.allclose(tod.read('TIME'),
+                                            10.0 + np.arange(33) / 2.0))
+
+                pixidx = tod.read('PIXIDX')
+                self.assertEqual(pixidx.dtype, np.dtype('int32'))
+                self.assertTrue(np.all(pixidx == values['PIXIDX']))
+                self.assertTrue(np.allclose(tod.read('DETQ1'), values['DETQ1'],
+                                            rtol=1e-6, atol=0))
+
+                # Read ranges within one chunk and across several chunks
+                for first, num in ((0, 1), (3, 4), (6, 9), (20, 13), (32, 1)):
+                    self.assertTrue(np.all(tod.read('PIXIDX', first, num) ==
+                                           values['PIXIDX'][first:first + num]))
+                    self.assertTrue(np.allclose(
+                        tod.read('PSI', first, num),
+                        values['PSI'][first:first + num], rtol=1e-6, atol=0))
+
+    def test_quantization(self):
+        with tempfile.TemporaryDirectory() as tmpdir:
+            file_name = os.path.join(tmpdir, 'test.stod')
+            signal = np.linspace(-1.0, 1.0, 100)
+            columns = [tf.TodColumn('SIGNAL', 'int16', 'K', scale=1e-4)]
+            with tf.ChunkedTodWriter(file_name, columns, sampfreq=1.0) as f:
+                f.write(SIGNAL=signal)
+
+            result = tf.ChunkedTodFile(file_name).read('SIGNAL')
+            self.assertEqual(result.dtype, np.dtype('float64'))
+            self.assertTrue(np.allclose(result, signal, rtol=0, atol=0.5e-4))
+
+            with self.assertRaises(ValueError):
+                with tf.ChunkedTodWriter(file_name, columns,
+                                         sampfreq=1.0) as f:
+                    f.write(SIGNAL=signal * 10)
+
+    def test_toi_provider(self):
+        with tempfile.TemporaryDirectory() as tmpdir:
+            file_names = [os.path.join(tmpdir, x)
+                          for x in ('A.stod', 'B.stod')]
+            values_a = write_test_file(file_names[0], 0.0, 9)
+            values_b = write_test_file(file_names[1], 4.5, 12)
+            values = {key: np.concatenate([values_a[key], values_b[key]])
+                      for key in values_a.keys()}
+
+            providers = [tt.ChunkedToiProvider(rank=i, num_of_processes=2,
+                                               file_names=file_names)
+                         for i in range(2)]
+            self.assertEqual([x.get_num_of_local_samples() for x in providers],
+                             [10, 11])
+
+            time = np.concatenate([x.get_time() for x in providers])
+            self.assertTrue(np.allclose(time, np.arange(21) / 2.0))
+            signal = np.concatenate([x.get_signal('U1') for x in providers])
+            self.assertTrue(np.allclose(signal, values['DETU1'], rtol=1e-6))
+
+            # The pixel indexes are the ones saved in the files...
+            pixidx = providers[1].get_pixel_index(nside=16)
+            self.assertTrue(np.all(pixidx == values['PIXIDX'][10:]))
+            self.assertTrue(np.all(providers[1].get_pixel_index(nside=16,
+                                                                nest=True) ==
+                                   healpy.ring2nest(16, pixidx)))
+
+            # ...and the pointings are the centers of the pixels
+            theta, phi = providers[1].get_pointings()
+            self.assertTrue(np.all(healpy.ang2pix(16, theta, phi) == pixidx))
+
+            blocks = list(providers[0].iter_blocks(4))
+            self.assertEqual([len(x.psi) for x in blocks], [4, 4, 2])
+            self.assertTrue(np.allclose(
+                np.concatenate([x.signals for x in blocks], axis=1),
+                [values[x][:10] for x in tt.CHUNKED_SIGNAL_NAMES], rtol=1e-6))
@@ -0,0 +1,92 @@
+#!/usr/bin/env python3
+# -*- encoding: utf-8 -*-
+
+import unittest as ut
+
+import stripeline.noisegen as ng
+import stripeline.todsim as todsim
+import numpy as np
+
+
+def reference_tod(sky_i, sky_q, sky_u, pixidx, psi):
+    'Compute the noiseless output of a polarimeter using NumPy'
+    q_beam = sky_q[pixidx] * np.cos(2 * psi) - sky_u[pixidx] * np.sin(2 * psi)
+    u_beam = sky_q[pixidx] * np.sin(2 * psi) + sky_u[pixidx] * np.cos(2 * psi)
+    return 0.25 * np.array([sky_i[pixidx] + q_beam,
+                            sky_i[pixidx] - q_beam,
+                            sky_i[pixidx] + u_beam,
+                            sky_i[pixidx] - u_beam])
+
+
+class TestPolarimeter(ut.TestCase):
+
+    def setUp(self):
+        num_of_pixels = 48
+        num_of_samples = 3000
+        self.sky_i = np.arange(num_of_pixels, dtype='float64')
+        self.sky_q = np.sin(self.sky_i)
+        self.sky_u = np.cos(self.sky_i)
+        self.pixidx = (np.arange(num_of_samples, dtype='int64') * 7) % \
+            num_of_pixels
+        self.pointings = np.zeros((num_of_samples, 4))
+        self.pointings[:, 3] = np.linspace(0, 2 * np.pi, num_of_samples)
+
+    def test_noiseless(self):
+        det_output = np.empty((4, len(self.pixidx)))
+        todsim.tod_polarimeter(self.sky_i, self.sky_q, self.sky_u, self.pixidx,
+                               self.pointings, np.zeros(4), 0, 0, det_output)
+
+        expected = reference_tod(self.sky_i, self.sky_q, self.sky_u,
+                                 self.pixidx, self.pointings[:, 3])
+        self.assertTrue(np.allclose(det_output, expected))
+
+    def test_noise(self):
+        sigma = np.array([1.0, 2.0, 3.0, 4.0])
+        det_output = np.empty((4, len(self.pixidx)))
+        todsim.tod_polarimeter(self.sky_i, self.sky_q, self.sky_u, self.pixidx,
+                               self.pointings, sigma, 12, 100, det_output)
+
+        expected = reference_tod(self.sky_i, self.sky_q, self.sky_u,
+                                 self.pixidx, self.pointings[:, 3])
+        for det_idx in range(4):
+            noise = np.empty(len(self.pixidx))
+            ng.CounterRNG(seed=12, stream_id=det_idx).fill_vector(
+                noise, first_sample=100)
+            self.assertTrue(np.allclose(det_output[det_idx],
+                                        expected[det_idx] +
+                                        sigma[det_idx] * noise))
+
+    def test_chunks(self):
+        sigma = np.ones(4)
+        whole = np.empty((4, len(self.pixidx)))
+        todsim.tod_polarimeter(self.sky_i, self.sky_q, self.sky_u, self.pixidx,
+                               self.pointings, sigma, 1, 0, whole)
+
+        for start, stop in [(0, 1001), (1001, 3000)]:
+            chunk = np.empty((4, stop - start))
+            todsim.tod_polarimeter(self.sky_i, self.sky_q, self.sky_u,
+                                   self.pixidx[start:stop],
+                                   self.pointings[start:stop], sigma, 1,
+                                   start, chunk)
+            self.assertTrue(np.all(chunk == whole[:, start:stop]))
+
+    def test_interleaved(self):
+        sigma = np.array([1.0, 2.0, 3.0, 4.0])
+        expected = np.empty((4, len(self.pixidx)))
+        todsim.tod_polarimeter(self.sky_i, self.sky_q, self.sky_u, self.pixidx,
+                               self.pointings, sigma, 5, 10, expected)
+
+        sky_iqu = np.column_stack((self.sky_i, self.sky_q, self.sky_u))
+        det_output = np.empty((4, len(self.pixidx)))
+        todsim.tod_polarimeter_iqu(sky_iqu, self.pixidx, self.pointings,
+                                   sigma, 5, 10, det_output)
+        self.assertTrue(np.all(det_output == expected))
+
+        todsim.tod_polarimeter_iqu_f32(sky_iqu.astype('float32'), self.pixidx,
+                                       self.pointings, sigma, 5, 10,
+                                       det_output)
+        self.assertTrue(np.allclose(det_output, expected, rtol=0, atol=1e-5))
+
+
+if __name__ == '__main__':
+    ut.main()